@@ -19,9 +19,12 @@
 *
 */
 
+#define PRINT_IDENTIFIER "buildinfo"
+
 #include <stdio.h>
 #include <string.h>
 
+#include "oipcore/abi/output.h"
 #include "oipbuildinfo/oipbuildinfo.h"
 
 // Build info constants defined at build time.
@@ -62,9 +65,9 @@ int build_compare_critical(const struct BUILD_INFO_STRUCT *info1,
 
 void build_print_version_info(const char *prefix,
 			const struct BUILD_INFO_STRUCT *info) {
-	printf("%s%s - %s (ABI: %i)", prefix, info->version, info->date, info->abi);
+	fprintf(print_stdout, "%s%s - %s (ABI: %i)", prefix, info->version, info->date, info->abi);
 	if (info->debug) {
-		printf(" (DEBUG BUILD)");
+		fprintf(print_stdout, " (DEBUG BUILD)");
 	}
-	printf("\n");
+	fprintf(print_stdout, "\n");
 }
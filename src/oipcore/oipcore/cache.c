@@ -19,6 +19,38 @@
 *
 */
 
+/*
+*  The caches are kept within their byte budgets using the
+*  GreedyDual-Size policy. Every file gets the priority
+*  L + cost/size, where 'cost' is the time it took to compute the
+*  file and L is the priority of the last evicted file. The file
+*  with the lowest priority is evicted first, so big files that are
+*  cheap to compute go before small and expensive ones. Since L
+*  only grows, files that haven't been used for a while lose to
+*  the files that have been written or read after them.
+*
+*  Several processes can share one cache root. The files are named
+*  by content keys and spread over subdirectories named by the
+*  first digits of the key. A file is written into a temporary file
+*  next to it and renamed into place, so readers never see partial
+*  files and need no locking. Renaming and deleting files is done
+*  while holding an exclusive flock() on the lock file in the cache
+*  root, and a file is only deleted if it's still the file that was
+*  registered. The budgets are per process and the files written by
+*  other processes are adopted into the caches once they're used.
+*
+*  The access time of a file is its lease. A process sets it when
+*  it adopts a file and the reaper renews it for every registered
+*  file once per scan, so the reapers of other processes can tell
+*  the files of live processes from the files of crashed ones.
+*
+*  Evicted files are unregistered right away but deleted by the
+*  reaper thread, so no cache operation waits for the filesystem.
+*  A file that is looked up again before it's deleted is kept.
+*/
+
+#define _GNU_SOURCE
+
 #define PRINT_IDENTIFIER "cache"
 
 #include <stdlib.h>
@@ -30,41 +62,378 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/file.h>
 
 #include "oipcore/abi/output.h"
 #include "oipcore/file.h"
 #include "oipcore/cache.h"
 #include "oipcore/ptrarray.h"
+#include "oipcore/hashmap.h"
+#include "oipcore/pipeline.h"
+#include "oipcore/strutils.h"
 
 #include "configloader_priv.h"
+#include "cachefile_priv.h"
+#include "prefetch_priv.h"
+#include "reaper_priv.h"
 
 #define CACHE_PERMISSIONS S_IRWXU
+#define CACHE_MIB (1024*1024)
+
+#define CACHE_HASH_M0 0x9e3779b97f4a7c15ULL
+#define CACHE_HASH_M1 0xc2b2ae3d27d4eb4fULL
+
+// The heap position of a file that isn't in a heap.
+#define CACHE_HEAP_NONE ((size_t) -1)
 
 static char *cache_root = NULL;
-static size_t cache_default_max_files = 0;
+static size_t cache_default_max_bytes = 0;
+
+// All cache files of all caches and the global budget.
+static CACHE_HEAP cache_all = { NULL, 0, 0, CACHE_HEAP_GLOBAL };
+static size_t cache_max_bytes = 0;
+static size_t cache_total_bytes = 0;
+static double cache_inflation = 0;
+static unsigned long long int cache_seq = 0;
 
 static PTRARRAY_TYPE(CACHE) *caches = NULL;
+static HASHMAP *cache_index = NULL;
+
+// The lock file that serializes renaming and deleting files.
+static int cache_lock_fd = -1;
+static unsigned int cache_lock_depth = 0;
 
 static void cache_db_file_free(CACHE_FILE *cache_file);
-static void cache_db_file_free_wrapper(void *cache_file);
-static CACHE_FILE *cache_db_file_create(const CACHE *cache,
-					const char *fname);
+static CACHE_FILE *cache_db_file_create(CACHE *cache, const char *fname);
 
-static int cache_db_file_get_index(const CACHE *cache,
+static CACHE_FILE *cache_db_file_get(const CACHE *cache,
 					const char *fname);
-static int cache_db_file_get_index_oldest(const CACHE *cache);
+static int cache_delete_file_unlocked(CACHE *cache, const char *fname);
+
+static uint64_t cache_hash_mix(uint64_t x);
+static void cache_hash_word(CACHE_HASH *hash, const uint64_t w);
+static void cache_lock(void);
+static void cache_unlock(void);
+static char *cache_get_subdir(const char *fname);
+static int cache_db_file_remove(CACHE_FILE *cache_file);
+
+static int cache_heap_less(const CACHE_FILE *a, const CACHE_FILE *b);
+static void cache_heap_set(CACHE_HEAP *heap, const size_t pos,
+				CACHE_FILE *file);
+static void cache_heap_up(CACHE_HEAP *heap, size_t pos);
+static void cache_heap_down(CACHE_HEAP *heap, size_t pos);
+static int cache_heap_push(CACHE_HEAP *heap, CACHE_FILE *file);
+static void cache_heap_remove(CACHE_HEAP *heap, CACHE_FILE *file);
+static void cache_heap_fix(CACHE_HEAP *heap, CACHE_FILE *file);
+
+static int cache_db_file_attach(CACHE_FILE *cache_file);
+static void cache_db_file_detach(CACHE_FILE *cache_file);
+static void cache_db_file_set_priority(CACHE_FILE *cache_file);
+static int cache_make_room(CACHE *cache, const size_t size);
+static int cache_evict(CACHE_FILE *cache_file);
+static void cache_renew_file(const char *path);
+
+static uint64_t cache_hash_mix(uint64_t x) {
+	// Mix the bits of 'x'.
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static void cache_hash_word(CACHE_HASH *hash, const uint64_t w) {
+	// Add the 64-bit word 'w' to 'hash'.
+	hash->h[0] = (hash->h[0] ^ w)*CACHE_HASH_M0;
+	hash->h[0] = (hash->h[0] << 29) | (hash->h[0] >> 35);
+	hash->h[1] = (hash->h[1] + w)*CACHE_HASH_M1;
+	hash->h[1] = (hash->h[1] << 31) | (hash->h[1] >> 33);
+}
+
+void cache_hash_init(CACHE_HASH *hash) {
+	// Initialize 'hash' for cache_hash_update().
+	hash->h[0] = CACHE_HASH_M1;
+	hash->h[1] = CACHE_HASH_M0;
+}
+
+void cache_hash_update(CACHE_HASH *hash, const void *data, const size_t len) {
+	/*
+	*  Add 'len' bytes of 'data' to 'hash'. The data is hashed a
+	*  word at a time, so this is fast enough for image data. The
+	*  boundaries between updates are part of the hash.
+	*/
+	const uint8_t *pos = data;
+	uint64_t w = 0;
+	size_t n = len;
+
+	for (; n >= sizeof(w); n -= sizeof(w), pos += sizeof(w)) {
+		memcpy(&w, pos, sizeof(w));
+		cache_hash_word(hash, w);
+	}
+	w = 0;
+	memcpy(&w, pos, n);
+	cache_hash_word(hash, w);
+	hash->h[0] = cache_hash_mix(hash->h[0] ^ len);
+	hash->h[1] = cache_hash_mix(hash->h[1] + hash->h[0]);
+}
+
+void cache_hash_key(const CACHE_HASH *hash, CACHE_KEY *key) {
+	// Store the key of the data hashed into 'hash' in 'key'.
+	snprintf(key->str, sizeof(key->str), "%016" PRIx64 "%016" PRIx64,
+		cache_hash_mix(hash->h[0]), cache_hash_mix(hash->h[1] ^ hash->h[0]));
+}
+
+static void cache_lock(void) {
+	/*
+	*  Take the lock that other processes sharing the cache root
+	*  respect. Threads are serialized by the pipeline lock, so
+	*  this is only counted if it's already held.
+	*/
+	if (cache_lock_fd == -1 || cache_lock_depth++ != 0) {
+		return;
+	}
+	errno = 0;
+	while (flock(cache_lock_fd, LOCK_EX) == -1) {
+		if (errno != EINTR) {
+			printerrno("cache: flock()");
+			break;
+		}
+		errno = 0;
+	}
+}
+
+static void cache_unlock(void) {
+	// Release the lock taken with cache_lock().
+	if (cache_lock_fd == -1 || --cache_lock_depth != 0) {
+		return;
+	}
+	flock(cache_lock_fd, LOCK_UN);
+}
+
+static int cache_heap_less(const CACHE_FILE *a, const CACHE_FILE *b) {
+	// Return 1 if 'a' should be evicted before 'b' and 0 otherwise.
+	if (a->priority != b->priority) {
+		return a->priority < b->priority;
+	}
+	return a->seq < b->seq;
+}
+
+static void cache_heap_set(CACHE_HEAP *heap, const size_t pos,
+				CACHE_FILE *file) {
+	// Store 'file' at 'pos' in 'heap' and record the position.
+	heap->files[pos] = file;
+	file->heap_pos[heap->slot] = pos;
+}
+
+static void cache_heap_up(CACHE_HEAP *heap, size_t pos) {
+	// Move the file at 'pos' up until the heap order holds.
+	CACHE_FILE *file = heap->files[pos];
+
+	while (pos > 0 && cache_heap_less(file, heap->files[(pos - 1)/2])) {
+		cache_heap_set(heap, pos, heap->files[(pos - 1)/2]);
+		pos = (pos - 1)/2;
+	}
+	cache_heap_set(heap, pos, file);
+}
+
+static void cache_heap_down(CACHE_HEAP *heap, size_t pos) {
+	// Move the file at 'pos' down until the heap order holds.
+	CACHE_FILE *file = heap->files[pos];
+	size_t child = 0;
+
+	while ((child = 2*pos + 1) < heap->count) {
+		if (child + 1 < heap->count &&
+			cache_heap_less(heap->files[child + 1], heap->files[child])) {
+			child++;
+		}
+		if (!cache_heap_less(heap->files[child], file)) {
+			break;
+		}
+		cache_heap_set(heap, pos, heap->files[child]);
+		pos = child;
+	}
+	cache_heap_set(heap, pos, file);
+}
+
+static int cache_heap_push(CACHE_HEAP *heap, CACHE_FILE *file) {
+	/*
+	*  Add 'file' to 'heap'. Returns 0 on success and 1 on failure.
+	*/
+	CACHE_FILE **tmp = NULL;
+	size_t n_size = 0;
+
+	if (heap->count == heap->size) {
+		n_size = heap->size ? 2*heap->size : 16;
+		errno = 0;
+		tmp = realloc(heap->files, n_size*sizeof(*heap->files));
+		if (!tmp) {
+			printerrno("cache: realloc()");
+			return 1;
+		}
+		heap->files = tmp;
+		heap->size = n_size;
+	}
+	cache_heap_set(heap, heap->count++, file);
+	cache_heap_up(heap, heap->count - 1);
+	return 0;
+}
+
+static void cache_heap_remove(CACHE_HEAP *heap, CACHE_FILE *file) {
+	// Remove 'file' from 'heap' if it's in it.
+	size_t pos = file->heap_pos[heap->slot];
+
+	if (pos == CACHE_HEAP_NONE) {
+		return;
+	}
+	file->heap_pos[heap->slot] = CACHE_HEAP_NONE;
+	if (pos != --heap->count) {
+		cache_heap_set(heap, pos, heap->files[heap->count]);
+		cache_heap_fix(heap, heap->files[pos]);
+	}
+	heap->files[heap->count] = NULL;
+}
+
+static void cache_heap_fix(CACHE_HEAP *heap, CACHE_FILE *file) {
+	// Restore the heap order after the priority of 'file' changed.
+	cache_heap_up(heap, file->heap_pos[heap->slot]);
+	cache_heap_down(heap, file->heap_pos[heap->slot]);
+}
+
+static int cache_db_file_attach(CACHE_FILE *cache_file) {
+	/*
+	*  Add 'cache_file' to the eviction heaps and account its
+	*  size. Returns 0 on success and 1 on failure.
+	*/
+	if (cache_heap_push(&cache_file->cache->files, cache_file) != 0) {
+		return 1;
+	}
+	if (cache_heap_push(&cache_all, cache_file) != 0) {
+		cache_heap_remove(&cache_file->cache->files, cache_file);
+		return 1;
+	}
+	cache_file->cache->bytes += cache_file->size;
+	cache_total_bytes += cache_file->size;
+	return 0;
+}
+
+static void cache_db_file_detach(CACHE_FILE *cache_file) {
+	// Remove 'cache_file' from the eviction heaps and the accounting.
+	if (cache_file->heap_pos[CACHE_HEAP_LOCAL] == CACHE_HEAP_NONE) {
+		return;
+	}
+	cache_heap_remove(&cache_file->cache->files, cache_file);
+	cache_heap_remove(&cache_all, cache_file);
+	cache_file->cache->bytes -= cache_file->size;
+	cache_total_bytes -= cache_file->size;
+}
+
+static void cache_db_file_set_priority(CACHE_FILE *cache_file) {
+	/*
+	*  Set the GreedyDual-Size priority of 'cache_file'. This must
+	*  be done every time the file is written or used.
+	*/
+	cache_file->priority = cache_inflation +
+		cache_file->cost/(cache_file->size ? cache_file->size : 1);
+	cache_file->seq = cache_seq++;
+}
+
+static int cache_evict(CACHE_FILE *cache_file) {
+	/*
+	*  Evict 'cache_file' and raise the priority baseline to its
+	*  priority. Returns 0 on success and 1 on failure.
+	*/
+	if (cache_file->priority > cache_inflation) {
+		cache_inflation = cache_file->priority;
+	}
+	printverb_va("Evicting cache file '%s' of cache '%s' (%zu bytes).\n",
+			cache_file->fname, cache_file->cache->name, cache_file->size);
+
+	if (cache_db_file_remove(cache_file) != 0) {
+		return 1;
+	}
+	return cache_db_file_unreg(cache_file->cache, cache_file->fname);
+}
+
+static int cache_db_file_remove(CACHE_FILE *cache_file) {
+	/*
+	*  Delete the file of 'cache_file' unless another process has
+	*  replaced it since it was registered. The file is queued for
+	*  the reaper if it's running. A file that is already gone is
+	*  fine. Returns 0 on success and 1 on failure.
+	*/
+	struct stat st;
+	int ret = 0;
+
+	if (reaper_queue(cache_file->fname, cache_file->dev, cache_file->ino) == 0) {
+		return 0;
+	}
+
+	cache_lock();
+	errno = 0;
+	if (stat(cache_file->fpath, &st) == -1) {
+		if (errno != ENOENT) {
+			printerrno("cache: stat()");
+			ret = 1;
+		}
+	} else if (st.st_dev != cache_file->dev || st.st_ino != cache_file->ino) {
+		printverb_va("Cache file '%s' was replaced. Leaving it in place.\n",
+				cache_file->fname);
+	} else {
+		errno = 0;
+		if (unlink(cache_file->fpath) == -1 && errno != ENOENT) {
+			printerrno("cache: unlink()");
+			ret = 1;
+		}
+	}
+	cache_unlock();
+	return ret;
+}
+
+static int cache_make_room(CACHE *cache, const size_t size) {
+	/*
+	*  Evict files until a file of 'size' bytes fits in 'cache'
+	*  and in the global budget. Returns 0 on success and 1 if
+	*  the file can't fit.
+	*/
+	if ((cache->max_bytes && size > cache->max_bytes) ||
+		(cache_max_bytes && size > cache_max_bytes)) {
+		return 1;
+	}
+	while (cache->max_bytes && cache->bytes + size > cache->max_bytes) {
+		if (cache_evict(cache->files.files[0]) != 0) {
+			return 1;
+		}
+	}
+	while (cache_max_bytes && cache_total_bytes + size > cache_max_bytes) {
+		if (cache_evict(cache_all.files[0]) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
 void cache_dump(const CACHE *cache) {
 	/*
 	*  Dump info about 'cache' to STDOUT.
 	*/
-	printf("Cache '%s':\n", cache->name);
-	printf("  Name:      %s\n", cache->name);
-	printf("  Path:      %s\n", cache->path);
-	printf("  Max files: %u\n", cache->max_files);
-	printf("  Files:\n");
-	for (size_t i = 0; i < cache->db->ptrc; i++) {
-		printf("    %s : %s\n", cache->db->ptrs[i]->fname, cache->db->ptrs[i]->fpath);
+	CACHE_FILE *cache_file = NULL;
+
+	fprintf(print_stdout, "Cache '%s':\n", cache->name);
+	fprintf(print_stdout, "  Name:      %s\n", cache->name);
+	if (cache->max_bytes) {
+		fprintf(print_stdout, "  Max size:  %.2f MiB\n", (double) cache->max_bytes/CACHE_MIB);
+	} else {
+		fprintf(print_stdout, "  Max size:  unlimited\n");
+	}
+	fprintf(print_stdout, "  Size:      %.2f MiB\n", (double) cache->bytes/CACHE_MIB);
+	fprintf(print_stdout, "  Files:\n");
+	for (size_t i = 0; i < cache->files.count; i++) {
+		cache_file = cache->files.files[i];
+		fprintf(print_stdout, "    %s : %s (%zu B, %f s)\n", cache_file->fname,
+			cache_file->fpath, cache_file->size, cache_file->cost);
 	}
 }
 
@@ -72,18 +441,21 @@ void cache_dump_all(void) {
 	/*
 	*  Dump info about all caches to STDOUT.
 	*/
+	pipeline_lock();
+	fprintf(print_stdout, "Root: %s\n", cache_root);
+	if (cache_max_bytes) {
+		fprintf(print_stdout, "Total: %.2f of %.2f MiB\n", (double) cache_total_bytes/CACHE_MIB,
+			(double) cache_max_bytes/CACHE_MIB);
+	} else {
+		fprintf(print_stdout, "Total: %.2f MiB\n", (double) cache_total_bytes/CACHE_MIB);
+	}
+	cachefile_print_status();
+	prefetch_print_status();
+	reaper_print_status();
 	for (size_t i = 0; i < caches->ptrc; i++) {
 		cache_dump(caches->ptrs[i]);
 	}
-}
-
-
-static void cache_db_file_free_wrapper(void *cache_file) {
-	/*
-	*  Wrapper for cache_db_file_free(). This is used
-	*  as the freeing function for the PTRARRAY.
-	*/
-	cache_db_file_free((CACHE_FILE*) cache_file);
+	pipeline_unlock();
 }
 
 static void cache_db_file_free(CACHE_FILE *cache_file) {
@@ -96,8 +468,7 @@ static void cache_db_file_free(CACHE_FILE *cache_file) {
 	free(cache_file);
 }
 
-static CACHE_FILE *cache_db_file_create(const CACHE *cache,
-					const char *fname) {
+static CACHE_FILE *cache_db_file_create(CACHE *cache, const char *fname) {
 	/*
 	*  Create a CACHE_FILE instance. Returns a pointer to
 	*  the new instance on success or a NULL pointer on failure.
@@ -107,7 +478,7 @@ static CACHE_FILE *cache_db_file_create(const CACHE *cache,
 
 	// Allocate memory for the CACHE_FILE instance.
 	errno = 0;
-	n_cache_file = malloc(sizeof(CACHE));
+	n_cache_file = calloc(1, sizeof(*n_cache_file));
 	if (n_cache_file == NULL) {
 		printerrno("cache: malloc()");
 		return NULL;
@@ -125,7 +496,7 @@ static CACHE_FILE *cache_db_file_create(const CACHE *cache,
 
 	// Create the path string.
 	errno = 0;
-	n_cache_file->fpath = cache_get_path_to_file(cache, fname);
+	n_cache_file->fpath = cache_get_path_to_file(fname);
 	if (n_cache_file->fpath == NULL) {
 		printerr("Failed to get path to cache file.\n");
 		free(n_cache_file->fname);
@@ -133,9 +504,9 @@ static CACHE_FILE *cache_db_file_create(const CACHE *cache,
 		return NULL;
 	}
 
-	// Add the file timestamp.
-	n_cache_file->tstamp = time(NULL);
-
+	n_cache_file->cache = cache;
+	n_cache_file->heap_pos[CACHE_HEAP_GLOBAL] = CACHE_HEAP_NONE;
+	n_cache_file->heap_pos[CACHE_HEAP_LOCAL] = CACHE_HEAP_NONE;
 	return n_cache_file;
 }
 
@@ -145,124 +516,322 @@ int cache_db_file_unreg(CACHE *cache, const char *fname) {
 	*  on success and 1 on failure.
 	*/
 
-	int index = -1;
-	index = cache_db_file_get_index(cache, fname);
+	CACHE_FILE *cache_file = NULL;
 
-	if (index < 0) {
+	cache_file = cache_db_file_get(cache, fname);
+	if (!cache_file) {
 		printerr_va("Cache file '%s' not found.\n", fname);
 		return 1;
 	}
 
-	if (!ptrarray_pop_ptr((PTRARRAY_TYPE(void)*) cache,
-			cache->db->ptrs[index], 1)) {
-		printerr("Failed to unregister cache file.\n");
-		return 1;
-	}
+	cache_db_file_detach(cache_file);
+	hashmap_pop_str(cache->db_index, fname);
+	cache_db_file_free(cache_file);
 	return 0;
 }
 
 CACHE_FILE *cache_db_file_reg(CACHE *cache, const char *fname,
-				unsigned int auto_rm) {
+				const struct stat *st, const double cost) {
 	/*
-	*  Register the file 'fname' as a cache file for the
-	*  cache 'cache'. Returns a pointer to the allocated
-	*  CACHE_FILE instance on success or a NULL pointer
-	*  on failure.
+	*  Register the file 'fname' with the status 'st' that took
+	*  'cost' seconds to compute as a cache file of 'cache'.
+	*  Files with the lowest priority are evicted to keep 'cache'
+	*  and all caches together within their budgets. A file that
+	*  is already registered is updated. Returns a pointer to the
+	*  CACHE_FILE instance on success or a NULL pointer on failure,
+	*  in which case the file isn't registered anymore.
 	*/
-
-	int index = -1;
-	int rm_index = 0;
 	CACHE_FILE *n_cache_file = NULL;
+	size_t size = st->st_size;
+
+	n_cache_file = cache_db_file_get(cache, fname);
+	if (n_cache_file) {
+		// Don't evict the file itself to make room for it.
+		cache_db_file_detach(n_cache_file);
+	}
+
+	if (cache_make_room(cache, size) != 0) {
+		printerr_va("Cache file '%s' doesn't fit in cache '%s'.\n",
+				fname, cache->name);
+		if (n_cache_file) {
+			hashmap_pop_str(cache->db_index, fname);
+			cache_db_file_free(n_cache_file);
+		}
+		return NULL;
+	}
+
+	if (!n_cache_file) {
+		printverb_va("Registering file '%s' as a cache file.\n", fname);
+		n_cache_file = cache_db_file_create(cache, fname);
+		if (!n_cache_file) {
+			printerr("Failed to create cache file instance.\n");
+			return NULL;
+		}
+		if (hashmap_put_str(cache->db_index, fname, n_cache_file) != 0) {
+			printerr_va("Failed to index cache file '%s'.\n", fname);
+			cache_db_file_free(n_cache_file);
+			return NULL;
+		}
+	}
 
-	// Check if the supplied file is already registered.
-	index = cache_db_file_get_index(cache, fname);
-	if (index != -1) {
-		printerr_va("Cache file %s already registered.\n", fname);
-		return cache->db->ptrs[index];
+	n_cache_file->dev = st->st_dev;
+	n_cache_file->ino = st->st_ino;
+	n_cache_file->size = size;
+	n_cache_file->cost = cost;
+	cache_db_file_set_priority(n_cache_file);
+	if (cache_db_file_attach(n_cache_file) != 0) {
+		printerr_va("Failed to register cache file '%s'.\n", fname);
+		hashmap_pop_str(cache->db_index, fname);
+		cache_db_file_free(n_cache_file);
+		return NULL;
 	}
+	return n_cache_file;
+}
 
+void cache_db_file_touch(CACHE *cache, const char *fname) {
 	/*
-	*  Check if the cache directory has space for new files.
-	*  If auto_rm is 1, the oldest file in the cache will
-	*  be automatically removed in order to make space for the
-	*  new one if needed.
+	*  Mark the cache file 'fname' of 'cache' as used. This
+	*  must be called every time the file is read.
 	*/
-	if (cache->db->ptrc >= cache->max_files) {
-		printerr_va("Cache '%s' can't fit more files.\n", cache->name);
-		if (auto_rm) {
-			printverb("Removing cache files to make space for new ones.\n");
-			rm_index = cache_db_file_get_index_oldest(cache);
-			if (rm_index == -1) {
-				printerr("Failed to get oldest file index.\n");
-				return NULL;
-			}
-			if (cache_delete_file(cache, cache->db->ptrs[rm_index]->fname) != 0) {
-				printerr("File deletion failed. Can't register file.\n");
-				return NULL;
-			}
-		} else {
-			return NULL;
+	CACHE_FILE *cache_file = NULL;
+
+	cache_file = cache_db_file_get(cache, fname);
+	if (!cache_file || cache_file->heap_pos[CACHE_HEAP_LOCAL] == CACHE_HEAP_NONE) {
+		return;
+	}
+	cache_db_file_set_priority(cache_file);
+	cache_heap_fix(&cache->files, cache_file);
+	cache_heap_fix(&cache_all, cache_file);
+}
+
+static void cache_renew_file(const char *path) {
+	// Renew the lease of the cache file 'path'.
+	const struct timespec times[2] = {
+		{ .tv_sec = 0, .tv_nsec = UTIME_NOW },
+		{ .tv_sec = 0, .tv_nsec = UTIME_OMIT }
+	};
+
+	errno = 0;
+	if (utimensat(AT_FDCWD, path, times, 0) == -1 && errno != ENOENT) {
+		printerrno("cache: utimensat()");
+	}
+}
+
+void cache_renew_files(void) {
+	/*
+	*  Renew the leases of every registered cache file. The
+	*  pipeline lock must be held by the caller.
+	*/
+	CACHE_FILE *cache_file = NULL;
+	size_t iter = 0;
+
+	if (!caches) {
+		return;
+	}
+	cache_lock();
+	for (size_t i = 0; i < caches->ptrc; i++) {
+		iter = 0;
+		while (hashmap_next(caches->ptrs[i]->db_index, &iter,
+					(void**) &cache_file)) {
+			cache_renew_file(cache_file->fpath);
 		}
 	}
+	cache_unlock();
+}
+
+static CACHE_FILE *cache_db_file_get(const CACHE *cache, const char *fname) {
+	/*
+	*  Return the CACHE_FILE instance for 'fname' in the cache
+	*  file database of 'cache'. If the file is not found, a NULL
+	*  pointer is returned.
+	*/
+	return hashmap_get_str(cache->db_index, fname);
+}
 
-	printverb_va("Registering file '%s' as a cache file.\n", fname);
+static char *cache_get_subdir(const char *fname) {
+	/*
+	*  Return the path of the subdirectory the cache file 'fname'
+	*  is in or a NULL pointer on failure.
+	*/
+	char subdir[CACHE_SUBDIR_LEN + 1];
 
-	n_cache_file = cache_db_file_create(cache, fname);
-	if (!n_cache_file) {
-		printerr("Failed to create cache file instance.\n");
+	if (strlen(fname) <= CACHE_SUBDIR_LEN) {
+		printerr_va("Invalid cache file name '%s'.\n", fname);
 		return NULL;
 	}
+	memcpy(subdir, fname, CACHE_SUBDIR_LEN);
+	subdir[CACHE_SUBDIR_LEN] = '\0';
+	return file_path_join(2, cache_root, subdir);
+}
 
-	if (!ptrarray_put_ptr((PTRARRAY_TYPE(void)*) cache->db,
-				n_cache_file)) {
-		printerr_va("Failed to register cache file '%s'.\n", fname);
+char *cache_get_path_to_file(const char *fname) {
+	/*
+	*  Return a string pointer to the path to 'fname' or a
+	*  NULL pointer on failure.
+	*/
+	char *subdir = NULL;
+	char *ret = NULL;
+
+	subdir = cache_get_subdir(fname);
+	if (!subdir) {
 		return NULL;
 	}
-
-	return n_cache_file;
+	ret = file_path_join(2, subdir, fname);
+	free(subdir);
+	return ret;
 }
 
-static int cache_db_file_get_index_oldest(const CACHE *cache) {
+int cache_lookup(CACHE *cache, const char *fname) {
 	/*
-	*  Get the index of the oldest file in the file db
-	*  of 'cache' or -1 on failure.
+	*  Return 1 if the cache file 'fname' exists and 0 otherwise.
+	*  A file that another process has written is registered in
+	*  'cache' when it's found.
 	*/
-	int tmp_index = -1;
-	time_t tmp_tstamp = 0;
-
-	if (cache->db->ptrc > 0) {
-		tmp_tstamp = cache->db->ptrs[0]->tstamp;
-		tmp_index = 0;
-		for (size_t i = 0; i < cache->db->ptrc; i++) {
-			if (cache->db->ptrs[i]->tstamp < tmp_tstamp) {
-				tmp_tstamp = cache->db->ptrs[i]->tstamp;
-				tmp_index = i;
+	CACHE_FILE *cache_file = NULL;
+	CACHEFILE_INFO info;
+	struct stat st;
+	char *path = NULL;
+	int ret = 0;
+
+	pipeline_lock();
+	if (cache_db_file_get(cache, fname)) {
+		pipeline_unlock();
+		return 1;
+	}
+
+	// Keep a file that was evicted but hasn't been deleted yet.
+	if (reaper_cancel(fname)) {
+		printverb_va("Keeping evicted cache file '%s'.\n", fname);
+	}
+
+	path = cache_get_path_to_file(fname);
+	if (path) {
+		cache_lock();
+		errno = 0;
+		if (stat(path, &st) == -1) {
+			if (errno != ENOENT) {
+				printerrno("cache: stat()");
+			}
+		} else if (S_ISREG(st.st_mode) &&
+			cachefile_read_info(path, &info) == 0) {
+			printverb_va("Adopting cache file '%s'.\n", fname);
+			cache_file = cache_db_file_reg(cache, fname, &st, info.cost);
+			if (cache_file) {
+				cache_file->adopted = 1;
+				cache_renew_file(path);
+				ret = 1;
 			}
 		}
+		cache_unlock();
+		free(path);
 	}
-	return tmp_index;
+	pipeline_unlock();
+	return ret;
 }
 
-static int cache_db_file_get_index(const CACHE *cache, const char *fname) {
+int cache_store(CACHE *cache, const char *fname, const IMAGE *img,
+		const double cost) {
 	/*
-	*  Return the index of the CACHE_FILE instance for 'fname' in
-	*  the cache file database of 'cache'. If the file is not found,
-	*  -1 is returned.
+	*  Store 'img' that took 'cost' seconds to compute as the
+	*  cache file 'fname' of 'cache'. The image is written into
+	*  a temporary file that is renamed into place. The file is
+	*  registered once it's written since the eviction depends
+	*  on its size. Returns 0 on success and 1 on failure.
 	*/
-	for (size_t i = 0; i < cache->db->ptrc; i++) {
-		if (strcmp(cache->db->ptrs[i]->fname, fname) == 0) {
-			return i;
+	CACHE_FILE *cache_file = NULL;
+	struct stat st;
+	char *subdir = NULL;
+	char *path = NULL;
+	char *tmp = NULL;
+	int fd = -1;
+	int ret = 1;
+
+	subdir = cache_get_subdir(fname);
+	if (!subdir) {
+		return 1;
+	}
+	path = file_path_join(2, subdir, fname);
+	if (path) {
+		tmp = strutils_cat(2, "", path, CACHE_TMP_SUFFIX);
+	}
+	if (!path || !tmp) {
+		free(subdir);
+		free(path);
+		return 1;
+	}
+
+	errno = 0;
+	if (mkdir(subdir, CACHE_PERMISSIONS) == -1 && errno != EEXIST) {
+		printerrno("cache: mkdir()");
+	} else {
+		errno = 0;
+		fd = mkostemp(tmp, O_CLOEXEC);
+		if (fd == -1) {
+			printerrno("cache: mkostemp()");
+		}
+	}
+
+	printverb_va("Cache image: %s\n", path);
+	if (fd != -1 && cachefile_save(img, cost, fd) == 0) {
+		pipeline_lock();
+		cache_lock();
+		errno = 0;
+		if (stat(tmp, &st) == -1) {
+			printerrno("cache: stat()");
+		} else if (rename(tmp, path) == -1) {
+			printerrno("cache: rename()");
+		} else if ((cache_file = cache_db_file_reg(cache, fname, &st, cost))) {
+			cache_file->adopted = 0;
+			ret = 0;
+		} else {
+			unlink(path);
 		}
+		cache_unlock();
+		pipeline_unlock();
 	}
-	return -1;
+
+	// Don't leave a partial file behind.
+	if (fd != -1 && ret != 0) {
+		unlink(tmp);
+	}
+	free(subdir);
+	free(path);
+	free(tmp);
+	return ret;
 }
 
-char *cache_get_path_to_file(const CACHE *cache, const char *fname) {
+IMAGE *cache_load(CACHE *cache, const char *fname) {
 	/*
-	*  Return a string pointer to the path to 'fname' or a
-	*  NULL pointer on failure.
+	*  Load the cache file 'fname' of 'cache'. The image is taken
+	*  from the prefetcher if it has been prefetched. A file that
+	*  can't be loaded, eg. because another process evicted it, is
+	*  unregistered. Returns a pointer to the image on success or
+	*  a NULL pointer on failure.
 	*/
-	return file_path_join(2, cache->path, fname);
+	IMAGE *ret = NULL;
+	char *path = NULL;
+
+	ret = prefetch_take(fname);
+	if (ret) {
+		printverb_va("Using prefetched cache file '%s'.\n", fname);
+	} else {
+		path = cache_get_path_to_file(fname);
+		if (!path) {
+			return NULL;
+		}
+		printverb_va("Loading image from cache: %s\n", path);
+		ret = cachefile_load(path);
+		free(path);
+	}
+
+	pipeline_lock();
+	if (ret) {
+		cache_db_file_touch(cache, fname);
+	} else if (cache_db_file_get(cache, fname)) {
+		cache_db_file_unreg(cache, fname);
+	}
+	pipeline_unlock();
+	return ret;
 }
 
 int cache_has_file(const CACHE *cache, const char *fname) {
@@ -270,9 +839,27 @@ int cache_has_file(const CACHE *cache, const char *fname) {
 	*  Return 1 if 'cache' contains the file 'fname' and
 	*  return 0 otherwise;
 	*/
-	if (cache_db_file_get_index(cache, fname) != -1) {
+	if (cache_db_file_get(cache, fname)) {
+		return 1;
+	}
+	return 0;
+}
+
+int cache_is_registered(const char *fname) {
+	/*
+	*  Return 1 if the cache file 'fname' is registered in any
+	*  cache and 0 otherwise. After the caches have been destroyed
+	*  every file counts as registered. The pipeline lock must be
+	*  held by the caller.
+	*/
+	if (!caches) {
 		return 1;
 	}
+	for (size_t i = 0; i < caches->ptrc; i++) {
+		if (cache_db_file_get(caches->ptrs[i], fname)) {
+			return 1;
+		}
+	}
 	return 0;
 }
 
@@ -281,23 +868,23 @@ int cache_delete_file(CACHE *cache, const char *fname) {
 	*  Delete the file 'fname' from 'cache'.
 	*  Returns 0 on success and 1 on failure.
 	*/
-	int index = -1;
+	int ret = 0;
 
-	index = cache_db_file_get_index(cache, fname);
-	if (index == -1) {
+	pipeline_lock();
+	ret = cache_delete_file_unlocked(cache, fname);
+	pipeline_unlock();
+	return ret;
+}
+
+static int cache_delete_file_unlocked(CACHE *cache, const char *fname) {
+	CACHE_FILE *cache_file = NULL;
+
+	cache_file = cache_db_file_get(cache, fname);
+	if (!cache_file) {
 		printerr_va("File %s doesn't exist in cache %s.\n", fname, cache->name);
 		return 1;
 	}
-
-	errno = 0;
-	if (access(cache->db->ptrs[index]->fpath, F_OK) == 0) {
-		errno = 0;
-		if (unlink(cache->db->ptrs[index]->fpath) == -1) {
-			printerrno("cache: unlink()");
-			return 1;
-		}
-	} else {
-		printerrno("cache: access()");
+	if (cache_db_file_remove(cache_file) != 0) {
 		return 1;
 	}
 
@@ -316,12 +903,7 @@ CACHE *cache_get_by_name(const char *name) {
 	*  pointer otherwise.
 	*/
 
-	for (size_t i = 0; i < caches->ptrc; i++) {
-		if (strcmp(caches->ptrs[i]->name, name) == 0) {
-			return caches->ptrs[i];
-		}
-	}
-	return NULL;
+	return hashmap_get_str(cache_index, name);
 }
 
 CACHE *cache_create(const char *cache_name) {
@@ -353,37 +935,13 @@ CACHE *cache_create(const char *cache_name) {
 	}
 	memcpy(n_cache->name, cache_name, strlen(cache_name)*sizeof(char));
 
-	// Get the full cache path.
-	n_cache->path = file_path_join(2, cache_root, cache_name);
-	if (n_cache->path == NULL) {
-		free(n_cache->name);
-		free(n_cache);
-		return NULL;
-	}
-
-	// Create the cache directory.
-	errno = 0;
-	if (access(n_cache->path, F_OK) != 0) {
-		if (errno == ENOENT) {
-			errno = 0;
-			if (mkdir(n_cache->path, CACHE_PERMISSIONS) == -1) {
-				printerrno("cache: mkdir()");
-				cache_destroy(n_cache, 0);
-				return NULL;
-			}
-		} else {
-			printerrno("cache: access()");
-			cache_destroy(n_cache, 0);
-			return NULL;
-		}
-	}
-
-	// Set the default max_files value.
-	n_cache->max_files = cache_default_max_files;
+	// Set the default budget.
+	n_cache->max_bytes = cache_default_max_bytes;
+	n_cache->files.slot = CACHE_HEAP_LOCAL;
 
-	// Setup the cache DB.
-	n_cache->db = (PTRARRAY_TYPE(CACHE_FILE)*) ptrarray_create(&cache_db_file_free_wrapper);
-	if (!n_cache->db) {
+	// Setup the cache DB index.
+	n_cache->db_index = hashmap_create(HASHMAP_KEY_STR, NULL);
+	if (!n_cache->db_index) {
 		cache_destroy(n_cache, 0);
 		return NULL;
 	}
@@ -395,37 +953,45 @@ CACHE *cache_create(const char *cache_name) {
 		return NULL;
 	}
 
+	if (hashmap_put_str(cache_index, n_cache->name, n_cache) != 0) {
+		printerr("Failed to index CACHE.\n");
+		caches->ptrs[--caches->ptrc] = NULL;
+		cache_destroy(n_cache, 0);
+		return NULL;
+	}
+
 	return n_cache;
 }
 
 void cache_destroy(CACHE *cache, int del_files) {
 	/*
 	*  Destroy a cache and free the memory allocated to it.
-	*  If del_files is 0, the cache directory is left in place.
-	*  Otherwise the cache directory is deleted too.
+	*  If del_files is 0, the cache files are left in place.
+	*  Otherwise the files this process wrote are deleted unless
+	*  other processes have replaced them.
 	*/
+	CACHE_FILE *tmp = NULL;
 
 	if (cache != NULL) {
-		if (del_files) {
-			// Delete the cache directory recursively.
-			errno = 0;
-			if (access(cache->path, F_OK) == 0) {
-				if (file_rmdir_recursive(cache->path) != 0) {
-					printerr("Failed to delete cache.\n");
-				}
-			} else {
-				printerrno("cache: access()");
+		// Free the cache file database.
+		while (cache->files.count) {
+			tmp = cache->files.files[0];
+			if (del_files && !tmp->adopted &&
+				cache_db_file_remove(tmp) != 0) {
+				printerr_va("Failed to delete cache file '%s'.\n", tmp->fname);
 			}
+			cache_db_file_detach(tmp);
+			cache_db_file_free(tmp);
+		}
+		free(cache->files.files);
+		cache->files.files = NULL;
+		if (cache->db_index) {
+			hashmap_destroy(cache->db_index, 0);
+			cache->db_index = NULL;
 		}
-
-		// Free the cache file database.
-		ptrarray_free_ptrs((PTRARRAY_TYPE(void)*) cache->db);
-		ptrarray_free((PTRARRAY_TYPE(void)*) cache->db);
-		cache->db = NULL;
 
 		// Free the cache instance.
 		free(cache->name);
-		free(cache->path);
 		free(cache);
 	}
 }
@@ -435,6 +1001,10 @@ int cache_setup(void) {
 	*  Caching system setup function. This function must be run
 	*  before running any of the other functions in this file.
 	*/
+	long int max_mb = 0;
+	long int default_max_mb = 0;
+	char *lock_path = NULL;
+
 	printverb("Cache setup.\n");
 
 	cache_root = config_get_str_param("cache_root");
@@ -443,9 +1013,19 @@ int cache_setup(void) {
 		return 1;
 	}
 
-	cache_default_max_files = config_get_lint_param("cache_default_max_files");
-	if (cache_default_max_files <= 0) {
-		cache_default_max_files = 0;
+	// Budgets of zero mean no limit.
+	max_mb = config_get_lint_param("cache_max_mb");
+	default_max_mb = config_get_lint_param("cache_default_max_mb");
+	if (max_mb < 0 || default_max_mb < 0) {
+		printerr("Invalid cache budget.\n");
+		cache_root = NULL;
+		return 1;
+	}
+	cache_max_bytes = (size_t) max_mb*CACHE_MIB;
+	cache_default_max_bytes = (size_t) default_max_mb*CACHE_MIB;
+
+	if (cachefile_setup() != 0) {
+		cache_root = NULL;
 		return 1;
 	}
 
@@ -464,9 +1044,41 @@ int cache_setup(void) {
 		}
 	}
 
-	// Setup the caches PTRARRAY.
+#if OIP_BUILD_DEBUG
+	// Check the cache file codec before anything is cached.
+	if (cachefile_check(cache_root) != 0) {
+		return 1;
+	}
+#endif
+
+	// Open the lock file shared with the other processes.
+	lock_path = file_path_join(2, cache_root, CACHE_LOCK_FILE);
+	if (!lock_path) {
+		return 1;
+	}
+	errno = 0;
+	cache_lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC,
+				S_IRUSR | S_IWUSR);
+	free(lock_path);
+	if (cache_lock_fd == -1) {
+		printerrno("cache: open()");
+		return 1;
+	}
+
+	// Setup the caches PTRARRAY and the name index.
 	caches = (PTRARRAY_TYPE(CACHE)*) ptrarray_create(NULL);
 	if (!caches) {
+		close(cache_lock_fd);
+		cache_lock_fd = -1;
+		return 1;
+	}
+
+	cache_index = hashmap_create(HASHMAP_KEY_STR, NULL);
+	if (!cache_index) {
+		ptrarray_free((PTRARRAY_TYPE(void)*) caches);
+		caches = NULL;
+		close(cache_lock_fd);
+		cache_lock_fd = -1;
 		return 1;
 	}
 
@@ -476,11 +1088,14 @@ int cache_setup(void) {
 void cache_cleanup(int del_files) {
 	/*
 	*  Caching system cleanup function. If del_files is 0, the cache
-	*  directories will be left in place. Otherwise the cache
-	*  directories will be deleted.
+	*  files will be left in place. Otherwise the files of this
+	*  process are queued for the reaper, which deletes them before
+	*  it stops. The directories are shared, so they are always
+	*  left in place.
 	*/
 
-	// Destroy all existing caches.
+	// Destroy all existing caches. The reaper checks them meanwhile.
+	pipeline_lock();
 	if (caches) {
 		printverb("Cache cleanup.\n");
 		if (!del_files) {
@@ -491,5 +1106,22 @@ void cache_cleanup(int del_files) {
 			caches->ptrs[i] = NULL;
 		}
 		ptrarray_free((PTRARRAY_TYPE(void)*) caches);
+		caches = NULL;
+	}
+	if (cache_index) {
+		hashmap_destroy(cache_index, 0);
+		cache_index = NULL;
+	}
+	pipeline_unlock();
+	free(cache_all.files);
+	cache_all.files = NULL;
+	cache_all.count = 0;
+	cache_all.size = 0;
+	cache_total_bytes = 0;
+	cache_inflation = 0;
+	if (cache_lock_fd != -1) {
+		close(cache_lock_fd);
+		cache_lock_fd = -1;
+		cache_lock_depth = 0;
 	}
 }
@@ -0,0 +1,924 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/*
+*  The on-disk format of the cache files. The pixels are stored
+*  either raw or compressed losslessly with the QOI operations.
+*  The compressed pixels are split in chunks of rows that are
+*  coded independently, so they are encoded and decoded in
+*  parallel on the task pool.
+*
+*  In the automatic mode the format of each file is chosen by
+*  comparing the measured cache I/O bandwidth with the measured
+*  codec speed and compression ratio. Compression wins on slow,
+*  eg. network-attached, cache volumes and raw files win when the
+*  disk is faster than the codec.
+*/
+
+#define _GNU_SOURCE
+
+#define PRINT_IDENTIFIER "cachefile"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "oipcore/abi/output.h"
+#include "oipcore/taskpool.h"
+#include "oipcore/file.h"
+
+#include "cachefile_priv.h"
+#include "configloader_priv.h"
+
+#define CACHEFILE_MAGIC "OIPC"
+#define CACHEFILE_VERSION 2
+
+// The weight of a new sample in the moving averages.
+#define CACHEFILE_EWMA_WEIGHT 0.25
+
+/*
+*  The size of the image cachefile_check() writes. The odd width
+*  and the partial last chunk keep the chunks from lining up with
+*  the fill pattern. The image ends every chunk with a run that
+*  is longer than one run operation.
+*/
+#define CACHEFILE_CHECK_W 7
+#define CACHEFILE_CHECK_H (2*CACHEFILE_CHUNK_ROWS + 3)
+#define CACHEFILE_CHECK_RUN 70
+
+/*
+*  The header of a cache file. 'cost' is the time in seconds it
+*  took to compute the image. A compressed file has the lengths
+*  of its chunks as uint64_t values after the header.
+*/
+typedef struct STRUCT_CACHEFILE_HEADER {
+	char magic[4];
+	uint32_t version;
+	uint32_t format;
+	uint32_t w;
+	uint32_t h;
+	uint32_t chunk_rows;
+	uint32_t chunk_count;
+	uint32_t reserved;
+	double cost;
+} CACHEFILE_HEADER;
+
+// The chunks of an image that is being encoded or decoded.
+typedef struct STRUCT_CACHEFILE_CHUNKS {
+	IMAGE *img;
+	uint32_t chunk_rows;
+	uint8_t **bufs;
+	uint64_t *lens;
+	const uint8_t *data;
+	size_t *offsets;
+	atomic_int failed;
+} CACHEFILE_CHUNKS;
+
+static int cf_mode = CACHEFILE_FORMAT_AUTO;
+
+/*
+*  The measured I/O bandwidth, codec speeds in raw bytes per
+*  second and the compression ratio. 'cf_write_bw' and 'cf_read_bw'
+*  are the speeds of writing and reading whole files in either
+*  format, also in raw bytes per second. Zero means not measured.
+*/
+static pthread_mutex_t cf_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double cf_io_bw = 0;
+static double cf_enc_bw = 0;
+static double cf_dec_bw = 0;
+static double cf_ratio = 0;
+static double cf_write_bw = 0;
+static double cf_read_bw = 0;
+static unsigned long long int cf_auto_count = 0;
+static unsigned long long int cf_writes[2] = { 0, 0 };
+static unsigned long long int cf_reads[2] = { 0, 0 };
+
+static const char *cf_format_names[2] = { "raw", "qoi" };
+
+static double cachefile_elapsed(const struct timespec *t0);
+static void cachefile_ewma(double *avg, const double sample);
+static void cachefile_note(double *avg, const double bytes,
+				const struct timespec *t0);
+static int cachefile_choose(const size_t size);
+static int cachefile_write_all(const int fd, const void *buf, size_t len);
+static int cachefile_read_all(const int fd, void *buf, size_t len, off_t off);
+static void cachefile_encode_chunks(void *arg, size_t begin, size_t end);
+static void cachefile_decode_chunks(void *arg, size_t begin, size_t end);
+static int cachefile_encode(const IMAGE *img, const CACHEFILE_HEADER *hdr,
+				CACHEFILE_CHUNKS *chunks);
+static void cachefile_free_chunks(CACHEFILE_CHUNKS *chunks, const size_t count);
+static IMAGE *cachefile_read_qoi(const int fd, const CACHEFILE_HEADER *hdr,
+				const size_t fsize);
+static int cachefile_read_header(const int fd, const size_t fsize,
+				CACHEFILE_HEADER *hdr);
+static void cachefile_check_fill(IMAGE *img);
+static int cachefile_check_load(const char *dir, const void *data,
+				const size_t len, IMAGE **img);
+static int cachefile_check_reject(const char *dir, const void *data,
+				const size_t len, const char *what);
+
+static double cachefile_elapsed(const struct timespec *t0) {
+	// Return the time since 't0' in seconds.
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec)/1e9;
+}
+
+static void cachefile_ewma(double *avg, const double sample) {
+	// Add 'sample' to the moving average '*avg'.
+	if (*avg) {
+		*avg += (sample - *avg)*CACHEFILE_EWMA_WEIGHT;
+	} else {
+		*avg = sample;
+	}
+}
+
+static void cachefile_note(double *avg, const double bytes,
+				const struct timespec *t0) {
+	// Add the bandwidth of handling 'bytes' since 't0' to '*avg'.
+	double t = cachefile_elapsed(t0);
+
+	if (t > 0) {
+		pthread_mutex_lock(&cf_stats_mutex);
+		cachefile_ewma(avg, bytes/t);
+		pthread_mutex_unlock(&cf_stats_mutex);
+	}
+}
+
+static int cachefile_choose(const size_t size) {
+	/*
+	*  Choose the format for a file of 'size' raw pixel bytes. In
+	*  the automatic mode this estimates the time of writing and
+	*  later reading the file in both formats.
+	*/
+	double raw = 0;
+	double qoi = 0;
+	int ret = CACHEFILE_FORMAT_QOI;
+
+	if (cf_mode != CACHEFILE_FORMAT_AUTO) {
+		return cf_mode;
+	}
+
+	pthread_mutex_lock(&cf_stats_mutex);
+	if (cf_io_bw && cf_enc_bw && cf_ratio) {
+		raw = 2*size/cf_io_bw;
+		qoi = size/cf_enc_bw + size/(cf_dec_bw ? cf_dec_bw : cf_enc_bw) +
+			2*size*cf_ratio/cf_io_bw;
+		if (raw < qoi && cf_auto_count%CACHEFILE_PROBE_INTERVAL != 0) {
+			ret = CACHEFILE_FORMAT_RAW;
+		}
+	}
+	cf_auto_count++;
+	pthread_mutex_unlock(&cf_stats_mutex);
+	return ret;
+}
+
+static int cachefile_write_all(const int fd, const void *buf, size_t len) {
+	/*
+	*  Write 'len' bytes from 'buf' into 'fd'. Returns 0
+	*  on success and 1 on failure.
+	*/
+	const uint8_t *pos = buf;
+	ssize_t ret = 0;
+
+	while (len) {
+		errno = 0;
+		ret = write(fd, pos, len);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printerrno("write()");
+			return 1;
+		}
+		pos += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int cachefile_read_all(const int fd, void *buf, size_t len, off_t off) {
+	/*
+	*  Read 'len' bytes at 'off' in 'fd' into 'buf'. Returns 0
+	*  on success and 1 on failure.
+	*/
+	uint8_t *pos = buf;
+	ssize_t ret = 0;
+
+	while (len) {
+		errno = 0;
+		ret = pread(fd, pos, len, off);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printerrno("pread()");
+			return 1;
+		} else if (ret == 0) {
+			printerr("Cache file truncated.\n");
+			return 1;
+		}
+		pos += ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static void cachefile_encode_chunks(void *arg, size_t begin, size_t end) {
+	// Encode the chunks 'begin' - 'end' of a CACHEFILE_CHUNKS.
+	CACHEFILE_CHUNKS *chunks = (CACHEFILE_CHUNKS*) arg;
+	const IMAGE *img = chunks->img;
+	size_t rows = 0;
+	size_t n = 0;
+
+	for (size_t i = begin; i < end; i++) {
+		rows = img->h - i*chunks->chunk_rows;
+		if (rows > chunks->chunk_rows) {
+			rows = chunks->chunk_rows;
+		}
+		n = rows*img->w;
+		chunks->bufs[i] = malloc(IMG_QOI_MAX_LEN(n));
+		if (!chunks->bufs[i]) {
+			atomic_store(&chunks->failed, 1);
+			continue;
+		}
+		chunks->lens[i] = img_qoi_encode(
+			img->img + i*chunks->chunk_rows*img->w, n, chunks->bufs[i]);
+	}
+}
+
+static void cachefile_decode_chunks(void *arg, size_t begin, size_t end) {
+	// Decode the chunks 'begin' - 'end' of a CACHEFILE_CHUNKS.
+	CACHEFILE_CHUNKS *chunks = (CACHEFILE_CHUNKS*) arg;
+	IMAGE *img = chunks->img;
+	size_t rows = 0;
+
+	for (size_t i = begin; i < end; i++) {
+		rows = img->h - i*chunks->chunk_rows;
+		if (rows > chunks->chunk_rows) {
+			rows = chunks->chunk_rows;
+		}
+		if (img_qoi_decode(chunks->data + chunks->offsets[i], chunks->lens[i],
+				img->img + i*chunks->chunk_rows*img->w,
+				rows*img->w) != 0) {
+			atomic_store(&chunks->failed, 1);
+		}
+	}
+}
+
+static int cachefile_encode(const IMAGE *img, const CACHEFILE_HEADER *hdr,
+				CACHEFILE_CHUNKS *chunks) {
+	/*
+	*  Encode the chunks of 'img' described by 'hdr' into 'chunks'.
+	*  The buffers must be freed with cachefile_free_chunks() even
+	*  on failure. Returns 0 on success and 1 on failure.
+	*/
+	struct timespec t0;
+
+	memset(chunks, 0, sizeof(*chunks));
+	chunks->img = (IMAGE*) img;
+	chunks->chunk_rows = hdr->chunk_rows;
+	atomic_init(&chunks->failed, 0);
+
+	errno = 0;
+	chunks->bufs = calloc(hdr->chunk_count + 1, sizeof(*chunks->bufs));
+	chunks->lens = calloc(hdr->chunk_count + 1, sizeof(*chunks->lens));
+	if (!chunks->bufs || !chunks->lens) {
+		printerrno("calloc()");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	taskpool_parallel_for(hdr->chunk_count, 1, &cachefile_encode_chunks, chunks);
+	if (atomic_load(&chunks->failed)) {
+		printerr("Failed to allocate an encoding buffer.\n");
+		return 1;
+	}
+	cachefile_note(&cf_enc_bw, img_bytelen(img), &t0);
+	return 0;
+}
+
+static void cachefile_free_chunks(CACHEFILE_CHUNKS *chunks, const size_t count) {
+	// Free the encoding buffers of the 'count' chunks of 'chunks'.
+	if (chunks->bufs) {
+		for (size_t i = 0; i < count; i++) {
+			free(chunks->bufs[i]);
+		}
+	}
+	free(chunks->bufs);
+	free(chunks->lens);
+}
+
+static IMAGE *cachefile_read_qoi(const int fd, const CACHEFILE_HEADER *hdr,
+				const size_t fsize) {
+	/*
+	*  Read the compressed image with the header 'hdr' from the
+	*  file 'fd' of 'fsize' bytes. Returns a pointer to the image
+	*  on success or a NULL pointer on failure.
+	*/
+	CACHEFILE_CHUNKS chunks;
+	struct timespec t0;
+	uint8_t *data = NULL;
+	size_t data_off = 0;
+	size_t total = 0;
+	IMAGE *ret = NULL;
+
+	memset(&chunks, 0, sizeof(chunks));
+	chunks.chunk_rows = hdr->chunk_rows;
+	atomic_init(&chunks.failed, 0);
+
+	// The header has been checked against the file size.
+	data_off = sizeof(*hdr) + (size_t) hdr->chunk_count*sizeof(*chunks.lens);
+
+	errno = 0;
+	chunks.lens = calloc(hdr->chunk_count + 1, sizeof(*chunks.lens));
+	chunks.offsets = calloc(hdr->chunk_count + 1, sizeof(*chunks.offsets));
+	data = malloc(fsize - data_off + 1);
+	if (!chunks.lens || !chunks.offsets || !data) {
+		printerrno("malloc()");
+		free(chunks.lens);
+		free(chunks.offsets);
+		free(data);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (cachefile_read_all(fd, chunks.lens,
+			hdr->chunk_count*sizeof(*chunks.lens), sizeof(*hdr)) == 0 &&
+		cachefile_read_all(fd, data, fsize - data_off, data_off) == 0) {
+		cachefile_note(&cf_io_bw, fsize, &t0);
+
+		for (size_t i = 0; i < hdr->chunk_count; i++) {
+			chunks.offsets[i] = total;
+			total += chunks.lens[i];
+			if (chunks.lens[i] > fsize || total > fsize - data_off) {
+				break;
+			}
+		}
+		if (total != fsize - data_off) {
+			printerr("Malformed cache file.\n");
+		} else {
+			ret = img_alloc(hdr->w, hdr->h);
+		}
+	}
+
+	if (ret) {
+		chunks.img = ret;
+		chunks.data = data;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		taskpool_parallel_for(hdr->chunk_count, 1, &cachefile_decode_chunks,
+					&chunks);
+		if (atomic_load(&chunks.failed)) {
+			printerr("Malformed cache file.\n");
+			img_free(ret);
+			ret = NULL;
+		} else {
+			cachefile_note(&cf_dec_bw, img_bytelen(ret), &t0);
+		}
+	}
+	free(chunks.lens);
+	free(chunks.offsets);
+	free(data);
+	return ret;
+}
+
+static int cachefile_read_header(const int fd, const size_t fsize,
+				CACHEFILE_HEADER *hdr) {
+	/*
+	*  Read the header of the cache file 'fd' of 'fsize' bytes
+	*  into 'hdr'. The size of the image is checked against the
+	*  size of the file before anything is allocated for it.
+	*  Returns 0 on success and 1 if the file isn't a valid cache
+	*  file of this version.
+	*/
+	if (fsize < sizeof(*hdr) ||
+		cachefile_read_all(fd, hdr, sizeof(*hdr), 0) != 0 ||
+		memcmp(hdr->magic, CACHEFILE_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->version != CACHEFILE_VERSION) {
+		return 1;
+	}
+
+	if (!img_size_valid(hdr->w, hdr->h)) {
+		printerr("Invalid image size in a cache file.\n");
+		return 1;
+	} else if (hdr->format == CACHEFILE_FORMAT_RAW) {
+		if (fsize != sizeof(*hdr) + (size_t) hdr->w*hdr->h*sizeof(RGBQUAD)) {
+			printerr("Malformed cache file.\n");
+			return 1;
+		}
+	} else if (hdr->format == CACHEFILE_FORMAT_QOI) {
+		if (!hdr->chunk_rows ||
+			hdr->chunk_count != (hdr->h + (uint64_t) hdr->chunk_rows - 1)/
+						hdr->chunk_rows ||
+			fsize < sizeof(*hdr) + (size_t) hdr->chunk_count*sizeof(uint64_t)) {
+			printerr("Malformed cache file.\n");
+			return 1;
+		}
+	} else {
+		printerr("Unknown cache file format.\n");
+		return 1;
+	}
+	return 0;
+}
+
+int cachefile_save(const IMAGE *img, const double cost, const int fd) {
+	/*
+	*  Save 'img' that took 'cost' seconds to compute into the
+	*  new file 'fd'. 'fd' is closed in any case. Returns 0 on
+	*  success and 1 on failure.
+	*/
+	CACHEFILE_HEADER hdr;
+	CACHEFILE_CHUNKS chunks;
+	struct timespec t_start;
+	struct timespec t0;
+	size_t written = 0;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&chunks, 0, sizeof(chunks));
+	memcpy(hdr.magic, CACHEFILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHEFILE_VERSION;
+	hdr.format = cachefile_choose(img_bytelen(img));
+	hdr.w = img->w;
+	hdr.h = img->h;
+	hdr.cost = cost;
+	if (hdr.format == CACHEFILE_FORMAT_QOI) {
+		hdr.chunk_rows = CACHEFILE_CHUNK_ROWS;
+		hdr.chunk_count = (img->h + CACHEFILE_CHUNK_ROWS - 1)/CACHEFILE_CHUNK_ROWS;
+		if (cachefile_encode(img, &hdr, &chunks) != 0) {
+			cachefile_free_chunks(&chunks, hdr.chunk_count);
+			close(fd);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	written = sizeof(hdr);
+	ret = cachefile_write_all(fd, &hdr, sizeof(hdr));
+	if (hdr.format == CACHEFILE_FORMAT_QOI) {
+		written += hdr.chunk_count*sizeof(*chunks.lens);
+		ret = ret || cachefile_write_all(fd, chunks.lens,
+				hdr.chunk_count*sizeof(*chunks.lens));
+		for (size_t i = 0; !ret && i < hdr.chunk_count; i++) {
+			ret = cachefile_write_all(fd, chunks.bufs[i], chunks.lens[i]);
+			written += chunks.lens[i];
+		}
+	} else {
+		written += img_bytelen(img);
+		ret = ret || cachefile_write_all(fd, img->img, img_bytelen(img));
+	}
+	cachefile_free_chunks(&chunks, hdr.chunk_count);
+
+	// Network filesystems flush the file when it's closed.
+	errno = 0;
+	if (close(fd) == -1 && !ret) {
+		printerrno("close()");
+		ret = 1;
+	}
+	if (ret) {
+		return 1;
+	}
+	cachefile_note(&cf_io_bw, written, &t0);
+	cachefile_note(&cf_write_bw, img_bytelen(img), &t_start);
+
+	pthread_mutex_lock(&cf_stats_mutex);
+	if (hdr.format == CACHEFILE_FORMAT_QOI) {
+		cachefile_ewma(&cf_ratio, (double) written/
+				(img_bytelen(img) ? img_bytelen(img) : 1));
+	}
+	cf_writes[hdr.format]++;
+	pthread_mutex_unlock(&cf_stats_mutex);
+	printverb_va("Wrote a %s cache file of %zu bytes.\n",
+			cf_format_names[hdr.format], written);
+	return 0;
+}
+
+IMAGE *cachefile_load(const char *path) {
+	/*
+	*  Load the cache file 'path'. Returns a pointer to the
+	*  image on success or a NULL pointer on failure.
+	*/
+	CACHEFILE_HEADER hdr;
+	struct timespec t_start;
+	struct timespec t0;
+	struct stat st;
+	IMAGE *ret = NULL;
+	int fd = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	errno = 0;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		printerrno("open()");
+		return NULL;
+	}
+
+	errno = 0;
+	if (fstat(fd, &st) == -1) {
+		printerrno("fstat()");
+		close(fd);
+		return NULL;
+	}
+
+	if (cachefile_read_header(fd, st.st_size, &hdr) != 0) {
+		printerr_va("'%s' is not a cache file.\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	if (hdr.format == CACHEFILE_FORMAT_RAW) {
+		ret = img_alloc(hdr.w, hdr.h);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (ret && cachefile_read_all(fd, ret->img, img_bytelen(ret),
+						sizeof(hdr)) != 0) {
+			img_free(ret);
+			ret = NULL;
+		} else if (ret) {
+			cachefile_note(&cf_io_bw, st.st_size, &t0);
+		}
+	} else {
+		ret = cachefile_read_qoi(fd, &hdr, st.st_size);
+	}
+	close(fd);
+
+	if (ret) {
+		cachefile_note(&cf_read_bw, img_bytelen(ret), &t_start);
+		pthread_mutex_lock(&cf_stats_mutex);
+		cf_reads[hdr.format]++;
+		pthread_mutex_unlock(&cf_stats_mutex);
+	}
+	return ret;
+}
+
+int cachefile_read_info(const char *path, CACHEFILE_INFO *info) {
+	/*
+	*  Read the header of the cache file 'path' into 'info'.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	CACHEFILE_HEADER hdr;
+	struct stat st;
+	int ret = 1;
+	int fd = -1;
+
+	errno = 0;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		printerrno("open()");
+		return 1;
+	}
+	errno = 0;
+	if (fstat(fd, &st) == -1) {
+		printerrno("fstat()");
+	} else if (cachefile_read_header(fd, st.st_size, &hdr) != 0) {
+		printerr_va("'%s' is not a cache file.\n", path);
+	} else {
+		info->w = hdr.w;
+		info->h = hdr.h;
+		info->cost = hdr.cost;
+		ret = 0;
+	}
+	close(fd);
+	return ret;
+}
+
+int cachefile_estimate(const size_t size, double *write_t, double *read_t) {
+	/*
+	*  Store the estimated times in seconds of writing and reading
+	*  a cache file of 'size' raw pixel bytes in '*write_t' and
+	*  '*read_t'. Reading is assumed to be as fast as writing until
+	*  a file has been read. Returns 0 on success and 1 if nothing
+	*  has been measured yet.
+	*/
+	int ret = 1;
+
+	pthread_mutex_lock(&cf_stats_mutex);
+	if (cf_write_bw) {
+		*write_t = size/cf_write_bw;
+		*read_t = size/(cf_read_bw ? cf_read_bw : cf_write_bw);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&cf_stats_mutex);
+	return ret;
+}
+
+int cachefile_advise(const char *path) {
+	/*
+	*  Ask the kernel to start reading the cache file 'path' into
+	*  the page cache without waiting for it. Returns 0 on success
+	*  and 1 on failure.
+	*/
+	int ret = 0;
+	int fd = -1;
+
+	errno = 0;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		printerrno("open()");
+		return 1;
+	}
+	ret = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	if (ret != 0) {
+		errno = ret;
+		printerrno("posix_fadvise()");
+	}
+	close(fd);
+	return ret != 0;
+}
+
+void cachefile_print_status(void) {
+	/*
+	*  Print the cache file format and the measurements
+	*  it's chosen by to STDOUT.
+	*/
+	pthread_mutex_lock(&cf_stats_mutex);
+	fprintf(print_stdout, "Format: %s\n", cf_mode == CACHEFILE_FORMAT_AUTO ? "auto" :
+		cf_format_names[cf_mode]);
+	fprintf(print_stdout, "  I/O bandwidth:     %.2f MiB/s\n", cf_io_bw/(1024*1024));
+	fprintf(print_stdout, "  Encoding speed:    %.2f MiB/s\n", cf_enc_bw/(1024*1024));
+	fprintf(print_stdout, "  Decoding speed:    %.2f MiB/s\n", cf_dec_bw/(1024*1024));
+	fprintf(print_stdout, "  Compression ratio: %.3f\n", cf_ratio);
+	fprintf(print_stdout, "  File write speed:  %.2f MiB/s\n", cf_write_bw/(1024*1024));
+	fprintf(print_stdout, "  File read speed:   %.2f MiB/s\n", cf_read_bw/(1024*1024));
+	fprintf(print_stdout, "  Written:           %llu raw, %llu qoi\n", cf_writes[0], cf_writes[1]);
+	fprintf(print_stdout, "  Read:              %llu raw, %llu qoi\n", cf_reads[0], cf_reads[1]);
+	pthread_mutex_unlock(&cf_stats_mutex);
+}
+
+int cachefile_setup(void) {
+	/*
+	*  Read the cache file format from the config parameter
+	*  'cache_format', which is 'auto', 'raw' or 'qoi'. The
+	*  default is 'auto'. Returns 0 on success and 1 on failure.
+	*/
+	const char *format = NULL;
+
+	format = config_get_str_param("cache_format");
+	if (!format || strcmp(format, "auto") == 0) {
+		cf_mode = CACHEFILE_FORMAT_AUTO;
+	} else if (strcmp(format, cf_format_names[CACHEFILE_FORMAT_RAW]) == 0) {
+		cf_mode = CACHEFILE_FORMAT_RAW;
+	} else if (strcmp(format, cf_format_names[CACHEFILE_FORMAT_QOI]) == 0) {
+		cf_mode = CACHEFILE_FORMAT_QOI;
+	} else {
+		printerr_va("Invalid cache format '%s'.\n", format);
+		return 1;
+	}
+	return 0;
+}
+
+static void cachefile_check_fill(IMAGE *img) {
+	/*
+	*  Fill 'img' with pixels that exercise the edge cases of the
+	*  codec: colors that collide in the index, alpha changes,
+	*  differences that wrap around and runs at the chunk ends.
+	*/
+	const size_t chunk = (size_t) CACHEFILE_CHUNK_ROWS*img->w;
+	const size_t n = (size_t) img->w*img->h;
+	RGBQUAD *px = img->img;
+	uint32_t seed = 1;
+
+	for (size_t i = 0; i < n; i++) {
+		seed = seed*1103515245 + 12345;
+		px[i].rgbBlue = 10;
+		px[i].rgbGreen = 20;
+		px[i].rgbRed = 30;
+		px[i].rgbReserved = 255;
+		if (chunk - i%chunk <= CACHEFILE_CHECK_RUN ||
+			n - i <= CACHEFILE_CHECK_RUN) {
+			continue;
+		}
+		switch (i/16%5) {
+			case 0:
+				// Red values 64 apart share a slot in the index.
+				px[i].rgbRed += 64*(seed >> 16 & 3);
+				break;
+			case 1:
+				// The same color with a changing alpha.
+				px[i].rgbReserved = seed >> 16 & 1 ? 255 : 128 + (i & 7);
+				break;
+			case 2:
+				// Luma differences that wrap around.
+				px[i].rgbBlue = i*19;
+				px[i].rgbGreen = i*20;
+				px[i].rgbRed = i*21;
+				break;
+			case 3:
+				// Small differences that wrap around.
+				px[i].rgbBlue = i & 1 ? 0 : 255;
+				px[i].rgbGreen = i & 1 ? 255 : 0;
+				px[i].rgbRed = i & 1 ? 0 : 255;
+				break;
+			default:
+				px[i].rgbBlue = seed >> 8;
+				px[i].rgbGreen = seed >> 16;
+				px[i].rgbRed = seed >> 24;
+				px[i].rgbReserved = seed & 1 ? 255 : seed >> 4;
+				break;
+		}
+	}
+}
+
+static int cachefile_check_load(const char *dir, const void *data,
+				const size_t len, IMAGE **img) {
+	/*
+	*  Write the 'len' bytes of 'data' into a temporary file in
+	*  'dir' and load it as a cache file into '*img', which is set
+	*  to a NULL pointer if the file is rejected. Returns 0 on
+	*  success and 1 if the file couldn't be written.
+	*/
+	char *path = NULL;
+	int fd = -1;
+	int ret = 1;
+
+	*img = NULL;
+	path = file_path_join(2, dir, ".check.XXXXXX");
+	if (!path) {
+		return 1;
+	}
+
+	errno = 0;
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd == -1) {
+		printerrno("mkostemp()");
+		free(path);
+		return 1;
+	}
+	if (cachefile_write_all(fd, data, len) == 0) {
+		*img = cachefile_load(path);
+		ret = 0;
+	}
+	close(fd);
+	unlink(path);
+	free(path);
+	return ret;
+}
+
+static int cachefile_check_reject(const char *dir, const void *data,
+				const size_t len, const char *what) {
+	/*
+	*  Check that the cache file of 'len' bytes in 'data' is
+	*  rejected. The errors of the loader are hidden. 'what'
+	*  describes the damage. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	FILE *prev = print_stream;
+	FILE *null = NULL;
+	IMAGE *img = NULL;
+	int ret = 0;
+
+	null = fopen("/dev/null", "w");
+	if (null) {
+		print_stream = null;
+	}
+	ret = cachefile_check_load(dir, data, len, &img);
+	print_stream = prev;
+	if (null) {
+		fclose(null);
+	}
+
+	if (!ret && img) {
+		printerr_va("A cache file with %s was loaded.\n", what);
+		img_free(img);
+		ret = 1;
+	}
+	return ret;
+}
+
+int cachefile_check(const char *dir) {
+	/*
+	*  Check that a compressed cache file written into 'dir'
+	*  loads back unchanged and that files with truncated or
+	*  garbled chunk tables are rejected. The measurements taken
+	*  meanwhile are discarded, so this must be run before any
+	*  cache files are written. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	CACHEFILE_HEADER hdr;
+	CACHEFILE_CHUNKS chunks;
+	const uint64_t shifts[] = { 1, (uint64_t) 1 << 63 };
+	uint64_t *lens = NULL;
+	uint8_t *data = NULL;
+	size_t table_len = 0;
+	size_t len = 0;
+	IMAGE *img = NULL;
+	IMAGE *loaded = NULL;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHEFILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHEFILE_VERSION;
+	hdr.format = CACHEFILE_FORMAT_QOI;
+	hdr.w = CACHEFILE_CHECK_W;
+	hdr.h = CACHEFILE_CHECK_H;
+	hdr.chunk_rows = CACHEFILE_CHUNK_ROWS;
+	hdr.chunk_count = (hdr.h + CACHEFILE_CHUNK_ROWS - 1)/CACHEFILE_CHUNK_ROWS;
+	table_len = hdr.chunk_count*sizeof(*lens);
+
+	img = img_alloc(hdr.w, hdr.h);
+	if (!img) {
+		return 1;
+	}
+	cachefile_check_fill(img);
+	if (cachefile_encode(img, &hdr, &chunks) != 0) {
+		cachefile_free_chunks(&chunks, hdr.chunk_count);
+		img_free(img);
+		return 1;
+	}
+
+	// Lay the file out in memory.
+	len = sizeof(hdr) + table_len;
+	for (size_t i = 0; i < hdr.chunk_count; i++) {
+		len += chunks.lens[i];
+	}
+	errno = 0;
+	data = malloc(len);
+	if (!data) {
+		printerrno("malloc()");
+		cachefile_free_chunks(&chunks, hdr.chunk_count);
+		img_free(img);
+		return 1;
+	}
+	memcpy(data, &hdr, sizeof(hdr));
+	memcpy(data + sizeof(hdr), chunks.lens, table_len);
+	len = sizeof(hdr) + table_len;
+	for (size_t i = 0; i < hdr.chunk_count; i++) {
+		memcpy(data + len, chunks.bufs[i], chunks.lens[i]);
+		len += chunks.lens[i];
+	}
+	cachefile_free_chunks(&chunks, hdr.chunk_count);
+	lens = (uint64_t*) (data + sizeof(hdr));
+
+	if (cachefile_check_load(dir, data, len, &loaded) != 0) {
+		ret = 1;
+	} else if (!loaded || memcmp(loaded->img, img->img,
+					img_bytelen(img)) != 0) {
+		printerr("A cache file didn't load back unchanged.\n");
+		ret = 1;
+	}
+	if (loaded) {
+		img_free(loaded);
+	}
+
+	ret = ret || cachefile_check_reject(dir, data, sizeof(hdr) + table_len/2,
+						"a truncated chunk table");
+	ret = ret || cachefile_check_reject(dir, data, len - 1,
+						"a truncated chunk");
+
+	/*
+	*  Move data from the second chunk to the first one. The total
+	*  length stays the same, also when the lengths wrap around.
+	*/
+	for (size_t i = 0; !ret && i < sizeof(shifts)/sizeof(shifts[0]); i++) {
+		lens[0] += shifts[i];
+		lens[1] -= shifts[i];
+		ret = cachefile_check_reject(dir, data, len, "a garbled chunk table");
+		lens[0] -= shifts[i];
+		lens[1] += shifts[i];
+	}
+
+	free(data);
+	img_free(img);
+
+	pthread_mutex_lock(&cf_stats_mutex);
+	cf_io_bw = 0;
+	cf_enc_bw = 0;
+	cf_dec_bw = 0;
+	cf_read_bw = 0;
+	memset(cf_reads, 0, sizeof(cf_reads));
+	pthread_mutex_unlock(&cf_stats_mutex);
+
+	if (ret) {
+		printerr("The cache file check failed.\n");
+	}
+	return ret;
+}
@@ -0,0 +1,62 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef INCLUDED_CACHEFILE_PRIV
+	#define INCLUDED_CACHEFILE_PRIV
+
+	#include <stdint.h>
+
+	#include "oipimgutil/oipimgutil.h"
+
+	// The storage formats of cache files.
+	#define CACHEFILE_FORMAT_AUTO -1
+	#define CACHEFILE_FORMAT_RAW   0
+	#define CACHEFILE_FORMAT_QOI   1
+
+	// The number of image rows in an independently coded chunk.
+	#define CACHEFILE_CHUNK_ROWS 64
+
+	/*
+	*  In the automatic mode every Nth file is written in the
+	*  compressed format even if the raw format is faster so
+	*  that the codec measurements stay up to date.
+	*/
+	#define CACHEFILE_PROBE_INTERVAL 16
+
+	/*
+	*  The size of the image in a cache file and the time in
+	*  seconds it took to compute it.
+	*/
+	typedef struct STRUCT_CACHEFILE_INFO {
+		uint32_t w;
+		uint32_t h;
+		double cost;
+	} CACHEFILE_INFO;
+
+	int cachefile_setup(void);
+	int cachefile_save(const IMAGE *img, const double cost, const int fd);
+	IMAGE *cachefile_load(const char *path);
+	int cachefile_read_info(const char *path, CACHEFILE_INFO *info);
+	int cachefile_estimate(const size_t size, double *write_t, double *read_t);
+	int cachefile_advise(const char *path);
+	void cachefile_print_status(void);
+	int cachefile_check(const char *dir);
+#endif
@@ -31,7 +31,7 @@
 #include "oipcore/abi/output.h"
 #include "cli_priv.h"
 
-#define CLI_GETOPT_OPTS "vpc:"
+#define CLI_GETOPT_OPTS "vpc:f:d:w:o:t:"
 
 static struct CLI_OPTS cli_opts;
 
@@ -52,6 +52,21 @@ int cli_parse_opts(int argc, char **argv) {
 			case 'c':
 				cli_opts.opt_config_file = optarg;
 				break;
+			case 'f':
+				cli_opts.opt_script_file = optarg;
+				break;
+			case 'd':
+				cli_opts.opt_daemon_socket = optarg;
+				break;
+			case 'w':
+				cli_opts.opt_watch_dir = optarg;
+				break;
+			case 'o':
+				cli_opts.opt_output_dir = optarg;
+				break;
+			case 't':
+				cli_opts.opt_trace_file = optarg;
+				break;
 			case '?':
 				if (isprint(optopt)) {
 					printerr_va("Unknown option -%c.\n", optopt);
@@ -29,6 +29,11 @@
 		unsigned int opt_preserve_cache;
 		unsigned int opt_verbose;
 		char *opt_config_file;
+		char *opt_script_file;
+		char *opt_daemon_socket;
+		char *opt_watch_dir;
+		char *opt_output_dir;
+		char *opt_trace_file;
 	};
 
 	int cli_parse_opts(int argc, char **argv);
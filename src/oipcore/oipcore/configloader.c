@@ -29,18 +29,31 @@
 #include <errno.h>
 
 #include "oipcore/abi/output.h"
+#include "oipcore/hashmap.h"
 #include "configloader_priv.h"
 
 #define CONFIG_DEFAULT_PATH "oip.conf"
 #define CONFIG_BUF_LEN 100
-#define CONFIG_NUM_VALID_PARAMS 2
+#define CONFIG_NUM_VALID_PARAMS 13
 
 static unsigned int config_num_params = 0;
 static char **config = NULL;
+static HASHMAP *config_index = NULL;
 
 static char *config_valid_params[CONFIG_NUM_VALID_PARAMS] = {
 	"cache_root",
-	"cache_default_max_files"
+	"cache_max_mb",
+	"cache_default_max_mb",
+	"cache_format",
+	"progress_report_ms",
+	"worker_processes",
+	"watch_max_jobs",
+	"watch_debounce_ms",
+	"memory_budget_mb",
+	"task_threads",
+	"prefetch_max_mb",
+	"cache_policy",
+	"perf_counters"
 };
 
 static int config_lineempty(const char *ln);
@@ -149,6 +162,16 @@ static int config_parse_line(const char *ln) {
 	}
 	strcpy(config[config_num_params*2 - 1], token);
 	free(tmp_ln);
+
+	// Index the parameter. The first definition of a parameter is used.
+	if (hashmap_get_str(config_index, config[config_num_params*2 - 2])) {
+		return 0;
+	}
+	if (hashmap_put_str(config_index, config[config_num_params*2 - 2],
+			config[config_num_params*2 - 1]) != 0) {
+		printerr("Failed to index configuration parameter.\n");
+		return 1;
+	}
 	return 0;
 }
 
@@ -157,12 +180,10 @@ char *config_get_str_param(const char *param) {
 	*  Get the string value of 'param' or NULL
 	*  if 'param' does not exist.
 	*/
-	for (unsigned int i = 0; i < config_num_params; i++) {
-		if (strcmp(config[i*2], param) == 0) {
-			return config[i*2 + 1];
-		}
+	if (!config_index) {
+		return NULL;
 	}
-	return NULL;
+	return hashmap_get_str(config_index, param);
 }
 
 long int config_get_lint_param(const char *param) {
@@ -208,6 +229,12 @@ int config_load(char *cfpath) {
 		return 1;
 	}
 
+	config_index = hashmap_create(HASHMAP_KEY_STR, NULL);
+	if (!config_index) {
+		fclose(conf);
+		return 1;
+	}
+
 	while (!feof(conf)) {
 		if ((ret = fgets(linebuf, CONFIG_BUF_LEN, conf))) {
 			if (!config_lineempty(linebuf)) {
@@ -230,4 +257,8 @@ void config_cleanup(void) {
 		}
 		free(config);
 	}
+	if (config_index) {
+		hashmap_destroy(config_index, 0);
+		config_index = NULL;
+	}
 }
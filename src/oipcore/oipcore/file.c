@@ -48,15 +48,12 @@ char *file_path_join(size_t n, ...) {
 
 	va_start(va, n);
 	tmp = strutils_cat_va(n, "/", &va);
+	va_end(va);
 	if (!tmp) {
 		return NULL;
 	}
 	ret = strutils_strip_subseq(tmp, DIRECTORY_SEPARATOR);
-	if (!ret) {
-		free(tmp);
-		return NULL;
-	}
-	va_end(va);
+	free(tmp);
 	return ret;
 }
 
@@ -0,0 +1,441 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/*
+*  An open addressing hash map. The slots are split into groups of
+*  HASHMAP_GROUP_WIDTH and every slot has a control byte that is either
+*  HASHMAP_CTRL_EMPTY, HASHMAP_CTRL_DELETED or the low 7 bits of the
+*  key hash. A lookup compares the control bytes of a whole group at
+*  once (using SSE2 when available) and only compares the actual keys
+*  of slots whose control byte matches.
+*/
+
+#define PRINT_IDENTIFIER "hashmap"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#include "oipcore/abi/output.h"
+#include "oipcore/hashmap.h"
+
+#define HASHMAP_GROUP_WIDTH 16
+#define HASHMAP_MIN_CAP HASHMAP_GROUP_WIDTH
+
+#define HASHMAP_CTRL_EMPTY 0x80
+#define HASHMAP_CTRL_DELETED 0xFE
+
+#define HASHMAP_NOT_FOUND SIZE_MAX
+
+static uint64_t hashmap_mix(uint64_t x);
+static uint64_t hashmap_hash(const HASHMAP *map, const char *str,
+				const unsigned long long int num);
+static uint32_t hashmap_group_match(const unsigned char *group,
+					const unsigned char byte);
+static uint32_t hashmap_group_free(const unsigned char *group);
+static int hashmap_key_eq(const HASHMAP *map, const HASHMAP_SLOT *slot,
+				const char *str, const unsigned long long int num);
+static size_t hashmap_find(const HASHMAP *map, const uint64_t hash,
+				const char *str, const unsigned long long int num);
+static size_t hashmap_find_free(const HASHMAP *map, const uint64_t hash);
+static int hashmap_resize(HASHMAP *map, const size_t cap);
+static int hashmap_put(HASHMAP *map, const char *str,
+			const unsigned long long int num, void *val);
+static void *hashmap_get(const HASHMAP *map, const char *str,
+			const unsigned long long int num);
+static void *hashmap_pop(HASHMAP *map, const char *str,
+			const unsigned long long int num);
+
+static uint64_t hashmap_mix(uint64_t x) {
+	/*
+	*  Mix the bits of 'x'. This is the splitmix64 finalizer.
+	*/
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static uint64_t hashmap_hash(const HASHMAP *map, const char *str,
+				const unsigned long long int num) {
+	/*
+	*  Hash a key of 'map'. String keys are hashed using
+	*  FNV-1a and the result is mixed so that both the low
+	*  and the high bits are usable.
+	*/
+	uint64_t h = 0xCBF29CE484222325ULL;
+
+	if (map->key_type == HASHMAP_KEY_INT) {
+		return hashmap_mix(num);
+	}
+	while (*str != '\0') {
+		h ^= (unsigned char) *str++;
+		h *= 0x100000001B3ULL;
+	}
+	return hashmap_mix(h);
+}
+
+static uint32_t hashmap_group_match(const unsigned char *group,
+					const unsigned char byte) {
+	/*
+	*  Return a bitmask of the control bytes in 'group'
+	*  that are equal to 'byte'.
+	*/
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i*) group);
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl,
+						_mm_set1_epi8((char) byte)));
+#else
+	uint32_t ret = 0;
+	for (unsigned int i = 0; i < HASHMAP_GROUP_WIDTH; i++) {
+		if (group[i] == byte) {
+			ret |= 1u << i;
+		}
+	}
+	return ret;
+#endif
+}
+
+static uint32_t hashmap_group_free(const unsigned char *group) {
+	/*
+	*  Return a bitmask of the empty or deleted slots in 'group'.
+	*  Both of these have the high bit of the control byte set.
+	*/
+#ifdef __SSE2__
+	return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+#else
+	uint32_t ret = 0;
+	for (unsigned int i = 0; i < HASHMAP_GROUP_WIDTH; i++) {
+		if (group[i] & 0x80) {
+			ret |= 1u << i;
+		}
+	}
+	return ret;
+#endif
+}
+
+static int hashmap_key_eq(const HASHMAP *map, const HASHMAP_SLOT *slot,
+				const char *str, const unsigned long long int num) {
+	if (map->key_type == HASHMAP_KEY_INT) {
+		return slot->key.num == num;
+	}
+	return strcmp(slot->key.str, str) == 0;
+}
+
+static size_t hashmap_find(const HASHMAP *map, const uint64_t hash,
+				const char *str, const unsigned long long int num) {
+	/*
+	*  Return the slot index of a key or HASHMAP_NOT_FOUND if
+	*  the key doesn't exist in 'map'. The groups are probed
+	*  triangularly, which visits every group once since the
+	*  number of groups is a power of two.
+	*/
+	size_t mask = map->cap/HASHMAP_GROUP_WIDTH - 1;
+	size_t g = (hash >> 7) & mask;
+	unsigned char h2 = hash & 0x7F;
+	const unsigned char *group = NULL;
+	uint32_t match = 0;
+	size_t index = 0;
+
+	if (map->cap == 0) {
+		return HASHMAP_NOT_FOUND;
+	}
+
+	for (size_t probe = 0; probe <= mask; probe++) {
+		group = map->ctrl + g*HASHMAP_GROUP_WIDTH;
+		match = hashmap_group_match(group, h2);
+		while (match) {
+			index = g*HASHMAP_GROUP_WIDTH + __builtin_ctz(match);
+			if (hashmap_key_eq(map, &map->slots[index], str, num)) {
+				return index;
+			}
+			match &= match - 1;
+		}
+
+		// An empty slot in the group terminates the probe sequence.
+		if (hashmap_group_match(group, HASHMAP_CTRL_EMPTY)) {
+			break;
+		}
+		g = (g + probe + 1) & mask;
+	}
+	return HASHMAP_NOT_FOUND;
+}
+
+static size_t hashmap_find_free(const HASHMAP *map, const uint64_t hash) {
+	/*
+	*  Return the index of the first empty or deleted slot
+	*  in the probe sequence of 'hash'. The load factor is kept
+	*  below 7/8, so a free slot always exists.
+	*/
+	size_t mask = map->cap/HASHMAP_GROUP_WIDTH - 1;
+	size_t g = (hash >> 7) & mask;
+	uint32_t match = 0;
+
+	for (size_t probe = 0; probe <= mask; probe++) {
+		match = hashmap_group_free(map->ctrl + g*HASHMAP_GROUP_WIDTH);
+		if (match) {
+			return g*HASHMAP_GROUP_WIDTH + __builtin_ctz(match);
+		}
+		g = (g + probe + 1) & mask;
+	}
+	return HASHMAP_NOT_FOUND;
+}
+
+static int hashmap_resize(HASHMAP *map, const size_t cap) {
+	/*
+	*  Rehash 'map' into 'cap' slots. This also purges all
+	*  the deleted slots. Returns 0 on success and 1 on failure.
+	*  On failure the contents of 'map' are not modified.
+	*/
+	unsigned char *n_ctrl = NULL;
+	HASHMAP_SLOT *n_slots = NULL;
+	unsigned char *o_ctrl = map->ctrl;
+	HASHMAP_SLOT *o_slots = map->slots;
+	size_t o_cap = map->cap;
+	uint64_t hash = 0;
+	size_t index = 0;
+
+	errno = 0;
+	n_ctrl = malloc(cap*sizeof(*n_ctrl));
+	if (!n_ctrl) {
+		printerrno("malloc()");
+		return 1;
+	}
+	memset(n_ctrl, HASHMAP_CTRL_EMPTY, cap*sizeof(*n_ctrl));
+
+	errno = 0;
+	n_slots = calloc(cap, sizeof(*n_slots));
+	if (!n_slots) {
+		printerrno("calloc()");
+		free(n_ctrl);
+		return 1;
+	}
+
+	map->ctrl = n_ctrl;
+	map->slots = n_slots;
+	map->cap = cap;
+	map->used = map->cnt;
+
+	for (size_t i = 0; i < o_cap; i++) {
+		if (o_ctrl[i] & 0x80) {
+			continue;
+		}
+		hash = hashmap_hash(map, o_slots[i].key.str, o_slots[i].key.num);
+		index = hashmap_find_free(map, hash);
+		map->ctrl[index] = hash & 0x7F;
+		map->slots[index] = o_slots[i];
+	}
+	free(o_ctrl);
+	free(o_slots);
+	return 0;
+}
+
+static int hashmap_put(HASHMAP *map, const char *str,
+			const unsigned long long int num, void *val) {
+	/*
+	*  Map a key to 'val'. If the key already exists, the old
+	*  value is replaced without freeing it. String keys are
+	*  copied. Returns 0 on success and 1 on failure.
+	*/
+	uint64_t hash = hashmap_hash(map, str, num);
+	size_t index = 0;
+	size_t n_cap = 0;
+
+	index = hashmap_find(map, hash, str, num);
+	if (index != HASHMAP_NOT_FOUND) {
+		map->slots[index].val = val;
+		return 0;
+	}
+
+	// Grow the map or purge deleted slots if the load factor gets too high.
+	if ((map->used + 1)*8 > map->cap*7) {
+		n_cap = map->cap ? map->cap : HASHMAP_MIN_CAP;
+		while ((map->cnt + 1)*2 > n_cap) {
+			n_cap *= 2;
+		}
+		if (hashmap_resize(map, n_cap) != 0) {
+			return 1;
+		}
+	}
+
+	index = hashmap_find_free(map, hash);
+	if (map->key_type == HASHMAP_KEY_INT) {
+		map->slots[index].key.num = num;
+	} else {
+		errno = 0;
+		map->slots[index].key.str = calloc(strlen(str) + 1, sizeof(*str));
+		if (!map->slots[index].key.str) {
+			printerrno("calloc()");
+			return 1;
+		}
+		strcpy(map->slots[index].key.str, str);
+	}
+
+	if (map->ctrl[index] == HASHMAP_CTRL_EMPTY) {
+		map->used++;
+	}
+	map->ctrl[index] = hash & 0x7F;
+	map->slots[index].val = val;
+	map->cnt++;
+	return 0;
+}
+
+static void *hashmap_get(const HASHMAP *map, const char *str,
+			const unsigned long long int num) {
+	size_t index = hashmap_find(map, hashmap_hash(map, str, num), str, num);
+	if (index == HASHMAP_NOT_FOUND) {
+		return NULL;
+	}
+	return map->slots[index].val;
+}
+
+static void *hashmap_pop(HASHMAP *map, const char *str,
+			const unsigned long long int num) {
+	/*
+	*  Remove a key from 'map' and return the value it was mapped
+	*  to. The value itself is not freed. If the group of the removed
+	*  slot still has an empty slot, no probe sequence can continue
+	*  past the group and the slot can be marked empty instead of
+	*  deleted. Returns NULL if the key doesn't exist.
+	*/
+	size_t index = hashmap_find(map, hashmap_hash(map, str, num), str, num);
+	unsigned char *group = NULL;
+	void *ret = NULL;
+
+	if (index == HASHMAP_NOT_FOUND) {
+		return NULL;
+	}
+
+	ret = map->slots[index].val;
+	if (map->key_type == HASHMAP_KEY_STR) {
+		free(map->slots[index].key.str);
+	}
+	memset(&map->slots[index], 0, sizeof(map->slots[index]));
+
+	group = map->ctrl + index - index%HASHMAP_GROUP_WIDTH;
+	if (hashmap_group_match(group, HASHMAP_CTRL_EMPTY)) {
+		map->ctrl[index] = HASHMAP_CTRL_EMPTY;
+		map->used--;
+	} else {
+		map->ctrl[index] = HASHMAP_CTRL_DELETED;
+	}
+	map->cnt--;
+	return ret;
+}
+
+HASHMAP *hashmap_create(const int key_type, void (*const free_func)(void*)) {
+	/*
+	*  Create a new HASHMAP instance. 'key_type' is either
+	*  HASHMAP_KEY_STR or HASHMAP_KEY_INT. free_func is the
+	*  function to call when freeing values in the HASHMAP.
+	*  If freeing values is not needed, free_func can be set
+	*  to NULL. Returns a pointer to the new instance on success
+	*  or a NULL pointer on failure.
+	*/
+	HASHMAP *ret = NULL;
+
+	errno = 0;
+	ret = calloc(1, sizeof(*ret));
+	if (!ret) {
+		printerrno("calloc()");
+		return NULL;
+	}
+	ret->key_type = key_type;
+	ret->free_func = free_func;
+	return ret;
+}
+
+void hashmap_destroy(HASHMAP *map, const int free_vals) {
+	/*
+	*  Destroy a HASHMAP instance. If 'free_vals' is non-zero,
+	*  the values are freed with the free_func of the map too.
+	*/
+	if (!map) {
+		return;
+	}
+	for (size_t i = 0; i < map->cap; i++) {
+		if (map->ctrl[i] & 0x80) {
+			continue;
+		}
+		if (map->key_type == HASHMAP_KEY_STR) {
+			free(map->slots[i].key.str);
+		}
+		if (free_vals && map->free_func) {
+			map->free_func(map->slots[i].val);
+		}
+	}
+	free(map->ctrl);
+	free(map->slots);
+	free(map);
+}
+
+size_t hashmap_count(const HASHMAP *map) {
+	return map->cnt;
+}
+
+int hashmap_next(const HASHMAP *map, size_t *iter, void **val) {
+	/*
+	*  Iterate over the values in 'map'. '*iter' should be set
+	*  to zero before the first call. Returns 1 and stores the
+	*  next value in '*val' or returns 0 once every value has
+	*  been iterated over. The map must not be modified while
+	*  iterating.
+	*/
+	while (*iter < map->cap) {
+		if (!(map->ctrl[*iter] & 0x80)) {
+			*val = map->slots[(*iter)++].val;
+			return 1;
+		}
+		(*iter)++;
+	}
+	return 0;
+}
+
+int hashmap_put_str(HASHMAP *map, const char *key, void *val) {
+	return hashmap_put(map, key, 0, val);
+}
+
+void *hashmap_get_str(const HASHMAP *map, const char *key) {
+	return hashmap_get(map, key, 0);
+}
+
+void *hashmap_pop_str(HASHMAP *map, const char *key) {
+	return hashmap_pop(map, key, 0);
+}
+
+int hashmap_put_int(HASHMAP *map, const unsigned long long int key, void *val) {
+	return hashmap_put(map, NULL, key, val);
+}
+
+void *hashmap_get_int(const HASHMAP *map, const unsigned long long int key) {
+	return hashmap_get(map, NULL, key);
+}
+
+void *hashmap_pop_int(HASHMAP *map, const unsigned long long int key) {
+	return hashmap_pop(map, NULL, key);
+}
@@ -19,6 +19,8 @@
 *
 */
 
+#define _GNU_SOURCE
+
 #define PRINT_IDENTIFIER "job"
 
 #include <stdlib.h>
@@ -26,19 +28,53 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "oipcore/abi/output.h"
 #include "oipcore/plugin.h"
 #include "oipcore/job.h"
 #include "oipcore/plugin.h"
+#include "oipcore/pipeline.h"
+#include "oipcore/memgov.h"
+#include "oipcore/taskpool.h"
+
+#include "configloader_priv.h"
+#include "trace_priv.h"
+
+// The number of rows in a piece of a parallel downscale.
+#define JOB_DOWNSCALE_GRAIN 64
+
+typedef struct STRUCT_JOB_DOWNSCALE {
+	IMAGE *dst;
+	const IMAGE *src;
+} JOB_DOWNSCALE;
 
 static long long new_job_id = 0;
 
-JOB *job_create(const char *fpath) {
+static JOB *job_create_from_image(IMAGE *img, const char *name);
+static void job_key_file(JOB *job);
+static void job_key_pixels(JOB *job);
+static size_t job_spill_result(JOB *job);
+static void job_free_outputs(JOB *job);
+static void job_downscale_rows(void *arg, size_t begin, size_t end);
+static IMAGE *job_downscale(const IMAGE *src);
+
+static const char *job_priority_names[JOB_NUM_PRIORITIES] = {
+	"interactive",
+	"normal",
+	"batch"
+};
+
+static JOB *job_create_from_image(IMAGE *img, const char *name) {
 	/*
-	*  Initialize a new job. This function returns
-	*  a pointer to the newly allocated job or a NULL
-	*  pointer on failure.
+	*  Initialize a new job with the source image 'img'. 'name'
+	*  is stored as the filepath of the job. The job takes the
+	*  ownership of 'img' and it's freed if this function fails.
+	*  'img' can be NULL if the image is loaded from 'name' later.
+	*  Returns a pointer to the new job or a NULL pointer on
+	*  failure.
 	*/
 	unsigned int job_id_str_len = 0;
 	JOB *job = NULL;
@@ -46,30 +82,35 @@ JOB *job_create(const char *fpath) {
 	job = malloc(sizeof(JOB));
 	if (job == NULL) {
 		printerrno("malloc(): ");
+		if (img) {
+			img_free(img);
+		}
 		return NULL;
 	}
 	memset(job, 0, sizeof(JOB));
-
-	// Load source image.
-	job->src_img = img_load(fpath);
-	if (job->src_img == NULL) {
-		return NULL;
+	job->src_img = img;
+	job->spill_fd = -1;
+	if (img) {
+		job->src_w = img->w;
+		job->src_h = img->h;
 	}
 
 	// Preallocate the result image.
 	job->result_img = img_alloc(0, 0);
 	if (job->result_img == NULL) {
+		job_destroy(job);
 		return NULL;
 	}
 
 	// Copy the filepath to the job.
 	errno = 0;
-	job->filepath = calloc(strlen(fpath) + 1, sizeof(*fpath));
+	job->filepath = calloc(strlen(name) + 1, sizeof(*name));
 	if (job->filepath == NULL) {
 		printerrno("calloc(): ");
+		job_destroy(job);
 		return NULL;
 	}
-	strcpy(job->filepath, fpath);
+	strcpy(job->filepath, name);
 
 	// Assign the supplied job a unique job ID.
 	errno = 0;
@@ -81,27 +122,238 @@ JOB *job_create(const char *fpath) {
 	job->job_id = calloc(job_id_str_len, sizeof(char));
 	if (job->job_id == NULL) {
 		printerrno("calloc(): ");
+		job_destroy(job);
 		return NULL;
 	}
 	sprintf(job->job_id, "%llu", new_job_id);
 	new_job_id++;
 
 	job->status = JOB_STATUS_PENDING;
+	job->priority = JOB_PRIORITY_NORMAL;
+	job->preview_scale = 1.0f;
+	job->result_scale = 1.0f;
+	if (job_set_submitter(job, JOB_DEFAULT_SUBMITTER) != 0 ||
+		job_set_pipeline(job, PLUGIN_DEFAULT_PIPELINE) != 0) {
+		job_destroy(job);
+		return NULL;
+	}
 
 	return job;
 }
 
+JOB *job_create(const char *fpath) {
+	/*
+	*  Initialize a new job for the image file 'fpath'. With a
+	*  memory budget the image is only decoded when the job is
+	*  first fed. This function returns a pointer to the newly
+	*  allocated job or a NULL pointer on failure.
+	*/
+	IMAGE *img = NULL;
+	JOB *job = NULL;
+	uint32_t w = 0;
+	uint32_t h = 0;
+
+	if (memgov_get_budget()) {
+		if (img_probe(fpath, &w, &h) != 0) {
+			return NULL;
+		}
+		job = job_create_from_image(NULL, fpath);
+		if (job) {
+			job->src_w = w;
+			job->src_h = h;
+		}
+	} else {
+		// Load source image.
+		trace_begin("img_load", fpath);
+		img = img_load(fpath);
+		trace_end("img_load");
+		if (img == NULL) {
+			return NULL;
+		}
+		job = job_create_from_image(img, fpath);
+	}
+	if (job) {
+		job->spillable = 1;
+		job_key_file(job);
+	}
+	return job;
+}
+
+static void job_key_file(JOB *job) {
+	/*
+	*  Set the source key of 'job' from the identity and the
+	*  modification time of its source file, so the file isn't
+	*  read for hashing and other processes get the same key for
+	*  the same file. The key is left empty on failure.
+	*/
+	CACHE_HASH hash;
+	struct stat st;
+	uint64_t id[6];
+
+	errno = 0;
+	if (stat(job->filepath, &st) == -1) {
+		printerrno("stat()");
+		return;
+	}
+	id[0] = st.st_dev;
+	id[1] = st.st_ino;
+	id[2] = st.st_size;
+	id[3] = st.st_mtim.tv_sec;
+	id[4] = st.st_mtim.tv_nsec;
+	id[5] = st.st_ctim.tv_sec*1000000000ULL + st.st_ctim.tv_nsec;
+
+	cache_hash_init(&hash);
+	cache_hash_update(&hash, id, sizeof(id));
+	cache_hash_key(&hash, &job->src_key);
+}
+
+static void job_key_pixels(JOB *job) {
+	// Set the source key of 'job' from the source image pixels.
+	CACHE_HASH hash;
+	uint32_t dims[2];
+
+	dims[0] = job->src_img->w;
+	dims[1] = job->src_img->h;
+	cache_hash_init(&hash);
+	cache_hash_update(&hash, dims, sizeof(dims));
+	cache_hash_update(&hash, job->src_img->img, img_bytelen(job->src_img));
+	cache_hash_key(&hash, &job->src_key);
+}
+
+JOB *job_create_shared(const int fd, const uint32_t w, const uint32_t h,
+			const int format) {
+	/*
+	*  Initialize a new job whose source image is the 'w'x'h'
+	*  pixels of the IMG_FORMAT_* 'format' in the memfd or shared
+	*  memory object 'fd'. The pixels of a memfd that is sealed
+	*  against resizing are mapped without copying them, others
+	*  are copied. The job owns 'fd' after this call and it's
+	*  closed if this function fails. Returns a
+	*  pointer to the new job or a NULL pointer on failure.
+	*/
+	IMAGE *img = NULL;
+	JOB *job = NULL;
+	char name[32];
+
+	if (format != IMG_FORMAT_BGRA8) {
+		printerr("Unsupported pixel format.\n");
+		close(fd);
+		return NULL;
+	}
+	if (w == 0 || h == 0 || !img_size_valid(w, h)) {
+		printerr("Invalid image size.\n");
+		close(fd);
+		return NULL;
+	}
+
+	img = img_map_shared(fd, w, h);
+	if (img == NULL) {
+		close(fd);
+		return NULL;
+	}
+	snprintf(name, sizeof(name), "<shared %ux%u>", w, h);
+	job = job_create_from_image(img, name);
+	if (job) {
+		job_key_pixels(job);
+	}
+	return job;
+}
+
+int job_get_result_shared(JOB *job, int *fd, uint32_t *w, uint32_t *h) {
+	/*
+	*  Get a memfd with the result image of 'job' so that it can
+	*  be passed to another process without copying it. The result
+	*  is moved into shared memory the first time this is called.
+	*  The memfd is overwritten when the job is fed again. The
+	*  caller must close '*fd'. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	int ret = 0;
+
+	pipeline_lock();
+	if (job_restore_result(job) != 0 || img_share(job->result_img) != 0) {
+		ret = 1;
+	} else {
+		errno = 0;
+		*fd = fcntl(job->result_img->fd, F_DUPFD_CLOEXEC, 0);
+		if (*fd < 0) {
+			printerrno("fcntl()");
+			ret = 1;
+		}
+		*w = job->result_img->w;
+		*h = job->result_img->h;
+	}
+	pipeline_unlock();
+	return ret;
+}
+
 int job_save_result(JOB *job, char *fpath) {
-	return img_save(job->result_img, fpath);
+	int ret = 0;
+
+	// Don't save while the pipeline is writing the result.
+	pipeline_lock();
+	ret = job_restore_result(job);
+	if (ret == 0) {
+		trace_begin("img_save", fpath);
+		ret = img_save(job->result_img, fpath);
+		trace_end("img_save");
+	}
+	pipeline_unlock();
+	return ret;
 }
 
 int job_store_plugin_config(JOB *job) {
+	/*
+	*  Store the current plugin argument revisions and UIDs of
+	*  the pipeline of 'job' in 'job'. Returns 0 on success and
+	*  1 on failure.
+	*/
+	const PLUGIN_PIPELINE *pipeline = NULL;
+	unsigned long long int *tmp_arg_revs = NULL;
+	unsigned long long int *tmp_uids = NULL;
+	size_t count = 0;
+	int ret = 0;
+
+	pipeline = plugin_pipeline_get(job->pipeline);
+	if (!pipeline) {
+		printerr_va("Pipeline '%s' doesn't exist.\n", job->pipeline);
+		return 1;
+	}
+	count = plugin_pipeline_count(pipeline);
+
+	errno = 0;
+	tmp_arg_revs = calloc(count, sizeof(*tmp_arg_revs));
+	tmp_uids = calloc(count, sizeof(*tmp_uids));
+	if (!tmp_arg_revs || !tmp_uids) {
+		printerrno("calloc(): ");
+		free(tmp_arg_revs);
+		free(tmp_uids);
+		return 1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		tmp_arg_revs[i] = plugin_pipeline_get_plugin(pipeline, i)->arg_rev;
+		tmp_uids[i] = plugin_pipeline_get_plugin(pipeline, i)->uid;
+	}
+	ret = job_set_plugin_config(job, tmp_uids, tmp_arg_revs, count);
+	free(tmp_arg_revs);
+	free(tmp_uids);
+	return ret;
+}
+
+int job_set_plugin_config(JOB *job, const unsigned long long int *uids,
+			const unsigned long long int *arg_revs,
+			const unsigned int count) {
+	/*
+	*  Store 'count' plugin UIDs and argument revisions in 'job'.
+	*  Returns 0 on success and 1 on failure.
+	*/
 	unsigned long long int *tmp_arg_revs = NULL;
 	unsigned long long int *tmp_uids = NULL;
 
 	errno = 0;
 	tmp_arg_revs = realloc(job->prev_plugin_arg_revs,
-			plugins_get_count()*sizeof(unsigned long long int));
+			count*sizeof(unsigned long long int));
 	if (tmp_arg_revs == NULL) {
 		printerrno("realloc(): ");
 		return 1;
@@ -110,44 +362,506 @@ int job_store_plugin_config(JOB *job) {
 
 	errno = 0;
 	tmp_uids = realloc(job->prev_plugin_uids,
-			plugins_get_count()*sizeof(unsigned long long int));
+			count*sizeof(unsigned long long int));
 	if (tmp_uids == NULL) {
 		printerrno("realloc(): ");
 		return 1;
 	}
 	job->prev_plugin_uids = tmp_uids;
 
-	for (unsigned int i = 0; i < plugins_get_count(); i++) {
-		job->prev_plugin_arg_revs[i] = plugin_get(i)->arg_rev;
-		job->prev_plugin_uids[i] = plugin_get(i)->uid;
+	memcpy(job->prev_plugin_arg_revs, arg_revs, count*sizeof(*arg_revs));
+	memcpy(job->prev_plugin_uids, uids, count*sizeof(*uids));
+	job->prev_plugin_count = count;
+	return 0;
+}
+
+int job_set_priority(JOB *job, const int priority) {
+	/*
+	*  Set the priority class of 'job' to one of the JOB_PRIORITY_*
+	*  values. Returns 0 on success and 1 on failure.
+	*/
+	if (priority < 0 || priority >= JOB_NUM_PRIORITIES) {
+		printerr_va("Invalid job priority %i.\n", priority);
+		return 1;
 	}
-	job->prev_plugin_count = plugins_get_count();
+	job->priority = priority;
 	return 0;
 }
 
+int job_set_deadline(JOB *job, const unsigned long int deadline_ms) {
+	/*
+	*  Set the deadline of 'job' in milliseconds. The deadline
+	*  is relative to the time the job is fed to the pipeline.
+	*  A deadline of 0 means the job has no deadline.
+	*/
+	job->deadline_ms = deadline_ms;
+	return 0;
+}
+
+int job_set_submitter(JOB *job, const char *submitter) {
+	/*
+	*  Set the name of the submitter of 'job'. The pipeline is
+	*  shared fairly between submitters. Returns 0 on success
+	*  and 1 on failure.
+	*/
+	char *tmp = NULL;
+
+	errno = 0;
+	tmp = calloc(strlen(submitter) + 1, sizeof(*submitter));
+	if (!tmp) {
+		printerrno("calloc(): ");
+		return 1;
+	}
+	strcpy(tmp, submitter);
+	free(job->submitter);
+	job->submitter = tmp;
+	return 0;
+}
+
+int job_set_pipeline(JOB *job, const char *name) {
+	/*
+	*  Feed 'job' to the pipeline called 'name' from now on. The
+	*  pipeline is resolved when the job is fed, so a queued job
+	*  runs in the pipeline that was set last. Returns 0 on success
+	*  and 1 on failure.
+	*/
+	char *tmp = NULL;
+
+	if (!plugin_pipeline_get(name)) {
+		printerr_va("Pipeline '%s' doesn't exist.\n", name);
+		return 1;
+	}
+
+	errno = 0;
+	tmp = calloc(strlen(name) + 1, sizeof(*name));
+	if (!tmp) {
+		printerrno("calloc(): ");
+		return 1;
+	}
+	strcpy(tmp, name);
+
+	pipeline_lock();
+	free(job->pipeline);
+	job->pipeline = tmp;
+	pipeline_unlock();
+	return 0;
+}
+
+void job_set_roi(JOB *job, const IMG_RECT *roi) {
+	/*
+	*  Only compute the region 'roi' of the outputs of 'job'
+	*  when it's fed. A NULL 'roi' computes the full outputs.
+	*/
+	pipeline_lock();
+	if (roi) {
+		job->roi = *roi;
+		job->has_roi = 1;
+	} else {
+		job->has_roi = 0;
+	}
+	pipeline_unlock();
+}
+
+int job_set_preview(JOB *job, const float scale) {
+	/*
+	*  Feed 'job' at 'scale' times the full resolution from now
+	*  on. A scale of 1 means a full resolution feed. Returns 0 on
+	*  success and 1 on failure.
+	*/
+	if (!(scale > 0.0f && scale <= 1.0f)) {
+		printerr("The preview scale must be in the range (0, 1].\n");
+		return 1;
+	}
+	pipeline_lock();
+	job->preview_scale = scale;
+	pipeline_unlock();
+	return 0;
+}
+
+static void job_downscale_rows(void *arg, size_t begin, size_t end) {
+	// Compute a range of rows of a pyramid level.
+	JOB_DOWNSCALE *ds = (JOB_DOWNSCALE*) arg;
+	img_downscale_rows(ds->dst, ds->src, (uint32_t) begin, (uint32_t) end);
+}
+
+static IMAGE *job_downscale(const IMAGE *src) {
+	/*
+	*  Scale 'src' down to half of its size like img_downscale()
+	*  but compute the rows in parallel on the task pool. Returns
+	*  a pointer to the new image or a NULL pointer on failure.
+	*/
+	JOB_DOWNSCALE ds;
+
+	ds.src = src;
+	ds.dst = img_alloc(src->w/2, src->h/2);
+	if (!ds.dst) {
+		return NULL;
+	}
+	if (taskpool_parallel_for(ds.dst->h, JOB_DOWNSCALE_GRAIN,
+				&job_downscale_rows, &ds) != 0) {
+		img_free(ds.dst);
+		return NULL;
+	}
+	return ds.dst;
+}
+
+IMAGE *job_get_src_level(JOB *job, const float scale, float *level_scale) {
+	/*
+	*  Return the smallest level of the source image pyramid of
+	*  'job' that's at least 'scale' times the full size and store
+	*  the scale of the level in '*level_scale'. The pyramid is
+	*  built as far as needed. Must be called with the pipeline
+	*  lock held. Returns a NULL pointer on failure.
+	*/
+	IMAGE **tmp_pyramid = NULL;
+	IMAGE *tmp_img = NULL;
+	IMAGE *ret = NULL;
+	float ret_scale = 1.0f;
+	size_t n = 0;
+
+	// Decode the source image if it was deferred or spilled.
+	if (!job->src_img) {
+		printverb_va("Loading the source image of job '%s'.\n", job->job_id);
+		trace_begin("img_load", job->filepath);
+		job->src_img = img_load(job->filepath);
+		trace_end("img_load");
+		if (!job->src_img) {
+			return NULL;
+		}
+		job->src_w = job->src_img->w;
+		job->src_h = job->src_img->h;
+	}
+	ret = job->src_img;
+
+	while (ret_scale/2 >= scale && ret->w >= 2 && ret->h >= 2) {
+		if (n >= job->pyramid_count) {
+			printverb_va("Building pyramid level %zu of job '%s'.\n",
+					n, job->job_id);
+			tmp_img = job_downscale(ret);
+			if (!tmp_img) {
+				return NULL;
+			}
+
+			errno = 0;
+			tmp_pyramid = realloc(job->pyramid,
+					(n + 1)*sizeof(*job->pyramid));
+			if (!tmp_pyramid) {
+				printerrno("realloc()");
+				img_free(tmp_img);
+				return NULL;
+			}
+			job->pyramid = tmp_pyramid;
+			job->pyramid[n] = tmp_img;
+			job->pyramid_count = n + 1;
+		}
+		ret = job->pyramid[n++];
+		ret_scale /= 2;
+	}
+	*level_scale = ret_scale;
+	return ret;
+}
+
+static size_t job_spill_result(JOB *job) {
+	/*
+	*  Write the pixels of the result image of 'job' into an
+	*  unlinked file in the cache root and free them. Returns
+	*  the number of bytes freed.
+	*/
+	const char *dir = NULL;
+	IMAGE *empty = NULL;
+	size_t len = 0;
+	int fd = -1;
+
+	if (job->spill_fd >= 0 || !job->result_img->img || job->result_img->fd >= 0) {
+		return 0;
+	}
+
+	dir = config_get_str_param("cache_root");
+	errno = 0;
+	fd = open(dir ? dir : ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		printerrno("open()");
+		return 0;
+	}
+	len = img_bytelen(job->result_img);
+	errno = 0;
+	if (pwrite(fd, job->result_img->img, len, 0) != (ssize_t) len) {
+		printerrno("pwrite()");
+		close(fd);
+		return 0;
+	}
+
+	empty = img_alloc(0, 0);
+	if (!empty) {
+		close(fd);
+		return 0;
+	}
+	job->spill_w = job->result_img->w;
+	job->spill_h = job->result_img->h;
+	job->spill_fd = fd;
+	img_free(job->result_img);
+	job->result_img = empty;
+	return len;
+}
+
+int job_restore_result(JOB *job) {
+	/*
+	*  Read the spilled result image of 'job' back into memory.
+	*  The pipeline lock must be held. Returns 0 on success and
+	*  1 on failure.
+	*/
+	size_t len = 0;
+
+	if (job->spill_fd < 0) {
+		return 0;
+	}
+	if (img_realloc(job->result_img, job->spill_w, job->spill_h) != 0) {
+		return 1;
+	}
+	len = img_bytelen(job->result_img);
+	errno = 0;
+	if (pread(job->spill_fd, job->result_img->img, len, 0) != (ssize_t) len) {
+		printerrno("pread()");
+		return 1;
+	}
+	job_discard_spilled_result(job);
+	return 0;
+}
+
+void job_discard_spilled_result(JOB *job) {
+	// Drop the spilled result of 'job' when it's overwritten.
+	if (job->spill_fd >= 0) {
+		close(job->spill_fd);
+		job->spill_fd = -1;
+	}
+}
+
+size_t job_spill(JOB *job) {
+	/*
+	*  Free the source image and the pyramid of 'job' if they can
+	*  be loaded again from the file of the job and spill the
+	*  result image to disk. The job must not be queued in the
+	*  scheduler and the pipeline lock must be held. Returns the
+	*  number of bytes freed.
+	*/
+	size_t ret = 0;
+
+	ret = job_spill_result(job);
+	if (!job->spillable || !job->src_img) {
+		return ret;
+	}
+	for (size_t i = 0; i < job->pyramid_count; i++) {
+		ret += img_bytelen(job->pyramid[i]);
+		img_free(job->pyramid[i]);
+	}
+	free(job->pyramid);
+	job->pyramid = NULL;
+	job->pyramid_count = 0;
+
+	ret += img_bytelen(job->src_img);
+	img_free(job->src_img);
+	job->src_img = NULL;
+	return ret;
+}
+
+size_t job_mem_estimate(const JOB *job) {
+	/*
+	*  Estimate the pixel memory a feed of 'job' needs. A plugin
+	*  needs its input and its output at the same time, and the
+	*  source image is counted too if it has to be loaded first.
+	*/
+	size_t src = (size_t) job->src_w*job->src_h*sizeof(RGBQUAD);
+	size_t ret = 0;
+
+	ret = 2*src*job->preview_scale*job->preview_scale;
+	if (!job->src_img) {
+		ret += src;
+	}
+	return ret;
+}
+
+static void job_free_outputs(JOB *job) {
+	for (size_t i = 0; i < job->output_count; i++) {
+		img_free(job->output_imgs[i]);
+	}
+	free(job->output_imgs);
+	free(job->outputs);
+	job->output_imgs = NULL;
+	job->outputs = NULL;
+	job->output_count = 0;
+}
+
+int job_set_outputs(JOB *job, const size_t *outputs, const size_t count) {
+	/*
+	*  Set the plugins whose outputs are produced when 'job' is fed
+	*  to the pipeline. Duplicate indices are ignored. If 'count' is
+	*  0 only the output of the last plugin is produced. Returns 0
+	*  on success and 1 on failure.
+	*/
+	size_t *tmp_outputs = NULL;
+	IMAGE **tmp_imgs = NULL;
+	size_t n = 0;
+	int dup = 0;
+
+	if (count) {
+		errno = 0;
+		tmp_outputs = calloc(count, sizeof(*tmp_outputs));
+		tmp_imgs = calloc(count, sizeof(*tmp_imgs));
+		if (!tmp_outputs || !tmp_imgs) {
+			printerrno("calloc()");
+			free(tmp_outputs);
+			free(tmp_imgs);
+			return 1;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		dup = 0;
+		for (size_t j = 0; j < n; j++) {
+			if (tmp_outputs[j] == outputs[i]) {
+				dup = 1;
+				break;
+			}
+		}
+		if (dup) {
+			continue;
+		}
+		tmp_imgs[n] = img_alloc(0, 0);
+		if (!tmp_imgs[n]) {
+			for (size_t j = 0; j < n; j++) {
+				img_free(tmp_imgs[j]);
+			}
+			free(tmp_outputs);
+			free(tmp_imgs);
+			return 1;
+		}
+		tmp_outputs[n++] = outputs[i];
+	}
+
+	pipeline_lock();
+	job_free_outputs(job);
+	job->outputs = tmp_outputs;
+	job->output_imgs = tmp_imgs;
+	job->output_count = n;
+	pipeline_unlock();
+	return 0;
+}
+
+IMAGE *job_get_output(JOB *job, const size_t node) {
+	/*
+	*  Get the output image of the plugin 'node' from the last
+	*  time 'job' was fed to the pipeline. Returns a NULL pointer
+	*  if the output of 'node' isn't produced for 'job'.
+	*/
+	const PLUGIN_PIPELINE *pipeline = NULL;
+	size_t count = 0;
+
+	if (job->output_count == 0) {
+		pipeline = plugin_pipeline_get(job->pipeline);
+		if (pipeline) {
+			count = plugin_pipeline_count(pipeline);
+		}
+		if (count && node == count - 1) {
+			return job_restore_result(job) ? NULL : job->result_img;
+		}
+		return NULL;
+	}
+	for (size_t i = 0; i < job->output_count; i++) {
+		if (job->outputs[i] == node) {
+			return job->output_imgs[i];
+		}
+	}
+	return NULL;
+}
+
+int job_save_output(JOB *job, const size_t node, char *fpath) {
+	/*
+	*  Save the output image of the plugin 'node' into 'fpath'.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	IMAGE *img = NULL;
+	int ret = 0;
+
+	pipeline_lock();
+	img = job_get_output(job, node);
+	if (!img) {
+		printerr_va("Plugin %zu isn't an output of job '%s'.\n",
+				node, job->job_id);
+		ret = 1;
+	} else {
+		trace_begin("img_save", fpath);
+		ret = img_save(img, fpath);
+		trace_end("img_save");
+	}
+	pipeline_unlock();
+	return ret;
+}
+
+int job_priority_from_str(const char *str) {
+	/*
+	*  Return the JOB_PRIORITY_* value named by 'str'
+	*  or -1 if 'str' is not a valid priority name.
+	*/
+	for (int i = 0; i < JOB_NUM_PRIORITIES; i++) {
+		if (strcmp(job_priority_names[i], str) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char *job_priority_to_str(const int priority) {
+	if (priority < 0 || priority >= JOB_NUM_PRIORITIES) {
+		return "unknown";
+	}
+	return job_priority_names[priority];
+}
+
 void job_print(JOB *job) {
-	printf("\n==== JOB ====\n");
-	printf("    Filepath:        %s\n", job->filepath);
-	printf("    ID:              %s\n", job->job_id);
-	printf("    Status:          ");
+	fprintf(print_stdout, "\n==== JOB ====\n");
+	fprintf(print_stdout, "    Filepath:        %s\n", job->filepath);
+	fprintf(print_stdout, "    ID:              %s\n", job->job_id);
+	fprintf(print_stdout, "    Source key:      %s\n", job->src_key.str[0] ? job->src_key.str : "none");
+	fprintf(print_stdout, "    Status:          ");
 	if (job->status == JOB_STATUS_FAIL) {
-		printf("FAIL\n");
+		fprintf(print_stdout, "FAIL\n");
 	} else if (job->status == JOB_STATUS_SUCCESS) {
-		printf("SUCCESS\n");
+		fprintf(print_stdout, "SUCCESS\n");
 	} else if (job->status == JOB_STATUS_PENDING) {
-		printf("PENDING\n");
+		fprintf(print_stdout, "PENDING\n");
+	} else if (job->status == JOB_STATUS_CANCELLED) {
+		fprintf(print_stdout, "CANCELLED\n");
 	}
-	printf("    Plugin count:    %u\n", job->prev_plugin_count);
-	printf("    Plugin arg revs: ");
+	fprintf(print_stdout, "    Priority:        %s\n", job_priority_to_str(job->priority));
+	fprintf(print_stdout, "    Deadline:        %lu ms\n", job->deadline_ms);
+	fprintf(print_stdout, "    Submitter:       %s\n", job->submitter);
+	fprintf(print_stdout, "    Pipeline:        %s\n", job->pipeline);
+	fprintf(print_stdout, "    Result scale:    %g\n", job->result_scale);
+	if (job->has_roi) {
+		fprintf(print_stdout, "    ROI:             %u,%u %ux%u\n", job->roi.x,
+			job->roi.y, job->roi.w, job->roi.h);
+	} else {
+		fprintf(print_stdout, "    ROI:             full\n");
+	}
+	fprintf(print_stdout, "    Plugin count:    %u\n", job->prev_plugin_count);
+	fprintf(print_stdout, "    Plugin arg revs: ");
 	for (unsigned int i = 0; i < job->prev_plugin_count; i++) {
-		printf("%llu ", job->prev_plugin_arg_revs[i]);
+		fprintf(print_stdout, "%llu ", job->prev_plugin_arg_revs[i]);
 	}
-	printf("\n");
-	printf("    Plugin UIDs:     ");
+	fprintf(print_stdout, "\n");
+	fprintf(print_stdout, "    Plugin UIDs:     ");
 	for (unsigned int i = 0; i < job->prev_plugin_count; i++) {
-		printf("%llu ", job->prev_plugin_uids[i]);
+		fprintf(print_stdout, "%llu ", job->prev_plugin_uids[i]);
+	}
+	fprintf(print_stdout, "\n");
+	fprintf(print_stdout, "    Outputs:         ");
+	if (job->output_count == 0) {
+		fprintf(print_stdout, "last plugin");
+	}
+	for (size_t i = 0; i < job->output_count; i++) {
+		fprintf(print_stdout, "%zu ", job->outputs[i]);
 	}
-	printf("\n==== JOB ====\n\n");
+	fprintf(print_stdout, "\n==== JOB ====\n\n");
 }
 
 void job_destroy(JOB *job) {
@@ -164,6 +878,7 @@ void job_destroy(JOB *job) {
 			img_free(job->result_img);
 			job->result_img = NULL;
 		}
+		job_discard_spilled_result(job);
 		if (job->filepath != NULL) {
 			free(job->filepath);
 			job->filepath = NULL;
@@ -180,6 +895,20 @@ void job_destroy(JOB *job) {
 			free(job->prev_plugin_uids);
 			job->prev_plugin_uids = NULL;
 		}
+		job_free_outputs(job);
+		for (size_t i = 0; i < job->pyramid_count; i++) {
+			img_free(job->pyramid[i]);
+		}
+		free(job->pyramid);
+		job->pyramid = NULL;
+		if (job->submitter != NULL) {
+			free(job->submitter);
+			job->submitter = NULL;
+		}
+		if (job->pipeline != NULL) {
+			free(job->pipeline);
+			job->pipeline = NULL;
+		}
 		free(job);
 	}
 }
@@ -26,11 +26,15 @@
 
 #include "oipcore/abi/output.h"
 #include "oipcore/ptrarray.h"
+#include "oipcore/hashmap.h"
 #include "oipcore/jobmanager.h"
+#include "oipcore/pipeline.h"
+#include "oipcore/scheduler.h"
 
 PTRARRAY_TYPE_DEF(JOB);
 
 static PTRARRAY_TYPE(JOB) *jobs = NULL;
+static HASHMAP *jobs_index = NULL;
 
 static void jobmanager_job_free_wrapper(void *job);
 
@@ -49,6 +53,14 @@ int jobmanager_setup(void) {
 		printerr("Failed to create PTRARRAY.\n");
 		return 1;
 	}
+
+	jobs_index = hashmap_create(HASHMAP_KEY_STR, NULL);
+	if (!jobs_index) {
+		printerr("Failed to create HASHMAP.\n");
+		ptrarray_free((PTRARRAY_TYPE(void)*) jobs);
+		jobs = NULL;
+		return 1;
+	}
 	return 0;
 }
 
@@ -62,21 +74,18 @@ JOB *jobmanager_get_job_by_id(char *job_id) {
 	*  id 'job_id' or a NULL pointer if the JOB is
 	*  not found.
 	*/
-	for (size_t i = 0; i < jobs->ptrc; i++) {
-		if (strcmp(jobs->ptrs[i]->job_id, job_id) == 0) {
-			return jobs->ptrs[i];
-		}
-	}
-	return NULL;
+	return hashmap_get_str(jobs_index, job_id);
 }
 
 void jobmanager_list(void) {
 	/*
 	*  List all the registered JOBs.
 	*/
+	pipeline_lock();
 	for (size_t i = 0; i < jobs->ptrc; i++) {
 		job_print(jobs->ptrs[i]);
 	}
+	pipeline_unlock();
 }
 
 int jobmanager_reg_job(JOB *job) {
@@ -89,10 +98,21 @@ int jobmanager_reg_job(JOB *job) {
 		return 1;
 	}
 	printverb_va("Register job '%s' (%s).\n", job->job_id, job->filepath);
+
+	// The job list is scanned by the scheduler threads when spilling.
+	pipeline_lock();
 	if (!ptrarray_put_ptr((PTRARRAY_TYPE(void)*) jobs, job)) {
 		printerr("Failed to add job.\n");
+		pipeline_unlock();
 		return 1;
 	}
+	if (hashmap_put_str(jobs_index, job->job_id, job) != 0) {
+		printerr("Failed to index job.\n");
+		jobs->ptrs[--jobs->ptrc] = NULL;
+		pipeline_unlock();
+		return 1;
+	}
+	pipeline_unlock();
 	return 0;
 }
 
@@ -100,21 +120,55 @@ int jobmanager_unreg_job(JOB *job, int destroy_job) {
 	/*
 	*  Unregister a JOB from the jobmanager. If 'destroy_job'
 	*  is zero the JOB instance itself is not free'd. Otherwise
-	*  the JOB instance is free'd too. Returns 0 on success
+	*  the JOB instance is free'd too. Jobs that are queued in
+	*  the scheduler can't be unregistered. Returns 0 on success
 	*  and 1 on failure.
 	*/
 	PTRARRAY_TYPE(JOB) *tmp_jobs = NULL;
+
+	pipeline_lock();
+	if (scheduler_has_job(job)) {
+		printerr_va("Job '%s' is queued. Cancel it first.\n", job->job_id);
+		pipeline_unlock();
+		return 1;
+	}
 	printverb_va("Unregister job '%s' (%s).\n", job->job_id, job->filepath);
+
+	// The index entry is only removed once the job is unregistered.
 	tmp_jobs = (PTRARRAY_TYPE(JOB)*) ptrarray_pop_ptr((PTRARRAY_TYPE(void)*) jobs,
-								job, destroy_job);
+								job, 0);
 	if (!tmp_jobs) {
 		printerr("Failed to pop pointer from PTRARRAY.\n");
+		pipeline_unlock();
 		return 1;
 	}
 	jobs = tmp_jobs;
+	hashmap_pop_str(jobs_index, job->job_id);
+	if (destroy_job) {
+		jobs->free_func(job);
+	}
+	pipeline_unlock();
 	return 0;
 }
 
+size_t jobmanager_spill(const size_t bytes) {
+	/*
+	*  Spill the source images of registered jobs that aren't
+	*  queued until at least 'bytes' bytes have been freed.
+	*  Returns the number of bytes freed.
+	*/
+	size_t ret = 0;
+
+	pipeline_lock();
+	for (size_t i = 0; i < jobs->ptrc && ret < bytes; i++) {
+		if (!scheduler_has_job(jobs->ptrs[i])) {
+			ret += job_spill(jobs->ptrs[i]);
+		}
+	}
+	pipeline_unlock();
+	return ret;
+}
+
 void jobmanager_cleanup(int destroy_jobs) {
 	/*
 	*  Free allocated resources. If free_jobs is 0,
@@ -130,4 +184,8 @@ void jobmanager_cleanup(int destroy_jobs) {
 		ptrarray_free((PTRARRAY_TYPE(void)*) jobs);
 		jobs = NULL;
 	}
+	if (jobs_index) {
+		hashmap_destroy(jobs_index, 0);
+		jobs_index = NULL;
+	}
 }
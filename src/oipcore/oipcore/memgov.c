@@ -0,0 +1,128 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/*
+*  The memory governor keeps the pixel memory of all images below
+*  the budget set with 'memory_budget_mb'. The usage is accounted
+*  by oipimgutil. The scheduler doesn't start new jobs while the
+*  usage is over the budget and some other job is running, and the
+*  source images of idle jobs that can be loaded again from their
+*  files are spilled when a job or a plugin needs memory.
+*/
+
+#define PRINT_IDENTIFIER "memgov"
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "oipcore/abi/output.h"
+#include "oipimgutil/oipimgutil.h"
+#include "oipcore/memgov.h"
+#include "oipcore/jobmanager.h"
+
+#include "configloader_priv.h"
+
+#define MEMGOV_MIB (1024*1024)
+
+static size_t memgov_budget = 0;
+static atomic_ullong memgov_deferred = 0;
+static atomic_ullong memgov_spills = 0;
+static atomic_ullong memgov_spilled_bytes = 0;
+
+int memgov_setup(void) {
+	/*
+	*  Read the memory budget from the configuration. A budget
+	*  of zero means no limit. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	long int budget_mb = 0;
+
+	budget_mb = config_get_lint_param("memory_budget_mb");
+	if (budget_mb < 0) {
+		printerr("Invalid memory budget.\n");
+		return 1;
+	}
+	memgov_budget = (size_t) budget_mb*MEMGOV_MIB;
+	if (memgov_budget) {
+		printverb_va("Memory budget: %ld MiB.\n", budget_mb);
+	}
+	return 0;
+}
+
+size_t memgov_get_budget(void) {
+	// Return the memory budget in bytes or 0 if there's none.
+	return memgov_budget;
+}
+
+int memgov_over_budget(const size_t extra) {
+	/*
+	*  Return 1 if allocating 'extra' more bytes of pixel memory
+	*  would go over the budget and 0 otherwise.
+	*/
+	return memgov_budget && img_mem_used() + extra > memgov_budget;
+}
+
+size_t memgov_relieve(const size_t extra) {
+	/*
+	*  Spill the source images of idle jobs until 'extra' more
+	*  bytes fit in the budget or there's nothing left to spill.
+	*  Returns the number of bytes freed.
+	*/
+	size_t need = 0;
+	size_t ret = 0;
+
+	if (!memgov_over_budget(extra)) {
+		return 0;
+	}
+	need = img_mem_used() + extra - memgov_budget;
+	ret = jobmanager_spill(need);
+	if (ret) {
+		printverb_va("Spilled %zu bytes of idle source images.\n", ret);
+		atomic_fetch_add(&memgov_spills, 1);
+		atomic_fetch_add(&memgov_spilled_bytes, ret);
+	}
+	return ret;
+}
+
+void memgov_note_deferred(void) {
+	// Count a job whose start was deferred because of the budget.
+	atomic_fetch_add(&memgov_deferred, 1);
+}
+
+void memgov_print_status(void) {
+	/*
+	*  Print the memory usage and the governor counters to STDOUT.
+	*/
+	fprintf(print_stdout, "\n==== MEMORY ====\n");
+	if (memgov_budget) {
+		fprintf(print_stdout, "    Budget:          %.2f MiB\n",
+			(double) memgov_budget/MEMGOV_MIB);
+	} else {
+		fprintf(print_stdout, "    Budget:          unlimited\n");
+	}
+	fprintf(print_stdout, "    Used:            %.2f MiB\n", (double) img_mem_used()/MEMGOV_MIB);
+	fprintf(print_stdout, "    Peak:            %.2f MiB\n", (double) img_mem_peak()/MEMGOV_MIB);
+	fprintf(print_stdout, "    Deferred jobs:   %llu\n", atomic_load(&memgov_deferred));
+	fprintf(print_stdout, "    Spills:          %llu (%.2f MiB)\n", atomic_load(&memgov_spills),
+		(double) atomic_load(&memgov_spilled_bytes)/MEMGOV_MIB);
+	fprintf(print_stdout, "==== MEMORY ====\n\n");
+}
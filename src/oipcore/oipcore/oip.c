@@ -35,22 +35,40 @@
 #include "oipcore/pipeline.h"
 #include "oipcore/ptrarray.h"
 #include "oipcore/jobmanager.h"
+#include "oipcore/scheduler.h"
+#include "oipcore/memgov.h"
+#include "oipcore/taskpool.h"
 
 #include "configloader_priv.h"
 #include "cli_priv.h"
+#include "worker_priv.h"
+#include "prefetch_priv.h"
+#include "reaper_priv.h"
+#include "trace_priv.h"
+#include "perfctr_priv.h"
+
+// The output stream of the calling thread, see output.h.
+_Thread_local FILE *print_stream = NULL;
 
 void oip_cleanup(void) {
 	// Run cleanup functions.
+	scheduler_cleanup();
+	prefetch_cleanup();
+	taskpool_cleanup();
+	perfctr_cleanup();
+	workers_cleanup();
 	plugins_cleanup();
+	reaper_cleanup();
 	config_cleanup();
 	jobmanager_cleanup(1);
 	pipeline_cleanup();
+	trace_cleanup();
 }
 
 int oip_setup(int argc, char **argv) {
 	// Read CLI options.
 	if (cli_parse_opts(argc, argv) != 0) {
-		printf("oip: CLI argument parsing failed.\n");
+		fprintf(print_stdout, "oip: CLI argument parsing failed.\n");
 		return 1;
 	}
 
@@ -61,22 +79,126 @@ int oip_setup(int argc, char **argv) {
 		print_verbose_off();
 	}
 
+	// Start tracing if a trace file was given.
+	if (trace_setup(cli_get_opts()->opt_trace_file) != 0) {
+		printerr("Failed to setup tracing.\n");
+		return 1;
+	}
+
 	// Load configuration from file.
 	if (config_load(cli_get_opts()->opt_config_file) != 0) {
 		printerr("Failed to load configuration file.\n");
 		return 1;
 	}
 
+	// Setup the memory governor.
+	if (memgov_setup() != 0) {
+		printerr("Failed to setup the memory governor.\n");
+		return 1;
+	}
+
+	// Enable the hardware performance counters if configured.
+	if (perfctr_setup() != 0) {
+		printerr("Failed to setup the performance counters.\n");
+		return 1;
+	}
+
 	// Setup the plugin system.
 	if (plugins_setup() != 0) {
 		printerr("Failed to setup the plugin system.\n");
 		return 1;
 	}
 
+	// Start the worker processes before any threads are started.
+	if (workers_setup() != 0) {
+		printerr("Failed to start the worker processes.\n");
+		return 1;
+	}
+
+	// Start the task pool after the worker processes.
+	if (taskpool_setup() != 0) {
+		printerr("Failed to setup the task pool.\n");
+		return 1;
+	}
+
+	// Start deleting cache files in the background.
+	if (reaper_setup() != 0) {
+		printerr("Failed to setup the cache reaper.\n");
+		return 1;
+	}
+
+	// Start the cache prefetcher.
+	if (prefetch_setup() != 0) {
+		printerr("Failed to setup the cache prefetcher.\n");
+		return 1;
+	}
+
 	// Setup the jobmanager.
 	if (jobmanager_setup() != 0) {
 		printerr("Failed to setup jobmanager.\n");
 		return 1;
 	}
+
+	// Setup the pipeline.
+	if (pipeline_setup() != 0) {
+		printerr("Failed to setup the pipeline.\n");
+		return 1;
+	}
+
+	// Setup the job scheduler.
+	if (scheduler_setup() != 0) {
+		printerr("Failed to setup the scheduler.\n");
+		return 1;
+	}
 	return 0;
 }
+
+const char *oip_get_script_file(void) {
+	/*
+	*  Return the path of the script file given with the -f
+	*  option or a NULL pointer if no script was given.
+	*/
+	return cli_get_opts()->opt_script_file;
+}
+
+const char *oip_get_daemon_socket(void) {
+	/*
+	*  Return the path of the daemon socket given with the -d
+	*  option or a NULL pointer if no socket was given.
+	*/
+	return cli_get_opts()->opt_daemon_socket;
+}
+
+const char *oip_get_watch_dir(void) {
+	/*
+	*  Return the spool directory given with the -w option
+	*  or a NULL pointer if no directory was given.
+	*/
+	return cli_get_opts()->opt_watch_dir;
+}
+
+const char *oip_get_output_dir(void) {
+	/*
+	*  Return the output directory given with the -o option
+	*  or a NULL pointer if no directory was given.
+	*/
+	return cli_get_opts()->opt_output_dir;
+}
+
+unsigned int oip_get_watch_max_jobs(void) {
+	/*
+	*  Return the maximum number of jobs the watch mode keeps
+	*  in the pipeline at once.
+	*/
+	long int val = config_get_lint_param("watch_max_jobs");
+	return val > 0 ? val : OIP_DEFAULT_WATCH_MAX_JOBS;
+}
+
+unsigned int oip_get_watch_debounce_ms(void) {
+	/*
+	*  Return the time in milliseconds a file in the spool
+	*  directory must be left alone before it's processed.
+	*/
+	long int val = config_get_lint_param("watch_debounce_ms");
+	return val > 0 ? val : OIP_DEFAULT_WATCH_DEBOUNCE_MS;
+}
@@ -35,29 +35,41 @@
 		// Define printing control macros for the main OIP binary.
 		#define print_verbose_on() print_verbose = 1;
 		#define print_verbose_off() print_verbose = 0;
+
+		/*
+		*  A thread can capture its own output by pointing
+		*  'print_stream' to eg. a memory stream. Everything the
+		*  thread prints goes there instead of STDOUT and STDERR.
+		*/
+		extern _Thread_local FILE *print_stream;
+		#define print_stdout (print_stream ? print_stream : stdout)
+		#define print_stderr (print_stream ? print_stream : stderr)
+	#else
+		#define print_stdout stdout
+		#define print_stderr stderr
 	#endif
 
 	// Print an error message.
-	#define printerr_va(format, ...) fprintf(stderr, "%s: "format, PRINT_IDENTIFIER, __VA_ARGS__);
-	#define printerr(format) fprintf(stderr, "%s: "format, PRINT_IDENTIFIER);
+	#define printerr_va(format, ...) fprintf(print_stderr, "%s: "format, PRINT_IDENTIFIER, __VA_ARGS__);
+	#define printerr(format) fprintf(print_stderr, "%s: "format, PRINT_IDENTIFIER);
 
 	// Print a text description of an error.
-	#define printerrno(format) fprintf(stderr, "%s: "format": %s\n", PRINT_IDENTIFIER, strerror(errno));
+	#define printerrno(format) fprintf(print_stderr, "%s: "format": %s\n", PRINT_IDENTIFIER, strerror(errno));
 
 	// Print an informational message.
-	#define printinfo_va(format, ...) fprintf(stdout, "%s: "format, PRINT_IDENTIFIER, __VA_ARGS__);
-	#define printinfo(format) fprintf(stdout, "%s: "format, PRINT_IDENTIFIER);
+	#define printinfo_va(format, ...) fprintf(print_stdout, "%s: "format, PRINT_IDENTIFIER, __VA_ARGS__);
+	#define printinfo(format) fprintf(print_stdout, "%s: "format, PRINT_IDENTIFIER);
 
 	// Print a verbose informational message.
 	#define printverb_va(format, ...) {						\
 		if (print_verbose) {							\
-			fprintf(stdout, "%s: "format, PRINT_IDENTIFIER, __VA_ARGS__); 	\
+			fprintf(print_stdout, "%s: "format, PRINT_IDENTIFIER, __VA_ARGS__); 	\
 		}									\
 	} 										\
 
 	#define printverb(format) {							\
 		if (print_verbose) {							\
-			fprintf(stdout, "%s: "format, PRINT_IDENTIFIER); 		\
+			fprintf(print_stdout, "%s: "format, PRINT_IDENTIFIER); 		\
 		}									\
 	} 										\
 
@@ -31,12 +31,105 @@
 	#define PLUGIN_STATUS_ERROR   -1
 	#define PLUGIN_STATUS_DONE     2
 
+	// Argument types of the typed argument schema.
+	#define PLUGIN_ARG_TYPE_INT           0
+	#define PLUGIN_ARG_TYPE_FLOAT         1
+	#define PLUGIN_ARG_TYPE_FLOAT_LIST    2
+	#define PLUGIN_ARG_TYPE_POINT_LIST    3
+	#define PLUGIN_ARG_TYPE_CHANNEL_MASK  4
+
+	// Channel mask bits. The string form is eg. "rgb" or "a".
+	#define PLUGIN_CHANNEL_R 0x1
+	#define PLUGIN_CHANNEL_G 0x2
+	#define PLUGIN_CHANNEL_B 0x4
+	#define PLUGIN_CHANNEL_A 0x8
+
+	/*
+	*  A typed plugin argument. 'def' is the default value in the
+	*  same string form as the value set by the user or NULL if
+	*  the argument has no default. Float lists are of the form
+	*  "1,0.5,2" and point lists of the form "0:0,0.5:0.6,1:1".
+	*/
+	typedef struct STRUCT_PLUGIN_ARG_SCHEMA {
+		const char *name;
+		int type;
+		const char *def;
+	} PLUGIN_ARG_SCHEMA;
+
+	typedef struct STRUCT_PLUGIN_POINT {
+		float x;
+		float y;
+	} PLUGIN_POINT;
+
+	/*
+	*  A parsed typed argument. 'set' is 0 if the argument
+	*  was neither set nor has a default. 'count' is the
+	*  number of values in 'floats' or 'points'.
+	*/
+	typedef struct STRUCT_PLUGIN_ARG_VAL {
+		int type;
+		int set;
+		union {
+			long int i;
+			float f;
+			unsigned int mask;
+			float *floats;
+			PLUGIN_POINT *points;
+		};
+		size_t count;
+	} PLUGIN_ARG_VAL;
+
+	/*
+	*  'arg_vals' holds the typed arguments in the order of the
+	*  argument schema of the plugin and 'params' is the parameter
+	*  block returned by plugin_prepare(). Both stay the same until
+	*  the arguments of the plugin change. 'ctx' is the context of
+	*  the plugin instance and 'worker_ctx' the sub-context of the
+	*  worker thread that runs the plugin.
+	*/
 	struct PLUGIN_INDATA {
 		IMAGE *src;
 		IMAGE *dst;
 		char **args;
 		int argc;
 		void (*set_progress)(const unsigned int progress);
+		int (*is_cancelled)(void);
+
+		const PLUGIN_ARG_VAL *arg_vals;
+		unsigned int arg_vals_count;
+		void *params;
+
+		void *ctx;
+		void *worker_ctx;
+
+		/*
+		*  The region of the full input image that 'src' covers.
+		*  This is the whole image unless only a region of interest
+		*  is computed. The full input image is 'full_w'x'full_h'.
+		*/
+		IMG_RECT roi;
+		uint32_t full_w;
+		uint32_t full_h;
+
+		/*
+		*  The scale of the input relative to the full resolution
+		*  image. This is below 1 in preview runs and plugins should
+		*  scale their radii and other distances by it.
+		*/
+		float scale;
+
+		/*
+		*  Run 'body' in parallel for subranges of 0 - 'n' that
+		*  are at most 'grain' long, for example for rows or tiles
+		*  of the image. The pieces run on the shared task pool of
+		*  the core and 'body' may be called from any thread, so
+		*  it must not call 'set_progress' or 'is_cancelled'. This
+		*  returns once every piece is done. Returns 0 on success
+		*  and 1 on failure.
+		*/
+		int (*parallel_for)(const size_t n, const size_t grain,
+				void (*const body)(void *arg, size_t begin, size_t end),
+				void *arg);
 	};
 
 	typedef struct STRUCT_PLUGIN_INFO {
@@ -54,5 +147,48 @@
 		int (*plugin_process)(struct PLUGIN_INDATA *in);
 		int (*plugin_setup)(void);
 		void (*plugin_cleanup)(void);
+
+		/*
+		*  The optional typed argument schema. The arguments in the
+		*  schema are valid arguments in addition to 'valid_args'.
+		*/
+		const PLUGIN_ARG_SCHEMA *arg_schema;
+		const unsigned int arg_schema_count;
+
+		/*
+		*  Optional hooks for compiling the typed arguments into a
+		*  parameter block. plugin_prepare() is called once each time
+		*  the arguments change and it should store the block in
+		*  '*params' and return PLUGIN_STATUS_DONE. The block is freed
+		*  with plugin_unprepare() once it's no longer used.
+		*/
+		int (*plugin_prepare)(const PLUGIN_ARG_VAL *args,
+					const unsigned int argc, void **params);
+		void (*plugin_unprepare)(void *params);
+
+		/*
+		*  Optional hooks for per-instance state. instance_create()
+		*  is called when the plugin is loaded into a pipeline and
+		*  it should store the context of the instance in '*ctx' and
+		*  return PLUGIN_STATUS_DONE. worker_create() is called the
+		*  first time a worker thread runs the instance and creates
+		*  a sub-context for the worker, so plugin_process() calls
+		*  on different workers don't share mutable state.
+		*/
+		int (*instance_create)(void **ctx);
+		void (*instance_destroy)(void *ctx);
+		int (*worker_create)(void *ctx, void **worker_ctx);
+		void (*worker_destroy)(void *ctx, void *worker_ctx);
+
+		/*
+		*  Optional region of interest mapping. roi_map() stores the
+		*  input region that's needed to compute the output region
+		*  'out' in 'in', eg. 'out' itself for point operations or
+		*  'out' dilated by the kernel radius for convolutions. Only
+		*  plugins whose output has the size of the input can have
+		*  this hook. Plugins without it always get the full input.
+		*/
+		void (*roi_map)(void *ctx, void *params, const IMG_RECT *out,
+				IMG_RECT *in);
 	} PLUGIN_INFO;
 #endif
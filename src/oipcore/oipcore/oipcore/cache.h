@@ -23,24 +23,97 @@
 	#define INCLUDED_CACHE
 
 	#include <stdlib.h>
-	#include <time.h>
+	#include <stddef.h>
+	#include <stdint.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
 
+	#include "oipimgutil/oipimgutil.h"
 	#include "oipcore/ptrarray.h"
+	#include "oipcore/hashmap.h"
 
+	#define CACHE_HEAP_GLOBAL 0
+	#define CACHE_HEAP_LOCAL  1
+
+	// The length of a cache key in hex digits.
+	#define CACHE_KEY_LEN 32
+
+	// The number of key digits in the name of a cache subdirectory.
+	#define CACHE_SUBDIR_LEN 2
+
+	/*
+	*  The lock file in the cache root and the suffix of the
+	*  temporary files that cache files are written into.
+	*/
+	#define CACHE_LOCK_FILE ".lock"
+	#define CACHE_TMP_MARK ".tmp-"
+	#define CACHE_TMP_SUFFIX CACHE_TMP_MARK "XXXXXX"
+
+	/*
+	*  The content key of a cache file. A cache file is named by
+	*  the hash of everything its contents depend on, so processes
+	*  that share the cache root find each other's files. An empty
+	*  key means that the data can't be cached.
+	*/
+	typedef struct CACHE_KEY_STRUCT {
+		char str[CACHE_KEY_LEN + 1];
+	} CACHE_KEY;
+
+	// The state of hashing data into a CACHE_KEY.
+	typedef struct CACHE_HASH_STRUCT {
+		uint64_t h[2];
+	} CACHE_HASH;
+
+	struct CACHE_STRUCT;
+
+	/*
+	*  A cache file. 'size' is the size of the file in bytes and
+	*  'cost' the time in seconds it took to compute its contents.
+	*  'priority' is the eviction priority of the file and the file
+	*  with the lowest priority is evicted first. 'heap_pos' holds
+	*  the position of the file in the CACHE_HEAP_* heaps. 'dev' and
+	*  'ino' identify the file that was registered, so a file that
+	*  another process has replaced since isn't deleted. 'adopted'
+	*  is set if the file was written by another process.
+	*/
 	typedef struct CACHE_FILE_STRUCT {
 		char *fname;
 		char *fpath;
-		time_t tstamp;
+		struct CACHE_STRUCT *cache;
+		dev_t dev;
+		ino_t ino;
+		int adopted;
+		size_t size;
+		double cost;
+		double priority;
+		unsigned long long int seq;
+		size_t heap_pos[2];
 	} CACHE_FILE;
 
-	PTRARRAY_TYPE_DEF(CACHE_FILE);
+	/*
+	*  A binary min-heap of cache files ordered by their eviction
+	*  priority. 'slot' is the CACHE_HEAP_* index of the heap.
+	*/
+	typedef struct CACHE_HEAP_STRUCT {
+		CACHE_FILE **files;
+		size_t count;
+		size_t size;
+		int slot;
+	} CACHE_HEAP;
 
+	/*
+	*  A cache. 'max_bytes' is the size budget of the cache or
+	*  0 if it has none and 'bytes' the size of its files. The
+	*  files of all caches are in the same hashed directories
+	*  under the cache root.
+	*/
 	typedef struct CACHE_STRUCT {
 		char *name;
-		char *path;
-		unsigned int max_files;
+		size_t max_bytes;
+		size_t bytes;
 
-		PTRARRAY_TYPE(CACHE_FILE) *db;
+		CACHE_HEAP files;
+		HASHMAP *db_index;
 	} CACHE;
 
 	PTRARRAY_TYPE_DEF(CACHE);
@@ -51,14 +124,25 @@
 	int cache_setup(void);
 	void cache_cleanup(int del_files);
 
+	void cache_hash_init(CACHE_HASH *hash);
+	void cache_hash_update(CACHE_HASH *hash, const void *data, const size_t len);
+	void cache_hash_key(const CACHE_HASH *hash, CACHE_KEY *key);
+
 	int cache_db_file_unreg(CACHE *cache, const char *fname);
 	CACHE_FILE *cache_db_file_reg(CACHE *cache, const char *fname,
-					unsigned int auto_rm);
+					const struct stat *st, const double cost);
+	void cache_db_file_touch(CACHE *cache, const char *fname);
+
+	int cache_lookup(CACHE *cache, const char *fname);
+	int cache_store(CACHE *cache, const char *fname, const IMAGE *img,
+			const double cost);
+	IMAGE *cache_load(CACHE *cache, const char *fname);
 
 	int cache_delete_file(CACHE *cache, const char *fname);
 	int cache_has_file(const CACHE *cache, const char *fname);
-	char *cache_get_path_to_file(const CACHE *cache,
-					const char *fname);
+	int cache_is_registered(const char *fname);
+	void cache_renew_files(void);
+	char *cache_get_path_to_file(const char *fname);
 
 	void cache_dump_all(void);
 	void cache_dump(const CACHE *cache);
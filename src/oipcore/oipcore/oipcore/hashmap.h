@@ -0,0 +1,71 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef INCLUDED_HASHMAP
+	#define INCLUDED_HASHMAP
+
+	#include <stdlib.h>
+	#include <stdint.h>
+
+	#define HASHMAP_KEY_STR 0
+	#define HASHMAP_KEY_INT 1
+
+	/*
+	*  Convert a size_t index to a HASHMAP value and back. This
+	*  makes it possible to use a HASHMAP as an index into an
+	*  array without allocating memory for the values. The
+	*  index is offset by one so that index 0 isn't stored
+	*  as a NULL pointer.
+	*/
+	#define HASHMAP_IDX_TO_VAL(idx) ((void*) (uintptr_t) ((idx) + 1))
+	#define HASHMAP_VAL_TO_IDX(val) ((size_t) ((uintptr_t) (val) - 1))
+
+	typedef struct STRUCT_HASHMAP_SLOT {
+		union {
+			char *str;
+			unsigned long long int num;
+		} key;
+		void *val;
+	} HASHMAP_SLOT;
+
+	typedef struct STRUCT_HASHMAP {
+		unsigned char *ctrl;
+		HASHMAP_SLOT *slots;
+		size_t cap;
+		size_t cnt;
+		size_t used;
+		int key_type;
+		void (*free_func)(void*);
+	} HASHMAP;
+
+	HASHMAP *hashmap_create(const int key_type, void (*const free_func)(void*));
+	void hashmap_destroy(HASHMAP *map, const int free_vals);
+	size_t hashmap_count(const HASHMAP *map);
+	int hashmap_next(const HASHMAP *map, size_t *iter, void **val);
+
+	int hashmap_put_str(HASHMAP *map, const char *key, void *val);
+	void *hashmap_get_str(const HASHMAP *map, const char *key);
+	void *hashmap_pop_str(HASHMAP *map, const char *key);
+
+	int hashmap_put_int(HASHMAP *map, const unsigned long long int key, void *val);
+	void *hashmap_get_int(const HASHMAP *map, const unsigned long long int key);
+	void *hashmap_pop_int(HASHMAP *map, const unsigned long long int key);
+#endif
@@ -23,25 +23,112 @@
 	#define INCLUDED_JOB
 
 	#include "oipimgutil/oipimgutil.h"
+	#include "oipcore/cache.h"
 
 	#define JOB_STATUS_PENDING 0
 	#define JOB_STATUS_SUCCESS 1
 	#define JOB_STATUS_FAIL 2
+	#define JOB_STATUS_CANCELLED 3
+
+	// Job priority classes in the order of precedence.
+	#define JOB_PRIORITY_INTERACTIVE 0
+	#define JOB_PRIORITY_NORMAL 1
+	#define JOB_PRIORITY_BATCH 2
+	#define JOB_NUM_PRIORITIES 3
+
+	#define JOB_DEFAULT_SUBMITTER "default"
 
 	typedef struct STRUCT_JOB {
 		IMAGE *src_img;
 		IMAGE *result_img;
 		char *job_id;
 		char *filepath;
+
+		/*
+		*  The content key of the source image. The cache files of
+		*  the plugin outputs are keyed by it. It's empty if the
+		*  outputs can't be cached.
+		*/
+		CACHE_KEY src_key;
+
 		unsigned long long int *prev_plugin_uids;
 		unsigned long long int *prev_plugin_arg_revs;
 		unsigned int prev_plugin_count;
 		int status;
+
+		int priority;
+		unsigned long int deadline_ms;
+		char *submitter;
+
+		// The name of the pipeline the job is fed to.
+		char *pipeline;
+
+		// The region of the outputs to compute if 'has_roi' is set.
+		IMG_RECT roi;
+		int has_roi;
+
+		/*
+		*  The downscaled source images of preview runs. Level 'n'
+		*  is 1/2^(n + 1) of the full size. 'preview_scale' is the
+		*  scale requested for the next feed and 'result_scale' the
+		*  scale the current results were computed at.
+		*/
+		IMAGE **pyramid;
+		size_t pyramid_count;
+		float preview_scale;
+		float result_scale;
+
+		/*
+		*  The plugins whose outputs are requested. If there are
+		*  none, the output of the last plugin is used. The output
+		*  of the first requested plugin is also put in result_img.
+		*/
+		size_t *outputs;
+		IMAGE **output_imgs;
+		size_t output_count;
+
+		/*
+		*  Set if 'src_img' can be freed and loaded again from
+		*  'filepath' when memory is short. 'src_img' is NULL
+		*  while the source image isn't loaded. The pixels of a
+		*  spilled 'result_img' are in the file 'spill_fd' and
+		*  the image is empty until they are restored. 'src_w'
+		*  and 'src_h' are the size of the source image, which
+		*  is known also while it isn't loaded.
+		*/
+		int spillable;
+		int spill_fd;
+		uint32_t spill_w;
+		uint32_t spill_h;
+		uint32_t src_w;
+		uint32_t src_h;
 	} JOB;
 
 	JOB *job_create(const char *fpath);
+	JOB *job_create_shared(const int fd, const uint32_t w, const uint32_t h,
+				const int format);
+	int job_get_result_shared(JOB *job, int *fd, uint32_t *w, uint32_t *h);
 	int job_save_result(JOB *job, char *fpath);
 	int job_store_plugin_config(JOB *job);
+	int job_set_plugin_config(JOB *job, const unsigned long long int *uids,
+				const unsigned long long int *arg_revs,
+				const unsigned int count);
+	int job_set_priority(JOB *job, const int priority);
+	int job_set_deadline(JOB *job, const unsigned long int deadline_ms);
+	int job_set_submitter(JOB *job, const char *submitter);
+	int job_set_pipeline(JOB *job, const char *name);
+	void job_set_roi(JOB *job, const IMG_RECT *roi);
+	int job_set_preview(JOB *job, const float scale);
+	IMAGE *job_get_src_level(JOB *job, const float scale, float *level_scale);
+	size_t job_spill(JOB *job);
+	int job_restore_result(JOB *job);
+	void job_discard_spilled_result(JOB *job);
+	size_t job_mem_estimate(const JOB *job);
+	int job_set_outputs(JOB *job, const size_t *outputs, const size_t count);
+	IMAGE *job_get_output(JOB *job, const size_t node);
+	int job_save_output(JOB *job, const size_t node, char *fpath);
+	int job_priority_from_str(const char *str);
+	const char *job_priority_to_str(const int priority);
 	void job_print(JOB *job);
 	void job_destroy(JOB *job);
 #endif
@@ -33,4 +33,5 @@
 
 	int jobmanager_reg_job(JOB *job);
 	int jobmanager_unreg_job(JOB *job, int destroy_job);
+	size_t jobmanager_spill(const size_t bytes);
 #endif
@@ -0,0 +1,37 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#ifndef INCLUDED_MEMGOV
+	#define INCLUDED_MEMGOV
+
+	#include <stddef.h>
+
+	// How often deferred jobs are reconsidered in milliseconds.
+	#define MEMGOV_RECHECK_MS 50
+
+	int memgov_setup(void);
+	size_t memgov_get_budget(void);
+	int memgov_over_budget(const size_t extra);
+	size_t memgov_relieve(const size_t extra);
+	void memgov_note_deferred(void);
+	void memgov_print_status(void);
+#endif
@@ -22,6 +22,15 @@
 #ifndef INCLUDED_OIP
 	#define INCLUDED_OIP
 
+	#define OIP_DEFAULT_WATCH_MAX_JOBS 4
+	#define OIP_DEFAULT_WATCH_DEBOUNCE_MS 250
+
 	void oip_cleanup(void);
 	int oip_setup(int argc, char **argv);
+	const char *oip_get_script_file(void);
+	const char *oip_get_daemon_socket(void);
+	const char *oip_get_watch_dir(void);
+	const char *oip_get_output_dir(void);
+	unsigned int oip_get_watch_max_jobs(void);
+	unsigned int oip_get_watch_debounce_ms(void);
 #endif
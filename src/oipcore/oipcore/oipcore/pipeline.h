@@ -26,6 +26,20 @@
 	#include "oipcore/job.h"
 	#include "oipcore/plugin.h"
 
+	#define PIPELINE_HANDLE_QUEUED     0
+	#define PIPELINE_HANDLE_RUNNING    1
+	#define PIPELINE_HANDLE_SUCCESS    2
+	#define PIPELINE_HANDLE_FAIL       3
+	#define PIPELINE_HANDLE_CANCELLED  4
+
+	/*
+	*  An opaque handle to a job that was submitted to the
+	*  pipeline using pipeline_submit().
+	*/
+	typedef struct STRUCT_SCHED_ENTRY PIPELINE_HANDLE;
+
+	#define PIPELINE_DEFAULT_REPORT_MS 100
+
 	struct PIPELINE_STATUS {
 		unsigned int progress;
 		PLUGIN *c_plugin;
@@ -35,6 +49,19 @@
 	int pipeline_reg_status_callback(void (*const callback)(const struct PIPELINE_STATUS *status));
 	int pipeline_unreg_status_callback(void (*const callback)(const struct PIPELINE_STATUS *status));
 
+	int pipeline_setup(void);
 	int pipeline_feed(JOB *job);
+
+	PIPELINE_HANDLE *pipeline_submit(JOB *job);
+	int pipeline_wait(PIPELINE_HANDLE *handle);
+	int pipeline_poll(PIPELINE_HANDLE *handle);
+	int pipeline_cancel(PIPELINE_HANDLE *handle);
+	int pipeline_on_done(PIPELINE_HANDLE *handle,
+			void (*const callback)(JOB *job, const int state, void *arg),
+			void *arg);
+	void pipeline_release(PIPELINE_HANDLE *handle);
+
+	void pipeline_lock(void);
+	void pipeline_unlock(void);
 	void pipeline_cleanup(void);
 #endif
@@ -23,27 +23,120 @@
 	#define PLUGIN_PRIV_INCLUDED
 
 	#include "oipcore/ptrarray.h"
+	#include "oipcore/hashmap.h"
 	#include "oipcore/abi/plugin.h"
 	#include "oipcore/cache.h"
 
+	// The source image of a job as a plugin input.
+	#define PLUGIN_INPUT_SRC -1
+
+	// The pipeline that exists from the start.
+	#define PLUGIN_DEFAULT_PIPELINE "default"
+
+	// The policies for caching the output of a plugin.
+	#define PLUGIN_CACHE_AUTO   0
+	#define PLUGIN_CACHE_ALWAYS 1
+	#define PLUGIN_CACHE_NEVER  2
+
+	/*
+	*  A loaded plugin shared library. The library is shared
+	*  by all instances of the plugin in every pipeline and
+	*  it's closed once the last instance is freed. 'name' is
+	*  the name the plugin was loaded with.
+	*/
+	typedef struct STRUCT_PLUGIN_LIB {
+		char *path;
+		char *name;
+		void *handle;
+		PLUGIN_INFO *p_params;
+		unsigned int refs;
+	} PLUGIN_LIB;
+
 	typedef struct STRUCT_PLUGIN {
 		PLUGIN_INFO *p_params;
 		CACHE *p_cache;
-		void *p_handle;
+		PLUGIN_LIB *p_lib;
 
 		PTRARRAY_TYPE(char) *args;
+		HASHMAP *arg_index;
+		HASHMAP *valid_args;
 
 		unsigned long long int arg_rev;
 		unsigned long long int uid;
+
+		// Index of the plugin whose output is used as the input.
+		long int input;
+
+		/*
+		*  The typed arguments and the parameter block compiled
+		*  from them for the argument revision 'prepared_rev'.
+		*/
+		PLUGIN_ARG_VAL *arg_vals;
+		void *params;
+		unsigned long long int prepared_rev;
+		int prepared;
+
+		// The instance context and the worker sub-contexts by worker.
+		void *ctx;
+		HASHMAP *worker_ctxs;
+
+		/*
+		*  The PLUGIN_CACHE_* policy of the plugin, the measured
+		*  compute time in seconds per megapixel of output and
+		*  the number of outputs that were and weren't cached.
+		*  'mpix_time' is the ratio of the moving averages of the
+		*  compute time 'time_avg' and the megapixels 'mpix_avg',
+		*  so small images don't skew it.
+		*/
+		int cache_policy;
+		double mpix_time;
+		double time_avg;
+		double mpix_avg;
+		unsigned long long int cache_writes;
+		unsigned long long int cache_skips;
+
+		/*
+		*  The hardware counts of the plugin code or a NULL pointer
+		*  if the counters are disabled or the plugin hasn't run.
+		*/
+		struct STRUCT_PERFCTR_SINK *perf;
 	} PLUGIN;
 
+	PTRARRAY_TYPE_DEF(PLUGIN);
+
+	/*
+	*  A named pipeline of plugin instances. Every pipeline has
+	*  its own plugin instances, arguments and caches.
+	*/
+	typedef struct STRUCT_PLUGIN_PIPELINE {
+		char *name;
+		PTRARRAY_TYPE(PLUGIN) *plugins;
+	} PLUGIN_PIPELINE;
+
 	int plugin_load(const char *dirpath, const char *name);
 	void print_plugin_config(void);
 	int plugin_feed(const size_t index, struct PLUGIN_INDATA *in);
 	int plugin_set_arg(const size_t index, char *arg, char *value);
 	int plugin_has_arg(const size_t index, const char *arg);
+	int plugin_set_input(const size_t index, const long int input);
 	PLUGIN *plugin_get(const size_t index);
 	size_t plugins_get_count(void);
+	int plugin_feed_instance(PLUGIN *plugin, struct PLUGIN_INDATA *in);
+	int plugin_prepare(PLUGIN *plugin);
+	int plugin_get_worker_ctx(PLUGIN *plugin, const unsigned int worker,
+					void **worker_ctx);
+	PLUGIN_LIB *plugin_lib_open(const char *path, const char *name);
+	void plugin_lib_unref(PLUGIN_LIB *lib);
+
+	int plugin_pipeline_create(const char *name);
+	int plugin_pipeline_select(const char *name);
+	PLUGIN_PIPELINE *plugin_pipeline_get(const char *name);
+	PLUGIN_PIPELINE *plugin_pipeline_current(void);
+	PLUGIN *plugin_pipeline_get_plugin(const PLUGIN_PIPELINE *pipeline,
+						const size_t index);
+	size_t plugin_pipeline_count(const PLUGIN_PIPELINE *pipeline);
+	void plugin_pipeline_list(void);
+
 	int plugins_setup(void);
 	void plugins_cleanup(void);
 #endif
@@ -0,0 +1,46 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef INCLUDED_SCHEDULER
+	#define INCLUDED_SCHEDULER
+
+	#include "oipcore/job.h"
+	#include "oipcore/pipeline.h"
+
+	#define SCHEDULER_DEFAULT_WEIGHT 1
+
+	int scheduler_setup(void);
+	void scheduler_cleanup(void);
+
+	PIPELINE_HANDLE *scheduler_submit(JOB *job);
+	int scheduler_wait(PIPELINE_HANDLE *handle);
+	int scheduler_poll(PIPELINE_HANDLE *handle);
+	int scheduler_cancel(PIPELINE_HANDLE *handle);
+	int scheduler_on_done(PIPELINE_HANDLE *handle,
+			void (*const callback)(JOB *job, const int state, void *arg),
+			void *arg);
+	void scheduler_release(PIPELINE_HANDLE *handle);
+	int scheduler_has_job(const JOB *job);
+
+	int scheduler_feed(JOB *job);
+	int scheduler_set_weight(const char *submitter, const unsigned int weight);
+	void scheduler_print_status(void);
+#endif
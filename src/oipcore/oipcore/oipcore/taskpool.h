@@ -0,0 +1,43 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#ifndef INCLUDED_TASKPOOL
+	#define INCLUDED_TASKPOOL
+
+	#include <stddef.h>
+
+	// The number of tasks a single thread can have queued.
+	#define TASKPOOL_DEQUE_LEN 1024
+
+	// The number of threads outside the pool that can submit tasks.
+	#define TASKPOOL_MAX_EXTERNAL 64
+
+	int taskpool_setup(void);
+	void taskpool_cleanup(void);
+	int taskpool_join(void);
+	void taskpool_leave(void);
+	unsigned int taskpool_thread_count(void);
+	int taskpool_parallel_for(const size_t n, const size_t grain,
+			void (*const body)(void *arg, size_t begin, size_t end),
+			void *arg);
+	void taskpool_print_status(void);
+#endif
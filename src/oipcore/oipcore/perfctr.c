@@ -0,0 +1,380 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/*
+*  Hardware performance counters. When the config parameter
+*  'perf_counters' is 1, every thread that runs plugin code opens
+*  a perf_event_open() group of user space counters for cycles,
+*  instructions, last level cache misses and branch misses on
+*  first use. The counts are attributed to the PERFCTR_SINK that
+*  is current on the thread: the pipeline switches to the sink of
+*  a plugin while it runs and the task pool switches to the sink
+*  of the thread that queued a task while the task runs, so the
+*  pieces of a parallel_for() are counted for the right plugin.
+*  A switch reads the group once and adds the counts since the
+*  previous switch to the previous sink, so nothing is counted
+*  twice even when a waiting thread runs the tasks of another
+*  plugin. If the kernel multiplexes the group with other counters,
+*  the count of each interval is scaled by the time the group was
+*  enabled and running during that interval.
+*/
+
+#define _GNU_SOURCE
+
+#define PRINT_IDENTIFIER "perfctr"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "oipcore/abi/output.h"
+
+#include "perfctr_priv.h"
+#include "configloader_priv.h"
+
+// The raw counts by event and the times of a group read.
+typedef struct STRUCT_PERFCTR_SAMPLE {
+	uint64_t enabled;
+	uint64_t running;
+	uint64_t values[PERFCTR_EVENTS];
+} PERFCTR_SAMPLE;
+
+/*
+*  The counter group of a thread. 'events' holds the PERFCTR_*
+*  event of each group member in the order they were opened and
+*  'last' the previous read.
+*/
+typedef struct STRUCT_PERFCTR_THREAD {
+	int fds[PERFCTR_EVENTS];
+	int events[PERFCTR_EVENTS];
+	unsigned int count;
+	PERFCTR_SAMPLE last;
+	struct STRUCT_PERFCTR_THREAD *next;
+} PERFCTR_THREAD;
+
+// The layout of a group read with the time fields.
+typedef struct STRUCT_PERFCTR_READ {
+	uint64_t nr;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t values[PERFCTR_EVENTS];
+} PERFCTR_READ;
+
+static const uint64_t pc_configs[PERFCTR_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static atomic_int pc_enabled = 0;
+static unsigned int pc_available = 0;
+static PERFCTR_THREAD *_Atomic pc_threads = NULL;
+static _Thread_local PERFCTR_THREAD *pc_thread = NULL;
+static _Thread_local int pc_thread_failed = 0;
+static _Thread_local PERFCTR_SINK *pc_sink = NULL;
+
+static int perfctr_open(const int event, const int group);
+static PERFCTR_THREAD *perfctr_get_thread(void);
+static int perfctr_read(PERFCTR_THREAD *thread, PERFCTR_SAMPLE *sample);
+
+static int perfctr_open(const int event, const int group) {
+	/*
+	*  Open a user space counter of the PERFCTR_* 'event' for
+	*  the calling thread in the group of the leader 'group' or
+	*  as a new group leader if 'group' is -1. Returns the file
+	*  descriptor of the counter or -1 on failure.
+	*/
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = pc_configs[event];
+	attr.read_format = PERF_FORMAT_GROUP |
+				PERF_FORMAT_TOTAL_TIME_ENABLED |
+				PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group,
+				PERF_FLAG_FD_CLOEXEC);
+}
+
+static PERFCTR_THREAD *perfctr_get_thread(void) {
+	/*
+	*  Return the counter group of the calling thread. The
+	*  group is opened on the first call. Returns a NULL pointer
+	*  on failure.
+	*/
+	PERFCTR_THREAD *thread = NULL;
+	PERFCTR_THREAD *head = NULL;
+	int fd = 0;
+
+	if (pc_thread || pc_thread_failed) {
+		return pc_thread;
+	}
+	pc_thread_failed = 1;
+
+	errno = 0;
+	thread = calloc(1, sizeof(*thread));
+	if (!thread) {
+		printerrno("calloc()");
+		return NULL;
+	}
+	for (int i = 0; i < PERFCTR_EVENTS; i++) {
+		if (!(pc_available & (1U << i))) {
+			continue;
+		}
+		errno = 0;
+		fd = perfctr_open(i, thread->count ? thread->fds[0] : -1);
+		if (fd < 0) {
+			printerrno("perf_event_open()");
+			if (!thread->count) {
+				free(thread);
+				return NULL;
+			}
+			continue;
+		}
+		thread->fds[thread->count] = fd;
+		thread->events[thread->count] = i;
+		thread->count++;
+	}
+	if (perfctr_read(thread, &thread->last) != 0) {
+		for (unsigned int i = 0; i < thread->count; i++) {
+			close(thread->fds[i]);
+		}
+		free(thread);
+		return NULL;
+	}
+
+	head = atomic_load(&pc_threads);
+	do {
+		thread->next = head;
+	} while (!atomic_compare_exchange_weak(&pc_threads, &head, thread));
+	pc_thread_failed = 0;
+	pc_thread = thread;
+	return thread;
+}
+
+static int perfctr_read(PERFCTR_THREAD *thread, PERFCTR_SAMPLE *sample) {
+	/*
+	*  Read the raw counts and the times of the counter group of
+	*  'thread' into 'sample'. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	PERFCTR_READ data;
+	ssize_t ret = 0;
+
+	errno = 0;
+	ret = read(thread->fds[0], &data, sizeof(data));
+	if (ret < (ssize_t) (3 + thread->count)*(ssize_t) sizeof(uint64_t)) {
+		printerrno("read()");
+		return 1;
+	}
+	memset(sample, 0, sizeof(*sample));
+	sample->enabled = data.time_enabled;
+	sample->running = data.time_running;
+	for (unsigned int i = 0; i < thread->count && i < data.nr; i++) {
+		sample->values[thread->events[i]] = data.values[i];
+	}
+	return 0;
+}
+
+int perfctr_enabled(void) {
+	return atomic_load_explicit(&pc_enabled, memory_order_relaxed);
+}
+
+PERFCTR_SINK *perfctr_sink_create(void) {
+	/*
+	*  Create a counter sink. The sink is freed with free().
+	*  Returns a NULL pointer on failure.
+	*/
+	PERFCTR_SINK *sink = NULL;
+
+	errno = 0;
+	sink = calloc(1, sizeof(*sink));
+	if (!sink) {
+		printerrno("calloc()");
+		return NULL;
+	}
+	for (int i = 0; i < PERFCTR_EVENTS; i++) {
+		atomic_init(&sink->counts[i], 0);
+	}
+	atomic_init(&sink->runs, 0);
+	return sink;
+}
+
+PERFCTR_SINK *perfctr_current(void) {
+	// Return the current sink of the calling thread.
+	return pc_sink;
+}
+
+PERFCTR_SINK *perfctr_switch(PERFCTR_SINK *sink) {
+	/*
+	*  Make 'sink' the current sink of the calling thread and add
+	*  the counts since the previous switch to the previous sink.
+	*  'sink' can be a NULL pointer, in which case nothing is
+	*  counted until the next switch. Returns the previous sink.
+	*/
+	PERFCTR_SINK *prev = pc_sink;
+	PERFCTR_THREAD *thread = NULL;
+	PERFCTR_SAMPLE sample;
+	uint64_t enabled = 0;
+	uint64_t running = 0;
+	uint64_t delta = 0;
+
+	if (!perfctr_enabled()) {
+		return prev;
+	}
+	pc_sink = sink;
+
+	thread = perfctr_get_thread();
+	if (!thread || perfctr_read(thread, &sample) != 0) {
+		return prev;
+	}
+
+	/*
+	*  The raw counts and times only grow. A group that didn't
+	*  run during the interval counted nothing.
+	*/
+	enabled = sample.enabled - thread->last.enabled;
+	running = sample.running - thread->last.running;
+	for (int i = 0; prev && running && i < PERFCTR_EVENTS; i++) {
+		delta = sample.values[i] - thread->last.values[i];
+		if (running < enabled) {
+			delta = (uint64_t) ((double) delta*enabled/running);
+		}
+		atomic_fetch_add_explicit(&prev->counts[i], delta,
+					memory_order_relaxed);
+	}
+	thread->last = sample;
+	return prev;
+}
+
+void perfctr_print_sink(PERFCTR_SINK *sink) {
+	/*
+	*  Print the instructions per cycle and the misses per
+	*  thousand instructions of 'sink' to STDOUT. Nothing is
+	*  printed if the counters are disabled.
+	*/
+	unsigned long long int counts[PERFCTR_EVENTS];
+	double kinstr = 0;
+
+	if (!perfctr_enabled()) {
+		return;
+	}
+	if (!sink || !atomic_load(&sink->runs)) {
+		fprintf(print_stdout, "    HW counters:     no runs\n");
+		return;
+	}
+	for (int i = 0; i < PERFCTR_EVENTS; i++) {
+		counts[i] = atomic_load_explicit(&sink->counts[i],
+						memory_order_relaxed);
+	}
+	kinstr = counts[PERFCTR_INSTRUCTIONS]/1e3;
+
+	fprintf(print_stdout, "    HW counters:     %llu cycles, %llu instructions in %llu runs\n",
+		counts[PERFCTR_CYCLES], counts[PERFCTR_INSTRUCTIONS],
+		atomic_load(&sink->runs));
+	if (counts[PERFCTR_CYCLES]) {
+		fprintf(print_stdout, "    IPC:             %.2f\n",
+			(double) counts[PERFCTR_INSTRUCTIONS]/counts[PERFCTR_CYCLES]);
+	}
+	if (kinstr > 0 && (pc_available & (1U << PERFCTR_LLC_MISSES))) {
+		fprintf(print_stdout, "    LLC MPKI:        %.2f\n",
+			counts[PERFCTR_LLC_MISSES]/kinstr);
+	}
+	if (kinstr > 0 && (pc_available & (1U << PERFCTR_BRANCH_MISSES))) {
+		fprintf(print_stdout, "    Branch MPKI:     %.2f\n",
+			counts[PERFCTR_BRANCH_MISSES]/kinstr);
+	}
+}
+
+int perfctr_setup(void) {
+	/*
+	*  Enable the counters if the config parameter 'perf_counters'
+	*  is 1. The events are probed once here and the counters are
+	*  left disabled with an error message if the CPU or the kernel,
+	*  eg. with a high perf_event_paranoid, doesn't allow counting
+	*  cycles. Returns 0 on success and 1 on failure.
+	*/
+	long int val = 0;
+	int fd = 0;
+
+	val = config_get_lint_param("perf_counters");
+	if (val != 0 && val != 1) {
+		printerr("Invalid perf_counters value.\n");
+		return 1;
+	} else if (!val) {
+		return 0;
+	}
+
+	pc_available = 0;
+	for (int i = 0; i < PERFCTR_EVENTS; i++) {
+		errno = 0;
+		fd = perfctr_open(i, -1);
+		if (fd < 0) {
+			printverb_va("Hardware event %d unavailable: %s\n",
+					i, strerror(errno));
+			continue;
+		}
+		close(fd);
+		pc_available |= 1U << i;
+	}
+	if (!(pc_available & (1U << PERFCTR_CYCLES))) {
+		printerr("Hardware performance counters unavailable.\n");
+		pc_available = 0;
+		return 0;
+	}
+	printverb("Hardware performance counters enabled.\n");
+	atomic_store(&pc_enabled, 1);
+	return 0;
+}
+
+void perfctr_cleanup(void) {
+	/*
+	*  Disable the counters and close the counter groups of
+	*  every thread. This must be called once the threads that
+	*  run plugins have been stopped.
+	*/
+	PERFCTR_THREAD *thread = NULL;
+	PERFCTR_THREAD *next = NULL;
+
+	atomic_store(&pc_enabled, 0);
+	thread = atomic_exchange(&pc_threads, NULL);
+	while (thread) {
+		for (unsigned int i = 0; i < thread->count; i++) {
+			close(thread->fds[i]);
+		}
+		next = thread->next;
+		free(thread);
+		thread = next;
+	}
+	pc_thread = NULL;
+	pc_thread_failed = 0;
+	pc_sink = NULL;
+}
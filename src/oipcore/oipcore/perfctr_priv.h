@@ -0,0 +1,51 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef INCLUDED_PERFCTR_PRIV
+	#define INCLUDED_PERFCTR_PRIV
+
+	#include <stdatomic.h>
+
+	// The hardware events that are counted, in group order.
+	#define PERFCTR_CYCLES        0
+	#define PERFCTR_INSTRUCTIONS  1
+	#define PERFCTR_LLC_MISSES    2
+	#define PERFCTR_BRANCH_MISSES 3
+	#define PERFCTR_EVENTS        4
+
+	/*
+	*  The counts of the code run on behalf of eg. a plugin,
+	*  summed over every thread that ran it. 'runs' is the
+	*  number of times the owner was run.
+	*/
+	typedef struct STRUCT_PERFCTR_SINK {
+		atomic_ullong counts[PERFCTR_EVENTS];
+		atomic_ullong runs;
+	} PERFCTR_SINK;
+
+	int perfctr_setup(void);
+	void perfctr_cleanup(void);
+	int perfctr_enabled(void);
+	PERFCTR_SINK *perfctr_sink_create(void);
+	PERFCTR_SINK *perfctr_current(void);
+	PERFCTR_SINK *perfctr_switch(PERFCTR_SINK *sink);
+	void perfctr_print_sink(PERFCTR_SINK *sink);
+#endif
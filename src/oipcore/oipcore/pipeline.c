@@ -26,25 +26,86 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "oipcore/abi/output.h"
 #include "oipcore/pipeline.h"
+#include "oipcore/scheduler.h"
 #include "oipcore/file.h"
 #include "oipcore/cache.h"
+#include "oipcore/ptrarray.h"
+#include "oipcore/memgov.h"
+#include "oipcore/taskpool.h"
 
-static int pipeline_write_cache(const JOB *job, const unsigned int p_index,
-				const IMAGE *img);
-static int pipeline_load_cache(const JOB *job, IMAGE **dst);
-static float pipeline_cputime(void);
+#include "pipeline_priv.h"
+#include "prefetch_priv.h"
+#include "cachefile_priv.h"
+#include "configloader_priv.h"
+#include "worker_priv.h"
+#include "trace_priv.h"
+#include "perfctr_priv.h"
+
+// The weight of a new sample in the compute time averages.
+#define PIPELINE_EWMA_WEIGHT 0.25
+
+PTRARRAY_TYPE_DEF(PIPELINE_RUN);
+
+static void pipeline_node_key(const PLUGIN *plugin, const CACHE_KEY *input,
+				CACHE_KEY *dst);
+static void pipeline_plan_keys(const PLUGIN_PIPELINE *graph, const long int *inputs,
+				const CACHE_KEY *src, CACHE_KEY *keys);
+static int pipeline_write_cache(const PIPELINE_RUN *run, const unsigned int p_index,
+				const IMAGE *img, const double cost);
+static int pipeline_should_cache(PLUGIN *plugin, const IMAGE *img,
+				const double cost);
+static int pipeline_node_valid(const PIPELINE_RUN *run, const size_t node);
+static int pipeline_load_cache(const PIPELINE_RUN *run, const size_t node,
+				IMAGE **dst);
+static void pipeline_buf_release(PIPELINE_RUN *run, PIPELINE_BUF *buf);
+static void pipeline_run_free(PIPELINE_RUN *run);
+static int pipeline_copy_output(PIPELINE_RUN *run, const size_t node, IMAGE *dst);
+static void pipeline_buf_set_full(PIPELINE_BUF *buf);
+static int pipeline_setup_scale(PIPELINE_RUN *run);
+static void pipeline_roi_need(PIPELINE_RUN *run, const size_t node,
+				const IMG_RECT *rect);
+static void pipeline_roi_propagate(PIPELINE_RUN *run);
+static IMAGE *pipeline_roi_input(PIPELINE_RUN *run, const size_t node,
+				const PIPELINE_BUF *input, IMG_RECT *roi);
 static void pipeline_update_progress(const unsigned int progress);
-static void pipeline_call_status_callbacks(void);
+static void pipeline_call_status_callbacks(const struct PIPELINE_STATUS *status);
+static void pipeline_report_run(PIPELINE_RUN *run);
+static void pipeline_report_reg(PIPELINE_RUN *run);
+static void pipeline_report_unreg(PIPELINE_RUN *run);
+static void *pipeline_reporter(void *arg);
+static int pipeline_is_cancelled(void);
+static void pipeline_lock_init(void);
 
-static clock_t cputime_last = 0.0f;
+static pthread_once_t pipeline_lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pipeline_mutex;
 
-static struct PIPELINE_STATUS pipeline_status = {
-	.progress = 0,
-	.c_plugin = NULL
-};
+// The run that is currently being fed to a plugin in this thread.
+static _Thread_local PIPELINE_RUN *pipeline_current_run = NULL;
+
+// The ID of the worker thread that runs plugins on this thread.
+static _Thread_local unsigned int pipeline_worker_id = 0;
+
+/*
+*  The progress reporter thread samples the progress of the
+*  runs in 'report_runs' every 'report_ms' milliseconds and calls
+*  the status callbacks. The status callbacks and 'report_runs'
+*  are protected by 'report_mutex'.
+*/
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t report_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t report_reaped_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t report_thread;
+static int report_thread_running = 0;
+static int report_stop = 0;
+static long int report_ms = PIPELINE_DEFAULT_REPORT_MS;
+static PTRARRAY_TYPE(PIPELINE_RUN) *report_runs = NULL;
 
 static struct STATUS_CALLBACKS {
 	void (**funcs)(const struct PIPELINE_STATUS *status);
@@ -54,123 +115,405 @@ static struct STATUS_CALLBACKS {
 	.cnt = 0
 };
 
-static float pipeline_cputime(void) {
+static void pipeline_node_key(const PLUGIN *plugin, const CACHE_KEY *input,
+				CACHE_KEY *dst) {
 	/*
-	*  Return the elapsed CPU time in seconds
-	*  since this function was last called.
+	*  Store the cache key of the output of 'plugin' with its
+	*  current arguments for the input with the key 'input' in
+	*  'dst'. The key covers the plugin library and the arguments
+	*  in the order the plugin declares them, so the same plugin
+	*  config gives the same key in every process. An empty
+	*  'input' gives an empty key.
 	*/
+	const PLUGIN_INFO *info = plugin->p_params;
+	const char *name = NULL;
+	void *arg_i = NULL;
+	CACHE_HASH hash;
+	struct stat st;
+	uint64_t lib_id[4];
 
-	clock_t cputime_current = clock();
-	float ret = 0.0f;
+	dst->str[0] = '\0';
+	if (!input->str[0]) {
+		return;
+	}
 
-	ret = (float) (cputime_current - cputime_last)/CLOCKS_PER_SEC;
-	cputime_last = cputime_current;
-	return ret;
+	// A rebuilt plugin library invalidates its cache files.
+	errno = 0;
+	if (stat(plugin->p_lib->path, &st) == -1) {
+		printerrno("stat()");
+		return;
+	}
+	lib_id[0] = st.st_dev;
+	lib_id[1] = st.st_ino;
+	lib_id[2] = st.st_size;
+	lib_id[3] = st.st_mtim.tv_sec*1000000000ULL + st.st_mtim.tv_nsec;
+
+	cache_hash_init(&hash);
+	cache_hash_update(&hash, input->str, sizeof(input->str));
+	cache_hash_update(&hash, plugin->p_lib->name, strlen(plugin->p_lib->name));
+	cache_hash_update(&hash, lib_id, sizeof(lib_id));
+	for (size_t i = 0; i < info->valid_args_count + info->arg_schema_count; i++) {
+		if (i < info->valid_args_count) {
+			name = info->valid_args[i];
+		} else {
+			name = info->arg_schema[i - info->valid_args_count].name;
+		}
+		arg_i = hashmap_get_str(plugin->arg_index, name);
+		if (arg_i) {
+			cache_hash_update(&hash, name, strlen(name));
+			name = plugin->args->ptrs[HASHMAP_VAL_TO_IDX(arg_i) + 1];
+			cache_hash_update(&hash, name, strlen(name));
+		}
+	}
+	cache_hash_key(&hash, dst);
 }
 
-static int pipeline_write_cache(const JOB *job, const unsigned int p_index,
-				const IMAGE *img) {
+static void pipeline_plan_keys(const PLUGIN_PIPELINE *graph, const long int *inputs,
+				const CACHE_KEY *src, CACHE_KEY *keys) {
 	/*
-	*  Write the supplied image into the cache file of the plugin at 'p_index'.
-	*  Returns 0 on success and 1 on failure.
+	*  Derive the cache keys of the outputs of the plugins in
+	*  'graph' into 'keys' from the source image key 'src'. The
+	*  inputs of the plugins are taken from 'inputs' or from the
+	*  plugins if it's NULL. Plugins only take their input from
+	*  the plugins before them.
+	*/
+	const PLUGIN *plugin = NULL;
+	long int input = 0;
+
+	for (size_t i = 0; i < plugin_pipeline_count(graph); i++) {
+		plugin = plugin_pipeline_get_plugin(graph, i);
+		input = inputs ? inputs[i] : plugin->input;
+		if (input == PLUGIN_INPUT_SRC) {
+			pipeline_node_key(plugin, src, &keys[i]);
+		} else {
+			pipeline_node_key(plugin, &keys[input], &keys[i]);
+		}
+	}
+}
+
+static int pipeline_write_cache(const PIPELINE_RUN *run, const unsigned int p_index,
+				const IMAGE *img, const double cost) {
+	/*
+	*  Write the supplied image into the cache file of the plugin at
+	*  'p_index' under the key of its output buffer. 'cost' is the
+	*  time in seconds it took to compute the image. Returns 0 on
+	*  success and 1 on failure.
 	*/
 	PLUGIN *tmp_plugin = NULL;
-	CACHE_FILE *tmp_cache_file = NULL;
+	int ret = 0;
 
-	tmp_plugin = plugin_get(p_index);
+	tmp_plugin = plugin_pipeline_get_plugin(run->graph, p_index);
 	if (!tmp_plugin) {
 		return 1;
 	}
+	trace_begin("pipeline_write_cache", tmp_plugin->p_params->name);
+	ret = cache_store(tmp_plugin->p_cache, run->bufs[p_index].key.str,
+				img, cost);
+	trace_end("pipeline_write_cache");
+	return ret;
+}
 
-	tmp_cache_file = cache_db_file_reg(tmp_plugin->p_cache, job->job_id, 1);
-	if (!tmp_cache_file) {
-		printerr("Failed to register cache file.\n");
+static int pipeline_should_cache(PLUGIN *plugin, const IMAGE *img,
+				const double cost) {
+	/*
+	*  Decide whether the output 'img' of 'plugin' should be cached.
+	*  'cost' is the time it takes to compute 'img' again from the
+	*  closest cache file. In the automatic mode the output is cached
+	*  if computing it again would take longer than writing and then
+	*  reading the cache file. Outputs are cached until the cache
+	*  file I/O has been measured.
+	*/
+	double write_t = 0;
+	double read_t = 0;
+
+	switch (plugin->cache_policy) {
+		case PLUGIN_CACHE_ALWAYS:
+			return 1;
+		case PLUGIN_CACHE_NEVER:
+			return 0;
+		default:
+			break;
+	}
+	if (cachefile_estimate(img_bytelen(img), &write_t, &read_t) != 0) {
 		return 1;
 	}
+	if (cost < write_t + read_t) {
+		printverb_va("Not caching the output of %s: %f s to compute, "
+				"%f s to write and read.\n", plugin->p_params->name,
+				cost, write_t + read_t);
+		return 0;
+	}
+	return 1;
+}
 
-	printverb_va("Cache image: %s\n", tmp_cache_file->fpath);
-	if (img_save(img, tmp_cache_file->fpath) != 0) {
-		if (cache_db_file_unreg(tmp_plugin->p_cache, job->job_id) != 0) {
-			printerr("Failed to unregister cache file.\n");
-		}
+static int pipeline_node_valid(const PIPELINE_RUN *run, const size_t node) {
+	/*
+	*  Return 1 if there's a cache file for the output of the
+	*  plugin 'node' with the plugin config at the beginning of
+	*  the run and 0 otherwise. The file might have been written
+	*  by another process sharing the cache root.
+	*/
+	if (!run->keys[node].str[0]) {
+		return 0;
+	}
+	return cache_lookup(plugin_pipeline_get_plugin(run->graph, node)->p_cache,
+				run->keys[node].str);
+}
+
+static int pipeline_load_cache(const PIPELINE_RUN *run, const size_t node,
+				IMAGE **dst) {
+	/*
+	*  Load the cache file of the plugin 'node' for the job of
+	*  'run' into *dst. Returns 0 on success and 1 on failure.
+	*/
+	PLUGIN *plugin = plugin_pipeline_get_plugin(run->graph, node);
+	IMAGE *tmp = NULL;
+
+	trace_begin("pipeline_load_cache", plugin->p_params->name);
+	tmp = cache_load(plugin->p_cache, run->keys[node].str);
+	trace_end("pipeline_load_cache");
+	if (tmp == NULL) {
+		printerr("Failed to load cache image.\n");
 		return 1;
 	}
+	*dst = tmp;
 	return 0;
 }
 
-static int pipeline_load_cache(const JOB *job, IMAGE **dst) {
+static void pipeline_buf_release(PIPELINE_RUN *run, PIPELINE_BUF *buf) {
 	/*
-	*  Load the last up-to-date cache file of 'job'. The resulting
-	*  image is loaded into *dst. If no up-to-date cache file is found,
-	*  the contents of *dst are not modified and 0 is returned.
-	*  On failure -1 is returned.
+	*  Drop a reference to 'buf' and free the image once
+	*  there are no references left.
 	*/
+	if (buf == &run->src_buf || buf->refs == 0) {
+		return;
+	}
+	if (--buf->refs == 0) {
+		img_free(buf->img);
+		buf->img = NULL;
+	}
+}
 
-	IMAGE *tmp = NULL;
-	unsigned int maxindex = 0;
-	unsigned int first = 0;
-	char *cache_fpath = NULL;
+static void pipeline_run_free(PIPELINE_RUN *run) {
+	if (run->bufs) {
+		for (size_t i = 0; i < run->stage_count; i++) {
+			if (run->bufs[i].img) {
+				img_free(run->bufs[i].img);
+			}
+		}
+	}
+	if (run->in.dst) {
+		img_free(run->in.dst);
+	}
+	free(run->inputs);
+	free(run->nodes);
+	free(run->consumers);
+	free(run->bufs);
+	free(run->node_bufs);
+	free(run->outputs);
+	free(run->uids);
+	free(run->arg_revs);
+	free(run->keys);
+	free(run->roi_states);
+	free(run->rois);
+	free(run);
+}
 
-	if (job->prev_plugin_count == 0) {
-		return 0;
+static void pipeline_update_progress(const unsigned int progress) {
+	/*
+	*  Set the progress of the current plugin in the range 0-100.
+	*  This is called by plugins from their processing loops, so
+	*  it only stores the value. The reporter thread takes care of
+	*  calling the status callbacks.
+	*/
+	if (pipeline_current_run) {
+		atomic_store_explicit(&pipeline_current_run->progress,
+				progress > 100 ? 100 : progress,
+				memory_order_relaxed);
 	}
+}
 
-	if (plugins_get_count() <= job->prev_plugin_count) {
-		maxindex = plugins_get_count();
-	} else {
-		maxindex = job->prev_plugin_count;
+static void pipeline_call_status_callbacks(const struct PIPELINE_STATUS *status) {
+	/*
+	*  Call every registered status callback. The
+	*  report mutex must be locked by the caller.
+	*/
+	for (size_t i = 0; i < status_callbacks.cnt; i++) {
+		status_callbacks.funcs[i](status);
 	}
+}
 
-	first = maxindex;
-	for (unsigned int i = 0; i < maxindex; i++) {
-		if (plugin_get(i)->arg_rev != job->prev_plugin_arg_revs[i] ||
-			plugin_get(i)->uid != job->prev_plugin_uids[i] ||
-			!cache_has_file(plugin_get(i)->p_cache, job->job_id)) {
-			printverb_va("First changed plugin is %u.\n", i);
-			first = i;
-		}
+static void pipeline_report_run(PIPELINE_RUN *run) {
+	/*
+	*  Sample the progress of 'run' and call the status callbacks
+	*  if it has changed since the last sample. The report mutex
+	*  must be locked by the caller.
+	*/
+	struct PIPELINE_STATUS status;
+	PLUGIN *plugin = NULL;
+	unsigned int progress = 0;
+	size_t seq = 0;
+	size_t seq_done = 0;
+
+	/*
+	*  The plugin and progress are stored before the step sequence
+	*  number, so the sample is consistent if the sequence number
+	*  didn't change in between.
+	*/
+	seq = atomic_load_explicit(&run->seq, memory_order_acquire);
+	plugin = atomic_load_explicit(&run->c_plugin, memory_order_acquire);
+	progress = atomic_load_explicit(&run->progress, memory_order_relaxed);
+	seq_done = atomic_load_explicit(&run->seq_done, memory_order_acquire);
+	if (seq != atomic_load_explicit(&run->seq, memory_order_acquire)) {
+		return;
 	}
 
-	cache_fpath = cache_get_path_to_file(plugin_get(first - 1)->p_cache,
-						job->job_id);
-	if (cache_fpath == NULL) {
-		printerr("Failed to get cache file path.\n");
-		return -1;
+	status.c_job = run->job;
+	if (seq != run->r_seq) {
+		// Finish the previous plugin if it wasn't fully reported.
+		if (run->r_plugin && run->r_progress < 100 && seq_done >= run->r_seq) {
+			status.c_plugin = run->r_plugin;
+			status.progress = 100;
+			pipeline_call_status_callbacks(&status);
+		}
+		run->r_seq = seq;
+		run->r_plugin = plugin;
+		run->r_progress = 0;
+		if (plugin) {
+			status.c_plugin = plugin;
+			status.progress = 0;
+			pipeline_call_status_callbacks(&status);
+		}
 	}
 
-	printverb_va("Loading image from cache: %s\n", cache_fpath);
-	tmp = img_load(cache_fpath);
-	free(cache_fpath);
-	if (tmp == NULL) {
-		printerr("Failed to load cache image.\n");
-		return -1;
+	if (seq_done >= seq) {
+		progress = 100;
+	}
+	if (plugin && progress != run->r_progress) {
+		run->r_progress = progress;
+		status.c_plugin = plugin;
+		status.progress = progress;
+		pipeline_call_status_callbacks(&status);
 	}
-	*dst = tmp;
-	return first;
 }
 
-static void pipeline_update_progress(const unsigned int progress) {
+static void pipeline_report_reg(PIPELINE_RUN *run) {
 	/*
-	*  Set the pipeline progress in the range 0-100 and call
-	*  the status callbacks.
+	*  Register 'run' with the progress reporter.
 	*/
-	if (progress != pipeline_status.progress) {
-		if (progress > 100) {
-			pipeline_status.progress = 100;
+	pthread_mutex_lock(&report_mutex);
+	run->reaped = 1;
+	if (report_thread_running) {
+		if (ptrarray_put_ptr((PTRARRAY_TYPE(void)*) report_runs, run)) {
+			run->reaped = 0;
 		} else {
-			pipeline_status.progress = progress;
+			printerr("Failed to register run with the reporter.\n");
 		}
-		pipeline_call_status_callbacks();
 	}
+	pthread_mutex_unlock(&report_mutex);
 }
 
-static void pipeline_call_status_callbacks(void) {
+static void pipeline_report_unreg(PIPELINE_RUN *run) {
 	/*
-	*  Call every registered status callback.
+	*  Unregister 'run' from the progress reporter. This waits
+	*  until the reporter has reported the final progress of the
+	*  run so that the callbacks never see a freed job.
 	*/
-	for (size_t i = 0; i < status_callbacks.cnt; i++) {
-		status_callbacks.funcs[i](&pipeline_status);
+	pthread_mutex_lock(&report_mutex);
+	run->finished = 1;
+	if (!run->reaped) {
+		pthread_cond_signal(&report_cond);
+		while (!run->reaped) {
+			pthread_cond_wait(&report_reaped_cond, &report_mutex);
+		}
 	}
+	pthread_mutex_unlock(&report_mutex);
+}
+
+static void *pipeline_reporter(void *arg) {
+	/*
+	*  The progress reporter thread.
+	*/
+	PTRARRAY_TYPE(PIPELINE_RUN) *tmp_runs = NULL;
+	PIPELINE_RUN *run = NULL;
+	struct timespec wakeup;
+	size_t i = 0;
+
+	(void) arg;
+
+	pthread_mutex_lock(&report_mutex);
+	for (;;) {
+		i = 0;
+		while (i < report_runs->ptrc) {
+			run = report_runs->ptrs[i];
+			pipeline_report_run(run);
+			if (!run->finished) {
+				i++;
+				continue;
+			}
+			tmp_runs = (PTRARRAY_TYPE(PIPELINE_RUN)*) ptrarray_pop_ptr(
+					(PTRARRAY_TYPE(void)*) report_runs, run, 0);
+			if (tmp_runs) {
+				report_runs = tmp_runs;
+			} else {
+				i++;
+			}
+			run->reaped = 1;
+			pthread_cond_broadcast(&report_reaped_cond);
+		}
+		if (report_stop) {
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += report_ms/1000;
+		wakeup.tv_nsec += (report_ms%1000)*1000000;
+		if (wakeup.tv_nsec >= 1000000000) {
+			wakeup.tv_sec++;
+			wakeup.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&report_cond, &report_mutex, &wakeup);
+	}
+	pthread_mutex_unlock(&report_mutex);
+	return NULL;
+}
+
+static int pipeline_is_cancelled(void) {
+	/*
+	*  Return 1 if the run that is currently being fed to a plugin
+	*  has been cancelled and 0 otherwise. Plugins can call this
+	*  periodically and return early if the run was cancelled.
+	*/
+	if (pipeline_current_run && pipeline_current_run->cancel) {
+		return atomic_load(pipeline_current_run->cancel) != 0;
+	}
+	return 0;
+}
+
+static void pipeline_lock_init(void) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&pipeline_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void pipeline_lock(void) {
+	/*
+	*  Lock the pipeline. The plugins, their arguments and the
+	*  caches can't be modified while a plugin is processing a
+	*  job, so the scheduler holds this lock while it feeds a job
+	*  to a plugin and functions that modify the pipeline take it
+	*  too. The lock is recursive. It's released while a worker
+	*  process runs a plugin, see worker_feed().
+	*/
+	pthread_once(&pipeline_lock_once, &pipeline_lock_init);
+	pthread_mutex_lock(&pipeline_mutex);
+}
+
+void pipeline_unlock(void) {
+	pthread_mutex_unlock(&pipeline_mutex);
 }
 
 int pipeline_reg_status_callback(void (*const callback)(const struct PIPELINE_STATUS *status)) {
@@ -186,16 +529,19 @@ int pipeline_reg_status_callback(void (*const callback)(const struct PIPELINE_ST
 	}
 
 	printverb("Registering status callback function.\n");
+	pthread_mutex_lock(&report_mutex);
 	errno = 0;
 	tmp = realloc(status_callbacks.funcs,
 		(++status_callbacks.cnt)*sizeof(callback));
 	if (!tmp) {
 		printerrno("realloc(): ");
 		status_callbacks.cnt--;
+		pthread_mutex_unlock(&report_mutex);
 		return 1;
 	}
 	status_callbacks.funcs = tmp;
 	tmp[status_callbacks.cnt - 1] = callback;
+	pthread_mutex_unlock(&report_mutex);
 	return 0;
 }
 
@@ -217,6 +563,7 @@ int pipeline_unreg_status_callback(void (*const callback)(const struct PIPELINE_
 	};
 
 	printverb("Unregistering a status callback function.\n");
+	pthread_mutex_lock(&report_mutex);
 	for (size_t i = 0; i < status_callbacks.cnt; i++) {
 		if (callback != status_callbacks.funcs[i]) {
 			errno = 0;
@@ -224,6 +571,7 @@ int pipeline_unreg_status_callback(void (*const callback)(const struct PIPELINE_
 			if (!tmp_2.funcs) {
 				printerrno("realloc()");
 				free(tmp_1.funcs);
+				pthread_mutex_unlock(&report_mutex);
 				return 1;
 			}
 			tmp_1.funcs = tmp_2.funcs;
@@ -233,107 +581,808 @@ int pipeline_unreg_status_callback(void (*const callback)(const struct PIPELINE_
 	free(status_callbacks.funcs);
 	status_callbacks.funcs = tmp_1.funcs;
 	status_callbacks.cnt = tmp_1.cnt;
+	pthread_mutex_unlock(&report_mutex);
 	return 0;
 }
 
-int pipeline_feed(JOB *job) {
+static void pipeline_buf_set_full(PIPELINE_BUF *buf) {
 	/*
-	*  Feed a processing job to the processing pipeline.
-	*  The result is put into job->result_img.
-	*  This function returns 0 on success and 1 on failure.
+	*  Mark 'buf' as covering the whole plugin output.
 	*/
+	buf->rect.x = 0;
+	buf->rect.y = 0;
+	buf->rect.w = buf->img->w;
+	buf->rect.h = buf->img->h;
+	buf->full_w = buf->img->w;
+	buf->full_h = buf->img->h;
+}
 
-	struct PLUGIN_INDATA in;
-	int ret = 0;
-	int first = 0;
+static int pipeline_setup_scale(PIPELINE_RUN *run) {
+	/*
+	*  Pick the source image of 'run' from the source pyramid of
+	*  the job according to the preview scale of the job and scale
+	*  the region of interest to match it. Returns 0 on success and
+	*  1 on failure.
+	*/
+	JOB *job = run->job;
+	uint32_t x1 = 0;
+	uint32_t y1 = 0;
 
-	float t_delta = 0;
-	size_t throughput = 0;
+	run->src_buf.img = job_get_src_level(job, job->preview_scale, &run->scale);
+	if (!run->src_buf.img) {
+		printerr("Failed to scale the source image.\n");
+		return 1;
+	}
+	run->preview = run->scale < 1.0f;
+	if (run->preview) {
+		printverb_va("Preview run at scale %g.\n", run->scale);
+	}
 
-	if (plugins_get_count() != 0) {
-		job->status = JOB_STATUS_FAIL;
+	run->has_roi = job->has_roi;
+	run->roi = job->roi;
+	if (run->has_roi && run->preview) {
+		x1 = ceilf((job->roi.x + job->roi.w)*run->scale);
+		y1 = ceilf((job->roi.y + job->roi.h)*run->scale);
+		run->roi.x = job->roi.x*run->scale;
+		run->roi.y = job->roi.y*run->scale;
+		run->roi.w = x1 - run->roi.x;
+		run->roi.h = y1 - run->roi.y;
+	}
+	return 0;
+}
 
-		in.set_progress = &pipeline_update_progress;
-		in.src = job->src_img;
-		in.dst = img_alloc(0, 0);
-		if (!in.dst) {
-			return 1;
+static void pipeline_roi_need(PIPELINE_RUN *run, const size_t node,
+				const IMG_RECT *rect) {
+	/*
+	*  Add 'rect' to the needed region of the output of the
+	*  plugin 'node'. A NULL 'rect' means the whole output.
+	*/
+	if (!rect) {
+		run->roi_states[node] = PIPELINE_ROI_FULL;
+	} else if (run->roi_states[node] == PIPELINE_ROI_NONE) {
+		run->roi_states[node] = PIPELINE_ROI_RECT;
+		run->rois[node] = *rect;
+	} else if (run->roi_states[node] == PIPELINE_ROI_RECT) {
+		img_rect_union(&run->rois[node], rect);
+	}
+}
+
+static void pipeline_roi_propagate(PIPELINE_RUN *run) {
+	/*
+	*  Propagate the region of interest of the job backwards from
+	*  the outputs. Plugins are visited in reverse order, so the
+	*  needed region of a plugin is known once every plugin that
+	*  takes its output as the input has been visited. Plugins
+	*  without a roi_map() hook need their whole input.
+	*/
+	PLUGIN *plugin = NULL;
+	IMG_RECT in_roi;
+	long int u = 0;
+
+	for (size_t i = 0; i < run->output_count; i++) {
+		pipeline_roi_need(run, run->outputs[i], run->has_roi ? &run->roi : NULL);
+	}
+	for (size_t n = run->stage_count; n-- > 0;) {
+		u = run->inputs[n];
+		if (run->nodes[n] != PIPELINE_NODE_RUN || u == PLUGIN_INPUT_SRC) {
+			continue;
 		}
+		plugin = plugin_pipeline_get_plugin(run->graph, n);
+		if (run->roi_states[n] == PIPELINE_ROI_RECT && plugin->p_params->roi_map &&
+			plugin_prepare(plugin) == 0) {
+			plugin->p_params->roi_map(plugin->ctx, plugin->params,
+							&run->rois[n], &in_roi);
+			pipeline_roi_need(run, u, &in_roi);
+		} else {
+			pipeline_roi_need(run, u, NULL);
+		}
+	}
+}
+
+static IMAGE *pipeline_roi_input(PIPELINE_RUN *run, const size_t node,
+				const PIPELINE_BUF *input, IMG_RECT *roi) {
+	/*
+	*  Crop the input region that's needed for the region of
+	*  interest of the plugin 'node' from 'input' and store the
+	*  region in 'roi'. The input is clamped to what 'input'
+	*  covers in case the arguments of the plugin changed after
+	*  the run began. Returns a pointer to the cropped image or
+	*  a NULL pointer on failure.
+	*/
+	PLUGIN *plugin = plugin_pipeline_get_plugin(run->graph, node);
+	IMG_RECT rel;
+
+	img_rect_clamp(&run->rois[node], input->full_w, input->full_h);
+	plugin->p_params->roi_map(plugin->ctx, plugin->params, &run->rois[node], roi);
+	img_rect_intersect(roi, &input->rect);
 
-		first = pipeline_load_cache(job, &in.src);
-		if (first < 0) {
-			printerr("Cache loading failed.\n");
-			first = 0;
+	rel = *roi;
+	rel.x -= input->rect.x;
+	rel.y -= input->rect.y;
+	return img_crop(input->img, &rel);
+}
+
+void pipeline_set_worker_id(const unsigned int worker) {
+	/*
+	*  Set the ID of the calling worker thread. Plugins get
+	*  a separate sub-context for each worker ID.
+	*/
+	pipeline_worker_id = worker;
+}
+
+PIPELINE_RUN *pipeline_run_begin(JOB *job) {
+	/*
+	*  Begin feeding 'job' to the processing pipeline. This finds
+	*  the plugins that are needed for the requested outputs of the
+	*  job, loads the up-to-date cache files among them and returns
+	*  a PIPELINE_RUN instance that is then advanced one plugin at
+	*  a time using pipeline_run_step(). Returns a NULL pointer on
+	*  failure.
+	*/
+	PIPELINE_RUN *run = NULL;
+	PLUGIN_PIPELINE *graph = NULL;
+	size_t count = 0;
+	long int v = 0;
+
+	graph = plugin_pipeline_get(job->pipeline);
+	if (!graph) {
+		printerr_va("Pipeline '%s' doesn't exist.\n", job->pipeline);
+		return NULL;
+	}
+	count = plugin_pipeline_count(graph);
+	if (count == 0) {
+		return NULL;
+	}
+
+	errno = 0;
+	run = calloc(1, sizeof(*run));
+	if (!run) {
+		printerrno("calloc()");
+		return NULL;
+	}
+	run->job = job;
+	run->graph = graph;
+	run->stage_count = count;
+	run->output_count = job->output_count ? job->output_count : 1;
+
+	errno = 0;
+	run->inputs = calloc(count, sizeof(*run->inputs));
+	run->nodes = calloc(count, sizeof(*run->nodes));
+	run->consumers = calloc(count, sizeof(*run->consumers));
+	run->bufs = calloc(count, sizeof(*run->bufs));
+	run->node_bufs = calloc(count, sizeof(*run->node_bufs));
+	run->outputs = calloc(run->output_count, sizeof(*run->outputs));
+	run->uids = calloc(count, sizeof(*run->uids));
+	run->arg_revs = calloc(count, sizeof(*run->arg_revs));
+	run->keys = calloc(count, sizeof(*run->keys));
+	run->roi_states = calloc(count, sizeof(*run->roi_states));
+	run->rois = calloc(count, sizeof(*run->rois));
+	if (!run->inputs || !run->nodes || !run->consumers || !run->bufs ||
+		!run->node_bufs || !run->outputs || !run->uids || !run->arg_revs ||
+		!run->keys || !run->roi_states || !run->rois) {
+		printerrno("calloc()");
+		pipeline_run_free(run);
+		return NULL;
+	}
+
+	// No requested outputs means the output of the last plugin.
+	if (job->output_count == 0) {
+		run->outputs[0] = count - 1;
+	}
+	for (size_t i = 0; i < job->output_count; i++) {
+		if (job->outputs[i] >= count) {
+			printerr_va("Output plugin %zu doesn't exist.\n", job->outputs[i]);
+			pipeline_run_free(run);
+			return NULL;
 		}
+		run->outputs[i] = job->outputs[i];
+	}
 
-		for (size_t i = first; i < plugins_get_count(); i++) {
-			pipeline_cputime();
-			printverb_va("Feeding image data to plugin %zu.\n", i);
+	// Start from the plugin config of the previous run.
+	for (size_t i = 0; i < count; i++) {
+		run->inputs[i] = plugin_pipeline_get_plugin(graph, i)->input;
+		if (i < job->prev_plugin_count) {
+			run->uids[i] = job->prev_plugin_uids[i];
+			run->arg_revs[i] = job->prev_plugin_arg_revs[i];
+		} else {
+			run->arg_revs[i] = PIPELINE_REV_INVALID;
+		}
+	}
+
+	job->status = JOB_STATUS_FAIL;
 
-			in.args = plugin_get(i)->args->ptrs;
-			in.argc = plugin_get(i)->args->ptrc/2; // ptrc/2 since an arg is a pair of strings.
+	run->in.set_progress = &pipeline_update_progress;
+	run->in.is_cancelled = &pipeline_is_cancelled;
+	run->in.parallel_for = &taskpool_parallel_for;
+	if (pipeline_setup_scale(run) != 0) {
+		pipeline_run_free(run);
+		return NULL;
+	}
+	run->in.scale = run->scale;
+	pipeline_buf_set_full(&run->src_buf);
 
-			// Update status data.
-			pipeline_status.progress = 0;
-			pipeline_status.c_plugin = plugin_get(i);
-			pipeline_status.c_job = job;
-			pipeline_call_status_callbacks();
+	// Preview runs have no source key, so they aren't cached.
+	if (!run->preview) {
+		run->src_buf.key = job->src_key;
+	}
+	pipeline_plan_keys(graph, run->inputs, &run->src_buf.key, run->keys);
 
-			// Feed the image data to individual plugins.
-			if (plugin_feed(i, &in) != PLUGIN_STATUS_DONE) {
-				printerr_va("Failed to use plugin %zu.\n", i);
-				continue;
+	/*
+	*  Walk the graph from each output towards the source image.
+	*  The walk stops at the first plugin with an up-to-date cache
+	*  file or at a plugin that's already needed by another output,
+	*  so shared plugins are only run once.
+	*/
+	for (size_t i = 0; i < run->output_count; i++) {
+		v = run->outputs[i];
+		while (v != PLUGIN_INPUT_SRC && run->nodes[v] == PIPELINE_NODE_UNUSED) {
+			if (!run->preview && pipeline_node_valid(run, v) &&
+				pipeline_load_cache(run, v, &run->bufs[v].img) == 0) {
+				run->nodes[v] = PIPELINE_NODE_CACHED;
+				run->node_bufs[v] = &run->bufs[v];
+				run->bufs[v].key = run->keys[v];
+				pipeline_buf_set_full(&run->bufs[v]);
+				break;
 			}
+			run->nodes[v] = PIPELINE_NODE_RUN;
+			v = run->inputs[v];
+		}
+	}
+
+	// Count the consumers of each output buffer.
+	for (size_t i = 0; i < count; i++) {
+		if (run->nodes[i] == PIPELINE_NODE_RUN &&
+			run->inputs[i] != PLUGIN_INPUT_SRC) {
+			run->consumers[run->inputs[i]]++;
+		}
+	}
+	for (size_t i = 0; i < run->output_count; i++) {
+		run->consumers[run->outputs[i]]++;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (run->nodes[i] == PIPELINE_NODE_CACHED) {
+			run->bufs[i].refs = run->consumers[i];
+		}
+	}
+
+	pipeline_roi_propagate(run);
+
+	pipeline_report_reg(run);
+	return run;
+}
+
+void pipeline_prefetch(JOB *job) {
+	/*
+	*  Request the prefetching of the cache files that 'job' would
+	*  resume from if it was started now. This walks the graph like
+	*  pipeline_run_begin() does. The pipeline lock must be held by
+	*  the caller.
+	*/
+	PLUGIN_PIPELINE *graph = NULL;
+	CACHE_KEY *keys = NULL;
+	PLUGIN *plugin = NULL;
+	char *visited = NULL;
+	size_t count = 0;
+	size_t output = 0;
+	long int v = 0;
+
+	graph = plugin_pipeline_get(job->pipeline);
+	if (!graph || job->preview_scale < 1.0f || !job->src_key.str[0]) {
+		return;
+	}
+	count = plugin_pipeline_count(graph);
+	if (count == 0) {
+		return;
+	}
 
-			// Calculate elapsed time and throughput.
-			t_delta = pipeline_cputime();
-			throughput = round(img_bytelen(in.src)/t_delta);
-			printverb_va("Took %f CPU seconds. Throughput %zu B/s.\n",
-					t_delta, throughput);
+	errno = 0;
+	keys = calloc(count, sizeof(*keys));
+	visited = calloc(count, sizeof(*visited));
+	if (!keys || !visited) {
+		printerrno("calloc()");
+		free(keys);
+		free(visited);
+		return;
+	}
+	pipeline_plan_keys(graph, NULL, &job->src_key, keys);
 
-			// Save a copy of the result into the cache file.
-			if (pipeline_write_cache(job, i, in.dst) != 0) {
-				printerr("Failed to write cache file.\n");
+	for (size_t i = 0; i < (job->output_count ? job->output_count : 1); i++) {
+		output = job->output_count ? job->outputs[i] : count - 1;
+		if (output >= count) {
+			continue;
+		}
+		for (v = output; v != PLUGIN_INPUT_SRC && !visited[v]; v = plugin->input) {
+			visited[v] = 1;
+			plugin = plugin_pipeline_get_plugin(graph, v);
+			if (keys[v].str[0] && cache_lookup(plugin->p_cache, keys[v].str)) {
+				prefetch_request(keys[v].str, job->job_id);
+				break;
 			}
+		}
+	}
+	free(keys);
+	free(visited);
+}
+
+int pipeline_run_step(PIPELINE_RUN *run) {
+	/*
+	*  Feed the image data of 'run' to the next plugin that needs
+	*  to be run. Returns PIPELINE_RUN_CONTINUE if there are plugins
+	*  left to run, PIPELINE_RUN_DONE once every plugin has been run
+	*  and PIPELINE_RUN_ERROR on failure.
+	*/
+	PIPELINE_BUF *input = NULL;
+	PLUGIN *plugin = NULL;
+	IMAGE *roi_img = NULL;
+	IMAGE *tmp_img = NULL;
+	PERFCTR_SINK *perf = NULL;
+	IMG_RECT rel;
+	CACHE_KEY key;
+	struct timespec t_start;
+	struct timespec t_end;
+	double cost = 0;
+	double mpix = 0;
+	size_t throughput = 0;
+	size_t src_bytes = 0;
+	size_t i = 0;
+	int status = PLUGIN_STATUS_ERROR;
+	int ready = 0;
+
+	if (run->cancel && atomic_load(run->cancel)) {
+		printverb_va("Job '%s' cancelled.\n", run->job->job_id);
+		run->ret = 1;
+	}
+	if (run->ret != 0) {
+		return PIPELINE_RUN_ERROR;
+	}
+
+	while (run->stage < run->stage_count &&
+		run->nodes[run->stage] != PIPELINE_NODE_RUN) {
+		run->stage++;
+	}
+	if (run->stage >= run->stage_count) {
+		return PIPELINE_RUN_DONE;
+	}
+	i = run->stage++;
+	plugin = plugin_pipeline_get_plugin(run->graph, i);
+
+	if (run->inputs[i] == PLUGIN_INPUT_SRC) {
+		input = &run->src_buf;
+	} else {
+		input = run->node_bufs[run->inputs[i]];
+	}
+
+	// Make room for the output of the plugin if memory is short.
+	if (input->img) {
+		memgov_relieve(img_bytelen(input->img));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	printverb_va("Feeding image data to plugin %zu.\n", i);
+
+	/*
+	*  Record the plugin config that is actually used for this
+	*  plugin since the config might change between steps. The
+	*  graph of the run can't change, so if the input of the plugin
+	*  was changed the result is recorded as outdated.
+	*/
+	run->uids[i] = plugin->uid;
+	run->arg_revs[i] = plugin->arg_rev;
+	if (plugin->input != run->inputs[i]) {
+		run->arg_revs[i] = PIPELINE_REV_INVALID;
+	}
+
+	/*
+	*  Key the output by the arguments it's computed with. Worker
+	*  processes release the pipeline lock during the feed, so the
+	*  arguments may have changed by the time the plugin returns.
+	*/
+	pipeline_node_key(plugin, &input->key, &key);
+
+	run->in.args = plugin->args->ptrs;
+	run->in.argc = plugin->args->ptrc/2; // ptrc/2 since an arg is a pair of strings.
+
+	/*
+	*  Compile the typed arguments if they changed since the last
+	*  feed. Worker processes have worker contexts of their own.
+	*/
+	ready = plugin_prepare(plugin) == 0 && (workers_count() ||
+		plugin_get_worker_ctx(plugin, pipeline_worker_id,
+					&run->in.worker_ctx) == 0);
+
+	/*
+	*  Only feed the input region that's needed for the region of
+	*  interest if the plugin can map its output region to an input
+	*  region. Otherwise the plugin gets its whole input.
+	*/
+	run->in.roi = input->rect;
+	run->in.full_w = input->full_w;
+	run->in.full_h = input->full_h;
+	if (ready && run->roi_states[i] == PIPELINE_ROI_RECT &&
+		plugin->p_params->roi_map) {
+		roi_img = pipeline_roi_input(run, i, input, &run->in.roi);
+		ready = roi_img != NULL;
+	}
+
+	run->in.src = roi_img ? roi_img : input->img;
+	src_bytes = img_bytelen(run->in.src);
+	run->in.dst = img_alloc(0, 0);
+	if (!run->in.dst) {
+		if (roi_img) {
+			img_free(roi_img);
+		}
+		run->ret = 1;
+		return PIPELINE_RUN_ERROR;
+	}
+
+	// Publish the plugin for the progress reporter.
+	atomic_store_explicit(&run->c_plugin, plugin, memory_order_relaxed);
+	atomic_store_explicit(&run->progress, 0, memory_order_relaxed);
+	atomic_fetch_add_explicit(&run->seq, 1, memory_order_release);
 
-			// Free in.src if it doesn't point to the original image.
-			if (in.src != job->src_img) {
-				img_free(in.src);
+	// Feed the image data to the plugin.
+	if (ready) {
+		run->in.arg_vals = plugin->arg_vals;
+		run->in.arg_vals_count = plugin->p_params->arg_schema_count;
+		run->in.params = plugin->params;
+		run->in.ctx = plugin->ctx;
+
+		pipeline_current_run = run;
+		trace_begin("plugin_process", plugin->p_params->name);
+		if (workers_count()) {
+			status = worker_feed(pipeline_worker_id, plugin, &run->in);
+		} else {
+			// Count the hardware events of the plugin code.
+			if (perfctr_enabled() && !plugin->perf) {
+				plugin->perf = perfctr_sink_create();
+			}
+			perf = perfctr_switch(plugin->perf);
+			status = plugin_feed_instance(plugin, &run->in);
+			perfctr_switch(perf);
+			if (plugin->perf) {
+				atomic_fetch_add_explicit(&plugin->perf->runs, 1,
+							memory_order_relaxed);
 			}
+		}
+		trace_end("plugin_process");
+		pipeline_current_run = NULL;
+	}
+	if (roi_img) {
+		img_free(roi_img);
+		run->in.src = NULL;
+	}
 
-			in.src = in.dst;
-			in.dst = img_alloc(0, 0);
-			if (!in.dst) {
-				img_free(in.src);
-				return 1;
+	if (run->cancel && atomic_load(run->cancel)) {
+		// The output of a cancelled plugin can't be trusted.
+		printverb_va("Job '%s' cancelled.\n", run->job->job_id);
+		run->ret = 1;
+		return PIPELINE_RUN_ERROR;
+	} else if (status != PLUGIN_STATUS_DONE) {
+		// Pass the input through a failed plugin.
+		printerr_va("Failed to use plugin %zu.\n", i);
+		img_free(run->in.dst);
+		run->arg_revs[i] = PIPELINE_REV_INVALID;
+		run->node_bufs[i] = input;
+	} else {
+		atomic_fetch_add_explicit(&run->seq_done, 1, memory_order_release);
+
+		/*
+		*  Calculate the elapsed time and the throughput. The time
+		*  is measured by this run only, since the other runs and
+		*  the pool threads share the CPU time of the process.
+		*/
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		cost = (t_end.tv_sec - t_start.tv_sec) +
+			(t_end.tv_nsec - t_start.tv_nsec)/1e9;
+		if (cost > 0) {
+			throughput = round(src_bytes/cost);
+		}
+		printverb_va("Took %f seconds. Throughput %zu B/s.\n",
+				cost, throughput);
+
+		/*
+		*  Average the compute time per megapixel of output so that
+		*  a single slow run doesn't decide whether to cache.
+		*/
+		mpix = (double) run->in.dst->w*run->in.dst->h/1e6;
+		if (mpix > 0) {
+			if (plugin->mpix_avg) {
+				plugin->time_avg += (cost - plugin->time_avg)*
+							PIPELINE_EWMA_WEIGHT;
+				plugin->mpix_avg += (mpix - plugin->mpix_avg)*
+							PIPELINE_EWMA_WEIGHT;
+			} else {
+				plugin->time_avg = cost;
+				plugin->mpix_avg = mpix;
 			}
+			plugin->mpix_time = plugin->time_avg/plugin->mpix_avg;
+			cost = plugin->mpix_time*mpix;
 		}
+		run->bufs[i].cost = cost + input->cost;
 
-		if (img_realloc(job->result_img, in.src->w, in.src->h) == 0) {
-			img_cpy(job->result_img, in.src);
-			job->status = JOB_STATUS_SUCCESS;
+		run->bufs[i].img = run->in.dst;
+		run->node_bufs[i] = &run->bufs[i];
+		if (roi_img) {
+			/*
+			*  Cut the output down to the region that's needed.
+			*  A partial output can't be cached, so it's recorded
+			*  as outdated.
+			*/
+			run->arg_revs[i] = PIPELINE_REV_INVALID;
+			img_rect_intersect(&run->rois[i], &run->in.roi);
+			rel = run->rois[i];
+			rel.x -= run->in.roi.x;
+			rel.y -= run->in.roi.y;
+			if (rel.x || rel.y || rel.w != run->in.dst->w ||
+				rel.h != run->in.dst->h) {
+				tmp_img = img_crop(run->in.dst, &rel);
+				if (!tmp_img) {
+					// The output is freed with the buffer.
+					run->in.dst = NULL;
+					run->ret = 1;
+					return PIPELINE_RUN_ERROR;
+				}
+				img_free(run->in.dst);
+				run->bufs[i].img = tmp_img;
+			}
+			run->bufs[i].rect = run->rois[i];
+			run->bufs[i].full_w = input->full_w;
+			run->bufs[i].full_h = input->full_h;
 		} else {
+			/*
+			*  Save a copy of the result into the cache file if
+			*  it pays off. The key is needed for the keys of the
+			*  plugins after this one even if it isn't cached.
+			*/
+			run->bufs[i].key = key;
+			if (run->bufs[i].key.str[0] &&
+				pipeline_should_cache(plugin, run->in.dst, run->bufs[i].cost)) {
+				if (pipeline_write_cache(run, i, run->in.dst,
+							run->bufs[i].cost) != 0) {
+					printerr("Failed to write cache file.\n");
+				} else {
+					run->bufs[i].cost = 0;
+				}
+				plugin->cache_writes++;
+			} else if (run->bufs[i].key.str[0]) {
+				plugin->cache_skips++;
+			}
+			pipeline_buf_set_full(&run->bufs[i]);
+		}
+	}
+	run->in.src = NULL;
+	run->in.dst = NULL;
+
+	// Pass the output on and release the input.
+	run->node_bufs[i]->refs += run->consumers[i];
+	pipeline_buf_release(run, input);
+
+	for (size_t n = run->stage; n < run->stage_count; n++) {
+		if (run->nodes[n] == PIPELINE_NODE_RUN) {
+			return PIPELINE_RUN_CONTINUE;
+		}
+	}
+	return PIPELINE_RUN_DONE;
+}
+
+static int pipeline_copy_output(PIPELINE_RUN *run, const size_t node, IMAGE *dst) {
+	/*
+	*  Copy the output of the plugin 'node' into 'dst'. Only the
+	*  region of interest of the job is copied if it has one.
+	*/
+	const PIPELINE_BUF *buf = run->node_bufs[node];
+	const IMAGE *src = buf->img;
+	IMAGE *tmp = NULL;
+	IMG_RECT rect = buf->rect;
+
+	if (run->has_roi) {
+		img_rect_intersect(&rect, &run->roi);
+	}
+	if (img_rect_eq(&rect, &buf->rect)) {
+		if (img_realloc(dst, src->w, src->h) != 0) {
+			return 1;
+		}
+		img_cpy(dst, src);
+		return 0;
+	}
+
+	rect.x -= buf->rect.x;
+	rect.y -= buf->rect.y;
+	tmp = img_crop(src, &rect);
+	if (!tmp || img_realloc(dst, tmp->w, tmp->h) != 0) {
+		if (tmp) {
+			img_free(tmp);
+		}
+		return 1;
+	}
+	img_cpy(dst, tmp);
+	img_free(tmp);
+	return 0;
+}
+
+int pipeline_run_end(PIPELINE_RUN *run) {
+	/*
+	*  Finish a PIPELINE_RUN and free it. The requested outputs are
+	*  put into the output images of the job and the first one into
+	*  run->job->result_img. Returns 0 on success and 1 on failure.
+	*/
+	JOB *job = run->job;
+	IMAGE *img = NULL;
+	long int v = 0;
+	int ret = run->ret;
+
+	pipeline_report_unreg(run);
+	if (ret == 0) {
+		job_discard_spilled_result(job);
+		if (pipeline_copy_output(run, run->outputs[0], job->result_img) != 0) {
 			ret = 1;
 		}
+		for (size_t i = 0; i < run->output_count; i++) {
+			img = job_get_output(job, run->outputs[i]);
+			if (img && img != job->result_img &&
+				pipeline_copy_output(run, run->outputs[i], img) != 0) {
+				ret = 1;
+			}
+		}
 
-		// Cleanup
-		if (in.src != job->src_img) {
-			img_free(in.src);
+		/*
+		*  The cache files of the plugins that weren't run are
+		*  outdated if a plugin they take their input from was run.
+		*/
+		for (size_t i = 0; i < run->stage_count; i++) {
+			if (run->nodes[i] == PIPELINE_NODE_RUN) {
+				continue;
+			}
+			for (v = run->inputs[i]; v != PLUGIN_INPUT_SRC; v = run->inputs[v]) {
+				if (run->nodes[v] == PIPELINE_NODE_RUN) {
+					run->arg_revs[i] = PIPELINE_REV_INVALID;
+					break;
+				}
+			}
 		}
-		img_free(in.dst);
 
-		// Update the plugin argument revisions and UIDs on success.
-		if (job_store_plugin_config(job) != 0) {
+		/*
+		*  Update the plugin argument revisions and UIDs. Preview
+		*  runs leave the cache files and the config alone.
+		*/
+		job->result_scale = run->scale;
+		if (!run->preview && job_set_plugin_config(job, run->uids, run->arg_revs,
+						run->stage_count) != 0) {
 			printerr("Failed to store plugin config in the job.\n");
 			ret = 1;
 		}
-		return ret;
+		if (ret == 0) {
+			job->status = JOB_STATUS_SUCCESS;
+		}
+	} else if (run->cancel && atomic_load(run->cancel)) {
+		job->status = JOB_STATUS_CANCELLED;
 	}
-	return 1;
+
+	pipeline_run_free(run);
+	return ret;
+}
+
+int pipeline_feed(JOB *job) {
+	/*
+	*  Feed a processing job to the processing pipeline.
+	*  The result is put into job->result_img.
+	*  This function returns 0 on success and 1 on failure.
+	*/
+	PIPELINE_RUN *run = NULL;
+
+	run = pipeline_run_begin(job);
+	if (!run) {
+		return 1;
+	}
+	while (pipeline_run_step(run) == PIPELINE_RUN_CONTINUE);
+	return pipeline_run_end(run);
+}
+
+PIPELINE_HANDLE *pipeline_submit(JOB *job) {
+	/*
+	*  Submit 'job' to the pipeline without waiting for it to
+	*  finish. The job is run by the scheduler and the result is
+	*  put into job->result_img. The returned handle must be
+	*  released using pipeline_release() once it's not needed
+	*  anymore. Returns a NULL pointer on failure.
+	*/
+	return scheduler_submit(job);
+}
+
+int pipeline_wait(PIPELINE_HANDLE *handle) {
+	/*
+	*  Wait until the job of 'handle' has finished. Returns one of
+	*  PIPELINE_HANDLE_SUCCESS, PIPELINE_HANDLE_FAIL and
+	*  PIPELINE_HANDLE_CANCELLED.
+	*/
+	return scheduler_wait(handle);
+}
+
+int pipeline_poll(PIPELINE_HANDLE *handle) {
+	/*
+	*  Return the current PIPELINE_HANDLE_* state of 'handle'
+	*  without blocking.
+	*/
+	return scheduler_poll(handle);
+}
+
+int pipeline_cancel(PIPELINE_HANDLE *handle) {
+	/*
+	*  Cancel the job of 'handle'. A queued job is dropped and a
+	*  running job is stopped at the next plugin boundary or when
+	*  the running plugin notices the cancellation. Use
+	*  pipeline_wait() to wait for the job to actually stop.
+	*  Returns 0 on success and 1 if the job has already finished.
+	*/
+	return scheduler_cancel(handle);
+}
+
+int pipeline_on_done(PIPELINE_HANDLE *handle,
+		void (*const callback)(JOB *job, const int state, void *arg),
+		void *arg) {
+	/*
+	*  Set a callback that's called with the final PIPELINE_HANDLE_*
+	*  state once the job of 'handle' finishes. The callback is
+	*  called from the scheduler thread or immediately if the job
+	*  has already finished. Returns 0 on success and 1 on failure.
+	*/
+	return scheduler_on_done(handle, callback, arg);
+}
+
+void pipeline_release(PIPELINE_HANDLE *handle) {
+	/*
+	*  Release a handle returned by pipeline_submit(). The job
+	*  itself keeps running if it hasn't finished yet.
+	*/
+	scheduler_release(handle);
+}
+
+int pipeline_setup(void) {
+	/*
+	*  Setup the pipeline and start the progress reporter
+	*  thread. Returns 0 on success and 1 on failure.
+	*/
+	int ret = 0;
+
+	printverb("Setup.\n");
+	report_ms = config_get_lint_param("progress_report_ms");
+	if (report_ms <= 0) {
+		report_ms = PIPELINE_DEFAULT_REPORT_MS;
+	}
+	printverb_va("Progress report interval: %li ms.\n", report_ms);
+
+	report_runs = (PTRARRAY_TYPE(PIPELINE_RUN)*) ptrarray_create(NULL);
+	if (!report_runs) {
+		return 1;
+	}
+
+	report_stop = 0;
+	ret = pthread_create(&report_thread, NULL, &pipeline_reporter, NULL);
+	if (ret != 0) {
+		errno = ret;
+		printerrno("pthread_create()");
+		ptrarray_free((PTRARRAY_TYPE(void)*) report_runs);
+		report_runs = NULL;
+		return 1;
+	}
+	report_thread_running = 1;
+	return 0;
 }
 
 void pipeline_cleanup(void) {
 	printverb("Cleanup.\n");
+	if (report_thread_running) {
+		pthread_mutex_lock(&report_mutex);
+		report_stop = 1;
+		pthread_cond_signal(&report_cond);
+		pthread_mutex_unlock(&report_mutex);
+		pthread_join(report_thread, NULL);
+		report_thread_running = 0;
+	}
+	if (report_runs) {
+		ptrarray_free((PTRARRAY_TYPE(void)*) report_runs);
+		report_runs = NULL;
+	}
 	if (status_callbacks.funcs) {
 		free(status_callbacks.funcs);
 		status_callbacks.funcs = NULL;
@@ -0,0 +1,128 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef INCLUDED_PIPELINE_PRIV
+	#define INCLUDED_PIPELINE_PRIV
+
+	#include <stdatomic.h>
+	#include <limits.h>
+
+	#include "oipcore/pipeline.h"
+
+	#define PIPELINE_RUN_ERROR    -1
+	#define PIPELINE_RUN_CONTINUE  0
+	#define PIPELINE_RUN_DONE      1
+
+	// The state of a plugin node in a PIPELINE_RUN.
+	#define PIPELINE_NODE_UNUSED   0
+	#define PIPELINE_NODE_RUN      1
+	#define PIPELINE_NODE_CACHED   2
+
+	// The region of a plugin output that's needed in a PIPELINE_RUN.
+	#define PIPELINE_ROI_NONE      0
+	#define PIPELINE_ROI_RECT      1
+	#define PIPELINE_ROI_FULL      2
+
+	// An argument revision that never matches a plugin.
+	#define PIPELINE_REV_INVALID   ULLONG_MAX
+
+	/*
+	*  A reference counted image buffer of a plugin output. The
+	*  image is freed once every plugin that takes it as its
+	*  input has been run. 'rect' is the region of the full
+	*  'full_w'x'full_h' plugin output that 'img' covers. 'key' is
+	*  the cache key of the full output or empty if it can't be
+	*  cached. 'cost' is the estimated time in seconds it takes to
+	*  compute the image again from the closest cache file.
+	*/
+	typedef struct STRUCT_PIPELINE_BUF {
+		IMAGE *img;
+		CACHE_KEY key;
+		double cost;
+		unsigned int refs;
+		IMG_RECT rect;
+		uint32_t full_w;
+		uint32_t full_h;
+	} PIPELINE_BUF;
+
+	/*
+	*  The state of a job that is being fed through the pipeline. This
+	*  makes it possible to interleave the plugins of multiple jobs.
+	*  'graph' is the pipeline of the job when the run begins and its
+	*  plugin graph is copied into 'inputs'. 'nodes' holds the
+	*  PIPELINE_NODE_* state of each plugin and 'node_bufs' points to
+	*  the output buffer of each plugin. 'roi_states' holds the
+	*  PIPELINE_ROI_* state of each plugin and 'rois' the region of
+	*  the plugin output that's needed by the plugins after it. 'roi'
+	*  is the region of interest of the job at the 'scale' of the run.
+	*  The results of 'preview' runs aren't cached. 'keys' holds the
+	*  cache keys of the plugin outputs if the plugins are run with
+	*  their arguments at the beginning of the run. 'cancel' can be
+	*  pointed to a flag that is set when the run should be aborted.
+	*
+	*  The progress fields are written by the thread that runs
+	*  the plugins and sampled by the progress reporter thread.
+	*  The r_* fields are only touched by the reporter.
+	*/
+	typedef struct STRUCT_PIPELINE_RUN {
+		JOB *job;
+		PLUGIN_PIPELINE *graph;
+		struct PLUGIN_INDATA in;
+		size_t stage;
+		size_t stage_count;
+		long int *inputs;
+		int *nodes;
+		unsigned int *consumers;
+		PIPELINE_BUF *bufs;
+		PIPELINE_BUF **node_bufs;
+		PIPELINE_BUF src_buf;
+		CACHE_KEY *keys;
+		int *roi_states;
+		IMG_RECT *rois;
+		IMG_RECT roi;
+		int has_roi;
+		float scale;
+		int preview;
+		size_t *outputs;
+		size_t output_count;
+		unsigned long long int *uids;
+		unsigned long long int *arg_revs;
+		const atomic_int *cancel;
+		int ret;
+
+		PLUGIN *_Atomic c_plugin;
+		atomic_uint progress;
+		atomic_size_t seq;
+		atomic_size_t seq_done;
+
+		size_t r_seq;
+		PLUGIN *r_plugin;
+		unsigned int r_progress;
+		int finished;
+		int reaped;
+	} PIPELINE_RUN;
+
+	void pipeline_set_worker_id(const unsigned int worker);
+	PIPELINE_RUN *pipeline_run_begin(JOB *job);
+	void pipeline_prefetch(JOB *job);
+	int pipeline_run_step(PIPELINE_RUN *run);
+	int pipeline_run_end(PIPELINE_RUN *run);
+#endif
@@ -31,24 +31,114 @@
 
 #include "oipcore/abi/output.h"
 #include "oipcore/plugin.h"
-#include "oipcore/plugin.h"
 #include "oipcore/cache.h"
+#include "oipcore/pipeline.h"
+#include "oipcore/hashmap.h"
 #include "oipcore/file.h"
 #include "oipcore/strutils.h"
 #include "oipbuildinfo/oipbuildinfo.h"
 
 #include "cli_priv.h"
+#include "plugin_args_priv.h"
+#include "configloader_priv.h"
+#include "perfctr_priv.h"
+
+// A worker sub-context of a plugin instance.
+typedef struct STRUCT_PLUGIN_WORKER_CTX {
+	void *ctx;
+} PLUGIN_WORKER_CTX;
+
+// Plugin libraries by path and pipelines by name.
+static HASHMAP *plugin_libs = NULL;
+static HASHMAP *plugin_pipelines = NULL;
 
-PTRARRAY_TYPE_DEF(PLUGIN);
+// The selected pipeline and its plugins.
+static PLUGIN_PIPELINE *plugin_cur_pipeline = NULL;
+static PTRARRAY_TYPE(PLUGIN) *plugins = NULL;
 
-PTRARRAY_TYPE(PLUGIN) *plugins = NULL;
 static unsigned long long int plugin_last_uid = 0;
 
+static const char *plugin_cache_policy_names[] = { "auto", "always", "never" };
+
 static unsigned int plugin_gen_uid_int(void);
 static char *plugin_get_uid_str(PLUGIN *plugin);
 static int plugin_data_append(PLUGIN *plugin);
+static int plugin_index_valid_args(PLUGIN *plugin);
+static void plugin_lib_free(PLUGIN_LIB *lib);
+static int plugin_load_unlocked(const char *dirpath, const char *name);
+static int plugin_set_arg_unlocked(const size_t index, char *arg, char *value);
+static void plugin_unprepare(PLUGIN *plugin);
+static int plugin_instance_create(PLUGIN *plugin);
+static void plugin_instance_destroy(PLUGIN *plugin);
 static void plugin_free(PLUGIN *plugin);
 static void plugin_free_wrapper(void *plugin);
+static void plugin_pipeline_free(PLUGIN_PIPELINE *pipeline);
+static int plugin_cache_policy_parse(const char *str, int *policy);
+static int plugin_get_cache_policy(const char *name, int *policy);
+
+static int plugin_cache_policy_parse(const char *str, int *policy) {
+	/*
+	*  Parse the cache policy name 'str' into '*policy'.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	for (int i = PLUGIN_CACHE_AUTO; i <= PLUGIN_CACHE_NEVER; i++) {
+		if (strcmp(str, plugin_cache_policy_names[i]) == 0) {
+			*policy = i;
+			return 0;
+		}
+	}
+	printerr_va("Invalid cache policy '%s'.\n", str);
+	return 1;
+}
+
+static int plugin_get_cache_policy(const char *name, int *policy) {
+	/*
+	*  Get the cache policy of the plugin 'name' from the config
+	*  parameter 'cache_policy' into '*policy'. The parameter is a
+	*  comma separated list of policies. A bare policy is the
+	*  default and '<plugin>:<policy>' overrides it for a plugin,
+	*  eg. 'auto,lut:never,denoise:always'. The default is 'auto'.
+	*  With a NULL 'name' the parameter is only validated. Returns
+	*  0 on success and 1 on failure.
+	*/
+	const char *param = NULL;
+	char *str = NULL;
+	char *save = NULL;
+	char *sep = NULL;
+	int def = PLUGIN_CACHE_AUTO;
+	int named = -1;
+	int tmp = 0;
+	int ret = 0;
+
+	param = config_get_str_param("cache_policy");
+	if (!param) {
+		*policy = def;
+		return 0;
+	}
+
+	errno = 0;
+	str = strdup(param);
+	if (!str) {
+		printerrno("strdup()");
+		return 1;
+	}
+	for (char *tok = strtok_r(str, ",", &save); tok && !ret;
+			tok = strtok_r(NULL, ",", &save)) {
+		sep = strchr(tok, ':');
+		if (!sep) {
+			ret = plugin_cache_policy_parse(tok, &def);
+			continue;
+		}
+		*sep = '\0';
+		ret = plugin_cache_policy_parse(sep + 1, &tmp);
+		if (!ret && name && strcmp(tok, name) == 0) {
+			named = tmp;
+		}
+	}
+	free(str);
+	*policy = named != -1 ? named : def;
+	return ret;
+}
 
 static unsigned int plugin_gen_uid_int(void) {
 	return plugin_last_uid++;
@@ -66,18 +156,205 @@ static int plugin_data_append(PLUGIN *plugin) {
 	return 0;
 }
 
+static int plugin_index_valid_args(PLUGIN *plugin) {
+	/*
+	*  Create the valid argument and argument value indexes
+	*  of 'plugin'. Returns 0 on success and 1 on failure.
+	*/
+	plugin->arg_index = hashmap_create(HASHMAP_KEY_STR, NULL);
+	if (!plugin->arg_index) {
+		return 1;
+	}
+
+	plugin->valid_args = hashmap_create(HASHMAP_KEY_STR, NULL);
+	if (!plugin->valid_args) {
+		hashmap_destroy(plugin->arg_index, 0);
+		plugin->arg_index = NULL;
+		return 1;
+	}
+
+	for (size_t i = 0; i < plugin->p_params->valid_args_count; i++) {
+		if (hashmap_put_str(plugin->valid_args, plugin->p_params->valid_args[i],
+					HASHMAP_IDX_TO_VAL(i)) != 0) {
+			hashmap_destroy(plugin->arg_index, 0);
+			hashmap_destroy(plugin->valid_args, 0);
+			plugin->arg_index = NULL;
+			plugin->valid_args = NULL;
+			return 1;
+		}
+	}
+
+	// The arguments in the schema are valid too.
+	for (size_t i = 0; i < plugin->p_params->arg_schema_count; i++) {
+		if (hashmap_put_str(plugin->valid_args, plugin->p_params->arg_schema[i].name,
+					HASHMAP_IDX_TO_VAL(i)) != 0) {
+			hashmap_destroy(plugin->arg_index, 0);
+			hashmap_destroy(plugin->valid_args, 0);
+			plugin->arg_index = NULL;
+			plugin->valid_args = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+PLUGIN_LIB *plugin_lib_open(const char *path, const char *name) {
+	/*
+	*  Open the plugin shared library at 'path' or return the
+	*  already opened library if one exists. The plugin setup
+	*  function is only run when the library is first opened.
+	*  Returns a pointer to the PLUGIN_LIB on success or a NULL
+	*  pointer on failure.
+	*/
+	PLUGIN_LIB *lib = NULL;
+	char *info_struct_name = NULL;
+	char *dlret = NULL;
+	int ret = 0;
+
+	lib = hashmap_get_str(plugin_libs, path);
+	if (lib) {
+		printverb_va("Plugin library %s already loaded.\n", path);
+		lib->refs++;
+		return lib;
+	}
+
+	if (access(path, F_OK) != 0) {
+		printerr("Plugin doesn't exist.\n");
+		return NULL;
+	}
+
+	errno = 0;
+	lib = calloc(1, sizeof(*lib));
+	if (!lib) {
+		printerrno("calloc()");
+		return NULL;
+	}
+
+	errno = 0;
+	lib->path = strdup(path);
+	if (!lib->path) {
+		printerrno("strdup()");
+		free(lib);
+		return NULL;
+	}
+
+	errno = 0;
+	lib->name = strdup(name);
+	if (!lib->name) {
+		printerrno("strdup()");
+		plugin_lib_free(lib);
+		return NULL;
+	}
+
+	// Load the shared library file.
+	lib->handle = dlopen(path, RTLD_NOW);
+	if (!lib->handle) {
+		printerr_va("dlopen(): %s\n", dlerror());
+		plugin_lib_free(lib);
+		return NULL;
+	}
+
+	// Construct the plugin info struct name.
+	info_struct_name = strutils_cat(2, "", name, PLUGIN_INFO_NAME_SUFFIX);
+	if (!info_struct_name) {
+		plugin_lib_free(lib);
+		return NULL;
+	}
+
+	// Store the plugin parameter pointer in lib->p_params.
+	dlerror();
+	lib->p_params = dlsym(lib->handle, info_struct_name);
+	free(info_struct_name);
+	dlret = dlerror();
+	if (dlret) {
+		printerr_va("dlsym(): %s\n", dlret);
+		plugin_lib_free(lib);
+		return NULL;
+	}
+
+	// Check for build mismatches.
+	ret = build_compare_critical(lib->p_params->built_against, &OIP_BUILD_INFO);
+	if (ret != BUILD_MATCH) {
+		if (ret == BUILD_MISMATCH_ABI) {
+			printerr_va("ABI version mismatch! %i vs. %i\n",
+				lib->p_params->built_against->abi, OIP_BUILD_INFO.abi);
+		} else if (ret == BUILD_MISMATCH_DEBUG) {
+			printerr("Debug build mismatch!");
+			if (lib->p_params->built_against->debug) {
+				fprintf(print_stdout, " (Plugin: Debug) vs.");
+			} else {
+				fprintf(print_stdout, " (Plugin: Non-debug) vs.");
+			}
+			if (OIP_BUILD_INFO.debug) {
+				fprintf(print_stdout, " (OIP: Debug)\n");
+			} else {
+				fprintf(print_stdout, " (OIP: Non-debug)\n");
+			}
+		}
+		plugin_lib_free(lib);
+		return NULL;
+	}
+
+	if (hashmap_put_str(plugin_libs, path, lib) != 0) {
+		printerr("Failed to register plugin library.\n");
+		plugin_lib_free(lib);
+		return NULL;
+	}
+	lib->refs = 1;
+
+	// Set the flag_print_verbose value of the plugin.
+	if (lib->p_params->flag_print_verbose) {
+		*lib->p_params->flag_print_verbose = cli_get_opts()->opt_verbose;
+	}
+
+	// Run the setup function.
+	lib->p_params->plugin_setup();
+	return lib;
+}
+
+void plugin_lib_unref(PLUGIN_LIB *lib) {
+	/*
+	*  Drop a reference to 'lib'. The plugin cleanup function
+	*  is run and the library is closed once the last plugin
+	*  instance using it is freed.
+	*/
+	if (--lib->refs) {
+		return;
+	}
+	printverb_va("Closing plugin library %s.\n", lib->path);
+	hashmap_pop_str(plugin_libs, lib->path);
+	lib->p_params->plugin_cleanup();
+	plugin_lib_free(lib);
+}
+
+static void plugin_lib_free(PLUGIN_LIB *lib) {
+	if (lib->handle) {
+		dlclose(lib->handle);
+	}
+	free(lib->path);
+	free(lib->name);
+	free(lib);
+}
+
 int plugin_load(const char *dirpath, const char *name) {
 	/*
-	*  Load plugin with 'name' from the directory 'dirpath'.
+	*  Load plugin with 'name' from the directory 'dirpath' and
+	*  append it to the selected pipeline. The plugin is appended
+	*  between the plugin steps of any running jobs.
 	*/
+	int ret = 0;
+
+	pipeline_lock();
+	ret = plugin_load_unlocked(dirpath, name);
+	pipeline_unlock();
+	return ret;
+}
 
+static int plugin_load_unlocked(const char *dirpath, const char *name) {
 	PLUGIN plugin;
 	char *cache_name = NULL;
 	char *libfname = NULL;
 	char *path = NULL;
-	char *info_struct_name = NULL;
-	char *dlret = NULL;
-	int ret = 0;
 
 	printverb_va("Loading plugin %s from directory %s.\n", name, dirpath);
 
@@ -99,122 +376,214 @@ int plugin_load(const char *dirpath, const char *name) {
 		return 1;
 	}
 
-	if (access(path, F_OK) == 0) {
-		// Load the shared library file.
-		plugin.p_handle = dlopen(path, RTLD_NOW);
-		free(path);
-		if (!plugin.p_handle) {
-			printerr_va("dlopen(): %s\n", dlerror());
-			return 1;
-		}
+	plugin.p_lib = plugin_lib_open(path, name);
+	free(path);
+	if (!plugin.p_lib) {
+		return 1;
+	}
+	plugin.p_params = plugin.p_lib->p_params;
 
-		// Construct the plugin info struct name.
-		info_struct_name = strutils_cat(2, "", name, PLUGIN_INFO_NAME_SUFFIX);
-		if (!info_struct_name) {
-			dlclose(plugin.p_handle);
-			return 1;
-		}
+	// Generate the plugin UID.
+	plugin.uid = plugin_gen_uid_int();
 
-		// Store the plugin parameter pointer in plugin.p_params.
-		dlerror();
-		plugin.p_params = dlsym(plugin.p_handle, info_struct_name);
-		free(info_struct_name);
-		dlret = dlerror();
-		if (dlret) {
-			printerr_va("dlsym(): %s\n", dlret);
-			dlclose(plugin.p_handle);
-			return 1;
-		}
+	// Plugins are chained linearly by default.
+	plugin.input = (long int) plugins->ptrc - 1;
 
-		// Check for build mismatches.
-		ret = build_compare_critical(plugin.p_params->built_against, &OIP_BUILD_INFO);
-		if (ret != BUILD_MATCH) {
-			if (ret == BUILD_MISMATCH_ABI) {
-				printerr_va("ABI version mismatch! %i vs. %i\n",
-					plugin.p_params->built_against->abi, OIP_BUILD_INFO.abi);
-			} else if (ret == BUILD_MISMATCH_DEBUG) {
-				printerr("Debug build mismatch!");
-				if (plugin.p_params->built_against->debug) {
-					printf(" (Plugin: Debug) vs.");
-				} else {
-					printf(" (Plugin: Non-debug) vs.");
-				}
-				if (OIP_BUILD_INFO.debug) {
-					printf(" (OIP: Debug)\n");
-				} else {
-					printf(" (OIP: Non-debug)\n");
-				}
-			}
-			dlclose(plugin.p_handle);
-			return 1;
-		}
+	if (plugin_get_cache_policy(name, &plugin.cache_policy) != 0) {
+		plugin_lib_unref(plugin.p_lib);
+		return 1;
+	}
 
-		// Generate the plugin UID.
-		plugin.uid = plugin_gen_uid_int();
+	// Create plugin cache.
+	cache_name = plugin_get_uid_str(&plugin);
+	if (!cache_name) {
+		printerr("Failed to get plugin identifier.\n");
+		plugin_lib_unref(plugin.p_lib);
+		return 1;
+	}
 
-		// Create plugin cache.
-		cache_name = plugin_get_uid_str(&plugin);
-		if (!cache_name) {
-			printerr("Failed to get plugin identifier.\n");
-			dlclose(plugin.p_handle);
-			return 1;
-		}
+	plugin.p_cache = cache_create(cache_name);
+	free(cache_name);
+	if (!plugin.p_cache) {
+		printerr("Failed to create plugin cache.\n");
+		plugin_lib_unref(plugin.p_lib);
+		return 1;
+	}
 
-		plugin.p_cache = cache_create(cache_name);
-		free(cache_name);
-		if (!plugin.p_cache) {
-			printerr("Failed to create plugin cache.\n");
-			dlclose(plugin.p_handle);
-			return 1;
-		}
+	plugin.args = (PTRARRAY_TYPE(char)*) ptrarray_create(&free);
+	if (!plugin.args) {
+		plugin_lib_unref(plugin.p_lib);
+		cache_destroy(plugin.p_cache, 0);
+		return 1;
+	}
 
-		plugin.args = (PTRARRAY_TYPE(char)*) ptrarray_create(&free);
-		if (!plugin.args) {
-			dlclose(plugin.p_handle);
-			cache_destroy(plugin.p_cache, 0);
-			return 1;
-		}
+	if (plugin_index_valid_args(&plugin) != 0) {
+		printerr("Failed to index plugin arguments.\n");
+		ptrarray_free((PTRARRAY_TYPE(void)*) plugin.args);
+		plugin_lib_unref(plugin.p_lib);
+		cache_destroy(plugin.p_cache, 0);
+		return 1;
+	}
+
+	if (plugin_instance_create(&plugin) != 0) {
+		printerr("Failed to create plugin instance.\n");
+		hashmap_destroy(plugin.arg_index, 0);
+		hashmap_destroy(plugin.valid_args, 0);
+		ptrarray_free((PTRARRAY_TYPE(void)*) plugin.args);
+		plugin_lib_unref(plugin.p_lib);
+		cache_destroy(plugin.p_cache, 0);
+		return 1;
+	}
+
+	// Append the plugin data to the plugin array.
+	if (plugin_data_append(&plugin) != 0) {
+		plugin_instance_destroy(&plugin);
+		hashmap_destroy(plugin.arg_index, 0);
+		hashmap_destroy(plugin.valid_args, 0);
+		ptrarray_free((PTRARRAY_TYPE(void)*) plugin.args);
+		plugin_lib_unref(plugin.p_lib);
+		cache_destroy(plugin.p_cache, 0);
+		return 1;
+	}
+	return 0;
+}
+
+static int plugin_instance_create(PLUGIN *plugin) {
+	/*
+	*  Create the instance context of 'plugin' using the
+	*  instance_create() hook of the plugin. Returns 0 on
+	*  success and 1 on failure.
+	*/
+	plugin->worker_ctxs = hashmap_create(HASHMAP_KEY_INT, NULL);
+	if (!plugin->worker_ctxs) {
+		return 1;
+	}
+	if (plugin->p_params->instance_create &&
+		plugin->p_params->instance_create(&plugin->ctx) != PLUGIN_STATUS_DONE) {
+		hashmap_destroy(plugin->worker_ctxs, 0);
+		plugin->worker_ctxs = NULL;
+		return 1;
+	}
+	return 0;
+}
 
-		// Append the plugin data to the plugin array.
-		plugin_data_append(&plugin);
+static void plugin_instance_destroy(PLUGIN *plugin) {
+	/*
+	*  Destroy the worker sub-contexts and the instance
+	*  context of 'plugin'.
+	*/
+	PLUGIN_WORKER_CTX *wctx = NULL;
+	size_t iter = 0;
 
-		// Set the flag_print_verbose value of the plugin.
-		if (plugin.p_params->flag_print_verbose) {
-			*plugin.p_params->flag_print_verbose = cli_get_opts()->opt_verbose;
+	if (!plugin->worker_ctxs) {
+		return;
+	}
+	while (hashmap_next(plugin->worker_ctxs, &iter, (void**) &wctx)) {
+		if (plugin->p_params->worker_destroy) {
+			plugin->p_params->worker_destroy(plugin->ctx, wctx->ctx);
 		}
+		free(wctx);
+	}
+	hashmap_destroy(plugin->worker_ctxs, 0);
+	plugin->worker_ctxs = NULL;
+
+	if (plugin->p_params->instance_destroy) {
+		plugin->p_params->instance_destroy(plugin->ctx);
+	}
+	plugin->ctx = NULL;
+}
 
-		// Run the setup function.
-		plugin.p_params->plugin_setup();
+int plugin_get_worker_ctx(PLUGIN *plugin, const unsigned int worker,
+				void **worker_ctx) {
+	/*
+	*  Store the sub-context of 'worker' for 'plugin' in
+	*  '*worker_ctx'. The sub-context is created the first time
+	*  'worker' asks for it. Must be called with the pipeline
+	*  lock held. Returns 0 on success and 1 on failure.
+	*/
+	PLUGIN_WORKER_CTX *wctx = NULL;
+
+	wctx = hashmap_get_int(plugin->worker_ctxs, worker);
+	if (wctx) {
+		*worker_ctx = wctx->ctx;
 		return 0;
 	}
-	free(path);
-	printerr("Plugin doesn't exist.\n");
-	return 1;
+
+	errno = 0;
+	wctx = calloc(1, sizeof(*wctx));
+	if (!wctx) {
+		printerrno("calloc()");
+		return 1;
+	}
+	if (plugin->p_params->worker_create) {
+		printverb_va("Creating worker %u context for plugin %s.\n",
+				worker, plugin->p_params->name);
+		if (plugin->p_params->worker_create(plugin->ctx,
+					&wctx->ctx) != PLUGIN_STATUS_DONE) {
+			printerr_va("Failed to create worker context for plugin %s.\n",
+					plugin->p_params->name);
+			free(wctx);
+			return 1;
+		}
+	}
+	if (hashmap_put_int(plugin->worker_ctxs, worker, wctx) != 0) {
+		if (plugin->p_params->worker_destroy) {
+			plugin->p_params->worker_destroy(plugin->ctx, wctx->ctx);
+		}
+		free(wctx);
+		return 1;
+	}
+	*worker_ctx = wctx->ctx;
+	return 0;
 }
 
 void print_plugin_config(void) {
 	/*
 	*  Print info about all loaded plugin to stdout.
 	*/
-	printf("\n");
+	pipeline_lock();
+	fprintf(print_stdout, "\nPipeline '%s':\n", plugin_cur_pipeline->name);
 	for (unsigned int i = 0; i < plugins->ptrc; i++) {
-		printf("%s:\n", plugins->ptrs[i]->p_params->name);
-		printf("    Descr:           %s\n", plugins->ptrs[i]->p_params->descr);
-		printf("    Author:          %s\n", plugins->ptrs[i]->p_params->author);
-		printf("    Year:            %s\n", plugins->ptrs[i]->p_params->year);
+		fprintf(print_stdout, "%s:\n", plugins->ptrs[i]->p_params->name);
+		fprintf(print_stdout, "    Descr:           %s\n", plugins->ptrs[i]->p_params->descr);
+		fprintf(print_stdout, "    Author:          %s\n", plugins->ptrs[i]->p_params->author);
+		fprintf(print_stdout, "    Year:            %s\n", plugins->ptrs[i]->p_params->year);
 		build_print_version_info("    Built against:   ",
 				plugins->ptrs[i]->p_params->built_against);
-		printf("    Args: \n");
+		fprintf(print_stdout, "    Args: \n");
 		for (size_t arg = 0; arg < plugins->ptrs[i]->args->ptrc; arg += 2) {
-			printf("        %s: %s\n", plugins->ptrs[i]->args->ptrs[arg],
+			fprintf(print_stdout, "        %s: %s\n", plugins->ptrs[i]->args->ptrs[arg],
 				plugins->ptrs[i]->args->ptrs[arg + 1]);
 		}
-		printf("    Cache name:      %s\n", plugins->ptrs[i]->p_cache->name);
-		printf("    Cache path:      %s\n", plugins->ptrs[i]->p_cache->path);
-		printf("    UID:             %llu\n", plugins->ptrs[i]->uid);
-		printf("    Arg rev:         %llu\n", plugins->ptrs[i]->arg_rev);
+		if (plugins->ptrs[i]->p_params->arg_schema_count) {
+			fprintf(print_stdout, "    Arg schema: \n");
+		}
+		for (size_t arg = 0; arg < plugins->ptrs[i]->p_params->arg_schema_count; arg++) {
+			fprintf(print_stdout, "        %s: %s (default: %s)\n",
+				plugins->ptrs[i]->p_params->arg_schema[arg].name,
+				plugin_args_type_str(plugins->ptrs[i]->p_params->arg_schema[arg].type),
+				plugins->ptrs[i]->p_params->arg_schema[arg].def ?
+				plugins->ptrs[i]->p_params->arg_schema[arg].def : "none");
+		}
+		fprintf(print_stdout, "    Library:         %s\n", plugins->ptrs[i]->p_lib->path);
+		fprintf(print_stdout, "    Cache name:      %s\n", plugins->ptrs[i]->p_cache->name);
+		fprintf(print_stdout, "    Cache policy:    %s\n",
+			plugin_cache_policy_names[plugins->ptrs[i]->cache_policy]);
+		fprintf(print_stdout, "    Cached outputs:  %llu of %llu\n",
+			plugins->ptrs[i]->cache_writes,
+			plugins->ptrs[i]->cache_writes + plugins->ptrs[i]->cache_skips);
+		fprintf(print_stdout, "    Time per MP:     %f s\n", plugins->ptrs[i]->mpix_time);
+		perfctr_print_sink(plugins->ptrs[i]->perf);
+		if (plugins->ptrs[i]->input == PLUGIN_INPUT_SRC) {
+			fprintf(print_stdout, "    Input:           src\n");
+		} else {
+			fprintf(print_stdout, "    Input:           %li\n", plugins->ptrs[i]->input);
+		}
+		fprintf(print_stdout, "    UID:             %llu\n", plugins->ptrs[i]->uid);
+		fprintf(print_stdout, "    Arg rev:         %llu\n", plugins->ptrs[i]->arg_rev);
 	}
-	printf("\n");
+	fprintf(print_stdout, "\n");
+	pipeline_unlock();
 }
 
 int plugin_feed(const size_t index, struct PLUGIN_INDATA *in) {
@@ -224,57 +593,184 @@ int plugin_feed(const size_t index, struct PLUGIN_INDATA *in) {
 	*/
 
 	if (index < plugins->ptrc) {
-		return plugins->ptrs[index]->p_params->plugin_process(in);
+		return plugin_feed_instance(plugins->ptrs[index], in);
 	}
 	return PLUGIN_STATUS_ERROR;
 }
 
+int plugin_feed_instance(PLUGIN *plugin, struct PLUGIN_INDATA *in) {
+	/*
+	*  Feed data to the plugin instance 'plugin' which may be
+	*  in any pipeline. Returns one of the PLUGIN_STATUS_*
+	*  values defined in oip/plugin.h.
+	*/
+	return plugin->p_params->plugin_process(in);
+}
+
 int plugin_set_arg(const size_t index, char *arg, char *value) {
 	/*
 	*  Set the plugin argument 'arg' to 'value' for plugin at 'index'.
-	*  Returns 0 on success and 1 on failure.
+	*  Running jobs see the new value starting from their next
+	*  plugin step. Returns 0 on success and 1 on failure.
 	*/
+	int ret = 0;
+
+	pipeline_lock();
+	ret = plugin_set_arg_unlocked(index, arg, value);
+	pipeline_unlock();
+	return ret;
+}
 
-	int ret = -1;
+static int plugin_set_arg_unlocked(const size_t index, char *arg, char *value) {
+	PLUGIN *plugin = NULL;
+	PLUGIN_ARG_VAL tmp_arg_val;
+	void *tmp_val = NULL;
+	size_t arg_i = 0;
+	long int schema_i = 0;
 	char *tmp_str = NULL;
+
 	if (index < plugins->ptrc) {
+		plugin = plugins->ptrs[index];
 		if (!plugin_has_arg(index, arg)) {
 			return 1;
 		}
 
+		// Reject invalid typed arguments right away.
+		schema_i = plugin_args_find(plugin->p_params, arg);
+		if (schema_i >= 0) {
+			if (plugin_args_parse(&plugin->p_params->arg_schema[schema_i],
+						value, &tmp_arg_val) != 0) {
+				return 1;
+			}
+			plugin_args_free_val(&tmp_arg_val);
+		}
+
 		// If the argument exists, modify it.
-		ret = ptrarray_get_ptr_index((PTRARRAY_TYPE(void)*) plugins->ptrs[index]->args, arg);
-		if (ret >= 0) {
+		tmp_val = hashmap_get_str(plugin->arg_index, arg);
+		if (tmp_val) {
 			printverb_va("Plugin arg '%s' exists. Modifying it.\n", arg);
-			tmp_str = realloc(plugins->ptrs[index]->args->ptrs[ret + 1],
+			arg_i = HASHMAP_VAL_TO_IDX(tmp_val);
+			tmp_str = realloc(plugin->args->ptrs[arg_i + 1],
 				(strlen(value) + 1)*sizeof(*value));
 			if (!tmp_str) {
 				return 1;
 			}
 			strcpy(tmp_str, value);
-			plugins->ptrs[index]->args->ptrs[ret + 1] = tmp_str;
+			plugin->args->ptrs[arg_i + 1] = tmp_str;
+			plugin->arg_rev++;
 			return 0;
 		}
 
 		// Add a new argument.
 		printverb_va("Adding plugin arg '%s'.\n", arg);
-		tmp_str = ptrarray_put_data((PTRARRAY_TYPE(void)*) plugins->ptrs[index]->args,
+		arg_i = plugin->args->ptrc;
+		tmp_str = ptrarray_put_data((PTRARRAY_TYPE(void)*) plugin->args,
 				arg, (strlen(arg) + 1)*sizeof(*arg));
 		if (!tmp_str) {
 			return 1;
 		}
-		tmp_str = ptrarray_put_data((PTRARRAY_TYPE(void)*) plugins->ptrs[index]->args,
+		tmp_str = ptrarray_put_data((PTRARRAY_TYPE(void)*) plugin->args,
 				value, (strlen(value) + 1)*sizeof(*value));
 		if (!tmp_str) {
-			ptrarray_pop_ptr((PTRARRAY_TYPE(void)*) plugins->ptrs[index]->args, arg, 0);
+			free(plugin->args->ptrs[--plugin->args->ptrc]);
 			return 1;
 		}
-		plugins->ptrs[index]->arg_rev++;
+		if (hashmap_put_str(plugin->arg_index, arg,
+					HASHMAP_IDX_TO_VAL(arg_i)) != 0) {
+			free(plugin->args->ptrs[--plugin->args->ptrc]);
+			free(plugin->args->ptrs[--plugin->args->ptrc]);
+			return 1;
+		}
+		plugin->arg_rev++;
 		return 0;
 	}
 	return 1;
 }
 
+int plugin_prepare(PLUGIN *plugin) {
+	/*
+	*  Parse the typed arguments of 'plugin' and compile them into
+	*  a parameter block using the plugin_prepare() hook of the
+	*  plugin. This is only done once per argument revision and the
+	*  result is reused by every job until the arguments change.
+	*  Must be called with the pipeline lock held. Returns 0 on
+	*  success and 1 on failure.
+	*/
+	const PLUGIN_INFO *info = plugin->p_params;
+	PLUGIN_ARG_VAL *tmp_vals = NULL;
+	void *tmp_params = NULL;
+
+	if (plugin->prepared && plugin->prepared_rev == plugin->arg_rev) {
+		return 0;
+	}
+
+	if (plugin_args_compile(info, plugin->args->ptrs, plugin->args->ptrc/2,
+				&tmp_vals) != 0) {
+		return 1;
+	}
+
+	if (info->plugin_prepare) {
+		printverb_va("Preparing plugin %s for argument revision %llu.\n",
+				info->name, plugin->arg_rev);
+		if (info->plugin_prepare(tmp_vals, info->arg_schema_count,
+						&tmp_params) != PLUGIN_STATUS_DONE) {
+			printerr_va("Failed to prepare plugin %s.\n", info->name);
+			plugin_args_free(tmp_vals, info->arg_schema_count);
+			return 1;
+		}
+	}
+
+	plugin_unprepare(plugin);
+	plugin->arg_vals = tmp_vals;
+	plugin->params = tmp_params;
+	plugin->prepared_rev = plugin->arg_rev;
+	plugin->prepared = 1;
+	return 0;
+}
+
+static void plugin_unprepare(PLUGIN *plugin) {
+	/*
+	*  Free the typed arguments and the parameter block of 'plugin'.
+	*/
+	if (!plugin->prepared) {
+		return;
+	}
+	if (plugin->params && plugin->p_params->plugin_unprepare) {
+		plugin->p_params->plugin_unprepare(plugin->params);
+	}
+	plugin_args_free(plugin->arg_vals, plugin->p_params->arg_schema_count);
+	plugin->arg_vals = NULL;
+	plugin->params = NULL;
+	plugin->prepared = 0;
+}
+
+int plugin_set_input(const size_t index, const long int input) {
+	/*
+	*  Use the output of the plugin at 'input' as the input of the
+	*  plugin at 'index'. PLUGIN_INPUT_SRC means the source image of
+	*  the job. The input must come before 'index' so that the
+	*  pipeline stays acyclic. Returns 0 on success and 1 on failure.
+	*/
+	int ret = 0;
+
+	pipeline_lock();
+	if (index >= plugins->ptrc) {
+		printerr("Invalid plugin index.\n");
+		ret = 1;
+	} else if (input != PLUGIN_INPUT_SRC && (input < 0 || (size_t) input >= index)) {
+		printerr("A plugin can only take its input from a preceding plugin.\n");
+		ret = 1;
+	} else if (plugins->ptrs[index]->input != input) {
+		printverb_va("Setting the input of plugin %zu to %li.\n", index, input);
+		plugins->ptrs[index]->input = input;
+
+		// The output changes, so invalidate the cache.
+		plugins->ptrs[index]->arg_rev++;
+	}
+	pipeline_unlock();
+	return ret;
+}
+
 int plugin_has_arg(const size_t index, const char *arg) {
 	/*
 	*  Check if the plugin loaded at index 'index'
@@ -282,10 +778,8 @@ int plugin_has_arg(const size_t index, const char *arg) {
 	*  and 0 otherwise.
 	*/
 	if (index < plugins->ptrc) {
-		for (size_t i = 0; i < plugins->ptrs[index]->p_params->valid_args_count; i++) {
-			if (strcmp(plugins->ptrs[index]->p_params->valid_args[i], arg) == 0) {
-				return 1;
-			}
+		if (hashmap_get_str(plugins->ptrs[index]->valid_args, arg)) {
+			return 1;
 		}
 	}
 	return 0;
@@ -306,6 +800,136 @@ size_t plugins_get_count(void) {
 	return plugins->ptrc;
 }
 
+int plugin_pipeline_create(const char *name) {
+	/*
+	*  Create a new empty pipeline called 'name'. Returns 0
+	*  on success and 1 on failure.
+	*/
+	PLUGIN_PIPELINE *pipeline = NULL;
+	int ret = 0;
+
+	pipeline_lock();
+	if (hashmap_get_str(plugin_pipelines, name)) {
+		printerr_va("Pipeline '%s' already exists.\n", name);
+		pipeline_unlock();
+		return 1;
+	}
+
+	errno = 0;
+	pipeline = calloc(1, sizeof(*pipeline));
+	if (!pipeline) {
+		printerrno("calloc()");
+		pipeline_unlock();
+		return 1;
+	}
+
+	errno = 0;
+	pipeline->name = strdup(name);
+	if (!pipeline->name) {
+		printerrno("strdup()");
+		free(pipeline);
+		pipeline_unlock();
+		return 1;
+	}
+
+	pipeline->plugins = (PTRARRAY_TYPE(PLUGIN)*) ptrarray_create(&plugin_free_wrapper);
+	if (!pipeline->plugins) {
+		printerr("Failed to setup plugins PTRARRAY.\n");
+		free(pipeline->name);
+		free(pipeline);
+		pipeline_unlock();
+		return 1;
+	}
+
+	if (hashmap_put_str(plugin_pipelines, name, pipeline) != 0) {
+		printerr("Failed to register pipeline.\n");
+		plugin_pipeline_free(pipeline);
+		ret = 1;
+	}
+	pipeline_unlock();
+	return ret;
+}
+
+int plugin_pipeline_select(const char *name) {
+	/*
+	*  Select the pipeline that plugin_load() and the other
+	*  index based plugin functions operate on. Returns 0 on
+	*  success and 1 on failure.
+	*/
+	PLUGIN_PIPELINE *pipeline = NULL;
+
+	pipeline_lock();
+	pipeline = hashmap_get_str(plugin_pipelines, name);
+	if (!pipeline) {
+		printerr_va("Pipeline '%s' doesn't exist.\n", name);
+		pipeline_unlock();
+		return 1;
+	}
+	plugin_cur_pipeline = pipeline;
+	plugins = pipeline->plugins;
+	pipeline_unlock();
+	return 0;
+}
+
+PLUGIN_PIPELINE *plugin_pipeline_get(const char *name) {
+	/*
+	*  Return the pipeline called 'name' or a NULL pointer if
+	*  it doesn't exist. Pipelines are never freed before
+	*  plugins_cleanup().
+	*/
+	PLUGIN_PIPELINE *ret = NULL;
+
+	pipeline_lock();
+	ret = hashmap_get_str(plugin_pipelines, name);
+	pipeline_unlock();
+	return ret;
+}
+
+PLUGIN_PIPELINE *plugin_pipeline_current(void) {
+	return plugin_cur_pipeline;
+}
+
+PLUGIN *plugin_pipeline_get_plugin(const PLUGIN_PIPELINE *pipeline,
+					const size_t index) {
+	/*
+	*  Return the plugin at 'index' in 'pipeline' or a NULL
+	*  pointer if the plugin doesn't exist.
+	*/
+	if (index < pipeline->plugins->ptrc) {
+		return pipeline->plugins->ptrs[index];
+	}
+	return NULL;
+}
+
+size_t plugin_pipeline_count(const PLUGIN_PIPELINE *pipeline) {
+	return pipeline->plugins->ptrc;
+}
+
+void plugin_pipeline_list(void) {
+	/*
+	*  Print the pipelines and the loaded plugin libraries
+	*  to stdout. The selected pipeline is marked with '*'.
+	*/
+	PLUGIN_PIPELINE *pipeline = NULL;
+	PLUGIN_LIB *lib = NULL;
+	size_t iter = 0;
+
+	pipeline_lock();
+	fprintf(print_stdout, "\nPipelines:\n");
+	while (hashmap_next(plugin_pipelines, &iter, (void**) &pipeline)) {
+		fprintf(print_stdout, "  %c %s: %zu plugin(s)\n",
+			pipeline == plugin_cur_pipeline ? '*' : ' ',
+			pipeline->name, pipeline->plugins->ptrc);
+	}
+	fprintf(print_stdout, "Plugin libraries:\n");
+	iter = 0;
+	while (hashmap_next(plugin_libs, &iter, (void**) &lib)) {
+		fprintf(print_stdout, "    %s: %u instance(s)\n", lib->path, lib->refs);
+	}
+	fprintf(print_stdout, "\n");
+	pipeline_unlock();
+}
+
 char *plugin_get_uid_str(PLUGIN *plugin) {
 	/*
 	*  Return the plugin string identifier of the form 'name'-'uid'.
@@ -336,10 +960,14 @@ static void plugin_free(PLUGIN *plugin) {
 	/*
 	*  Free the resources allocated to a plugin.
 	*/
-	plugin->p_params->plugin_cleanup();
-	dlclose(plugin->p_handle);
+	plugin_unprepare(plugin);
+	plugin_instance_destroy(plugin);
+	plugin_lib_unref(plugin->p_lib);
 	ptrarray_free_ptrs((PTRARRAY_TYPE(void)*) plugin->args);
 	ptrarray_free((PTRARRAY_TYPE(void)*) plugin->args);
+	hashmap_destroy(plugin->arg_index, 0);
+	hashmap_destroy(plugin->valid_args, 0);
+	free(plugin->perf);
 	free(plugin);
 }
 
@@ -351,10 +979,26 @@ static void plugin_free_wrapper(void *plugin) {
 	plugin_free((PLUGIN*) plugin);
 }
 
+static void plugin_pipeline_free(PLUGIN_PIPELINE *pipeline) {
+	/*
+	*  Free a pipeline and the plugin instances in it.
+	*/
+	ptrarray_free_ptrs((PTRARRAY_TYPE(void)*) pipeline->plugins);
+	ptrarray_free((PTRARRAY_TYPE(void)*) pipeline->plugins);
+	free(pipeline->name);
+	free(pipeline);
+}
+
 int plugins_setup(void) {
 	/*
 	*  Setup the plugin system.
 	*/
+	int policy = 0;
+
+	if (plugin_get_cache_policy(NULL, &policy) != 0) {
+		printerr("Invalid cache policy config.\n");
+		return 1;
+	}
 
 	// Setup the cache system.
 	if (cache_setup() != 0) {
@@ -362,11 +1006,19 @@ int plugins_setup(void) {
 		return 1;
 	}
 
-	// Setup the plugins PTRARRAY.
-	plugins = (PTRARRAY_TYPE(PLUGIN)*) ptrarray_create(&plugin_free_wrapper);
-	if (!plugins) {
-		printerr("Failed to setup plugins PTRARRAY.\n");
-		cache_cleanup(0);
+	plugin_libs = hashmap_create(HASHMAP_KEY_STR, NULL);
+	plugin_pipelines = hashmap_create(HASHMAP_KEY_STR, NULL);
+	if (!plugin_libs || !plugin_pipelines) {
+		printerr("Failed to setup the plugin indexes.\n");
+		plugins_cleanup();
+		return 1;
+	}
+
+	// Setup the default pipeline.
+	if (plugin_pipeline_create(PLUGIN_DEFAULT_PIPELINE) != 0 ||
+		plugin_pipeline_select(PLUGIN_DEFAULT_PIPELINE) != 0) {
+		printerr("Failed to setup the default pipeline.\n");
+		plugins_cleanup();
 		return 1;
 	}
 	return 0;
@@ -377,11 +1029,23 @@ void plugins_cleanup(void) {
 	*  Free memory allocated for plugin data and close
 	*  opened library handles.
 	*/
-	if (plugins) {
+	PLUGIN_PIPELINE *pipeline = NULL;
+	size_t iter = 0;
+
+	if (plugin_pipelines) {
 		printverb("Freeing allocated plugin resources...\n");
-		ptrarray_free_ptrs((PTRARRAY_TYPE(void)*) plugins);
-		ptrarray_free((PTRARRAY_TYPE(void)*) plugins);
+		while (hashmap_next(plugin_pipelines, &iter, (void**) &pipeline)) {
+			plugin_pipeline_free(pipeline);
+		}
+		hashmap_destroy(plugin_pipelines, 0);
+		plugin_pipelines = NULL;
 		printverb("All plugins free'd!\n");
 	}
+	if (plugin_libs) {
+		hashmap_destroy(plugin_libs, 0);
+		plugin_libs = NULL;
+	}
+	plugin_cur_pipeline = NULL;
+	plugins = NULL;
 	cache_cleanup(!cli_get_opts()->opt_preserve_cache);
 }
@@ -0,0 +1,285 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#define PRINT_IDENTIFIER "plugin-args"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "oipcore/abi/output.h"
+#include "plugin_args_priv.h"
+
+static int plugin_args_parse_float(const char *str, char **end, float *val);
+static int plugin_args_parse_float_list(const char *str, PLUGIN_ARG_VAL *val);
+static int plugin_args_parse_point_list(const char *str, PLUGIN_ARG_VAL *val);
+static int plugin_args_parse_mask(const char *str, PLUGIN_ARG_VAL *val);
+static size_t plugin_args_count_items(const char *str);
+
+static int plugin_args_parse_float(const char *str, char **end, float *val) {
+	/*
+	*  Parse a float from the start of 'str' and store a pointer
+	*  to the first character after it in '*end'. Returns 0 on
+	*  success and 1 on failure.
+	*/
+	errno = 0;
+	*val = strtof(str, end);
+	if (errno != 0 || *end == str) {
+		return 1;
+	}
+	return 0;
+}
+
+static size_t plugin_args_count_items(const char *str) {
+	/*
+	*  Count the comma separated items in 'str'.
+	*/
+	size_t ret = 1;
+
+	for (const char *c = str; *c; c++) {
+		if (*c == ',') {
+			ret++;
+		}
+	}
+	return ret;
+}
+
+static int plugin_args_parse_float_list(const char *str, PLUGIN_ARG_VAL *val) {
+	char *end = NULL;
+	size_t n = 0;
+
+	errno = 0;
+	val->floats = calloc(plugin_args_count_items(str), sizeof(*val->floats));
+	if (!val->floats) {
+		printerrno("calloc()");
+		return 1;
+	}
+	while (1) {
+		if (plugin_args_parse_float(str, &end, &val->floats[n++]) != 0) {
+			break;
+		}
+		if (*end == '\0') {
+			val->count = n;
+			return 0;
+		} else if (*end != ',') {
+			break;
+		}
+		str = end + 1;
+	}
+	free(val->floats);
+	val->floats = NULL;
+	return 1;
+}
+
+static int plugin_args_parse_point_list(const char *str, PLUGIN_ARG_VAL *val) {
+	PLUGIN_POINT *p = NULL;
+	char *end = NULL;
+	size_t n = 0;
+
+	errno = 0;
+	val->points = calloc(plugin_args_count_items(str), sizeof(*val->points));
+	if (!val->points) {
+		printerrno("calloc()");
+		return 1;
+	}
+	while (1) {
+		p = &val->points[n++];
+		if (plugin_args_parse_float(str, &end, &p->x) != 0 || *end != ':') {
+			break;
+		}
+		str = end + 1;
+		if (plugin_args_parse_float(str, &end, &p->y) != 0) {
+			break;
+		}
+		if (*end == '\0') {
+			val->count = n;
+			return 0;
+		} else if (*end != ',') {
+			break;
+		}
+		str = end + 1;
+	}
+	free(val->points);
+	val->points = NULL;
+	return 1;
+}
+
+static int plugin_args_parse_mask(const char *str, PLUGIN_ARG_VAL *val) {
+	val->mask = 0;
+	for (const char *c = str; *c; c++) {
+		switch (*c) {
+			case 'r':
+				val->mask |= PLUGIN_CHANNEL_R;
+				break;
+			case 'g':
+				val->mask |= PLUGIN_CHANNEL_G;
+				break;
+			case 'b':
+				val->mask |= PLUGIN_CHANNEL_B;
+				break;
+			case 'a':
+				val->mask |= PLUGIN_CHANNEL_A;
+				break;
+			default:
+				return 1;
+		}
+	}
+	return val->mask == 0;
+}
+
+int plugin_args_parse(const PLUGIN_ARG_SCHEMA *schema, const char *str,
+			PLUGIN_ARG_VAL *val) {
+	/*
+	*  Parse the string 'str' into 'val' according to the
+	*  argument type in 'schema'. The list types allocate memory
+	*  that's freed with plugin_args_free(). Returns 0 on success
+	*  and 1 if 'str' isn't a valid value.
+	*/
+	char *end = NULL;
+	int ret = 1;
+
+	memset(val, 0, sizeof(*val));
+	val->type = schema->type;
+	switch (schema->type) {
+		case PLUGIN_ARG_TYPE_INT:
+			errno = 0;
+			val->i = strtol(str, &end, 10);
+			ret = errno != 0 || end == str || *end != '\0';
+			break;
+		case PLUGIN_ARG_TYPE_FLOAT:
+			ret = plugin_args_parse_float(str, &end, &val->f) != 0 || *end != '\0';
+			break;
+		case PLUGIN_ARG_TYPE_FLOAT_LIST:
+			ret = plugin_args_parse_float_list(str, val);
+			break;
+		case PLUGIN_ARG_TYPE_POINT_LIST:
+			ret = plugin_args_parse_point_list(str, val);
+			break;
+		case PLUGIN_ARG_TYPE_CHANNEL_MASK:
+			ret = plugin_args_parse_mask(str, val);
+			break;
+		default:
+			break;
+	}
+	if (ret != 0) {
+		printerr_va("Invalid %s value '%s' for argument '%s'.\n",
+			plugin_args_type_str(schema->type), str, schema->name);
+		return 1;
+	}
+	val->set = 1;
+	return 0;
+}
+
+long int plugin_args_find(const PLUGIN_INFO *info, const char *name) {
+	/*
+	*  Return the index of the argument 'name' in the argument
+	*  schema of 'info' or -1 if it's not in the schema.
+	*/
+	for (unsigned int i = 0; i < info->arg_schema_count; i++) {
+		if (strcmp(info->arg_schema[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int plugin_args_compile(const PLUGIN_INFO *info, char **args,
+			const size_t argc, PLUGIN_ARG_VAL **vals) {
+	/*
+	*  Parse the typed arguments of 'info' from the 'argc' name
+	*  and value string pairs in 'args'. Arguments that aren't
+	*  set get their default value. The parsed arguments are
+	*  stored in '*vals' in the order of the schema. Returns 0 on
+	*  success and 1 on failure.
+	*/
+	PLUGIN_ARG_VAL *tmp_vals = NULL;
+	const char *str = NULL;
+
+	if (info->arg_schema_count) {
+		errno = 0;
+		tmp_vals = calloc(info->arg_schema_count, sizeof(*tmp_vals));
+		if (!tmp_vals) {
+			printerrno("calloc()");
+			return 1;
+		}
+	}
+
+	for (unsigned int i = 0; i < info->arg_schema_count; i++) {
+		tmp_vals[i].type = info->arg_schema[i].type;
+		str = info->arg_schema[i].def;
+		for (size_t a = 0; a < argc; a++) {
+			if (strcmp(args[2*a], info->arg_schema[i].name) == 0) {
+				str = args[2*a + 1];
+				break;
+			}
+		}
+		if (str && plugin_args_parse(&info->arg_schema[i], str, &tmp_vals[i]) != 0) {
+			plugin_args_free(tmp_vals, info->arg_schema_count);
+			return 1;
+		}
+	}
+	*vals = tmp_vals;
+	return 0;
+}
+
+const char *plugin_args_type_str(const int type) {
+	switch (type) {
+		case PLUGIN_ARG_TYPE_INT:
+			return "int";
+		case PLUGIN_ARG_TYPE_FLOAT:
+			return "float";
+		case PLUGIN_ARG_TYPE_FLOAT_LIST:
+			return "float list";
+		case PLUGIN_ARG_TYPE_POINT_LIST:
+			return "point list";
+		case PLUGIN_ARG_TYPE_CHANNEL_MASK:
+			return "channel mask";
+		default:
+			return "unknown";
+	}
+}
+
+void plugin_args_free_val(PLUGIN_ARG_VAL *val) {
+	/*
+	*  Free the memory allocated for the value of 'val'.
+	*/
+	if (val->type == PLUGIN_ARG_TYPE_FLOAT_LIST) {
+		free(val->floats);
+		val->floats = NULL;
+	} else if (val->type == PLUGIN_ARG_TYPE_POINT_LIST) {
+		free(val->points);
+		val->points = NULL;
+	}
+}
+
+void plugin_args_free(PLUGIN_ARG_VAL *vals, const size_t count) {
+	/*
+	*  Free an array of 'count' parsed arguments.
+	*/
+	if (!vals) {
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		plugin_args_free_val(&vals[i]);
+	}
+	free(vals);
+}
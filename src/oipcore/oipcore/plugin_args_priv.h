@@ -0,0 +1,36 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#ifndef INCLUDED_PLUGIN_ARGS_PRIV
+	#define INCLUDED_PLUGIN_ARGS_PRIV
+
+	#include "oipcore/abi/plugin.h"
+
+	int plugin_args_parse(const PLUGIN_ARG_SCHEMA *schema, const char *str,
+				PLUGIN_ARG_VAL *val);
+	int plugin_args_compile(const PLUGIN_INFO *info, char **args,
+				const size_t argc, PLUGIN_ARG_VAL **vals);
+	long int plugin_args_find(const PLUGIN_INFO *info, const char *name);
+	const char *plugin_args_type_str(const int type);
+	void plugin_args_free_val(PLUGIN_ARG_VAL *val);
+	void plugin_args_free(PLUGIN_ARG_VAL *vals, const size_t count);
+#endif
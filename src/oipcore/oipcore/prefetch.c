@@ -0,0 +1,460 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/*
+*  The prefetcher reads the cache files that queued jobs will
+*  resume from before the jobs are started, so that the cache hits
+*  of the jobs don't wait for I/O. The scheduler plans the requests
+*  at plugin boundaries and a prefetcher thread decodes the files
+*  into images that pipeline runs then take instead of reading the
+*  files. The decoded images are limited to 'prefetch_max_mb' and
+*  the memory budget. Files that don't fit are only read into the
+*  page cache.
+*/
+
+#define PRINT_IDENTIFIER "prefetch"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "oipcore/abi/output.h"
+#include "oipcore/ptrarray.h"
+#include "oipcore/cache.h"
+#include "oipcore/memgov.h"
+#include "oipcore/taskpool.h"
+
+#include "prefetch_priv.h"
+#include "cachefile_priv.h"
+#include "configloader_priv.h"
+
+#define PREFETCH_MIB (1024*1024)
+
+// The states of a PREFETCH_ENTRY.
+#define PREFETCH_QUEUED  0
+#define PREFETCH_LOADING 1
+#define PREFETCH_READY   2
+
+/*
+*  A prefetched cache file. 'bytes' is the size of the decoded
+*  image. 'job_ids' are the IDs of the jobs that requested the
+*  file and the entry is dropped once all of them have finished.
+*  An entry that is dropped while it's loading is freed by the
+*  prefetcher thread once the load finishes.
+*/
+typedef struct STRUCT_PREFETCH_ENTRY {
+	char *fname;
+	PTRARRAY_TYPE(char) *job_ids;
+	IMAGE *img;
+	size_t bytes;
+	int state;
+	int dropped;
+} PREFETCH_ENTRY;
+
+PTRARRAY_TYPE_DEF(PREFETCH_ENTRY);
+
+static pthread_mutex_t pf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pf_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pf_thread;
+static int pf_running = 0;
+static int pf_stop = 0;
+
+static PTRARRAY_TYPE(PREFETCH_ENTRY) *pf_entries = NULL;
+static size_t pf_max_bytes = 0;
+static size_t pf_bytes = 0;
+
+static unsigned long long int pf_hits = 0;
+static unsigned long long int pf_misses = 0;
+static unsigned long long int pf_advised = 0;
+static unsigned long long int pf_wasted = 0;
+
+static PREFETCH_ENTRY *prefetch_find(const char *fname);
+static char *prefetch_find_job(const PREFETCH_ENTRY *entry, const char *job_id);
+static int prefetch_add_job(PREFETCH_ENTRY *entry, const char *job_id);
+static void prefetch_remove(PREFETCH_ENTRY *entry);
+static void prefetch_entry_free(PREFETCH_ENTRY *entry);
+static void prefetch_load(PREFETCH_ENTRY *entry);
+static void *prefetch_worker(void *arg);
+
+static PREFETCH_ENTRY *prefetch_find(const char *fname) {
+	/*
+	*  Return the entry of the cache file 'fname' or a NULL pointer
+	*  if there's none. The prefetch mutex must be locked by the
+	*  caller.
+	*/
+	for (size_t i = 0; i < pf_entries->ptrc; i++) {
+		if (!pf_entries->ptrs[i]->dropped &&
+			strcmp(pf_entries->ptrs[i]->fname, fname) == 0) {
+			return pf_entries->ptrs[i];
+		}
+	}
+	return NULL;
+}
+
+static char *prefetch_find_job(const PREFETCH_ENTRY *entry, const char *job_id) {
+	/*
+	*  Return the ID 'job_id' in the requesters of 'entry' or
+	*  a NULL pointer if the job hasn't requested the file.
+	*/
+	for (size_t i = 0; i < entry->job_ids->ptrc; i++) {
+		if (strcmp(entry->job_ids->ptrs[i], job_id) == 0) {
+			return entry->job_ids->ptrs[i];
+		}
+	}
+	return NULL;
+}
+
+static int prefetch_add_job(PREFETCH_ENTRY *entry, const char *job_id) {
+	/*
+	*  Add the job 'job_id' to the requesters of 'entry'. Returns
+	*  0 on success and 1 on failure.
+	*/
+	char *tmp = NULL;
+
+	if (prefetch_find_job(entry, job_id)) {
+		return 0;
+	}
+	errno = 0;
+	tmp = strdup(job_id);
+	if (!tmp) {
+		printerrno("strdup()");
+		return 1;
+	}
+	if (!ptrarray_put_ptr((PTRARRAY_TYPE(void)*) entry->job_ids, tmp)) {
+		free(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+static void prefetch_remove(PREFETCH_ENTRY *entry) {
+	/*
+	*  Remove 'entry' from the entries. The prefetch mutex
+	*  must be locked by the caller.
+	*/
+	PTRARRAY_TYPE(PREFETCH_ENTRY) *tmp = NULL;
+
+	tmp = (PTRARRAY_TYPE(PREFETCH_ENTRY)*) ptrarray_pop_ptr(
+			(PTRARRAY_TYPE(void)*) pf_entries, entry, 0);
+	if (tmp) {
+		pf_entries = tmp;
+	} else {
+		printerr("Failed to remove a prefetch entry.\n");
+	}
+	if (entry->state != PREFETCH_QUEUED) {
+		pf_bytes -= entry->bytes;
+	}
+}
+
+static void prefetch_entry_free(PREFETCH_ENTRY *entry) {
+	if (entry->img) {
+		img_free(entry->img);
+	}
+	if (entry->job_ids) {
+		ptrarray_free_ptrs((PTRARRAY_TYPE(void)*) entry->job_ids);
+		ptrarray_free((PTRARRAY_TYPE(void)*) entry->job_ids);
+	}
+	free(entry->fname);
+	free(entry);
+}
+
+static void prefetch_load(PREFETCH_ENTRY *entry) {
+	/*
+	*  Load the cache file of the queued 'entry'. The file is
+	*  decoded if the image fits in the limits and otherwise only
+	*  read into the page cache. The prefetch mutex must be locked
+	*  by the caller and it's unlocked while the file is read.
+	*/
+	CACHEFILE_INFO info;
+	char *path = NULL;
+	size_t bytes = 0;
+	int valid = 0;
+
+	entry->state = PREFETCH_LOADING;
+	pthread_mutex_unlock(&pf_mutex);
+	path = cache_get_path_to_file(entry->fname);
+	valid = path && cachefile_read_info(path, &info) == 0;
+	pthread_mutex_lock(&pf_mutex);
+
+	if (valid && !entry->dropped) {
+		bytes = (size_t) info.w*info.h*sizeof(RGBQUAD);
+		if (pf_bytes + bytes <= pf_max_bytes && !memgov_over_budget(bytes)) {
+			entry->bytes = bytes;
+			pf_bytes += bytes;
+			pthread_mutex_unlock(&pf_mutex);
+			printverb_va("Prefetching cache file '%s'.\n", path);
+			entry->img = cachefile_load(path);
+			pthread_mutex_lock(&pf_mutex);
+		} else {
+			pthread_mutex_unlock(&pf_mutex);
+			printverb_va("Reading cache file '%s' ahead.\n", path);
+			cachefile_advise(path);
+			pthread_mutex_lock(&pf_mutex);
+			pf_advised++;
+		}
+	}
+	free(path);
+
+	// Only decoded images are kept.
+	entry->state = PREFETCH_READY;
+	if (!entry->img || entry->dropped) {
+		prefetch_remove(entry);
+		prefetch_entry_free(entry);
+	}
+	pthread_cond_broadcast(&pf_done_cond);
+}
+
+static void *prefetch_worker(void *arg) {
+	/*
+	*  The prefetcher thread. Loads the queued entries in
+	*  the order they were requested.
+	*/
+	PREFETCH_ENTRY *entry = NULL;
+
+	(void) arg;
+	taskpool_join();
+
+	pthread_mutex_lock(&pf_mutex);
+	while (!pf_stop) {
+		entry = NULL;
+		for (size_t i = 0; i < pf_entries->ptrc; i++) {
+			if (pf_entries->ptrs[i]->state == PREFETCH_QUEUED) {
+				entry = pf_entries->ptrs[i];
+				break;
+			}
+		}
+		if (!entry) {
+			pthread_cond_wait(&pf_work_cond, &pf_mutex);
+			continue;
+		}
+		prefetch_load(entry);
+	}
+	pthread_mutex_unlock(&pf_mutex);
+	return NULL;
+}
+
+int prefetch_is_running(void) {
+	// Return 1 if the prefetcher is running and 0 otherwise.
+	return pf_running;
+}
+
+void prefetch_request(const char *fname, const char *job_id) {
+	/*
+	*  Queue the cache file 'fname' that the job 'job_id' will
+	*  resume from to be prefetched. Files that are already
+	*  queued aren't queued again, but the job is added to the
+	*  jobs that requested them.
+	*/
+	PREFETCH_ENTRY *entry = NULL;
+
+	if (!pf_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&pf_mutex);
+	entry = prefetch_find(fname);
+	if (entry) {
+		prefetch_add_job(entry, job_id);
+		pthread_mutex_unlock(&pf_mutex);
+		return;
+	}
+
+	errno = 0;
+	entry = calloc(1, sizeof(*entry));
+	if (entry) {
+		entry->fname = strdup(fname);
+		entry->job_ids = (PTRARRAY_TYPE(char)*) ptrarray_create(&free);
+	}
+	if (!entry || !entry->fname || !entry->job_ids ||
+		prefetch_add_job(entry, job_id) != 0) {
+		printerr("Failed to create a prefetch entry.\n");
+		if (entry) {
+			prefetch_entry_free(entry);
+		}
+		pthread_mutex_unlock(&pf_mutex);
+		return;
+	}
+	if (!ptrarray_put_ptr((PTRARRAY_TYPE(void)*) pf_entries, entry)) {
+		prefetch_entry_free(entry);
+		pthread_mutex_unlock(&pf_mutex);
+		return;
+	}
+	pthread_cond_signal(&pf_work_cond);
+	pthread_mutex_unlock(&pf_mutex);
+}
+
+IMAGE *prefetch_take(const char *fname) {
+	/*
+	*  Take the prefetched image of the cache file 'fname'. Waits
+	*  for the image if it's being loaded. A request that hasn't
+	*  been started yet is dropped. Returns a pointer to the image
+	*  or a NULL pointer if the file has to be read by the caller.
+	*  This is called with the pipeline lock held, so there's only
+	*  one caller waiting at a time.
+	*/
+	PREFETCH_ENTRY *entry = NULL;
+	IMAGE *ret = NULL;
+
+	if (!pf_running) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pf_mutex);
+	entry = prefetch_find(fname);
+	while (entry && entry->state == PREFETCH_LOADING) {
+		pthread_cond_wait(&pf_done_cond, &pf_mutex);
+		entry = prefetch_find(fname);
+	}
+	if (entry) {
+		prefetch_remove(entry);
+		ret = entry->img;
+		entry->img = NULL;
+		prefetch_entry_free(entry);
+	}
+	if (ret) {
+		pf_hits++;
+	} else {
+		pf_misses++;
+	}
+	pthread_mutex_unlock(&pf_mutex);
+	return ret;
+}
+
+void prefetch_forget(const char *job_id) {
+	/*
+	*  Forget the requests of the job 'job_id'. The prefetched
+	*  images that no other job requested are dropped. This is
+	*  called when the job has finished.
+	*/
+	PTRARRAY_TYPE(char) *tmp = NULL;
+	PREFETCH_ENTRY *entry = NULL;
+	char *id = NULL;
+	size_t i = 0;
+
+	if (!pf_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&pf_mutex);
+	while (i < pf_entries->ptrc) {
+		entry = pf_entries->ptrs[i];
+		id = entry->dropped ? NULL : prefetch_find_job(entry, job_id);
+		if (id) {
+			tmp = (PTRARRAY_TYPE(char)*) ptrarray_pop_ptr(
+				(PTRARRAY_TYPE(void)*) entry->job_ids, id, 1);
+			if (tmp) {
+				entry->job_ids = tmp;
+			} else {
+				printerr("Failed to forget a prefetch request.\n");
+			}
+		}
+		if (!id || entry->job_ids->ptrc) {
+			i++;
+		} else if (entry->state == PREFETCH_LOADING) {
+			entry->dropped = 1;
+			pf_wasted++;
+			i++;
+		} else {
+			if (entry->state == PREFETCH_READY) {
+				pf_wasted++;
+			}
+			prefetch_remove(entry);
+			prefetch_entry_free(entry);
+		}
+	}
+	pthread_mutex_unlock(&pf_mutex);
+}
+
+void prefetch_print_status(void) {
+	// Print the prefetcher counters to STDOUT.
+	pthread_mutex_lock(&pf_mutex);
+	fprintf(print_stdout, "Prefetch: %.2f of %.2f MiB\n", (double) pf_bytes/PREFETCH_MIB,
+		(double) pf_max_bytes/PREFETCH_MIB);
+	fprintf(print_stdout, "  Hits:       %llu\n", pf_hits);
+	fprintf(print_stdout, "  Misses:     %llu\n", pf_misses);
+	fprintf(print_stdout, "  Read ahead: %llu\n", pf_advised);
+	fprintf(print_stdout, "  Unused:     %llu\n", pf_wasted);
+	pthread_mutex_unlock(&pf_mutex);
+}
+
+int prefetch_setup(void) {
+	/*
+	*  Start the prefetcher thread. The config parameter
+	*  'prefetch_max_mb' limits the size of the decoded images
+	*  held by the prefetcher. With 0 the files are only read
+	*  into the page cache. This must be called after the task
+	*  pool has been started. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	long int max_mb = 0;
+	int ret = 0;
+
+	printverb("Setup.\n");
+	max_mb = config_get_lint_param("prefetch_max_mb");
+	if (max_mb < 0) {
+		printerr("Invalid prefetch size limit.\n");
+		return 1;
+	}
+	pf_max_bytes = (size_t) max_mb*PREFETCH_MIB;
+
+	pf_entries = (PTRARRAY_TYPE(PREFETCH_ENTRY)*) ptrarray_create(NULL);
+	if (!pf_entries) {
+		return 1;
+	}
+
+	pf_stop = 0;
+	ret = pthread_create(&pf_thread, NULL, &prefetch_worker, NULL);
+	if (ret != 0) {
+		errno = ret;
+		printerrno("pthread_create()");
+		ptrarray_free((PTRARRAY_TYPE(void)*) pf_entries);
+		pf_entries = NULL;
+		return 1;
+	}
+	pf_running = 1;
+	return 0;
+}
+
+void prefetch_cleanup(void) {
+	/*
+	*  Stop the prefetcher thread and free the prefetched images.
+	*/
+	if (!pf_running) {
+		return;
+	}
+	printverb("Cleanup.\n");
+	pthread_mutex_lock(&pf_mutex);
+	pf_stop = 1;
+	pthread_cond_broadcast(&pf_work_cond);
+	pthread_mutex_unlock(&pf_mutex);
+	pthread_join(pf_thread, NULL);
+	pf_running = 0;
+
+	while (pf_entries->ptrc) {
+		prefetch_entry_free(pf_entries->ptrs[--pf_entries->ptrc]);
+	}
+	ptrarray_free((PTRARRAY_TYPE(void)*) pf_entries);
+	pf_entries = NULL;
+	pf_bytes = 0;
+}
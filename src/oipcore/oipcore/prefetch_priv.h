@@ -0,0 +1,34 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef INCLUDED_PREFETCH_PRIV
+	#define INCLUDED_PREFETCH_PRIV
+
+	#include "oipimgutil/oipimgutil.h"
+
+	int prefetch_setup(void);
+	void prefetch_cleanup(void);
+	int prefetch_is_running(void);
+	void prefetch_request(const char *fname, const char *job_id);
+	IMAGE *prefetch_take(const char *fname);
+	void prefetch_forget(const char *job_id);
+	void prefetch_print_status(void);
+#endif
@@ -128,7 +128,6 @@ PTRARRAY_TYPE(void) *ptrarray_shrink(PTRARRAY_TYPE(void) *ptrarray) {
 				ptrarray_free((PTRARRAY_TYPE(void)*) ret);
 				return NULL;
 			}
-			ret->ptrc++;
 		}
 	}
 	ptrarray_free((PTRARRAY_TYPE(void)*) ptrarray);
@@ -157,7 +156,7 @@ PTRARRAY_TYPE(void) *ptrarray_pop_ptr(PTRARRAY_TYPE(void) *ptrarray,
 		return NULL;
 	}
 	if (free_ptr) {
-		ptrarray->free_func(ptr);
+		ret->free_func(ptr);
 	}
 	return ret;
 }
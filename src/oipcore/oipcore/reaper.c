@@ -0,0 +1,700 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/*
+*  The reaper deletes cache files in the background, so that
+*  evicting files and cleaning up the caches never wait for the
+*  filesystem. Evicted files are queued with the device and inode
+*  they were registered with, and the reaper thread unlinks them in
+*  batches with unlinkat() on the file descriptors of the cache
+*  subdirectories. A file that another process has replaced since
+*  is left in place.
+*
+*  Every REAPER_SCAN_INTERVAL seconds the reaper also scans the
+*  cache root. Temporary files of writers that crashed are deleted
+*  once they are REAPER_TMP_AGE seconds old. If the files on disk
+*  exceed 'cache_max_mb', the least recently used files that aren't
+*  registered in this process, eg. the files of crashed runs, are
+*  deleted once they haven't been used for REAPER_ORPHAN_AGE
+*  seconds.
+*
+*  Other processes may use the same files, so the access time of a
+*  file is used as a lease: every scan first renews the leases of
+*  the files registered in this process, and a file is only deleted
+*  as an orphan if its lease is still expired while the lock of the
+*  cache root is held. REAPER_ORPHAN_AGE must be several times
+*  REAPER_SCAN_INTERVAL so that a live process always renews its
+*  leases in time.
+*/
+
+#define _GNU_SOURCE
+
+#define PRINT_IDENTIFIER "reaper"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "oipcore/abi/output.h"
+#include "oipcore/cache.h"
+#include "oipcore/file.h"
+#include "oipcore/pipeline.h"
+
+#include "reaper_priv.h"
+#include "configloader_priv.h"
+
+#define REAPER_MIB (1024*1024)
+
+// The number of subdirectories named by CACHE_SUBDIR_LEN hex digits.
+#define REAPER_SUBDIRS 256
+
+// The number of files deleted while holding the cache root lock.
+#define REAPER_BATCH 64
+
+#define REAPER_SCAN_INTERVAL 60
+#define REAPER_TMP_AGE 3600
+#define REAPER_ORPHAN_AGE 600
+
+// A queued file. 'dev' and 'ino' identify the file to delete.
+typedef struct STRUCT_REAPER_ITEM {
+	char fname[CACHE_KEY_LEN + 1];
+	dev_t dev;
+	ino_t ino;
+	struct STRUCT_REAPER_ITEM *next;
+} REAPER_ITEM;
+
+// A cache file found by a scan of the cache root.
+typedef struct STRUCT_REAPER_FILE {
+	char fname[CACHE_KEY_LEN + 1];
+	size_t size;
+	time_t used;
+} REAPER_FILE;
+
+static pthread_mutex_t reap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reap_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reap_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reap_thread;
+static int reap_running = 0;
+static atomic_int reap_stop = 0;
+
+/*
+*  The queue of files to delete and the batch that is being
+*  deleted. 'reap_busy' is only touched by the reaper thread
+*  but it's read by reaper_cancel() under the mutex.
+*/
+static REAPER_ITEM *reap_head = NULL;
+static REAPER_ITEM *reap_tail = NULL;
+static REAPER_ITEM *reap_busy = NULL;
+static size_t reap_pending = 0;
+
+// The cache root, its lock file and the subdirectories.
+static int reap_root_fd = -1;
+static int reap_lock_fd = -1;
+static int reap_dir_fds[REAPER_SUBDIRS];
+static size_t reap_max_bytes = 0;
+
+static atomic_ullong reap_deleted = 0;
+static atomic_ullong reap_replaced = 0;
+static atomic_ullong reap_tmp = 0;
+static atomic_ullong reap_orphans = 0;
+static atomic_ullong reap_scans = 0;
+static atomic_size_t reap_disk_bytes = 0;
+
+static void reaper_lock(void);
+static void reaper_unlock(void);
+static int reaper_subdir_index(const char *name);
+static int reaper_dir_fd(const char *fname);
+static int reaper_unlink(const int dir_fd, const char *name,
+			const dev_t dev, const ino_t ino);
+static void reaper_delete_batch(REAPER_ITEM *batch);
+static int reaper_file_cmp(const void *a, const void *b);
+static int reaper_scan_dir(const int dir_fd, REAPER_FILE **files,
+			size_t *count, size_t *size, size_t *bytes);
+static void reaper_scan(void);
+static void *reaper_worker(void *arg);
+
+static void reaper_lock(void) {
+	/*
+	*  Take the lock on the cache root that the caches of all
+	*  processes respect. The reaper has a file description of
+	*  its own, so this also excludes the threads of this process
+	*  that hold the cache lock.
+	*/
+	errno = 0;
+	while (flock(reap_lock_fd, LOCK_EX) == -1) {
+		if (errno != EINTR) {
+			printerrno("flock()");
+			break;
+		}
+		errno = 0;
+	}
+}
+
+static void reaper_unlock(void) {
+	// Release the lock taken with reaper_lock().
+	flock(reap_lock_fd, LOCK_UN);
+}
+
+static int reaper_subdir_index(const char *name) {
+	/*
+	*  Return the index of the subdirectory 'name' or the
+	*  subdirectory of the cache file 'name' or -1 if 'name'
+	*  doesn't start with CACHE_SUBDIR_LEN hex digits.
+	*/
+	char subdir[CACHE_SUBDIR_LEN + 1];
+
+	for (size_t i = 0; i < CACHE_SUBDIR_LEN; i++) {
+		if (!isxdigit((unsigned char) name[i])) {
+			return -1;
+		}
+		subdir[i] = name[i];
+	}
+	subdir[CACHE_SUBDIR_LEN] = '\0';
+	return (int) strtol(subdir, NULL, 16);
+}
+
+static int reaper_dir_fd(const char *fname) {
+	/*
+	*  Return a file descriptor of the subdirectory of the cache
+	*  file 'fname' or -1 on failure. The descriptors are opened
+	*  once and kept open. Only called by the reaper thread.
+	*/
+	char subdir[CACHE_SUBDIR_LEN + 1];
+	int index = 0;
+
+	index = reaper_subdir_index(fname);
+	if (index < 0 || index >= REAPER_SUBDIRS) {
+		printerr_va("Invalid cache file name '%s'.\n", fname);
+		return -1;
+	}
+	if (reap_dir_fds[index] == -1) {
+		memcpy(subdir, fname, CACHE_SUBDIR_LEN);
+		subdir[CACHE_SUBDIR_LEN] = '\0';
+		errno = 0;
+		reap_dir_fds[index] = openat(reap_root_fd, subdir,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (reap_dir_fds[index] == -1 && errno != ENOENT) {
+			printerrno("openat()");
+		}
+	}
+	return reap_dir_fds[index];
+}
+
+static int reaper_unlink(const int dir_fd, const char *name,
+			const dev_t dev, const ino_t ino) {
+	/*
+	*  Delete the file 'name' in 'dir_fd' if it's still the file
+	*  'dev' and 'ino'. The cache root lock must be held by the
+	*  caller. Returns 1 if the file was deleted and 0 otherwise.
+	*/
+	struct stat st;
+
+	errno = 0;
+	if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+		if (errno != ENOENT) {
+			printerrno("fstatat()");
+		}
+		return 0;
+	}
+	if (st.st_dev != dev || st.st_ino != ino) {
+		atomic_fetch_add(&reap_replaced, 1);
+		return 0;
+	}
+	errno = 0;
+	if (unlinkat(dir_fd, name, 0) == -1) {
+		if (errno != ENOENT) {
+			printerrno("unlinkat()");
+		}
+		return 0;
+	}
+	return 1;
+}
+
+static void reaper_delete_batch(REAPER_ITEM *batch) {
+	/*
+	*  Delete the files of the queued items in 'batch'. The
+	*  reaper mutex must not be held by the caller.
+	*/
+	int dir_fd = -1;
+
+	reaper_lock();
+	for (REAPER_ITEM *item = batch; item; item = item->next) {
+		dir_fd = reaper_dir_fd(item->fname);
+		if (dir_fd != -1 &&
+			reaper_unlink(dir_fd, item->fname, item->dev, item->ino)) {
+			atomic_fetch_add(&reap_deleted, 1);
+		}
+	}
+	reaper_unlock();
+}
+
+static int reaper_file_cmp(const void *a, const void *b) {
+	// Order REAPER_FILE instances from the least recently used.
+	const REAPER_FILE *fa = a;
+	const REAPER_FILE *fb = b;
+
+	if (fa->used != fb->used) {
+		return fa->used < fb->used ? -1 : 1;
+	}
+	return strcmp(fa->fname, fb->fname);
+}
+
+static int reaper_scan_dir(const int dir_fd, REAPER_FILE **files,
+			size_t *count, size_t *size, size_t *bytes) {
+	/*
+	*  Scan the cache subdirectory 'dir_fd'. Old temporary files
+	*  are deleted and the cache files are appended to '*files',
+	*  which holds '*count' of '*size' files. The sizes of the
+	*  cache files are added to '*bytes'. Returns 0 on success and
+	*  1 on failure.
+	*/
+	REAPER_FILE *tmp = NULL;
+	struct dirent *ent = NULL;
+	struct stat st;
+	time_t now = time(NULL);
+	DIR *dir = NULL;
+	int fd = -1;
+
+	// fdopendir() takes over the descriptor, so use a copy.
+	errno = 0;
+	fd = dup(dir_fd);
+	if (fd == -1) {
+		printerrno("dup()");
+		return 1;
+	}
+	errno = 0;
+	dir = fdopendir(fd);
+	if (!dir) {
+		printerrno("fdopendir()");
+		close(fd);
+		return 1;
+	}
+	rewinddir(dir);
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		errno = 0;
+		if (fstatat(dir_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			if (errno != ENOENT) {
+				printerrno("fstatat()");
+			}
+			continue;
+		}
+		if (!S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		if (strstr(ent->d_name, CACHE_TMP_MARK)) {
+			// The temporary file of a writer that crashed.
+			if (now - st.st_mtime >= REAPER_TMP_AGE) {
+				printverb_va("Deleting stale temporary file '%s'.\n",
+						ent->d_name);
+				reaper_lock();
+				if (reaper_unlink(dir_fd, ent->d_name, st.st_dev, st.st_ino)) {
+					atomic_fetch_add(&reap_tmp, 1);
+				}
+				reaper_unlock();
+			}
+			continue;
+		}
+		if (strlen(ent->d_name) != CACHE_KEY_LEN) {
+			continue;
+		}
+
+		if (*count == *size) {
+			errno = 0;
+			tmp = realloc(*files, (*size*2 + 16)*sizeof(**files));
+			if (!tmp) {
+				printerrno("realloc()");
+				closedir(dir);
+				return 1;
+			}
+			*files = tmp;
+			*size = *size*2 + 16;
+		}
+		strcpy((*files)[*count].fname, ent->d_name);
+		(*files)[*count].size = st.st_size;
+		(*files)[*count].used = st.st_atime > st.st_mtime ?
+					st.st_atime : st.st_mtime;
+		(*count)++;
+		*bytes += st.st_size;
+	}
+	closedir(dir);
+	return 0;
+}
+
+static void reaper_scan(void) {
+	/*
+	*  Scan the cache root for stale temporary files and for
+	*  orphaned cache files that keep the files on disk over
+	*  the global cache budget.
+	*/
+	REAPER_FILE *files = NULL;
+	struct dirent *ent = NULL;
+	struct stat st;
+	time_t now = time(NULL);
+	size_t count = 0;
+	size_t size = 0;
+	size_t bytes = 0;
+	DIR *dir = NULL;
+	int dir_fd = -1;
+	int fd = -1;
+
+	pipeline_lock();
+	cache_renew_files();
+	pipeline_unlock();
+
+	errno = 0;
+	fd = openat(reap_root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		printerrno("openat()");
+		return;
+	}
+	errno = 0;
+	dir = fdopendir(fd);
+	if (!dir) {
+		printerrno("fdopendir()");
+		close(fd);
+		return;
+	}
+	while ((ent = readdir(dir))) {
+		if (strlen(ent->d_name) != CACHE_SUBDIR_LEN ||
+			reaper_subdir_index(ent->d_name) < 0) {
+			continue;
+		}
+		dir_fd = reaper_dir_fd(ent->d_name);
+		if (dir_fd == -1 ||
+			reaper_scan_dir(dir_fd, &files, &count, &size, &bytes) != 0) {
+			continue;
+		}
+	}
+	closedir(dir);
+
+	atomic_store(&reap_disk_bytes, bytes);
+	atomic_fetch_add(&reap_scans, 1);
+
+	if (!reap_max_bytes || bytes <= reap_max_bytes) {
+		free(files);
+		return;
+	}
+
+	/*
+	*  Delete the least recently used files that aren't registered
+	*  in this process and whose leases have expired. The pipeline
+	*  lock is held while a file is checked and deleted, so it
+	*  can't be adopted meanwhile, and the lock of the cache root
+	*  keeps the other processes from adopting it.
+	*/
+	qsort(files, count, sizeof(*files), &reaper_file_cmp);
+	for (size_t i = 0; i < count && bytes > reap_max_bytes &&
+			!atomic_load(&reap_stop); i++) {
+		if (now - files[i].used < REAPER_ORPHAN_AGE) {
+			break;
+		}
+		dir_fd = reaper_dir_fd(files[i].fname);
+		if (dir_fd == -1) {
+			continue;
+		}
+		pipeline_lock();
+		if (!cache_is_registered(files[i].fname)) {
+			reaper_lock();
+			errno = 0;
+			if (fstatat(dir_fd, files[i].fname, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+				now - st.st_atime >= REAPER_ORPHAN_AGE &&
+				now - st.st_mtime >= REAPER_ORPHAN_AGE &&
+				reaper_unlink(dir_fd, files[i].fname, st.st_dev, st.st_ino)) {
+				printverb_va("Deleted orphaned cache file '%s'.\n",
+						files[i].fname);
+				bytes -= files[i].size;
+				atomic_fetch_add(&reap_orphans, 1);
+			}
+			reaper_unlock();
+		}
+		pipeline_unlock();
+	}
+	free(files);
+	atomic_store(&reap_disk_bytes, bytes);
+}
+
+static void *reaper_worker(void *arg) {
+	/*
+	*  The reaper thread. Deletes the queued files and scans the
+	*  cache root periodically. The queue is drained before the
+	*  thread stops.
+	*/
+	REAPER_ITEM *tail = NULL;
+	REAPER_ITEM *tmp = NULL;
+	struct timespec until;
+	time_t next_scan = 0;
+	size_t n = 0;
+
+	(void) arg;
+
+	pthread_mutex_lock(&reap_mutex);
+	while (1) {
+		if (reap_head) {
+			// Take a batch of files off the queue.
+			reap_busy = reap_head;
+			tail = reap_head;
+			for (n = 1; n < REAPER_BATCH && tail->next; n++) {
+				tail = tail->next;
+			}
+			reap_head = tail->next;
+			if (!reap_head) {
+				reap_tail = NULL;
+			}
+			tail->next = NULL;
+			reap_pending -= n;
+			pthread_mutex_unlock(&reap_mutex);
+
+			reaper_delete_batch(reap_busy);
+
+			pthread_mutex_lock(&reap_mutex);
+			while (reap_busy) {
+				tmp = reap_busy->next;
+				free(reap_busy);
+				reap_busy = tmp;
+			}
+			pthread_cond_broadcast(&reap_done_cond);
+			continue;
+		}
+		if (atomic_load(&reap_stop)) {
+			break;
+		}
+		if (time(NULL) >= next_scan) {
+			pthread_mutex_unlock(&reap_mutex);
+			reaper_scan();
+			pthread_mutex_lock(&reap_mutex);
+			next_scan = time(NULL) + REAPER_SCAN_INTERVAL;
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += next_scan - time(NULL);
+		pthread_cond_timedwait(&reap_work_cond, &reap_mutex, &until);
+	}
+	pthread_mutex_unlock(&reap_mutex);
+	return NULL;
+}
+
+int reaper_is_running(void) {
+	// Return 1 if the reaper is running and 0 otherwise.
+	return reap_running;
+}
+
+int reaper_queue(const char *fname, const dev_t dev, const ino_t ino) {
+	/*
+	*  Queue the cache file 'fname' with the device 'dev' and the
+	*  inode 'ino' to be deleted. Returns 0 on success and 1 if the
+	*  file wasn't queued, in which case the caller must delete it.
+	*/
+	REAPER_ITEM *item = NULL;
+
+	if (!reap_running || strlen(fname) != CACHE_KEY_LEN) {
+		return 1;
+	}
+
+	errno = 0;
+	item = calloc(1, sizeof(*item));
+	if (!item) {
+		printerrno("calloc()");
+		return 1;
+	}
+	strcpy(item->fname, fname);
+	item->dev = dev;
+	item->ino = ino;
+
+	pthread_mutex_lock(&reap_mutex);
+	if (reap_tail) {
+		reap_tail->next = item;
+	} else {
+		reap_head = item;
+	}
+	reap_tail = item;
+	reap_pending++;
+	pthread_cond_signal(&reap_work_cond);
+	pthread_mutex_unlock(&reap_mutex);
+	return 0;
+}
+
+int reaper_cancel(const char *fname) {
+	/*
+	*  Cancel the deletion of the queued cache file 'fname', eg.
+	*  because it's needed again. If the file is being deleted this
+	*  waits until it's gone. Returns 1 if a queued deletion was
+	*  cancelled and 0 otherwise.
+	*/
+	REAPER_ITEM *prev = NULL;
+	REAPER_ITEM *item = NULL;
+	int busy = 0;
+
+	if (!reap_running) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&reap_mutex);
+	do {
+		busy = 0;
+		for (item = reap_busy; item; item = item->next) {
+			if (strcmp(item->fname, fname) == 0) {
+				busy = 1;
+				pthread_cond_wait(&reap_done_cond, &reap_mutex);
+				break;
+			}
+		}
+	} while (busy);
+
+	for (item = reap_head; item; prev = item, item = item->next) {
+		if (strcmp(item->fname, fname) != 0) {
+			continue;
+		}
+		if (prev) {
+			prev->next = item->next;
+		} else {
+			reap_head = item->next;
+		}
+		if (reap_tail == item) {
+			reap_tail = prev;
+		}
+		reap_pending--;
+		pthread_mutex_unlock(&reap_mutex);
+		free(item);
+		return 1;
+	}
+	pthread_mutex_unlock(&reap_mutex);
+	return 0;
+}
+
+void reaper_print_status(void) {
+	// Print the reaper counters to STDOUT.
+	pthread_mutex_lock(&reap_mutex);
+	fprintf(print_stdout, "Reaper:\n");
+	fprintf(print_stdout, "  Queued:       %zu\n", reap_pending);
+	fprintf(print_stdout, "  Deleted:      %llu\n", atomic_load(&reap_deleted));
+	fprintf(print_stdout, "  Replaced:     %llu\n", atomic_load(&reap_replaced));
+	fprintf(print_stdout, "  Stale tmp:    %llu\n", atomic_load(&reap_tmp));
+	fprintf(print_stdout, "  Orphans:      %llu\n", atomic_load(&reap_orphans));
+	fprintf(print_stdout, "  Scans:        %llu\n", atomic_load(&reap_scans));
+	fprintf(print_stdout, "  On disk:      %.2f MiB\n",
+		(double) atomic_load(&reap_disk_bytes)/REAPER_MIB);
+	pthread_mutex_unlock(&reap_mutex);
+}
+
+int reaper_setup(void) {
+	/*
+	*  Start the reaper thread. This must be called after the
+	*  cache system has been set up and after the worker processes
+	*  have been forked. Returns 0 on success and 1 on failure.
+	*/
+	const char *root = NULL;
+	char *lock_path = NULL;
+	long int max_mb = 0;
+	int ret = 0;
+
+	printverb("Setup.\n");
+	root = config_get_str_param("cache_root");
+	max_mb = config_get_lint_param("cache_max_mb");
+	if (!root || max_mb < 0) {
+		printerr("Invalid cache config.\n");
+		return 1;
+	}
+	reap_max_bytes = (size_t) max_mb*REAPER_MIB;
+
+	for (size_t i = 0; i < REAPER_SUBDIRS; i++) {
+		reap_dir_fds[i] = -1;
+	}
+
+	errno = 0;
+	reap_root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (reap_root_fd == -1) {
+		printerrno("open()");
+		return 1;
+	}
+
+	lock_path = file_path_join(2, root, CACHE_LOCK_FILE);
+	if (!lock_path) {
+		close(reap_root_fd);
+		reap_root_fd = -1;
+		return 1;
+	}
+	errno = 0;
+	reap_lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC,
+				S_IRUSR | S_IWUSR);
+	free(lock_path);
+	if (reap_lock_fd == -1) {
+		printerrno("open()");
+		close(reap_root_fd);
+		reap_root_fd = -1;
+		return 1;
+	}
+
+	atomic_store(&reap_stop, 0);
+	ret = pthread_create(&reap_thread, NULL, &reaper_worker, NULL);
+	if (ret != 0) {
+		errno = ret;
+		printerrno("pthread_create()");
+		close(reap_lock_fd);
+		close(reap_root_fd);
+		reap_lock_fd = -1;
+		reap_root_fd = -1;
+		return 1;
+	}
+	reap_running = 1;
+	return 0;
+}
+
+void reaper_cleanup(void) {
+	/*
+	*  Delete the queued files and stop the reaper thread.
+	*/
+	if (!reap_running) {
+		return;
+	}
+	printverb_va("Cleanup. Deleting %zu queued files.\n", reap_pending);
+	pthread_mutex_lock(&reap_mutex);
+	atomic_store(&reap_stop, 1);
+	pthread_cond_broadcast(&reap_work_cond);
+	pthread_mutex_unlock(&reap_mutex);
+	pthread_join(reap_thread, NULL);
+	reap_running = 0;
+
+	for (size_t i = 0; i < REAPER_SUBDIRS; i++) {
+		if (reap_dir_fds[i] != -1) {
+			close(reap_dir_fds[i]);
+			reap_dir_fds[i] = -1;
+		}
+	}
+	close(reap_lock_fd);
+	close(reap_root_fd);
+	reap_lock_fd = -1;
+	reap_root_fd = -1;
+}
@@ -0,0 +1,33 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef INCLUDED_REAPER_PRIV
+	#define INCLUDED_REAPER_PRIV
+
+	#include <sys/types.h>
+
+	int reaper_setup(void);
+	void reaper_cleanup(void);
+	int reaper_is_running(void);
+	int reaper_queue(const char *fname, const dev_t dev, const ino_t ino);
+	int reaper_cancel(const char *fname);
+	void reaper_print_status(void);
+#endif
@@ -0,0 +1,793 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/*
+*  The scheduler sits in front of the pipeline and decides which
+*  job gets to run its next plugin. Jobs are advanced one plugin
+*  at a time, so a higher priority job preempts lower priority
+*  work at the next plugin boundary. There's one scheduler thread
+*  per worker process, so with worker processes several jobs run
+*  at the same time.
+*
+*  With a memory budget, jobs are admitted only while the pixel
+*  memory is below the budget. A job that has been started always
+*  runs to the end so that it can free its memory, and one job is
+*  always admitted so that the queue can't stall.
+*
+*  At every plugin boundary the cache files that the queued jobs
+*  would resume from are handed to the prefetcher in the order the
+*  jobs would be run, so they are read while other jobs run.
+*/
+
+#define PRINT_IDENTIFIER "scheduler"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "oipcore/abi/output.h"
+#include "oipcore/scheduler.h"
+#include "oipcore/ptrarray.h"
+#include "oipcore/hashmap.h"
+#include "oipcore/memgov.h"
+#include "oipcore/taskpool.h"
+
+#include "pipeline_priv.h"
+#include "worker_priv.h"
+#include "prefetch_priv.h"
+
+typedef struct STRUCT_SCHED_SUBMITTER {
+	char *name;
+	unsigned int weight;
+	unsigned int pending;
+	double vtime;
+	double used_time;
+} SCHED_SUBMITTER;
+
+typedef struct STRUCT_SCHED_ENTRY {
+	JOB *job;
+	PIPELINE_RUN *run;
+	SCHED_SUBMITTER *submitter;
+	int priority;
+	int has_deadline;
+	struct timespec deadline;
+	unsigned long long int seq;
+	int running;
+	int admitted;
+	int deferred;
+	int prefetched;
+	int state;
+	int done;
+	atomic_int cancelled;
+	unsigned int refs;
+	void (*callback)(JOB *job, const int state, void *arg);
+	void *callback_arg;
+} SCHED_ENTRY;
+
+PTRARRAY_TYPE_DEF(SCHED_ENTRY);
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sched_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *sched_threads = NULL;
+static unsigned int sched_thread_count = 0;
+static int sched_thread_running = 0;
+static int sched_stop = 0;
+
+static PTRARRAY_TYPE(SCHED_ENTRY) *sched_queue = NULL;
+static HASHMAP *sched_jobs = NULL;
+static HASHMAP *sched_submitters = NULL;
+
+static unsigned long long int sched_seq = 0;
+static unsigned long long int sched_deadline_misses = 0;
+static unsigned int sched_admitted = 0;
+static double sched_vclock = 0;
+
+static void scheduler_submitter_free(void *submitter);
+static SCHED_SUBMITTER *scheduler_get_submitter(const char *name);
+static int scheduler_entry_cmp(const SCHED_ENTRY *a, const SCHED_ENTRY *b);
+static SCHED_ENTRY *scheduler_select(int *deferred);
+static int scheduler_entry_qsort_cmp(const void *a, const void *b);
+static void scheduler_prefetch(void);
+static void scheduler_unref(SCHED_ENTRY *entry);
+static void scheduler_finish(SCHED_ENTRY *entry, const int state);
+static double scheduler_elapsed(const struct timespec *t0,
+				const struct timespec *t1);
+static void *scheduler_worker(void *arg);
+
+static void scheduler_submitter_free(void *submitter) {
+	free(((SCHED_SUBMITTER*) submitter)->name);
+	free(submitter);
+}
+
+static SCHED_SUBMITTER *scheduler_get_submitter(const char *name) {
+	/*
+	*  Get the submitter 'name' or create it if it doesn't exist.
+	*  The scheduler mutex must be locked by the caller. Returns a
+	*  NULL pointer on failure.
+	*/
+	SCHED_SUBMITTER *ret = NULL;
+
+	ret = hashmap_get_str(sched_submitters, name);
+	if (ret) {
+		return ret;
+	}
+
+	errno = 0;
+	ret = calloc(1, sizeof(*ret));
+	if (!ret) {
+		printerrno("calloc()");
+		return NULL;
+	}
+
+	errno = 0;
+	ret->name = calloc(strlen(name) + 1, sizeof(*name));
+	if (!ret->name) {
+		printerrno("calloc()");
+		free(ret);
+		return NULL;
+	}
+	strcpy(ret->name, name);
+	ret->weight = SCHEDULER_DEFAULT_WEIGHT;
+	ret->vtime = sched_vclock;
+
+	if (hashmap_put_str(sched_submitters, name, ret) != 0) {
+		scheduler_submitter_free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+static int scheduler_entry_cmp(const SCHED_ENTRY *a, const SCHED_ENTRY *b) {
+	/*
+	*  Compare the scheduling order of two entries. Returns a
+	*  negative value if 'a' should be run before 'b' and a
+	*  positive value otherwise.
+	*/
+	if (a->priority != b->priority) {
+		return a->priority - b->priority;
+	}
+
+	// Entries with a deadline are run earliest deadline first.
+	if (a->has_deadline != b->has_deadline) {
+		return a->has_deadline ? -1 : 1;
+	} else if (a->has_deadline) {
+		if (a->deadline.tv_sec != b->deadline.tv_sec) {
+			return a->deadline.tv_sec < b->deadline.tv_sec ? -1 : 1;
+		} else if (a->deadline.tv_nsec != b->deadline.tv_nsec) {
+			return a->deadline.tv_nsec < b->deadline.tv_nsec ? -1 : 1;
+		}
+	}
+
+	// Weighted fair sharing between submitters.
+	if (a->submitter != b->submitter &&
+		a->submitter->vtime != b->submitter->vtime) {
+		return a->submitter->vtime < b->submitter->vtime ? -1 : 1;
+	}
+	return a->seq < b->seq ? -1 : 1;
+}
+
+static SCHED_ENTRY *scheduler_select(int *deferred) {
+	/*
+	*  Select the queued entry that should run next or return
+	*  a NULL pointer if there's nothing to run. '*deferred' is
+	*  set if an entry wasn't started because of the memory
+	*  budget. The scheduler mutex must be locked by the caller.
+	*/
+	SCHED_ENTRY *entry = NULL;
+	SCHED_ENTRY *ret = NULL;
+
+	*deferred = 0;
+	for (size_t i = 0; i < sched_queue->ptrc; i++) {
+		entry = sched_queue->ptrs[i];
+		if (entry->running || entry->done) {
+			continue;
+		}
+		if (atomic_load(&entry->cancelled)) {
+			// Reap cancelled entries right away.
+			return entry;
+		}
+		if (!entry->admitted && sched_admitted &&
+			memgov_over_budget(job_mem_estimate(entry->job))) {
+			if (!entry->deferred) {
+				printverb_va("Deferring job '%s' until memory is freed.\n",
+						entry->job->job_id);
+				memgov_note_deferred();
+				entry->deferred = 1;
+			}
+			*deferred = 1;
+			continue;
+		}
+		if (!ret || scheduler_entry_cmp(entry, ret) < 0) {
+			ret = entry;
+		}
+	}
+	if (ret && !ret->admitted) {
+		ret->admitted = 1;
+		sched_admitted++;
+	}
+	return ret;
+}
+
+static int scheduler_entry_qsort_cmp(const void *a, const void *b) {
+	return scheduler_entry_cmp(*(SCHED_ENTRY *const*) a, *(SCHED_ENTRY *const*) b);
+}
+
+static void scheduler_prefetch(void) {
+	/*
+	*  Request the prefetching of the cache files of the queued
+	*  jobs that haven't been started, in the order they would be
+	*  run. Each job is only planned once. The pipeline lock must
+	*  be held by the caller, so the jobs can't be destroyed
+	*  meanwhile.
+	*/
+	SCHED_ENTRY **pending = NULL;
+	JOB **jobs = NULL;
+	size_t count = 0;
+
+	if (!prefetch_is_running()) {
+		return;
+	}
+
+	pthread_mutex_lock(&sched_mutex);
+	errno = 0;
+	pending = calloc(sched_queue->ptrc + 1, sizeof(*pending));
+	jobs = calloc(sched_queue->ptrc + 1, sizeof(*jobs));
+	if (!pending || !jobs) {
+		printerrno("calloc()");
+		pthread_mutex_unlock(&sched_mutex);
+		free(pending);
+		free(jobs);
+		return;
+	}
+	for (size_t i = 0; i < sched_queue->ptrc; i++) {
+		if (!sched_queue->ptrs[i]->prefetched && !sched_queue->ptrs[i]->run &&
+			!sched_queue->ptrs[i]->running && !sched_queue->ptrs[i]->done &&
+			!atomic_load(&sched_queue->ptrs[i]->cancelled)) {
+			pending[count++] = sched_queue->ptrs[i];
+		}
+	}
+	qsort(pending, count, sizeof(*pending), &scheduler_entry_qsort_cmp);
+	for (size_t i = 0; i < count; i++) {
+		pending[i]->prefetched = 1;
+		jobs[i] = pending[i]->job;
+	}
+	pthread_mutex_unlock(&sched_mutex);
+
+	for (size_t i = 0; i < count; i++) {
+		pipeline_prefetch(jobs[i]);
+	}
+	free(pending);
+	free(jobs);
+}
+
+static void scheduler_unref(SCHED_ENTRY *entry) {
+	/*
+	*  Drop a reference to 'entry' and free it once there are no
+	*  references left. The scheduler mutex must be locked by the
+	*  caller.
+	*/
+	if (--entry->refs == 0) {
+		free(entry);
+	}
+}
+
+static void scheduler_finish(SCHED_ENTRY *entry, const int state) {
+	/*
+	*  Set the final state of 'entry', call its completion callback,
+	*  remove it from the queue and wake up the threads waiting for
+	*  it. The scheduler mutex must be locked by the caller. The
+	*  mutex is unlocked while the callback runs.
+	*/
+	PTRARRAY_TYPE(SCHED_ENTRY) *tmp_queue = NULL;
+	void (*callback)(JOB *job, const int state, void *arg) = NULL;
+	struct timespec now;
+
+	// Keep the entry from being selected while the callback runs.
+	entry->running = 1;
+	entry->state = state;
+	callback = entry->callback;
+	entry->callback = NULL;
+	if (callback) {
+		pthread_mutex_unlock(&sched_mutex);
+		callback(entry->job, state, entry->callback_arg);
+		pthread_mutex_lock(&sched_mutex);
+	}
+
+	if (entry->has_deadline) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > entry->deadline.tv_sec ||
+			(now.tv_sec == entry->deadline.tv_sec &&
+			now.tv_nsec > entry->deadline.tv_nsec)) {
+			printverb_va("Job '%s' missed its deadline.\n", entry->job->job_id);
+			sched_deadline_misses++;
+		}
+	}
+
+	tmp_queue = (PTRARRAY_TYPE(SCHED_ENTRY)*) ptrarray_pop_ptr(
+			(PTRARRAY_TYPE(void)*) sched_queue, entry, 0);
+	if (tmp_queue) {
+		sched_queue = tmp_queue;
+	} else {
+		printerr("Failed to remove entry from the queue.\n");
+	}
+	hashmap_pop_str(sched_jobs, entry->job->job_id);
+	prefetch_forget(entry->job->job_id);
+	entry->submitter->pending--;
+	entry->running = 0;
+	entry->done = 1;
+	if (entry->admitted) {
+		// The memory of the job may let deferred jobs start.
+		sched_admitted--;
+		pthread_cond_broadcast(&sched_work_cond);
+	}
+	pthread_cond_broadcast(&sched_done_cond);
+	scheduler_unref(entry);
+}
+
+static double scheduler_elapsed(const struct timespec *t0,
+				const struct timespec *t1) {
+	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec)/1e9;
+}
+
+static void *scheduler_worker(void *arg) {
+	/*
+	*  A scheduler worker thread. Runs one plugin of the selected
+	*  job at a time and charges the elapsed time to the submitter
+	*  of the job. 'arg' is the index of the worker.
+	*/
+	SCHED_ENTRY *entry = NULL;
+	struct timespec t0;
+	struct timespec t1;
+	struct timespec until;
+	double elapsed = 0;
+	int deferred = 0;
+	int status = 0;
+	int ret = 0;
+
+	pipeline_set_worker_id((unsigned int) (uintptr_t) arg);
+
+	/*
+	*  The plugins run by this thread submit their parallel loops
+	*  to the deque of the thread, where idle pool threads can
+	*  steal them. This thread runs them too while it waits.
+	*/
+	taskpool_join();
+
+	pthread_mutex_lock(&sched_mutex);
+	while (!sched_stop) {
+		entry = scheduler_select(&deferred);
+		if (!entry && deferred) {
+			/*
+			*  Memory can also be freed outside the scheduler,
+			*  so check the deferred jobs again after a while.
+			*/
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += MEMGOV_RECHECK_MS*1000000L;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&sched_work_cond, &sched_mutex, &until);
+			continue;
+		} else if (!entry) {
+			pthread_cond_wait(&sched_work_cond, &sched_mutex);
+			continue;
+		}
+		entry->running = 1;
+		entry->state = PIPELINE_HANDLE_RUNNING;
+		sched_vclock = entry->submitter->vtime;
+		pthread_mutex_unlock(&sched_mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		pipeline_lock();
+		ret = 0;
+		if (!entry->run && atomic_load(&entry->cancelled)) {
+			// Cancelled before the job was started.
+			entry->job->status = JOB_STATUS_CANCELLED;
+			status = PIPELINE_RUN_ERROR;
+			ret = 1;
+		} else if (!entry->run) {
+			memgov_relieve(job_mem_estimate(entry->job));
+			entry->run = pipeline_run_begin(entry->job);
+			if (entry->run) {
+				entry->run->cancel = &entry->cancelled;
+			}
+		}
+		if (entry->run) {
+			status = pipeline_run_step(entry->run);
+			if (status != PIPELINE_RUN_CONTINUE) {
+				ret = pipeline_run_end(entry->run);
+				entry->run = NULL;
+			}
+		} else if (!ret) {
+			printerr_va("Failed to start job '%s'.\n", entry->job->job_id);
+			status = PIPELINE_RUN_ERROR;
+			ret = 1;
+		}
+		scheduler_prefetch();
+		pipeline_unlock();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		elapsed = scheduler_elapsed(&t0, &t1);
+
+		pthread_mutex_lock(&sched_mutex);
+		entry->submitter->vtime += elapsed/entry->submitter->weight;
+		entry->submitter->used_time += elapsed;
+		entry->running = 0;
+		if (status != PIPELINE_RUN_CONTINUE) {
+			if (atomic_load(&entry->cancelled)) {
+				scheduler_finish(entry, PIPELINE_HANDLE_CANCELLED);
+			} else if (ret != 0) {
+				scheduler_finish(entry, PIPELINE_HANDLE_FAIL);
+			} else {
+				scheduler_finish(entry, PIPELINE_HANDLE_SUCCESS);
+			}
+		}
+	}
+	pthread_mutex_unlock(&sched_mutex);
+	return NULL;
+}
+
+PIPELINE_HANDLE *scheduler_submit(JOB *job) {
+	/*
+	*  Queue 'job' to be fed to the pipeline. The job is scheduled
+	*  according to its priority, deadline and submitter. Returns
+	*  a handle to the queued job that must be released using
+	*  scheduler_release() or a NULL pointer on failure.
+	*/
+	SCHED_ENTRY *entry = NULL;
+
+	if (!sched_thread_running) {
+		printerr("Scheduler not running.\n");
+		return NULL;
+	}
+
+	errno = 0;
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		printerrno("calloc()");
+		return NULL;
+	}
+	entry->job = job;
+	entry->priority = job->priority;
+	entry->state = PIPELINE_HANDLE_QUEUED;
+	atomic_init(&entry->cancelled, 0);
+	if (job->deadline_ms) {
+		clock_gettime(CLOCK_MONOTONIC, &entry->deadline);
+		entry->deadline.tv_sec += job->deadline_ms/1000;
+		entry->deadline.tv_nsec += (job->deadline_ms%1000)*1000000;
+		if (entry->deadline.tv_nsec >= 1000000000) {
+			entry->deadline.tv_sec++;
+			entry->deadline.tv_nsec -= 1000000000;
+		}
+		entry->has_deadline = 1;
+	}
+
+	pthread_mutex_lock(&sched_mutex);
+	if (hashmap_get_str(sched_jobs, job->job_id)) {
+		printerr_va("Job '%s' is already queued.\n", job->job_id);
+		pthread_mutex_unlock(&sched_mutex);
+		free(entry);
+		return NULL;
+	}
+
+	entry->submitter = scheduler_get_submitter(job->submitter);
+	if (!entry->submitter) {
+		pthread_mutex_unlock(&sched_mutex);
+		free(entry);
+		return NULL;
+	}
+
+	if (!ptrarray_put_ptr((PTRARRAY_TYPE(void)*) sched_queue, entry)) {
+		pthread_mutex_unlock(&sched_mutex);
+		free(entry);
+		return NULL;
+	}
+	if (hashmap_put_str(sched_jobs, job->job_id, entry) != 0) {
+		sched_queue->ptrs[--sched_queue->ptrc] = NULL;
+		pthread_mutex_unlock(&sched_mutex);
+		free(entry);
+		return NULL;
+	}
+	entry->seq = sched_seq++;
+
+	// One reference for the scheduler and one for the caller.
+	entry->refs = 2;
+
+	/*
+	*  A submitter that becomes active again starts from the current
+	*  virtual time so that it can't save up credit while idle.
+	*/
+	if (entry->submitter->pending++ == 0 &&
+		entry->submitter->vtime < sched_vclock) {
+		entry->submitter->vtime = sched_vclock;
+	}
+
+	printverb_va("Queued job '%s' (%s, %s).\n", job->job_id,
+			job_priority_to_str(entry->priority), job->submitter);
+	pthread_cond_signal(&sched_work_cond);
+	pthread_mutex_unlock(&sched_mutex);
+	return entry;
+}
+
+int scheduler_wait(PIPELINE_HANDLE *handle) {
+	/*
+	*  Wait until the job of 'handle' has finished and
+	*  return its final PIPELINE_HANDLE_* state.
+	*/
+	int ret = 0;
+
+	pthread_mutex_lock(&sched_mutex);
+	while (!handle->done) {
+		pthread_cond_wait(&sched_done_cond, &sched_mutex);
+	}
+	ret = handle->state;
+	pthread_mutex_unlock(&sched_mutex);
+	return ret;
+}
+
+int scheduler_poll(PIPELINE_HANDLE *handle) {
+	/*
+	*  Return the current PIPELINE_HANDLE_* state of 'handle'.
+	*/
+	int ret = 0;
+
+	pthread_mutex_lock(&sched_mutex);
+	ret = handle->state;
+	pthread_mutex_unlock(&sched_mutex);
+	return ret;
+}
+
+int scheduler_cancel(PIPELINE_HANDLE *handle) {
+	/*
+	*  Request the cancellation of the job of 'handle'. The worker
+	*  thread drops the job before its next plugin step. Returns 0
+	*  on success and 1 if the job has already finished.
+	*/
+	pthread_mutex_lock(&sched_mutex);
+	if (handle->state >= PIPELINE_HANDLE_SUCCESS) {
+		pthread_mutex_unlock(&sched_mutex);
+		return 1;
+	}
+	printverb_va("Cancelling job '%s'.\n", handle->job->job_id);
+	atomic_store(&handle->cancelled, 1);
+	pthread_cond_signal(&sched_work_cond);
+	pthread_mutex_unlock(&sched_mutex);
+	return 0;
+}
+
+int scheduler_on_done(PIPELINE_HANDLE *handle,
+		void (*const callback)(JOB *job, const int state, void *arg),
+		void *arg) {
+	/*
+	*  Set the completion callback of 'handle'. If the job has
+	*  already finished the callback is called immediately.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	int state = 0;
+
+	if (!callback) {
+		printerr("Won't register a NULL pointer as a completion callback.\n");
+		return 1;
+	}
+
+	pthread_mutex_lock(&sched_mutex);
+	if (handle->state >= PIPELINE_HANDLE_SUCCESS) {
+		state = handle->state;
+		pthread_mutex_unlock(&sched_mutex);
+		callback(handle->job, state, arg);
+		return 0;
+	}
+	handle->callback = callback;
+	handle->callback_arg = arg;
+	pthread_mutex_unlock(&sched_mutex);
+	return 0;
+}
+
+void scheduler_release(PIPELINE_HANDLE *handle) {
+	/*
+	*  Release a handle returned by scheduler_submit().
+	*/
+	pthread_mutex_lock(&sched_mutex);
+	scheduler_unref(handle);
+	pthread_mutex_unlock(&sched_mutex);
+}
+
+int scheduler_has_job(const JOB *job) {
+	/*
+	*  Return 1 if 'job' is queued or running and 0 otherwise.
+	*/
+	int ret = 0;
+
+	pthread_mutex_lock(&sched_mutex);
+	if (sched_jobs && hashmap_get_str(sched_jobs, job->job_id)) {
+		ret = 1;
+	}
+	pthread_mutex_unlock(&sched_mutex);
+	return ret;
+}
+
+int scheduler_feed(JOB *job) {
+	/*
+	*  Queue 'job' to be fed to the pipeline and wait until it's
+	*  finished. Returns 0 on success and 1 on failure.
+	*/
+	PIPELINE_HANDLE *handle = NULL;
+	int ret = 0;
+
+	handle = scheduler_submit(job);
+	if (!handle) {
+		return 1;
+	}
+	ret = scheduler_wait(handle);
+	scheduler_release(handle);
+	if (ret != PIPELINE_HANDLE_SUCCESS) {
+		return 1;
+	}
+	return 0;
+}
+
+int scheduler_set_weight(const char *submitter, const unsigned int weight) {
+	/*
+	*  Set the fair share weight of 'submitter'. A submitter with
+	*  twice the weight of another one gets twice the pipeline time
+	*  when both have jobs queued. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	SCHED_SUBMITTER *tmp = NULL;
+
+	if (weight == 0) {
+		printerr("Submitter weight must be positive.\n");
+		return 1;
+	}
+
+	pthread_mutex_lock(&sched_mutex);
+	tmp = scheduler_get_submitter(submitter);
+	if (!tmp) {
+		pthread_mutex_unlock(&sched_mutex);
+		return 1;
+	}
+	tmp->weight = weight;
+	pthread_mutex_unlock(&sched_mutex);
+	return 0;
+}
+
+void scheduler_print_status(void) {
+	/*
+	*  Print the scheduler queue and submitter info to STDOUT.
+	*/
+	SCHED_SUBMITTER *submitter = NULL;
+	SCHED_ENTRY *entry = NULL;
+	size_t iter = 0;
+
+	pthread_mutex_lock(&sched_mutex);
+	fprintf(print_stdout, "\n==== SCHEDULER ====\n");
+	fprintf(print_stdout, "    Queued jobs:     %zu\n", sched_queue->ptrc);
+	for (size_t i = 0; i < sched_queue->ptrc; i++) {
+		entry = sched_queue->ptrs[i];
+		fprintf(print_stdout, "        %s: %s, %s%s\n", entry->job->job_id,
+			job_priority_to_str(entry->priority),
+			entry->submitter->name,
+			entry->running ? " (running)" :
+			atomic_load(&entry->cancelled) ? " (cancelling)" : "");
+	}
+	fprintf(print_stdout, "    Deadline misses: %llu\n", sched_deadline_misses);
+	fprintf(print_stdout, "    Submitters:\n");
+	while (hashmap_next(sched_submitters, &iter, (void**) &submitter)) {
+		fprintf(print_stdout, "        %s: weight %u, pending %u, time %f s\n",
+			submitter->name, submitter->weight,
+			submitter->pending, submitter->used_time);
+	}
+	fprintf(print_stdout, "==== SCHEDULER ====\n\n");
+	pthread_mutex_unlock(&sched_mutex);
+}
+
+int scheduler_setup(void) {
+	/*
+	*  Setup the scheduler and start the worker threads.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	int ret = 0;
+
+	printverb("Setup.\n");
+	sched_queue = (PTRARRAY_TYPE(SCHED_ENTRY)*) ptrarray_create(NULL);
+	sched_jobs = hashmap_create(HASHMAP_KEY_STR, NULL);
+	sched_submitters = hashmap_create(HASHMAP_KEY_STR, &scheduler_submitter_free);
+	if (!sched_queue || !sched_jobs || !sched_submitters) {
+		scheduler_cleanup();
+		return 1;
+	}
+
+	// One thread per worker process or a single thread without them.
+	sched_thread_count = workers_count() ? workers_count() : 1;
+	errno = 0;
+	sched_threads = calloc(sched_thread_count, sizeof(*sched_threads));
+	if (!sched_threads) {
+		printerrno("calloc()");
+		scheduler_cleanup();
+		return 1;
+	}
+
+	sched_stop = 0;
+	for (unsigned int i = 0; i < sched_thread_count; i++) {
+		ret = pthread_create(&sched_threads[i], NULL, &scheduler_worker,
+					(void*) (uintptr_t) i);
+		if (ret != 0) {
+			errno = ret;
+			printerrno("pthread_create()");
+			sched_thread_count = i;
+			sched_thread_running = i != 0;
+			scheduler_cleanup();
+			return 1;
+		}
+	}
+	sched_thread_running = 1;
+	return 0;
+}
+
+void scheduler_cleanup(void) {
+	/*
+	*  Stop the worker threads and fail all jobs that are
+	*  still queued.
+	*/
+	printverb("Cleanup.\n");
+	if (sched_thread_running) {
+		pthread_mutex_lock(&sched_mutex);
+		sched_stop = 1;
+		pthread_cond_broadcast(&sched_work_cond);
+		pthread_mutex_unlock(&sched_mutex);
+		for (unsigned int i = 0; i < sched_thread_count; i++) {
+			pthread_join(sched_threads[i], NULL);
+		}
+		sched_thread_running = 0;
+	}
+	free(sched_threads);
+	sched_threads = NULL;
+	sched_thread_count = 0;
+
+	pthread_mutex_lock(&sched_mutex);
+	while (sched_queue && sched_queue->ptrc) {
+		if (sched_queue->ptrs[0]->run) {
+			sched_queue->ptrs[0]->run->ret = 1;
+			pipeline_run_end(sched_queue->ptrs[0]->run);
+			sched_queue->ptrs[0]->run = NULL;
+		}
+		scheduler_finish(sched_queue->ptrs[0], PIPELINE_HANDLE_FAIL);
+	}
+	if (sched_queue) {
+		ptrarray_free((PTRARRAY_TYPE(void)*) sched_queue);
+		sched_queue = NULL;
+	}
+	if (sched_jobs) {
+		hashmap_destroy(sched_jobs, 0);
+		sched_jobs = NULL;
+	}
+	if (sched_submitters) {
+		hashmap_destroy(sched_submitters, 1);
+		sched_submitters = NULL;
+	}
+	pthread_mutex_unlock(&sched_mutex);
+}
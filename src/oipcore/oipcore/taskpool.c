@@ -0,0 +1,592 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/*
+*  A work-stealing task pool shared by everything in the core that
+*  can split its work into parallel pieces. Every pool thread and
+*  every outside thread that submits tasks, like the scheduler
+*  threads that run the jobs, has its own deque of tasks. A thread
+*  pushes and pops tasks at the bottom of its own deque and idle
+*  threads steal from the top of the others, so the oldest and
+*  largest pieces of work are the ones that move between threads.
+*  A thread that waits for its tasks runs queued tasks meanwhile,
+*  which makes nested parallelism safe and keeps a single huge job
+*  from leaving cores idle while the other jobs are small. The
+*  deques of outside threads are returned to a free list when the
+*  threads exit, so short-lived threads don't use them up.
+*/
+
+#define PRINT_IDENTIFIER "taskpool"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "oipcore/abi/output.h"
+#include "oipcore/taskpool.h"
+
+#include "configloader_priv.h"
+#include "perfctr_priv.h"
+
+// The deque index of a thread that couldn't get a deque.
+#define TASKPOOL_NO_DEQUE -2
+
+/*
+*  A queued task. 'perf' is the hardware counter sink of the
+*  thread that queued the task, which also counts the task.
+*/
+typedef struct STRUCT_TASKPOOL_TASK {
+	void (*fn)(void *arg, size_t begin, size_t end);
+	void *arg;
+	size_t begin;
+	size_t end;
+	atomic_size_t *pending;
+	PERFCTR_SINK *perf;
+} TASKPOOL_TASK;
+
+/*
+*  A task deque. 'top' and 'bottom' only grow and the tasks
+*  between them are stored in 'tasks' modulo its length.
+*/
+typedef struct STRUCT_TASKPOOL_DEQUE {
+	pthread_mutex_t mutex;
+	size_t top;
+	size_t bottom;
+	TASKPOOL_TASK tasks[TASKPOOL_DEQUE_LEN];
+} TASKPOOL_DEQUE;
+
+/*
+*  A parallel loop. 'pending' counts the pieces of the
+*  loop that are queued or running on other threads.
+*/
+typedef struct STRUCT_TASKPOOL_FOR {
+	void (*body)(void *arg, size_t begin, size_t end);
+	void *arg;
+	size_t grain;
+	atomic_size_t pending;
+} TASKPOOL_FOR;
+
+static pthread_mutex_t tp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tp_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *tp_threads = NULL;
+static unsigned int tp_thread_count = 0;
+static int tp_running = 0;
+static int tp_stop = 0;
+
+static TASKPOOL_DEQUE *tp_deques = NULL;
+static size_t tp_deque_len = 0;
+static atomic_uint tp_external = 0;
+
+/*
+*  The external deques that have been left, protected by
+*  'tp_mutex'. 'tp_key' leaves the deque of a thread when
+*  the thread exits.
+*/
+static unsigned int tp_free[TASKPOOL_MAX_EXTERNAL];
+static unsigned int tp_free_count = 0;
+static pthread_key_t tp_key;
+static int tp_key_created = 0;
+static atomic_size_t tp_queued = 0;
+static atomic_uint tp_sleepers = 0;
+
+static atomic_ullong tp_tasks_run = 0;
+static atomic_ullong tp_steals = 0;
+static atomic_ullong tp_loops = 0;
+
+static _Thread_local int tp_self = -1;
+
+static unsigned int taskpool_deque_count(void);
+static int taskpool_self(void);
+static int taskpool_push(const int self, const TASKPOOL_TASK *task);
+static int taskpool_take(const int self, TASKPOOL_TASK *task);
+static void taskpool_run(const TASKPOOL_TASK *task);
+static void taskpool_wait(const int self, atomic_size_t *pending);
+static void taskpool_for_split(TASKPOOL_FOR *loop, const int self,
+				size_t begin, size_t end);
+static void taskpool_for_task(void *arg, size_t begin, size_t end);
+static void *taskpool_thread(void *arg);
+static void taskpool_release(void *slot);
+
+static unsigned int taskpool_deque_count(void) {
+	// Return the number of deques that are in use.
+	unsigned int external = atomic_load(&tp_external);
+
+	if (external > TASKPOOL_MAX_EXTERNAL) {
+		external = TASKPOOL_MAX_EXTERNAL;
+	}
+	return tp_thread_count + external;
+}
+
+static int taskpool_self(void) {
+	/*
+	*  Return the deque index of the calling thread or a negative
+	*  value if the thread has no deque and must run its tasks
+	*  serially.
+	*/
+	if (tp_self == -1) {
+		taskpool_join();
+	}
+	return tp_self;
+}
+
+static int taskpool_push(const int self, const TASKPOOL_TASK *task) {
+	/*
+	*  Push 'task' to the bottom of the deque 'self'. Returns 0
+	*  on success and 1 if the deque is full.
+	*/
+	TASKPOOL_DEQUE *deque = &tp_deques[self];
+
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->bottom - deque->top == TASKPOOL_DEQUE_LEN) {
+		pthread_mutex_unlock(&deque->mutex);
+		return 1;
+	}
+	atomic_fetch_add(task->pending, 1);
+	deque->tasks[deque->bottom%TASKPOOL_DEQUE_LEN] = *task;
+	deque->bottom++;
+	pthread_mutex_unlock(&deque->mutex);
+
+	/*
+	*  The sleepers check 'tp_queued' with 'tp_mutex' locked, so
+	*  incrementing it before locking the mutex can't lose a wakeup.
+	*/
+	atomic_fetch_add(&tp_queued, 1);
+	if (atomic_load(&tp_sleepers)) {
+		pthread_mutex_lock(&tp_mutex);
+		pthread_cond_signal(&tp_cond);
+		pthread_mutex_unlock(&tp_mutex);
+	}
+	return 0;
+}
+
+static int taskpool_take(const int self, TASKPOOL_TASK *task) {
+	/*
+	*  Pop the newest task of the deque 'self' or steal the oldest
+	*  task of some other deque. Returns 1 if a task was stored in
+	*  '*task' and 0 if there was nothing to run.
+	*/
+	TASKPOOL_DEQUE *deque = &tp_deques[self];
+	unsigned int count = 0;
+	unsigned int victim = 0;
+
+	if (!atomic_load(&tp_queued)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->bottom != deque->top) {
+		deque->bottom--;
+		*task = deque->tasks[deque->bottom%TASKPOOL_DEQUE_LEN];
+		pthread_mutex_unlock(&deque->mutex);
+		atomic_fetch_sub(&tp_queued, 1);
+		return 1;
+	}
+	pthread_mutex_unlock(&deque->mutex);
+
+	count = taskpool_deque_count();
+	for (unsigned int i = 1; i < count; i++) {
+		victim = (self + i)%count;
+		deque = &tp_deques[victim];
+		pthread_mutex_lock(&deque->mutex);
+		if (deque->bottom != deque->top) {
+			*task = deque->tasks[deque->top%TASKPOOL_DEQUE_LEN];
+			deque->top++;
+			pthread_mutex_unlock(&deque->mutex);
+			atomic_fetch_sub(&tp_queued, 1);
+			atomic_fetch_add(&tp_steals, 1);
+			return 1;
+		}
+		pthread_mutex_unlock(&deque->mutex);
+	}
+	return 0;
+}
+
+static void taskpool_run(const TASKPOOL_TASK *task) {
+	/*
+	*  Run 'task' and wake up the waiters once the last
+	*  task of its group has finished.
+	*/
+	PERFCTR_SINK *perf = NULL;
+
+	perf = perfctr_switch(task->perf);
+	task->fn(task->arg, task->begin, task->end);
+	perfctr_switch(perf);
+	atomic_fetch_add(&tp_tasks_run, 1);
+	if (atomic_fetch_sub(task->pending, 1) == 1) {
+		pthread_mutex_lock(&tp_mutex);
+		pthread_cond_broadcast(&tp_cond);
+		pthread_mutex_unlock(&tp_mutex);
+	}
+}
+
+static void taskpool_wait(const int self, atomic_size_t *pending) {
+	/*
+	*  Wait until '*pending' reaches zero. Queued tasks are run
+	*  while waiting so that nested waits can't deadlock.
+	*/
+	TASKPOOL_TASK task;
+
+	while (atomic_load(pending)) {
+		if (taskpool_take(self, &task)) {
+			taskpool_run(&task);
+			continue;
+		}
+
+		// The rest of the tasks are running on other threads.
+		pthread_mutex_lock(&tp_mutex);
+		atomic_fetch_add(&tp_sleepers, 1);
+		while (atomic_load(pending) && !atomic_load(&tp_queued)) {
+			pthread_cond_wait(&tp_cond, &tp_mutex);
+		}
+		atomic_fetch_sub(&tp_sleepers, 1);
+		pthread_mutex_unlock(&tp_mutex);
+	}
+}
+
+static void taskpool_for_split(TASKPOOL_FOR *loop, const int self,
+				size_t begin, size_t end) {
+	/*
+	*  Split the range 'begin' - 'end' of 'loop' in halves until
+	*  it's no longer than the grain size and run the first piece.
+	*  The other halves are queued so that thieves take the biggest
+	*  pieces first. A piece that doesn't fit in the deque is run
+	*  right away.
+	*/
+	TASKPOOL_TASK task;
+	size_t mid = 0;
+
+	task.fn = &taskpool_for_task;
+	task.arg = loop;
+	task.pending = &loop->pending;
+	task.perf = perfctr_current();
+	while (end - begin > loop->grain) {
+		mid = begin + (end - begin)/2;
+		task.begin = mid;
+		task.end = end;
+		if (taskpool_push(self, &task) != 0) {
+			break;
+		}
+		end = mid;
+	}
+	loop->body(loop->arg, begin, end);
+}
+
+static void taskpool_for_task(void *arg, size_t begin, size_t end) {
+	// Run a queued piece of a parallel loop.
+	taskpool_for_split((TASKPOOL_FOR*) arg, tp_self, begin, end);
+}
+
+static void *taskpool_thread(void *arg) {
+	/*
+	*  A pool thread. Runs tasks from its own deque and steals
+	*  from the others when it runs out. 'arg' is the index of
+	*  the deque of the thread.
+	*/
+	TASKPOOL_TASK task;
+
+	tp_self = (int) (uintptr_t) arg;
+	for (;;) {
+		if (taskpool_take(tp_self, &task)) {
+			taskpool_run(&task);
+			continue;
+		}
+		pthread_mutex_lock(&tp_mutex);
+		atomic_fetch_add(&tp_sleepers, 1);
+		while (!tp_stop && !atomic_load(&tp_queued)) {
+			pthread_cond_wait(&tp_cond, &tp_mutex);
+		}
+		atomic_fetch_sub(&tp_sleepers, 1);
+		if (tp_stop) {
+			pthread_mutex_unlock(&tp_mutex);
+			break;
+		}
+		pthread_mutex_unlock(&tp_mutex);
+	}
+	return NULL;
+}
+
+int taskpool_join(void) {
+	/*
+	*  Give the calling thread a deque so that the tasks it submits
+	*  can be stolen by the pool threads. Threads join automatically
+	*  when they first submit tasks, but long-lived threads like the
+	*  scheduler threads join when they start. The deque is left
+	*  when the thread exits or calls taskpool_leave(). Returns 0
+	*  on success and 1 if there are no free deques left, in which
+	*  case the tasks of the thread are run serially.
+	*/
+	unsigned int index = 0;
+
+	if (tp_self >= 0) {
+		return 0;
+	} else if (tp_self == TASKPOOL_NO_DEQUE || !tp_running) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&tp_mutex);
+	if (tp_free_count) {
+		index = tp_free[--tp_free_count];
+	} else if (atomic_load(&tp_external) < TASKPOOL_MAX_EXTERNAL) {
+		index = atomic_fetch_add(&tp_external, 1);
+	} else {
+		pthread_mutex_unlock(&tp_mutex);
+		printverb("Out of task deques. Running tasks serially.\n");
+		tp_self = TASKPOOL_NO_DEQUE;
+		return 1;
+	}
+	pthread_mutex_unlock(&tp_mutex);
+
+	tp_self = (int) (tp_thread_count + index);
+	pthread_setspecific(tp_key, (void*) (uintptr_t) (index + 1));
+	return 0;
+}
+
+static void taskpool_release(void *slot) {
+	/*
+	*  Return the external deque 'slot' - 1 to the free list. A
+	*  deque that still has tasks queued is never used again.
+	*/
+	unsigned int index = (unsigned int) (uintptr_t) slot - 1;
+	TASKPOOL_DEQUE *deque = NULL;
+	int empty = 0;
+
+	if (!tp_deques) {
+		return;
+	}
+	deque = &tp_deques[tp_thread_count + index];
+	pthread_mutex_lock(&deque->mutex);
+	empty = deque->bottom == deque->top;
+	pthread_mutex_unlock(&deque->mutex);
+	if (!empty) {
+		printerr("A thread left the pool with tasks queued.\n");
+		return;
+	}
+
+	pthread_mutex_lock(&tp_mutex);
+	tp_free[tp_free_count++] = index;
+	pthread_mutex_unlock(&tp_mutex);
+}
+
+void taskpool_leave(void) {
+	/*
+	*  Return the deque of the calling thread to the pool. This
+	*  is done automatically when the thread exits. The thread
+	*  must not have tasks queued.
+	*/
+	void *slot = NULL;
+
+	if (tp_self < (int) tp_thread_count) {
+		return;
+	}
+	slot = pthread_getspecific(tp_key);
+	pthread_setspecific(tp_key, NULL);
+	tp_self = -1;
+	if (slot) {
+		taskpool_release(slot);
+	}
+}
+
+unsigned int taskpool_thread_count(void) {
+	return tp_thread_count;
+}
+
+int taskpool_parallel_for(const size_t n, const size_t grain,
+			void (*const body)(void *arg, size_t begin, size_t end),
+			void *arg) {
+	/*
+	*  Call 'body' for disjoint subranges of 0 - 'n' that together
+	*  cover the whole range and return once every call has returned.
+	*  The subranges are at most 'grain' long unless the deque of the
+	*  calling thread is full. 'body' may be called from any thread
+	*  of the pool and it may call this function again. Without the
+	*  pool, like in worker processes, the whole range is passed to
+	*  'body' at once. Returns 0 on success and 1 on failure.
+	*/
+	TASKPOOL_FOR loop;
+	int self = 0;
+
+	if (!body) {
+		printerr("Won't run a NULL loop body.\n");
+		return 1;
+	} else if (!n) {
+		return 0;
+	}
+
+	loop.body = body;
+	loop.arg = arg;
+	loop.grain = grain ? grain : 1;
+	atomic_init(&loop.pending, 0);
+
+	self = tp_running ? taskpool_self() : -1;
+	if (self < 0 || !tp_thread_count || n <= loop.grain) {
+		body(arg, 0, n);
+		return 0;
+	}
+
+	atomic_fetch_add(&tp_loops, 1);
+	taskpool_for_split(&loop, self, 0, n);
+	taskpool_wait(self, &loop.pending);
+	return 0;
+}
+
+void taskpool_print_status(void) {
+	/*
+	*  Print the task pool counters to STDOUT.
+	*/
+	unsigned int joined = 0;
+
+	pthread_mutex_lock(&tp_mutex);
+	joined = taskpool_deque_count() - tp_thread_count - tp_free_count;
+	pthread_mutex_unlock(&tp_mutex);
+
+	fprintf(print_stdout, "\n==== TASK POOL ====\n");
+	fprintf(print_stdout, "    Threads:         %u\n", tp_thread_count);
+	fprintf(print_stdout, "    Joined threads:  %u\n", joined);
+	fprintf(print_stdout, "    Parallel loops:  %llu\n", atomic_load(&tp_loops));
+	fprintf(print_stdout, "    Tasks run:       %llu\n", atomic_load(&tp_tasks_run));
+	fprintf(print_stdout, "    Tasks stolen:    %llu\n", atomic_load(&tp_steals));
+	fprintf(print_stdout, "==== TASK POOL ====\n\n");
+}
+
+int taskpool_setup(void) {
+	/*
+	*  Start the pool threads. The config parameter 'task_threads'
+	*  sets the number of threads. By default there's one thread
+	*  less than there are online CPUs because the threads that
+	*  submit tasks also run them. This must be called after the
+	*  worker processes have been started. Returns 0 on success
+	*  and 1 on failure.
+	*/
+	long int count = 0;
+	int ret = 0;
+
+	printverb("Setup.\n");
+	count = config_get_lint_param("task_threads");
+	if (count < 0) {
+		printerr("Invalid task thread count.\n");
+		return 1;
+	} else if (count == 0) {
+		errno = 0;
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+		if (count < 0) {
+			printerrno("sysconf()");
+			count = 1;
+		}
+		count--;
+	}
+
+	errno = 0;
+	tp_deques = calloc(count + TASKPOOL_MAX_EXTERNAL, sizeof(*tp_deques));
+	if (!tp_deques) {
+		printerrno("calloc()");
+		return 1;
+	}
+	tp_deque_len = count + TASKPOOL_MAX_EXTERNAL;
+	for (size_t i = 0; i < tp_deque_len; i++) {
+		pthread_mutex_init(&tp_deques[i].mutex, NULL);
+	}
+
+	ret = pthread_key_create(&tp_key, &taskpool_release);
+	if (ret != 0) {
+		errno = ret;
+		printerrno("pthread_key_create()");
+		taskpool_cleanup();
+		return 1;
+	}
+	tp_key_created = 1;
+
+	errno = 0;
+	tp_threads = calloc(count ? count : 1, sizeof(*tp_threads));
+	if (!tp_threads) {
+		printerrno("calloc()");
+		taskpool_cleanup();
+		return 1;
+	}
+
+	/*
+	*  The deques are used by index, so 'tp_thread_count' must be
+	*  the final thread count before any thread starts stealing.
+	*/
+	tp_stop = 0;
+	tp_thread_count = (unsigned int) count;
+	atomic_store(&tp_external, 0);
+	tp_free_count = 0;
+	for (unsigned int i = 0; i < tp_thread_count; i++) {
+		ret = pthread_create(&tp_threads[i], NULL, &taskpool_thread,
+					(void*) (uintptr_t) i);
+		if (ret != 0) {
+			errno = ret;
+			printerrno("pthread_create()");
+			pthread_mutex_lock(&tp_mutex);
+			tp_stop = 1;
+			pthread_cond_broadcast(&tp_cond);
+			pthread_mutex_unlock(&tp_mutex);
+			for (unsigned int j = 0; j < i; j++) {
+				pthread_join(tp_threads[j], NULL);
+			}
+			tp_thread_count = 0;
+			taskpool_cleanup();
+			return 1;
+		}
+	}
+	printverb_va("Started %u task threads.\n", tp_thread_count);
+	tp_running = 1;
+	return 0;
+}
+
+void taskpool_cleanup(void) {
+	/*
+	*  Stop the pool threads. No tasks may be running when
+	*  this is called.
+	*/
+	printverb("Cleanup.\n");
+	if (tp_running) {
+		tp_running = 0;
+		pthread_mutex_lock(&tp_mutex);
+		tp_stop = 1;
+		pthread_cond_broadcast(&tp_cond);
+		pthread_mutex_unlock(&tp_mutex);
+		for (unsigned int i = 0; i < tp_thread_count; i++) {
+			pthread_join(tp_threads[i], NULL);
+		}
+	}
+	if (tp_key_created) {
+		pthread_key_delete(tp_key);
+		tp_key_created = 0;
+	}
+	if (tp_deques) {
+		for (size_t i = 0; i < tp_deque_len; i++) {
+			pthread_mutex_destroy(&tp_deques[i].mutex);
+		}
+		free(tp_deques);
+		tp_deques = NULL;
+		tp_deque_len = 0;
+	}
+	free(tp_threads);
+	tp_threads = NULL;
+	tp_thread_count = 0;
+}
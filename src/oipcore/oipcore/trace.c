@@ -0,0 +1,331 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/*
+*  Timeline tracing. When tracing is enabled with 'oipshell -t
+*  <file>', begin and end events of the traced operations are
+*  recorded with their thread IDs and written to the file as
+*  Chrome trace-event JSON at exit, which eg. Perfetto can show.
+*
+*  Every thread records into a buffer of its own, so recording
+*  takes no locks. A buffer is a list of fixed-size chunks that
+*  only its thread appends to. The buffers are pushed onto a
+*  global list with a compare-and-swap when a thread records its
+*  first event and they are only read once tracing has stopped.
+*/
+
+#define _GNU_SOURCE
+
+#define PRINT_IDENTIFIER "trace"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "oipcore/abi/output.h"
+
+#include "trace_priv.h"
+
+// The number of events in a chunk of a trace buffer.
+#define TRACE_CHUNK_LEN 4096
+
+// The maximum number of events recorded by a thread.
+#define TRACE_MAX_EVENTS (1024*TRACE_CHUNK_LEN)
+
+// The maximum length of the detail string of an event.
+#define TRACE_DETAIL_LEN 64
+
+#define TRACE_PHASE_BEGIN 'B'
+#define TRACE_PHASE_END   'E'
+
+/*
+*  A trace event. 'name' must be a string that outlives the
+*  trace and 'detail' is a copy of an optional string, eg. the
+*  name of a plugin. 'ts' is the time since the trace was started
+*  in nanoseconds.
+*/
+typedef struct STRUCT_TRACE_EVENT {
+	const char *name;
+	char detail[TRACE_DETAIL_LEN];
+	uint64_t ts;
+	char phase;
+} TRACE_EVENT;
+
+typedef struct STRUCT_TRACE_CHUNK {
+	TRACE_EVENT events[TRACE_CHUNK_LEN];
+	struct STRUCT_TRACE_CHUNK *next;
+} TRACE_CHUNK;
+
+/*
+*  The trace buffer of a thread. 'count' is published after an
+*  event has been written, so a reader sees complete events.
+*/
+typedef struct STRUCT_TRACE_BUF {
+	pid_t tid;
+	TRACE_CHUNK *head;
+	TRACE_CHUNK *tail;
+	atomic_size_t count;
+	size_t dropped;
+	struct STRUCT_TRACE_BUF *next;
+} TRACE_BUF;
+
+static atomic_int trace_enabled = 0;
+static char *trace_path = NULL;
+static struct timespec trace_t0;
+static TRACE_BUF *_Atomic trace_bufs = NULL;
+static _Thread_local TRACE_BUF *trace_buf = NULL;
+
+static TRACE_BUF *trace_get_buf(void);
+static void trace_record(const char phase, const char *name,
+			const char *detail);
+static void trace_write_str(FILE *f, const char *str);
+static int trace_write(FILE *f);
+
+static TRACE_BUF *trace_get_buf(void) {
+	/*
+	*  Return the trace buffer of the calling thread. The buffer
+	*  is created on the first call. Returns a NULL pointer on
+	*  failure.
+	*/
+	TRACE_BUF *head = NULL;
+
+	if (trace_buf) {
+		return trace_buf;
+	}
+
+	errno = 0;
+	trace_buf = calloc(1, sizeof(*trace_buf));
+	if (!trace_buf) {
+		printerrno("calloc()");
+		return NULL;
+	}
+	trace_buf->tid = (pid_t) syscall(SYS_gettid);
+	atomic_init(&trace_buf->count, 0);
+
+	head = atomic_load(&trace_bufs);
+	do {
+		trace_buf->next = head;
+	} while (!atomic_compare_exchange_weak(&trace_bufs, &head, trace_buf));
+	return trace_buf;
+}
+
+static void trace_record(const char phase, const char *name,
+			const char *detail) {
+	/*
+	*  Record an event of 'phase' in the buffer of the calling
+	*  thread. Events that don't fit are counted as dropped.
+	*/
+	TRACE_CHUNK *chunk = NULL;
+	TRACE_EVENT *event = NULL;
+	struct timespec t;
+	TRACE_BUF *buf = NULL;
+	size_t count = 0;
+	size_t len = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	buf = trace_get_buf();
+	if (!buf) {
+		return;
+	}
+	count = atomic_load_explicit(&buf->count, memory_order_relaxed);
+	if (count >= TRACE_MAX_EVENTS) {
+		buf->dropped++;
+		return;
+	}
+
+	if (count%TRACE_CHUNK_LEN == 0) {
+		chunk = calloc(1, sizeof(*chunk));
+		if (!chunk) {
+			buf->dropped++;
+			return;
+		}
+		if (buf->tail) {
+			buf->tail->next = chunk;
+		} else {
+			buf->head = chunk;
+		}
+		buf->tail = chunk;
+	}
+
+	event = &buf->tail->events[count%TRACE_CHUNK_LEN];
+	event->name = name;
+	event->phase = phase;
+	event->ts = (uint64_t) (t.tv_sec - trace_t0.tv_sec)*1000000000ULL +
+			(uint64_t) t.tv_nsec - (uint64_t) trace_t0.tv_nsec;
+	if (detail) {
+		// Keep the end of a long path, it's the most specific part.
+		len = strlen(detail);
+		if (len >= TRACE_DETAIL_LEN) {
+			detail += len - (TRACE_DETAIL_LEN - 1);
+		}
+		strcpy(event->detail, detail);
+	} else {
+		event->detail[0] = '\0';
+	}
+	atomic_store_explicit(&buf->count, count + 1, memory_order_release);
+}
+
+void trace_begin(const char *name, const char *detail) {
+	/*
+	*  Record the beginning of the operation 'name' in the calling
+	*  thread. 'detail' is an optional string that is shown with
+	*  the event and it can be a NULL pointer.
+	*/
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+		trace_record(TRACE_PHASE_BEGIN, name, detail);
+	}
+}
+
+void trace_end(const char *name) {
+	// Record the end of the operation 'name' in the calling thread.
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+		trace_record(TRACE_PHASE_END, name, NULL);
+	}
+}
+
+static void trace_write_str(FILE *f, const char *str) {
+	// Write 'str' to 'f' as a JSON string.
+	fputc('"', f);
+	for (const char *c = str; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(f, "\\%c", *c);
+		} else if ((unsigned char) *c < 0x20) {
+			fprintf(f, "\\u%04x", (unsigned int) *c);
+		} else {
+			fputc(*c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static int trace_write(FILE *f) {
+	/*
+	*  Write the recorded events to 'f' as Chrome trace-event
+	*  JSON. Returns 0 on success and 1 on failure.
+	*/
+	const TRACE_EVENT *event = NULL;
+	const TRACE_CHUNK *chunk = NULL;
+	size_t count = 0;
+	size_t dropped = 0;
+	pid_t pid = getpid();
+	int first = 1;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (TRACE_BUF *buf = atomic_load(&trace_bufs); buf; buf = buf->next) {
+		count = atomic_load_explicit(&buf->count, memory_order_acquire);
+		chunk = buf->head;
+		for (size_t i = 0; i < count; i++) {
+			if (i && i%TRACE_CHUNK_LEN == 0) {
+				chunk = chunk->next;
+			}
+			event = &chunk->events[i%TRACE_CHUNK_LEN];
+			fprintf(f, "%s\n{\"name\":", first ? "" : ",");
+			trace_write_str(f, event->name);
+			fprintf(f, ",\"cat\":\"oip\",\"ph\":\"%c\",\"ts\":%.3f,"
+				"\"pid\":%d,\"tid\":%d", event->phase,
+				event->ts/1000.0, (int) pid, (int) buf->tid);
+			if (event->detail[0]) {
+				fprintf(f, ",\"args\":{\"detail\":");
+				trace_write_str(f, event->detail);
+				fputc('}', f);
+			}
+			fputc('}', f);
+			first = 0;
+		}
+		dropped += buf->dropped;
+	}
+	fprintf(f, "\n]}\n");
+	if (dropped) {
+		printerr_va("Dropped %zu trace events.\n", dropped);
+	}
+	return ferror(f) != 0;
+}
+
+int trace_setup(const char *path) {
+	/*
+	*  Start tracing into the file 'path'. Tracing is disabled if
+	*  'path' is a NULL pointer. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	if (!path) {
+		return 0;
+	}
+	printverb_va("Tracing into '%s'.\n", path);
+
+	errno = 0;
+	trace_path = strdup(path);
+	if (!trace_path) {
+		printerrno("strdup()");
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &trace_t0);
+	atomic_store(&trace_enabled, 1);
+	return 0;
+}
+
+void trace_cleanup(void) {
+	/*
+	*  Stop tracing, write the recorded events into the trace
+	*  file and free the trace buffers. This must be called once
+	*  the threads that record events have been stopped.
+	*/
+	TRACE_CHUNK *chunk = NULL;
+	TRACE_BUF *buf = NULL;
+	TRACE_BUF *next = NULL;
+	FILE *f = NULL;
+
+	if (!trace_path) {
+		return;
+	}
+	atomic_store(&trace_enabled, 0);
+
+	errno = 0;
+	f = fopen(trace_path, "w");
+	if (!f) {
+		printerrno("fopen()");
+	} else {
+		if (trace_write(f) != 0) {
+			printerr_va("Failed to write the trace file '%s'.\n", trace_path);
+		}
+		fclose(f);
+	}
+
+	buf = atomic_exchange(&trace_bufs, NULL);
+	while (buf) {
+		while (buf->head) {
+			chunk = buf->head->next;
+			free(buf->head);
+			buf->head = chunk;
+		}
+		next = buf->next;
+		free(buf);
+		buf = next;
+	}
+	trace_buf = NULL;
+	free(trace_path);
+	trace_path = NULL;
+}
@@ -0,0 +1,835 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/*
+*  Worker processes run plugins outside of the main process so that
+*  a crashing plugin only takes down its worker. The workers are
+*  forked by a spawner process that is forked before any threads are
+*  started, which makes it safe to restart a worker at any time.
+*  Image buffers are passed to the workers as memfds, so the pixel
+*  data is never copied between the processes.
+*/
+
+#define PRINT_IDENTIFIER "worker"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "oipcore/abi/output.h"
+#include "oipcore/pipeline.h"
+#include "oipcore/hashmap.h"
+#include "oipcore/taskpool.h"
+
+#include "worker_priv.h"
+#include "plugin_args_priv.h"
+#include "configloader_priv.h"
+
+// The maximum size of a request message.
+#define WORKER_MSG_MAX 65536
+
+// The interval for syncing the progress of a worker in ms.
+#define WORKER_POLL_MS 20
+
+/*
+*  The control block of a worker. It's in memory that is shared
+*  with the worker so that progress and cancellation don't need
+*  any messages.
+*/
+typedef struct STRUCT_WORKER_CTL {
+	atomic_uint progress;
+	atomic_int cancel;
+} WORKER_CTL;
+
+/*
+*  A request to run a plugin instance. The request is followed by
+*  the library path, the library name and 'argc' argument name and
+*  value pairs as NUL terminated strings. The source and destination
+*  image memfds are passed along with the request.
+*/
+typedef struct STRUCT_WORKER_REQ {
+	unsigned long long int uid;
+	unsigned long long int arg_rev;
+	uint32_t w;
+	uint32_t h;
+	IMG_RECT roi;
+	uint32_t full_w;
+	uint32_t full_h;
+	float scale;
+	uint32_t argc;
+	uint32_t strs_len;
+} WORKER_REQ;
+
+/*
+*  The reply to a WORKER_REQ. If the size of the result differs
+*  from the source image, the result is passed in a new memfd.
+*/
+typedef struct STRUCT_WORKER_REPLY {
+	int32_t status;
+	uint32_t w;
+	uint32_t h;
+	int32_t has_fd;
+} WORKER_REPLY;
+
+// A plugin instance in a worker process.
+typedef struct STRUCT_WORKER_INSTANCE {
+	PLUGIN_LIB *lib;
+	void *ctx;
+	void *worker_ctx;
+	PLUGIN_ARG_VAL *arg_vals;
+	void *params;
+	unsigned long long int prepared_rev;
+	int prepared;
+} WORKER_INSTANCE;
+
+static unsigned int worker_count = 0;
+static int *worker_socks = NULL;
+static pthread_mutex_t *worker_mutexes = NULL;
+static WORKER_CTL *worker_ctls = NULL;
+
+static int spawner_sock = -1;
+static pid_t spawner_pid = -1;
+static pthread_mutex_t spawner_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The state of the worker process itself.
+static WORKER_CTL *worker_self_ctl = NULL;
+static HASHMAP *worker_instances = NULL;
+
+static int worker_send(const int sock, const void *buf, const size_t len,
+			const void *buf2, const size_t len2,
+			const int *fds, const size_t nfds);
+static ssize_t worker_recv(const int sock, void *buf, const size_t len,
+				int *fds, size_t *nfds);
+static void worker_set_progress(const unsigned int progress);
+static int worker_is_cancelled(void);
+static void worker_instance_unprepare(WORKER_INSTANCE *inst);
+static void worker_instance_free(WORKER_INSTANCE *inst);
+static WORKER_INSTANCE *worker_get_instance(const WORKER_REQ *req,
+						const char *path,
+						const char *name,
+						char **args);
+static void worker_handle(const int sock, char *msg, const ssize_t len,
+				const int *fds, const size_t nfds);
+static void worker_main(const int sock, WORKER_CTL *ctl);
+static void spawner_main(const int sock);
+static int workers_spawn(const unsigned int worker);
+
+static int worker_send(const int sock, const void *buf, const size_t len,
+			const void *buf2, const size_t len2,
+			const int *fds, const size_t nfds) {
+	/*
+	*  Send 'buf' and 'buf2' as one message on 'sock' and pass
+	*  the 'nfds' file descriptors in 'fds' along with it. Returns
+	*  0 on success and 1 on failure.
+	*/
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr *cmsg = NULL;
+	union {
+		char buf[CMSG_SPACE(2*sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctrl, 0, sizeof(ctrl));
+	iov[0].iov_base = (void*) buf;
+	iov[0].iov_len = len;
+	iov[1].iov_base = (void*) buf2;
+	iov[1].iov_len = len2;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = len2 ? 2 : 1;
+
+	if (nfds) {
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds*sizeof(int));
+	}
+
+	errno = 0;
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+		printerrno("sendmsg()");
+		return 1;
+	}
+	return 0;
+}
+
+static ssize_t worker_recv(const int sock, void *buf, const size_t len,
+				int *fds, size_t *nfds) {
+	/*
+	*  Receive a message of at most 'len' bytes from 'sock' into
+	*  'buf'. At most two file descriptors passed with the message
+	*  are stored in 'fds' and their number in '*nfds'. Returns the
+	*  length of the message, 0 if the peer is gone or -1 on
+	*  failure.
+	*/
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg = NULL;
+	union {
+		char buf[CMSG_SPACE(2*sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	ssize_t ret = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	*nfds = 0;
+	do {
+		errno = 0;
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		printerrno("recvmsg()");
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *nfds*sizeof(int));
+		}
+	}
+	if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		printerr("Truncated message.\n");
+		for (size_t i = 0; i < *nfds; i++) {
+			close(fds[i]);
+		}
+		*nfds = 0;
+		return -1;
+	}
+	return ret;
+}
+
+static void worker_set_progress(const unsigned int progress) {
+	atomic_store_explicit(&worker_self_ctl->progress, progress,
+				memory_order_relaxed);
+}
+
+static int worker_is_cancelled(void) {
+	return atomic_load(&worker_self_ctl->cancel) != 0;
+}
+
+static void worker_instance_unprepare(WORKER_INSTANCE *inst) {
+	const PLUGIN_INFO *info = inst->lib->p_params;
+
+	if (!inst->prepared) {
+		return;
+	}
+	if (inst->params && info->plugin_unprepare) {
+		info->plugin_unprepare(inst->params);
+	}
+	plugin_args_free(inst->arg_vals, info->arg_schema_count);
+	inst->arg_vals = NULL;
+	inst->params = NULL;
+	inst->prepared = 0;
+}
+
+static void worker_instance_free(WORKER_INSTANCE *inst) {
+	const PLUGIN_INFO *info = inst->lib->p_params;
+
+	worker_instance_unprepare(inst);
+	if (info->worker_destroy) {
+		info->worker_destroy(inst->ctx, inst->worker_ctx);
+	}
+	if (info->instance_destroy) {
+		info->instance_destroy(inst->ctx);
+	}
+	plugin_lib_unref(inst->lib);
+	free(inst);
+}
+
+static WORKER_INSTANCE *worker_get_instance(const WORKER_REQ *req,
+						const char *path,
+						const char *name,
+						char **args) {
+	/*
+	*  Get the instance of the plugin instance 'req->uid' in this
+	*  worker and prepare it for the argument revision of 'req'.
+	*  The instance is created and its library loaded on first
+	*  use. Returns a NULL pointer on failure.
+	*/
+	WORKER_INSTANCE *inst = NULL;
+	const PLUGIN_INFO *info = NULL;
+	PLUGIN_ARG_VAL *tmp_vals = NULL;
+	void *tmp_params = NULL;
+
+	inst = hashmap_get_int(worker_instances, req->uid);
+	if (!inst) {
+		errno = 0;
+		inst = calloc(1, sizeof(*inst));
+		if (!inst) {
+			printerrno("calloc()");
+			return NULL;
+		}
+		inst->lib = plugin_lib_open(path, name);
+		if (!inst->lib) {
+			free(inst);
+			return NULL;
+		}
+		info = inst->lib->p_params;
+		if (info->instance_create &&
+			info->instance_create(&inst->ctx) != PLUGIN_STATUS_DONE) {
+			plugin_lib_unref(inst->lib);
+			free(inst);
+			return NULL;
+		}
+		if (info->worker_create &&
+			info->worker_create(inst->ctx, &inst->worker_ctx) != PLUGIN_STATUS_DONE) {
+			if (info->instance_destroy) {
+				info->instance_destroy(inst->ctx);
+			}
+			plugin_lib_unref(inst->lib);
+			free(inst);
+			return NULL;
+		}
+		if (hashmap_put_int(worker_instances, req->uid, inst) != 0) {
+			worker_instance_free(inst);
+			return NULL;
+		}
+	}
+	info = inst->lib->p_params;
+
+	if (inst->prepared && inst->prepared_rev == req->arg_rev) {
+		return inst;
+	}
+	if (plugin_args_compile(info, args, req->argc, &tmp_vals) != 0) {
+		return NULL;
+	}
+	if (info->plugin_prepare && info->plugin_prepare(tmp_vals,
+			info->arg_schema_count, &tmp_params) != PLUGIN_STATUS_DONE) {
+		printerr_va("Failed to prepare plugin %s.\n", info->name);
+		plugin_args_free(tmp_vals, info->arg_schema_count);
+		return NULL;
+	}
+	worker_instance_unprepare(inst);
+	inst->arg_vals = tmp_vals;
+	inst->params = tmp_params;
+	inst->prepared_rev = req->arg_rev;
+	inst->prepared = 1;
+	return inst;
+}
+
+static void worker_handle(const int sock, char *msg, const ssize_t len,
+				const int *fds, const size_t nfds) {
+	/*
+	*  Run the plugin request in 'msg' and send the reply on
+	*  'sock'. The file descriptors in 'fds' are closed.
+	*/
+	WORKER_REQ req;
+	WORKER_REPLY reply;
+	WORKER_INSTANCE *inst = NULL;
+	struct PLUGIN_INDATA in;
+	char **args = NULL;
+	char *strs = NULL;
+	char *path = NULL;
+	char *name = NULL;
+	IMAGE *src = NULL;
+	IMAGE *dst = NULL;
+	size_t off = 0;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.status = PLUGIN_STATUS_ERROR;
+
+	if (nfds != 2 || len < (ssize_t) sizeof(req)) {
+		printerr("Malformed request.\n");
+		for (size_t i = 0; i < nfds; i++) {
+			close(fds[i]);
+		}
+		worker_send(sock, &reply, sizeof(reply), NULL, 0, NULL, 0);
+		return;
+	}
+	memcpy(&req, msg, sizeof(req));
+
+	// Split the strings that follow the request.
+	strs = msg + sizeof(req);
+	if (req.strs_len == len - sizeof(req) && req.strs_len != 0 &&
+		strs[req.strs_len - 1] == '\0' && 2*(size_t) req.argc <= req.strs_len) {
+		errno = 0;
+		args = calloc(2*req.argc + 1, sizeof(*args));
+		if (!args) {
+			printerrno("calloc()");
+		}
+	}
+	for (size_t i = 0; args && i < 2 + 2*(size_t) req.argc; i++) {
+		if (off >= req.strs_len) {
+			free(args);
+			args = NULL;
+			break;
+		}
+		if (i == 0) {
+			path = strs + off;
+		} else if (i == 1) {
+			name = strs + off;
+		} else {
+			args[i - 2] = strs + off;
+		}
+		off += strlen(strs + off) + 1;
+	}
+
+	src = img_map_shared(fds[0], req.w, req.h);
+	if (!src) {
+		close(fds[0]);
+	}
+	dst = img_map_shared(fds[1], req.w, req.h);
+	if (!dst) {
+		close(fds[1]);
+	}
+
+	if (!args) {
+		printerr("Malformed request.\n");
+	} else if (src && dst) {
+		inst = worker_get_instance(&req, path, name, args);
+	}
+	if (inst) {
+		memset(&in, 0, sizeof(in));
+		in.src = src;
+		in.dst = dst;
+		in.args = args;
+		in.argc = req.argc;
+		in.set_progress = &worker_set_progress;
+		in.is_cancelled = &worker_is_cancelled;
+		in.parallel_for = &taskpool_parallel_for;
+		in.arg_vals = inst->arg_vals;
+		in.arg_vals_count = inst->lib->p_params->arg_schema_count;
+		in.params = inst->params;
+		in.ctx = inst->ctx;
+		in.worker_ctx = inst->worker_ctx;
+		in.roi = req.roi;
+		in.full_w = req.full_w;
+		in.full_h = req.full_h;
+		in.scale = req.scale;
+
+		reply.status = inst->lib->p_params->plugin_process(&in);
+		reply.w = dst->w;
+		reply.h = dst->h;
+
+		// A result of a different size is moved to a new memfd.
+		if (reply.status == PLUGIN_STATUS_DONE && dst->fd < 0) {
+			if (img_share(dst) == 0) {
+				reply.has_fd = 1;
+			} else {
+				reply.status = PLUGIN_STATUS_ERROR;
+			}
+		}
+	}
+
+	worker_send(sock, &reply, sizeof(reply), NULL, 0,
+			reply.has_fd ? &dst->fd : NULL, reply.has_fd ? 1 : 0);
+	if (src) {
+		img_free(src);
+	}
+	if (dst) {
+		img_free(dst);
+	}
+	free(args);
+	fflush(stdout);
+}
+
+static void worker_main(const int sock, WORKER_CTL *ctl) {
+	/*
+	*  The main loop of a worker process. Requests are handled
+	*  until the main process closes its end of 'sock'.
+	*/
+	WORKER_INSTANCE *inst = NULL;
+	char *msg = NULL;
+	int fds[2];
+	size_t nfds = 0;
+	size_t iter = 0;
+	ssize_t len = 0;
+
+	worker_self_ctl = ctl;
+	worker_instances = hashmap_create(HASHMAP_KEY_INT, NULL);
+	msg = malloc(WORKER_MSG_MAX);
+	if (!worker_instances || !msg) {
+		printerr("Failed to setup worker process.\n");
+		_exit(1);
+	}
+
+	while ((len = worker_recv(sock, msg, WORKER_MSG_MAX, fds, &nfds)) > 0) {
+		worker_handle(sock, msg, len, fds, nfds);
+	}
+
+	while (hashmap_next(worker_instances, &iter, (void**) &inst)) {
+		worker_instance_free(inst);
+	}
+	hashmap_destroy(worker_instances, 0);
+	free(msg);
+	fflush(stdout);
+	_exit(0);
+}
+
+static void spawner_main(const int sock) {
+	/*
+	*  The main loop of the spawner process. A worker is forked
+	*  for each worker index received on 'sock' and the main
+	*  process end of its socket is sent back.
+	*/
+	unsigned int worker = 0;
+	int pair[2];
+	size_t nfds = 0;
+	pid_t pid = 0;
+
+	// Let the kernel reap the workers.
+	signal(SIGCHLD, SIG_IGN);
+
+	while (worker_recv(sock, &worker, sizeof(worker), pair, &nfds) ==
+			sizeof(worker)) {
+		pid = -1;
+		errno = 0;
+		if (worker >= worker_count ||
+			socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+			printerrno("socketpair()");
+			worker_send(sock, &pid, sizeof(pid), NULL, 0, NULL, 0);
+			continue;
+		}
+
+		errno = 0;
+		pid = fork();
+		if (pid == 0) {
+			close(sock);
+			close(pair[0]);
+			signal(SIGCHLD, SIG_DFL);
+			worker_main(pair[1], &worker_ctls[worker]);
+		} else if (pid < 0) {
+			printerrno("fork()");
+		}
+		worker_send(sock, &pid, sizeof(pid), NULL, 0, pair, pid > 0 ? 1 : 0);
+		close(pair[0]);
+		close(pair[1]);
+	}
+	_exit(0);
+}
+
+static int workers_spawn(const unsigned int worker) {
+	/*
+	*  Start the worker process 'worker'. Returns 0 on success
+	*  and 1 on failure.
+	*/
+	pid_t pid = -1;
+	size_t nfds = 0;
+	int fd = -1;
+
+	atomic_store(&worker_ctls[worker].progress, 0);
+	atomic_store(&worker_ctls[worker].cancel, 0);
+
+	pthread_mutex_lock(&spawner_mutex);
+	if (worker_send(spawner_sock, &worker, sizeof(worker), NULL, 0, NULL, 0) != 0 ||
+		worker_recv(spawner_sock, &pid, sizeof(pid), &fd, &nfds) != sizeof(pid) ||
+		pid < 0 || nfds != 1) {
+		pthread_mutex_unlock(&spawner_mutex);
+		printerr_va("Failed to start worker process %u.\n", worker);
+		return 1;
+	}
+	pthread_mutex_unlock(&spawner_mutex);
+
+	printverb_va("Started worker process %u with PID %i.\n", worker, (int) pid);
+	worker_socks[worker] = fd;
+	return 0;
+}
+
+int worker_feed(const unsigned int worker, PLUGIN *plugin,
+		struct PLUGIN_INDATA *in) {
+	/*
+	*  Feed 'in' to the plugin instance 'plugin' in the worker
+	*  process 'worker'. The source image is moved into a memfd
+	*  if it isn't shared already and the result is stored in
+	*  'in->dst' as a shared image. Must be called with the
+	*  pipeline lock held. The lock is released while the worker
+	*  runs the plugin so that other jobs can run meanwhile. A
+	*  worker that dies is restarted and the plugin fails. Returns
+	*  one of the PLUGIN_STATUS_* values.
+	*/
+	WORKER_REQ req;
+	WORKER_REPLY reply;
+	WORKER_CTL *ctl = NULL;
+	IMAGE *dst = NULL;
+	IMAGE *tmp = NULL;
+	char *strs = NULL;
+	char *p = NULL;
+	struct pollfd pfd;
+	size_t strs_len = 0;
+	size_t nfds = 0;
+	ssize_t len = 0;
+	int fds[2];
+	int rfd = -1;
+	int dead = 0;
+	int ret = 0;
+
+	if (worker >= worker_count) {
+		printerr_va("Invalid worker %u.\n", worker);
+		return PLUGIN_STATUS_ERROR;
+	}
+
+	// Pack the strings of the request.
+	strs_len = strlen(plugin->p_lib->path) + strlen(plugin->p_lib->name) + 2;
+	for (int i = 0; i < 2*in->argc; i++) {
+		strs_len += strlen(in->args[i]) + 1;
+	}
+	if (sizeof(req) + strs_len > WORKER_MSG_MAX) {
+		printerr("Plugin arguments too long for a worker process.\n");
+		return PLUGIN_STATUS_ERROR;
+	}
+	errno = 0;
+	strs = malloc(strs_len);
+	if (!strs) {
+		printerrno("malloc()");
+		return PLUGIN_STATUS_ERROR;
+	}
+	p = stpcpy(strs, plugin->p_lib->path) + 1;
+	p = stpcpy(p, plugin->p_lib->name) + 1;
+	for (int i = 0; i < 2*in->argc; i++) {
+		p = stpcpy(p, in->args[i]) + 1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.uid = plugin->uid;
+	req.arg_rev = plugin->arg_rev;
+	req.w = in->src->w;
+	req.h = in->src->h;
+	req.roi = in->roi;
+	req.full_w = in->full_w;
+	req.full_h = in->full_h;
+	req.scale = in->scale;
+	req.argc = in->argc;
+	req.strs_len = strs_len;
+
+	if (img_share(in->src) != 0) {
+		free(strs);
+		return PLUGIN_STATUS_ERROR;
+	}
+	dst = img_alloc_shared(in->src->w, in->src->h);
+	if (!dst) {
+		free(strs);
+		return PLUGIN_STATUS_ERROR;
+	}
+	fds[0] = in->src->fd;
+	fds[1] = dst->fd;
+
+	ctl = &worker_ctls[worker];
+	pthread_mutex_lock(&worker_mutexes[worker]);
+	pipeline_unlock();
+
+	atomic_store(&ctl->progress, 0);
+	atomic_store(&ctl->cancel, 0);
+	if (worker_socks[worker] < 0 && workers_spawn(worker) != 0) {
+		ret = 1;
+	} else if (worker_send(worker_socks[worker], &req, sizeof(req),
+				strs, strs_len, fds, 2) != 0) {
+		dead = 1;
+	}
+	free(strs);
+
+	// Sync the progress and the cancellation flag until the reply.
+	pfd.fd = worker_socks[worker];
+	pfd.events = POLLIN;
+	while (!ret && !dead) {
+		if (poll(&pfd, 1, WORKER_POLL_MS) <= 0) {
+			in->set_progress(atomic_load(&ctl->progress));
+			if (in->is_cancelled()) {
+				atomic_store(&ctl->cancel, 1);
+			}
+			continue;
+		}
+		len = worker_recv(worker_socks[worker], &reply, sizeof(reply),
+					&rfd, &nfds);
+		if (len != sizeof(reply) || (reply.has_fd && nfds != 1)) {
+			dead = 1;
+		}
+		break;
+	}
+	in->set_progress(atomic_load(&ctl->progress));
+
+	if (dead) {
+		printerr_va("Worker process %u died. Restarting it.\n", worker);
+		close(worker_socks[worker]);
+		worker_socks[worker] = -1;
+		workers_spawn(worker);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&worker_mutexes[worker]);
+	pipeline_lock();
+
+	if (ret || reply.status != PLUGIN_STATUS_DONE) {
+		if (nfds) {
+			close(rfd);
+		}
+		img_free(dst);
+		return ret ? PLUGIN_STATUS_ERROR : reply.status;
+	}
+
+	if (reply.has_fd) {
+		tmp = img_map_shared(rfd, reply.w, reply.h);
+		if (!tmp) {
+			close(rfd);
+			img_free(dst);
+			return PLUGIN_STATUS_ERROR;
+		}
+		img_free(dst);
+		dst = tmp;
+	} else if (nfds) {
+		close(rfd);
+	}
+
+	// Move the result into 'in->dst'.
+	free(in->dst->img);
+	*in->dst = *dst;
+	free(dst);
+	return PLUGIN_STATUS_DONE;
+}
+
+unsigned int workers_count(void) {
+	return worker_count;
+}
+
+int workers_setup(void) {
+	/*
+	*  Start the worker processes if the config parameter
+	*  'worker_processes' is above zero. This must be called
+	*  before any threads are started. Returns 0 on success
+	*  and 1 on failure.
+	*/
+	long int count = 0;
+	int pair[2];
+
+	printverb("Setup.\n");
+	count = config_get_lint_param("worker_processes");
+	if (count <= 0) {
+		printverb("Running plugins in the main process.\n");
+		return 0;
+	} else if (count > WORKER_MAX_PROCESSES) {
+		printerr_va("Too many worker processes. The maximum is %i.\n",
+				WORKER_MAX_PROCESSES);
+		return 1;
+	}
+
+	errno = 0;
+	worker_socks = calloc(count, sizeof(*worker_socks));
+	worker_mutexes = calloc(count, sizeof(*worker_mutexes));
+	if (!worker_socks || !worker_mutexes) {
+		printerrno("calloc()");
+		workers_cleanup();
+		return 1;
+	}
+
+	errno = 0;
+	worker_ctls = mmap(NULL, count*sizeof(*worker_ctls), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (worker_ctls == MAP_FAILED) {
+		printerrno("mmap()");
+		worker_ctls = NULL;
+		workers_cleanup();
+		return 1;
+	}
+	for (long int i = 0; i < count; i++) {
+		worker_socks[i] = -1;
+		atomic_init(&worker_ctls[i].progress, 0);
+		atomic_init(&worker_ctls[i].cancel, 0);
+		pthread_mutex_init(&worker_mutexes[i], NULL);
+	}
+	worker_count = count;
+
+	errno = 0;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+		printerrno("socketpair()");
+		workers_cleanup();
+		return 1;
+	}
+
+	// Don't let the spawner inherit buffered output.
+	fflush(stdout);
+	fflush(stderr);
+
+	errno = 0;
+	spawner_pid = fork();
+	if (spawner_pid == 0) {
+		close(pair[0]);
+		spawner_main(pair[1]);
+	} else if (spawner_pid < 0) {
+		printerrno("fork()");
+		close(pair[0]);
+		close(pair[1]);
+		workers_cleanup();
+		return 1;
+	}
+	close(pair[1]);
+	spawner_sock = pair[0];
+
+	for (unsigned int i = 0; i < worker_count; i++) {
+		if (workers_spawn(i) != 0) {
+			workers_cleanup();
+			return 1;
+		}
+	}
+	printverb_va("Started %u worker processes.\n", worker_count);
+	return 0;
+}
+
+void workers_cleanup(void) {
+	/*
+	*  Stop the worker processes. The workers and the spawner
+	*  exit once their sockets are closed.
+	*/
+	printverb("Cleanup.\n");
+	for (unsigned int i = 0; i < worker_count; i++) {
+		if (worker_socks[i] >= 0) {
+			close(worker_socks[i]);
+		}
+		pthread_mutex_destroy(&worker_mutexes[i]);
+	}
+	if (spawner_sock >= 0) {
+		close(spawner_sock);
+		spawner_sock = -1;
+	}
+	if (spawner_pid > 0) {
+		waitpid(spawner_pid, NULL, 0);
+		spawner_pid = -1;
+	}
+	if (worker_ctls) {
+		munmap(worker_ctls, worker_count*sizeof(*worker_ctls));
+		worker_ctls = NULL;
+	}
+	free(worker_socks);
+	free(worker_mutexes);
+	worker_socks = NULL;
+	worker_mutexes = NULL;
+	worker_count = 0;
+}
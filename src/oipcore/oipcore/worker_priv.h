@@ -0,0 +1,36 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#ifndef INCLUDED_WORKER_PRIV
+	#define INCLUDED_WORKER_PRIV
+
+	#include "oipcore/plugin.h"
+
+	// The maximum number of worker processes.
+	#define WORKER_MAX_PROCESSES 64
+
+	int workers_setup(void);
+	void workers_cleanup(void);
+	unsigned int workers_count(void);
+	int worker_feed(const unsigned int worker, PLUGIN *plugin,
+			struct PLUGIN_INDATA *in);
+#endif
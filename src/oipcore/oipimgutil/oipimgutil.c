@@ -19,6 +19,7 @@
 *
 */
 
+#define _GNU_SOURCE
 #define PRINT_IDENTIFIER "imgutil"
 
 #include <stdint.h>
@@ -27,6 +28,10 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "oipimgutil/oipimgutil.h"
 #include "oipcore/abi/output.h"
@@ -34,26 +39,117 @@
 #define IMGUTIL_OUTPUT_FORMAT FIF_JPEG
 #define IMGUTIL_INTERNAL_BPP 32
 
-IMAGE *img_load(const char *path) {
+// The opcodes of the QOI image format.
+#define IMGUTIL_QOI_OP_INDEX 0x00
+#define IMGUTIL_QOI_OP_DIFF  0x40
+#define IMGUTIL_QOI_OP_LUMA  0x80
+#define IMGUTIL_QOI_OP_RUN   0xc0
+#define IMGUTIL_QOI_OP_RGB   0xfe
+#define IMGUTIL_QOI_OP_RGBA  0xff
+#define IMGUTIL_QOI_MASK     0xc0
+#define IMGUTIL_QOI_MAX_RUN  62
+
+// The seals that keep a shared image from changing size.
+#define IMGUTIL_SIZE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+#define IMGUTIL_QOI_HASH(p) (((p).rgbRed*3 + (p).rgbGreen*5 + \
+				(p).rgbBlue*7 + (p).rgbReserved*11)%64)
+
+// The pixel memory of all images of the process in bytes.
+static atomic_size_t img_mem_cur = 0;
+static atomic_size_t img_mem_max = 0;
+
+static void img_mem_account(const size_t add, const size_t sub);
+static FREE_IMAGE_FORMAT img_get_type(const char *path);
+static int img_px_eq(const RGBQUAD *a, const RGBQUAD *b);
+static IMAGE *img_read_fd(const int fd, uint32_t w, uint32_t h);
+
+static void img_mem_account(const size_t add, const size_t sub) {
+	/*
+	*  Add 'add' bytes to and subtract 'sub' bytes from the pixel
+	*  memory usage and update the peak usage.
+	*/
+	size_t cur = 0;
+	size_t peak = 0;
+
+	if (add >= sub) {
+		cur = atomic_fetch_add(&img_mem_cur, add - sub) + (add - sub);
+	} else {
+		cur = atomic_fetch_sub(&img_mem_cur, sub - add) - (sub - add);
+	}
+	peak = atomic_load(&img_mem_max);
+	while (cur > peak && !atomic_compare_exchange_weak(&img_mem_max, &peak, cur));
+}
+
+size_t img_mem_used(void) {
+	// Return the pixel memory used by all images in bytes.
+	return atomic_load(&img_mem_cur);
+}
+
+size_t img_mem_peak(void) {
+	// Return the peak pixel memory usage in bytes.
+	return atomic_load(&img_mem_max);
+}
+
+static FREE_IMAGE_FORMAT img_get_type(const char *path) {
+	/*
+	*  Get the type of the image file 'path'. Returns FIF_UNKNOWN
+	*  if the file can't be read or its type isn't supported.
+	*/
 	FREE_IMAGE_FORMAT ftype = FIF_UNKNOWN;
-	FIBITMAP *fimage = NULL;
-	FIBITMAP *fimage_converted = NULL;
-	IMAGE *ret = NULL;
 
 	errno = 0;
 	if (access(path, F_OK)){
 		printerrno("access()");
-		return NULL;
+		return FIF_UNKNOWN;
 	}
 	ftype = FreeImage_GetFileType(path, 0);
 	if (ftype == FIF_UNKNOWN) {
 		ftype = FreeImage_GetFIFFromFilename(path);
 		if (ftype == FIF_UNKNOWN) {
 			printerr("img_load(): Unknown filetype.\n");
-			return NULL;
+			return FIF_UNKNOWN;
 		}
 	}
-	if (FreeImage_FIFSupportsReading(ftype)) {
+	if (!FreeImage_FIFSupportsReading(ftype)) {
+		printerr("img_load(): Image plugin doesn't support reading.\n");
+		return FIF_UNKNOWN;
+	}
+	return ftype;
+}
+
+int img_probe(const char *path, uint32_t *w, uint32_t *h) {
+	/*
+	*  Check that 'path' is an image file that img_load() can
+	*  read and get its size in '*w' and '*h' without decoding
+	*  the pixels. Returns 0 if it is and 1 if not.
+	*/
+	FREE_IMAGE_FORMAT ftype = FIF_UNKNOWN;
+	FIBITMAP *fimage = NULL;
+
+	ftype = img_get_type(path);
+	if (ftype == FIF_UNKNOWN) {
+		return 1;
+	}
+	fimage = FreeImage_Load(ftype, path, FIF_LOAD_NOPIXELS);
+	if (!fimage) {
+		printerr("img_probe(): Failed to read the image header.\n");
+		return 1;
+	}
+	*w = FreeImage_GetWidth(fimage);
+	*h = FreeImage_GetHeight(fimage);
+	FreeImage_Unload(fimage);
+	return 0;
+}
+
+IMAGE *img_load(const char *path) {
+	FREE_IMAGE_FORMAT ftype = FIF_UNKNOWN;
+	FIBITMAP *fimage = NULL;
+	FIBITMAP *fimage_converted = NULL;
+	IMAGE *ret = NULL;
+
+	ftype = img_get_type(path);
+	if (ftype != FIF_UNKNOWN) {
 		fimage = FreeImage_Load(ftype, path, 0);
 		if (!fimage) {
 			printerr("img_load(): Failed to load image.\n");
@@ -81,7 +177,6 @@ IMAGE *img_load(const char *path) {
 		FreeImage_Unload(fimage_converted);
 		return ret;
 	}
-	printerr("img_load(): Image plugin doesn't support reading.\n");
 	return NULL;
 }
 
@@ -101,6 +196,12 @@ int img_save(const IMAGE *img, const char *filename) {
 
 IMAGE *img_alloc(uint32_t w, uint32_t h) {
 	IMAGE *ret = NULL;
+
+	if (!img_size_valid(w, h)) {
+		printerr_va("Image size %ux%u too large.\n", w, h);
+		return NULL;
+	}
+
 	errno = 0;
 	ret = malloc(sizeof(IMAGE));
 	if (!ret) {
@@ -109,6 +210,7 @@ IMAGE *img_alloc(uint32_t w, uint32_t h) {
 	}
 	ret->w = w;
 	ret->h = h;
+	ret->fd = -1;
 
 	if (ret->w != 0 && ret->h != 0) {
 		errno = 0;
@@ -118,6 +220,7 @@ IMAGE *img_alloc(uint32_t w, uint32_t h) {
 			free(ret);
 			return NULL;
 		}
+		img_mem_account(img_bytelen(ret), 0);
 	} else {
 		ret->img = NULL;
 	}
@@ -126,18 +229,244 @@ IMAGE *img_alloc(uint32_t w, uint32_t h) {
 
 int img_realloc(IMAGE *img, uint32_t w, uint32_t h) {
 	RGBQUAD *tmp = NULL;
+
+	if (!img_size_valid(w, h)) {
+		printerr_va("Image size %ux%u too large.\n", w, h);
+		return 1;
+	}
+
+	if (img->fd >= 0) {
+		/*
+		*  Shared images keep their mapping if the size doesn't
+		*  change. Otherwise the pixel data is moved to the heap.
+		*/
+		if (img->w == w && img->h == h) {
+			return 0;
+		}
+		errno = 0;
+		tmp = malloc((size_t) w*h*sizeof(RGBQUAD));
+		if (!tmp && (size_t) w*h != 0) {
+			printerrno("malloc()");
+			return 1;
+		}
+		if (tmp && img->img) {
+			memcpy(tmp, img->img, ((size_t) w*h < (size_t) img->w*img->h ?
+					(size_t) w*h : (size_t) img->w*img->h)*sizeof(RGBQUAD));
+		}
+		if (img->img) {
+			munmap(img->img, img_bytelen(img));
+		}
+		close(img->fd);
+		img_mem_account((size_t) w*h*sizeof(RGBQUAD), img_bytelen(img));
+		img->fd = -1;
+		img->img = tmp;
+		img->w = w;
+		img->h = h;
+		return 0;
+	}
+
 	errno = 0;
-	tmp = realloc(img->img, w*h*sizeof(RGBQUAD));
+	tmp = realloc(img->img, (size_t) w*h*sizeof(RGBQUAD));
 	if (!tmp) {
 		printerrno("realloc()");
 		return 1;
 	}
+	img_mem_account((size_t) w*h*sizeof(RGBQUAD), img_bytelen(img));
 	img->img = tmp;
 	img->w = w;
 	img->h = h;
 	return 0;
 }
 
+static IMAGE *img_read_fd(const int fd, uint32_t w, uint32_t h) {
+	/*
+	*  Read the 'w'x'h' pixels at the beginning of 'fd' into a
+	*  new image on the heap. Returns a pointer to the new image
+	*  on success or a NULL pointer on failure.
+	*/
+	IMAGE *ret = NULL;
+	size_t off = 0;
+	ssize_t len = 0;
+
+	ret = img_alloc(w, h);
+	if (!ret) {
+		return NULL;
+	}
+	while (off < img_bytelen(ret)) {
+		errno = 0;
+		len = pread(fd, (char*) ret->img + off, img_bytelen(ret) - off,
+				(off_t) off);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		} else if (len < 0) {
+			printerrno("pread()");
+			img_free(ret);
+			return NULL;
+		} else if (len == 0) {
+			printerr_va("Shared image too small for %ux%u pixels.\n", w, h);
+			img_free(ret);
+			return NULL;
+		}
+		off += (size_t) len;
+	}
+	return ret;
+}
+
+IMAGE *img_map_shared(const int fd, uint32_t w, uint32_t h) {
+	/*
+	*  Map the 'w'x'h' pixels in the memfd or shared memory object
+	*  'fd' into a new shared image. Objects that can't be mapped
+	*  for writing are mapped copy-on-write. The image takes
+	*  ownership of 'fd' on success. Returns a pointer to the new
+	*  image on success or a NULL pointer on failure.
+	*
+	*  Accessing a mapping faults with SIGBUS if another process
+	*  shrinks the object, so only memfds that are sealed against
+	*  resizing are mapped. The pixels of other objects are copied
+	*  into a heap image and 'fd' is closed.
+	*/
+	IMAGE *ret = NULL;
+	struct stat st;
+	int seals = 0;
+
+	if (!img_size_valid(w, h)) {
+		printerr_va("Image size %ux%u too large.\n", w, h);
+		return NULL;
+	}
+
+	errno = 0;
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & IMGUTIL_SIZE_SEALS) != IMGUTIL_SIZE_SEALS) {
+		ret = img_read_fd(fd, w, h);
+		if (ret) {
+			close(fd);
+		}
+		return ret;
+	}
+
+	errno = 0;
+	if (fstat(fd, &st) != 0) {
+		printerrno("fstat()");
+		return NULL;
+	}
+	if ((uint64_t) st.st_size < (uint64_t) w*h*sizeof(RGBQUAD)) {
+		printerr_va("Shared image too small for %ux%u pixels.\n", w, h);
+		return NULL;
+	}
+
+	errno = 0;
+	ret = malloc(sizeof(IMAGE));
+	if (!ret) {
+		printerrno("malloc()");
+		return NULL;
+	}
+	ret->w = w;
+	ret->h = h;
+	ret->fd = fd;
+	ret->img = NULL;
+
+	if (img_bytelen(ret) != 0) {
+		errno = 0;
+		ret->img = mmap(NULL, img_bytelen(ret), PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+		if (ret->img == MAP_FAILED && errno == EACCES) {
+			errno = 0;
+			ret->img = mmap(NULL, img_bytelen(ret), PROT_READ | PROT_WRITE,
+					MAP_PRIVATE, fd, 0);
+		}
+		if (ret->img == MAP_FAILED) {
+			printerrno("mmap()");
+			free(ret);
+			return NULL;
+		}
+		img_mem_account(img_bytelen(ret), 0);
+	}
+	return ret;
+}
+
+IMAGE *img_alloc_shared(uint32_t w, uint32_t h) {
+	/*
+	*  Allocate a 'w'x'h' image whose pixel data is in a memfd
+	*  so that it can be passed to another process. The memfd is
+	*  sealed against resizing so that the processes it's passed
+	*  to can map it safely. Returns a pointer to the new image
+	*  on success or a NULL pointer on failure.
+	*/
+	IMAGE *ret = NULL;
+	int fd = -1;
+
+	if (!img_size_valid(w, h)) {
+		printerr_va("Image size %ux%u too large.\n", w, h);
+		return NULL;
+	}
+
+	errno = 0;
+	fd = memfd_create("oip-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		printerrno("memfd_create()");
+		return NULL;
+	}
+
+	errno = 0;
+	if (ftruncate(fd, (off_t) w*h*sizeof(RGBQUAD)) != 0) {
+		printerrno("ftruncate()");
+		close(fd);
+		return NULL;
+	}
+
+	errno = 0;
+	if (fcntl(fd, F_ADD_SEALS, IMGUTIL_SIZE_SEALS) != 0) {
+		printerrno("fcntl()");
+		close(fd);
+		return NULL;
+	}
+
+	ret = img_map_shared(fd, w, h);
+	if (!ret) {
+		close(fd);
+		return NULL;
+	}
+	return ret;
+}
+
+int img_share(IMAGE *img) {
+	/*
+	*  Move the pixel data of 'img' into a memfd if it isn't
+	*  shared already. Returns 0 on success and 1 on failure.
+	*/
+	IMAGE *tmp = NULL;
+
+	if (img->fd >= 0) {
+		return 0;
+	}
+
+	tmp = img_alloc_shared(img->w, img->h);
+	if (!tmp) {
+		return 1;
+	}
+	if (img->img) {
+		memcpy(tmp->img, img->img, img_bytelen(img));
+		img_mem_account(0, img_bytelen(img));
+	}
+	free(img->img);
+	img->img = tmp->img;
+	img->fd = tmp->fd;
+	free(tmp);
+	return 0;
+}
+
+int img_format_from_str(const char *str) {
+	/*
+	*  Convert the pixel format name 'str' to an IMG_FORMAT_*
+	*  constant. Returns IMG_FORMAT_INVALID if 'str' isn't the
+	*  name of a supported format.
+	*/
+	if (strcmp(str, "bgra8") == 0) {
+		return IMG_FORMAT_BGRA8;
+	}
+	return IMG_FORMAT_INVALID;
+}
+
 int img_cpy(IMAGE *dest, const IMAGE *src) {
 	if (dest->w == src->w && dest->h == src->h) {
 		memcpy(dest->img, src->img, img_bytelen(dest));
@@ -148,10 +477,321 @@ int img_cpy(IMAGE *dest, const IMAGE *src) {
 }
 
 size_t img_bytelen(const IMAGE *img) {
-	return img->w*img->h*sizeof(RGBQUAD);
+	return (size_t) img->w*img->h*sizeof(RGBQUAD);
+}
+
+int img_size_valid(uint32_t w, uint32_t h) {
+	/*
+	*  Check that a 'w'x'h' image has at most IMG_MAX_PIXELS
+	*  pixels and that its byte length fits in size_t. Returns
+	*  1 if it does and 0 if not.
+	*/
+	return (uint64_t) w*h <= IMG_MAX_PIXELS &&
+		(uint64_t) w*h <= SIZE_MAX/sizeof(RGBQUAD);
 }
 
 void img_free(IMAGE *img) {
-	free(img->img);
+	if (img->img) {
+		img_mem_account(0, img_bytelen(img));
+	}
+	if (img->fd >= 0) {
+		if (img->img) {
+			munmap(img->img, img_bytelen(img));
+		}
+		close(img->fd);
+	} else {
+		free(img->img);
+	}
 	free(img);
 }
+
+IMAGE *img_crop(const IMAGE *src, const IMG_RECT *rect) {
+	/*
+	*  Copy the region 'rect' of 'src' into a new image. The region
+	*  must be inside 'src'. Returns a pointer to the new image on
+	*  success or a NULL pointer on failure.
+	*/
+	IMAGE *ret = NULL;
+
+	if (rect->x + rect->w > src->w || rect->y + rect->h > src->h) {
+		printerr("img_crop(): Region out of bounds.\n");
+		return NULL;
+	}
+
+	ret = img_alloc(rect->w, rect->h);
+	if (!ret) {
+		return NULL;
+	}
+	for (uint32_t y = 0; y < rect->h; y++) {
+		memcpy(ret->img + (size_t) y*rect->w,
+			src->img + (size_t) (rect->y + y)*src->w + rect->x,
+			rect->w*sizeof(RGBQUAD));
+	}
+	return ret;
+}
+
+IMAGE *img_downscale(const IMAGE *src) {
+	/*
+	*  Scale 'src' down to half of its size by averaging each
+	*  2x2 block of pixels. Odd edge pixels are dropped. Returns
+	*  a pointer to the new image on success or a NULL pointer
+	*  on failure.
+	*/
+	IMAGE *ret = NULL;
+
+	if (src->w < 2 || src->h < 2) {
+		printerr("img_downscale(): Image too small.\n");
+		return NULL;
+	}
+
+	ret = img_alloc(src->w/2, src->h/2);
+	if (!ret) {
+		return NULL;
+	}
+	img_downscale_rows(ret, src, 0, ret->h);
+	return ret;
+}
+
+void img_downscale_rows(IMAGE *dst, const IMAGE *src,
+			const uint32_t begin, const uint32_t end) {
+	/*
+	*  Compute the rows 'begin' - 'end' of 'dst', which is 'src'
+	*  scaled down to half of its size. Disjoint row ranges can
+	*  be computed in parallel.
+	*/
+	const RGBQUAD *r0 = NULL;
+	const RGBQUAD *r1 = NULL;
+	RGBQUAD *d = NULL;
+
+	for (uint32_t y = begin; y < end; y++) {
+		r0 = src->img + (size_t) 2*y*src->w;
+		r1 = r0 + src->w;
+		d = dst->img + (size_t) y*dst->w;
+		for (uint32_t x = 0; x < dst->w; x++) {
+			d[x].rgbBlue = (r0[2*x].rgbBlue + r0[2*x + 1].rgbBlue +
+					r1[2*x].rgbBlue + r1[2*x + 1].rgbBlue + 2)/4;
+			d[x].rgbGreen = (r0[2*x].rgbGreen + r0[2*x + 1].rgbGreen +
+					r1[2*x].rgbGreen + r1[2*x + 1].rgbGreen + 2)/4;
+			d[x].rgbRed = (r0[2*x].rgbRed + r0[2*x + 1].rgbRed +
+					r1[2*x].rgbRed + r1[2*x + 1].rgbRed + 2)/4;
+			d[x].rgbReserved = (r0[2*x].rgbReserved + r0[2*x + 1].rgbReserved +
+					r1[2*x].rgbReserved + r1[2*x + 1].rgbReserved + 2)/4;
+		}
+	}
+}
+
+void img_rect_union(IMG_RECT *dst, const IMG_RECT *src) {
+	/*
+	*  Grow 'dst' so that it also covers 'src'.
+	*/
+	uint32_t x1 = dst->x + dst->w;
+	uint32_t y1 = dst->y + dst->h;
+
+	if (src->x + src->w > x1) {
+		x1 = src->x + src->w;
+	}
+	if (src->y + src->h > y1) {
+		y1 = src->y + src->h;
+	}
+	if (src->x < dst->x) {
+		dst->x = src->x;
+	}
+	if (src->y < dst->y) {
+		dst->y = src->y;
+	}
+	dst->w = x1 - dst->x;
+	dst->h = y1 - dst->y;
+}
+
+void img_rect_intersect(IMG_RECT *dst, const IMG_RECT *src) {
+	/*
+	*  Shrink 'dst' to the region it shares with 'src'. The
+	*  result has a zero width or height if there's none.
+	*/
+	uint32_t x0 = dst->x > src->x ? dst->x : src->x;
+	uint32_t y0 = dst->y > src->y ? dst->y : src->y;
+	uint32_t x1 = dst->x + dst->w;
+	uint32_t y1 = dst->y + dst->h;
+
+	if (src->x + src->w < x1) {
+		x1 = src->x + src->w;
+	}
+	if (src->y + src->h < y1) {
+		y1 = src->y + src->h;
+	}
+	dst->x = x0;
+	dst->y = y0;
+	dst->w = x1 > x0 ? x1 - x0 : 0;
+	dst->h = y1 > y0 ? y1 - y0 : 0;
+}
+
+void img_rect_clamp(IMG_RECT *rect, const uint32_t w, const uint32_t h) {
+	/*
+	*  Clamp 'rect' inside a 'w'x'h' image.
+	*/
+	const IMG_RECT bounds = { .x = 0, .y = 0, .w = w, .h = h };
+
+	img_rect_intersect(rect, &bounds);
+}
+
+void img_rect_dilate(IMG_RECT *rect, const uint32_t d) {
+	/*
+	*  Grow 'rect' by 'd' pixels in every direction. The
+	*  result is clamped at zero but not at the image size.
+	*/
+	uint32_t dx = rect->x < d ? rect->x : d;
+	uint32_t dy = rect->y < d ? rect->y : d;
+
+	rect->x -= dx;
+	rect->y -= dy;
+	rect->w += dx + d;
+	rect->h += dy + d;
+}
+
+int img_rect_eq(const IMG_RECT *a, const IMG_RECT *b) {
+	return a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h;
+}
+
+static int img_px_eq(const RGBQUAD *a, const RGBQUAD *b) {
+	// Compare two pixels as 32-bit words.
+	uint32_t wa;
+	uint32_t wb;
+
+	memcpy(&wa, a, sizeof(wa));
+	memcpy(&wb, b, sizeof(wb));
+	return wa == wb;
+}
+
+size_t img_qoi_encode(const RGBQUAD *px, const size_t n, uint8_t *out) {
+	/*
+	*  Encode the 'n' pixels of 'px' losslessly with the QOI
+	*  operations into 'out', which must have room for at least
+	*  IMG_QOI_MAX_LEN(n) bytes. Returns the encoded length.
+	*/
+	RGBQUAD index[64];
+	RGBQUAD prev = { 0, 0, 0, 255 };
+	unsigned int run = 0;
+	size_t pos = 0;
+	unsigned int h = 0;
+	int8_t vr = 0;
+	int8_t vg = 0;
+	int8_t vb = 0;
+	int8_t vg_r = 0;
+	int8_t vg_b = 0;
+
+	memset(index, 0, sizeof(index));
+	for (size_t i = 0; i < n; i++) {
+		if (img_px_eq(&px[i], &prev)) {
+			if (++run == IMGUTIL_QOI_MAX_RUN || i == n - 1) {
+				out[pos++] = IMGUTIL_QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run) {
+			out[pos++] = IMGUTIL_QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+
+		h = IMGUTIL_QOI_HASH(px[i]);
+		if (img_px_eq(&index[h], &px[i])) {
+			out[pos++] = IMGUTIL_QOI_OP_INDEX | h;
+		} else if (px[i].rgbReserved == prev.rgbReserved) {
+			index[h] = px[i];
+			vr = px[i].rgbRed - prev.rgbRed;
+			vg = px[i].rgbGreen - prev.rgbGreen;
+			vb = px[i].rgbBlue - prev.rgbBlue;
+			vg_r = vr - vg;
+			vg_b = vb - vg;
+			if (vr > -3 && vr < 2 && vg > -3 && vg < 2 &&
+				vb > -3 && vb < 2) {
+				out[pos++] = IMGUTIL_QOI_OP_DIFF | (vr + 2) << 4 |
+						(vg + 2) << 2 | (vb + 2);
+			} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+					vg_b > -9 && vg_b < 8) {
+				out[pos++] = IMGUTIL_QOI_OP_LUMA | (vg + 32);
+				out[pos++] = (vg_r + 8) << 4 | (vg_b + 8);
+			} else {
+				out[pos++] = IMGUTIL_QOI_OP_RGB;
+				out[pos++] = px[i].rgbRed;
+				out[pos++] = px[i].rgbGreen;
+				out[pos++] = px[i].rgbBlue;
+			}
+		} else {
+			index[h] = px[i];
+			out[pos++] = IMGUTIL_QOI_OP_RGBA;
+			out[pos++] = px[i].rgbRed;
+			out[pos++] = px[i].rgbGreen;
+			out[pos++] = px[i].rgbBlue;
+			out[pos++] = px[i].rgbReserved;
+		}
+		prev = px[i];
+	}
+	return pos;
+}
+
+int img_qoi_decode(const uint8_t *in, const size_t len, RGBQUAD *px,
+			const size_t n) {
+	/*
+	*  Decode 'n' pixels encoded by img_qoi_encode() from the 'len'
+	*  bytes of 'in' into 'px'. Returns 0 on success and 1 if the
+	*  data is truncated or malformed.
+	*/
+	RGBQUAD index[64];
+	RGBQUAD cur = { 0, 0, 0, 255 };
+	unsigned int run = 0;
+	size_t pos = 0;
+	uint8_t b1 = 0;
+	uint8_t b2 = 0;
+	int vg = 0;
+
+	memset(index, 0, sizeof(index));
+	for (size_t i = 0; i < n; i++) {
+		if (run) {
+			run--;
+			px[i] = cur;
+			continue;
+		}
+		if (pos >= len) {
+			return 1;
+		}
+
+		b1 = in[pos++];
+		if (b1 == IMGUTIL_QOI_OP_RGB) {
+			if (len - pos < 3) {
+				return 1;
+			}
+			cur.rgbRed = in[pos++];
+			cur.rgbGreen = in[pos++];
+			cur.rgbBlue = in[pos++];
+		} else if (b1 == IMGUTIL_QOI_OP_RGBA) {
+			if (len - pos < 4) {
+				return 1;
+			}
+			cur.rgbRed = in[pos++];
+			cur.rgbGreen = in[pos++];
+			cur.rgbBlue = in[pos++];
+			cur.rgbReserved = in[pos++];
+		} else if ((b1 & IMGUTIL_QOI_MASK) == IMGUTIL_QOI_OP_INDEX) {
+			cur = index[b1];
+		} else if ((b1 & IMGUTIL_QOI_MASK) == IMGUTIL_QOI_OP_DIFF) {
+			cur.rgbRed += ((b1 >> 4) & 0x03) - 2;
+			cur.rgbGreen += ((b1 >> 2) & 0x03) - 2;
+			cur.rgbBlue += (b1 & 0x03) - 2;
+		} else if ((b1 & IMGUTIL_QOI_MASK) == IMGUTIL_QOI_OP_LUMA) {
+			if (pos >= len) {
+				return 1;
+			}
+			b2 = in[pos++];
+			vg = (b1 & 0x3f) - 32;
+			cur.rgbRed += vg - 8 + ((b2 >> 4) & 0x0f);
+			cur.rgbGreen += vg;
+			cur.rgbBlue += vg - 8 + (b2 & 0x0f);
+		} else {
+			run = b1 & 0x3f;
+		}
+		index[IMGUTIL_QOI_HASH(cur)] = cur;
+		px[i] = cur;
+	}
+	return pos == len ? 0 : 1;
+}
@@ -24,18 +24,73 @@
 
 	#include <FreeImage.h>
 
+	/*
+	*  'fd' is the memfd that backs the pixel data of a shared
+	*  image or -1 if the pixel data is on the heap. Shared images
+	*  can be mapped by other processes without copying them.
+	*/
 	typedef struct STRUCT_IMAGE {
 		RGBQUAD *img;
 		uint32_t w;
 		uint32_t h;
+		int fd;
 	} IMAGE;
 
+	/*
+	*  Pixel formats of images passed in by other processes.
+	*  BGRA8 is the layout of RGBQUAD, the internal format.
+	*/
+	#define IMG_FORMAT_INVALID -1
+	#define IMG_FORMAT_BGRA8    0
+
+	/*
+	*  The maximum number of pixels in an image. Pixel indices
+	*  fit in 32 bits and the byte length of an image in size_t.
+	*/
+	#define IMG_MAX_PIXELS UINT32_MAX
+
+	// The maximum length of 'n' pixels encoded by img_qoi_encode().
+	#define IMG_QOI_MAX_LEN(n) ((size_t) (n)*5)
+
+	/*
+	*  A rectangular region of an image. The coordinates are
+	*  in the row order of the pixel data of IMAGE.
+	*/
+	typedef struct STRUCT_IMG_RECT {
+		uint32_t x;
+		uint32_t y;
+		uint32_t w;
+		uint32_t h;
+	} IMG_RECT;
+
 	void img_free(IMAGE *img);
 	size_t img_bytelen(const IMAGE *img);
+	int img_size_valid(uint32_t w, uint32_t h);
 	int img_cpy(IMAGE *dest, const IMAGE *src);
 	int img_realloc(IMAGE *img, uint32_t w, uint32_t h);
 	IMAGE *img_alloc(uint32_t w, uint32_t h);
+	IMAGE *img_alloc_shared(uint32_t w, uint32_t h);
+	IMAGE *img_map_shared(const int fd, uint32_t w, uint32_t h);
+	int img_share(IMAGE *img);
+	int img_format_from_str(const char *str);
+	size_t img_mem_used(void);
+	size_t img_mem_peak(void);
 	IMAGE *img_load(const char *path);
+	int img_probe(const char *path, uint32_t *w, uint32_t *h);
 	int img_save(const IMAGE *img, const char *filename);
+
+	IMAGE *img_crop(const IMAGE *src, const IMG_RECT *rect);
+	IMAGE *img_downscale(const IMAGE *src);
+	void img_downscale_rows(IMAGE *dst, const IMAGE *src,
+				const uint32_t begin, const uint32_t end);
+	void img_rect_union(IMG_RECT *dst, const IMG_RECT *src);
+	void img_rect_intersect(IMG_RECT *dst, const IMG_RECT *src);
+	void img_rect_clamp(IMG_RECT *rect, const uint32_t w, const uint32_t h);
+	void img_rect_dilate(IMG_RECT *rect, const uint32_t d);
+	int img_rect_eq(const IMG_RECT *a, const IMG_RECT *b);
+
+	size_t img_qoi_encode(const RGBQUAD *px, const size_t n, uint8_t *out);
+	int img_qoi_decode(const uint8_t *in, const size_t len, RGBQUAD *px,
+				const size_t n);
 #endif
 
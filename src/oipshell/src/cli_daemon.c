@@ -0,0 +1,1123 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/*
+*  The OIP daemon keeps the plugins, their caches and the worker
+*  processes warm between batches. Clients connect to a Unix domain
+*  socket and send shell commands, one per line. Each command gets a
+*  reply of the form "OK <n>\n" or "ERR <n>\n" followed by the <n>
+*  bytes of output of the command. Feeds are always asynchronous and
+*  'job wait' replies once the job is done without blocking the
+*  other clients.
+*
+*  Local clients can pass decoded images as a memfd or a shared
+*  memory object attached to the 'job create-shared' command with
+*  SCM_RIGHTS. The reply of 'job result-shared' carries a memfd
+*  with the result image in the same way.
+*
+*  Commands like 'plugin load' run arbitrary code as the daemon
+*  user, so the socket is only accessible by its owner and
+*  connections from other users are refused.
+*
+*  The event loop only does the socket I/O. Commands are run one
+*  at a time on a command thread, since they share the jobs and
+*  the feed handles of the shell, and the output of a command is
+*  captured through the 'print_stream' of the command thread. A
+*  slow command therefore doesn't keep the other clients from
+*  being served, and the output of the other threads of the
+*  daemon never ends up in a reply.
+*/
+
+#define _GNU_SOURCE
+
+#define PRINT_IDENTIFIER "cli-daemon"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "oipcore/abi/output.h"
+#include "oipcore/hashmap.h"
+#include "oipcore/jobmanager.h"
+#include "oipcore/job.h"
+#include "oipimgutil/oipimgutil.h"
+
+#include "cli_shell_priv.h"
+
+#define CLI_DAEMON_MAX_EVENTS 32
+#define CLI_DAEMON_LINE_MAX 4096
+#define CLI_DAEMON_BACKLOG 64
+#define CLI_DAEMON_MAX_FDS 8
+
+/*
+*  A connected client. 'in' holds the received bytes that aren't
+*  a complete command yet and 'out' the replies that haven't been
+*  sent. 'wait_job' is the ID of the job the client is waiting for.
+*  The commands of the client are processed in order, so nothing
+*  after a 'job wait' is run before the wait is over. 'fds' are the
+*  received file descriptors that no command has used yet. 'out_fd'
+*  is sent with the reply that starts at 'out_fd_off' in 'out'.
+*  'cmd' is the command of the client that is queued or running
+*  on the command thread. A client that disconnects while it has
+*  a command is 'closed' and freed once the command is done.
+*  'events' are the events the socket of the client is polled for.
+*/
+typedef struct STRUCT_CLI_DAEMON_CLIENT {
+	int fd;
+	char in[CLI_DAEMON_LINE_MAX];
+	size_t in_len;
+	char *out;
+	size_t out_len;
+	size_t out_cap;
+	char *wait_job;
+	int fds[CLI_DAEMON_MAX_FDS];
+	size_t fd_count;
+	int out_fd;
+	size_t out_fd_off;
+	int closing;
+	int closed;
+	uint32_t events;
+	struct STRUCT_CLI_DAEMON_CMD *cmd;
+} CLI_DAEMON_CLIENT;
+
+/*
+*  A command that is run on the command thread. The event loop
+*  sets 'client', 'line', 'keywords' and 'in_fd', which is the
+*  file descriptor passed with the command or -1. The command
+*  thread sets the rest: 'out' is the output of the command,
+*  'out_fd' is sent with the reply if it isn't -1 and 'wait_job'
+*  is the ID of the job the client waits for.
+*/
+typedef struct STRUCT_CLI_DAEMON_CMD {
+	CLI_DAEMON_CLIENT *client;
+	char *line;
+	PTRARRAY_TYPE(char) *keywords;
+	int in_fd;
+	char *out;
+	size_t out_len;
+	int out_fd;
+	char *wait_job;
+	int ret;
+	int closing;
+	struct STRUCT_CLI_DAEMON_CMD *next;
+} CLI_DAEMON_CMD;
+
+static int daemon_epoll = -1;
+static int daemon_listen = -1;
+static int daemon_wake = -1;
+static HASHMAP *daemon_clients = NULL;
+static volatile sig_atomic_t daemon_stop = 0;
+
+/*
+*  The command queue and the commands that are done. The
+*  shell mutex is held by the command thread while a command
+*  runs and by the event loop while it checks the feed handles.
+*/
+static pthread_t daemon_cmd_thread;
+static int daemon_cmd_running = 0;
+static int daemon_cmd_stop = 0;
+static pthread_mutex_t daemon_cmd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t daemon_cmd_cond = PTHREAD_COND_INITIALIZER;
+static CLI_DAEMON_CMD *daemon_cmd_head = NULL;
+static CLI_DAEMON_CMD *daemon_cmd_tail = NULL;
+static CLI_DAEMON_CMD *daemon_cmd_done = NULL;
+static pthread_mutex_t daemon_shell_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void cli_daemon_signal(int sig);
+static void cli_daemon_done_callback(JOB *job, const int state, void *arg);
+static int cli_daemon_epoll_set(const int fd, const int op,
+				const uint32_t events);
+static int cli_daemon_reply(CLI_DAEMON_CLIENT *client, const int ok,
+				const char *data, const size_t len);
+static int cli_daemon_reply_str(CLI_DAEMON_CLIENT *client, const int ok,
+				const char *str);
+static void cli_daemon_recv_fds(CLI_DAEMON_CLIENT *client, struct msghdr *msg);
+static int cli_daemon_pop_fd(CLI_DAEMON_CLIENT *client);
+static int cli_daemon_create_shared(CLI_DAEMON_CMD *cmd);
+static int cli_daemon_result_shared(const PTRARRAY_TYPE(char) *keywords,
+				int *fd);
+static ssize_t cli_daemon_send(CLI_DAEMON_CLIENT *client);
+static void cli_daemon_flush(CLI_DAEMON_CLIENT *client);
+static void cli_daemon_poll(CLI_DAEMON_CLIENT *client);
+static int cli_daemon_check_wait(CLI_DAEMON_CLIENT *client);
+static void cli_daemon_command(CLI_DAEMON_CMD *cmd);
+static void *cli_daemon_command_thread(void *arg);
+static int cli_daemon_queue(CLI_DAEMON_CLIENT *client, const char *line);
+static void cli_daemon_free_cmd(CLI_DAEMON_CMD *cmd);
+static CLI_DAEMON_CLIENT *cli_daemon_finish(CLI_DAEMON_CMD *cmd);
+static void cli_daemon_process(CLI_DAEMON_CLIENT *client);
+static void cli_daemon_read(CLI_DAEMON_CLIENT *client);
+static void cli_daemon_accept(void);
+static void cli_daemon_free_client(CLI_DAEMON_CLIENT *client);
+static void cli_daemon_close(CLI_DAEMON_CLIENT *client);
+static void cli_daemon_wake_clients(void);
+static int cli_daemon_listen(const char *path);
+static void cli_daemon_cleanup(const char *path);
+
+static void cli_daemon_signal(int sig) {
+	uint64_t one = 1;
+	ssize_t ret = 0;
+
+	(void) sig;
+	daemon_stop = 1;
+	ret = write(daemon_wake, &one, sizeof(one));
+	(void) ret;
+}
+
+static void cli_daemon_done_callback(JOB *job, const int state, void *arg) {
+	/*
+	*  Wake up the event loop so that the clients waiting for
+	*  'job' get their reply. This is called by the scheduler.
+	*/
+	uint64_t one = 1;
+	ssize_t ret = 0;
+
+	(void) job;
+	(void) state;
+	(void) arg;
+	ret = write(daemon_wake, &one, sizeof(one));
+	(void) ret;
+}
+
+static int cli_daemon_epoll_set(const int fd, const int op,
+				const uint32_t events) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	errno = 0;
+	if (epoll_ctl(daemon_epoll, op, fd, &ev) != 0) {
+		printerrno("epoll_ctl()");
+		return 1;
+	}
+	return 0;
+}
+
+static int cli_daemon_reply(CLI_DAEMON_CLIENT *client, const int ok,
+				const char *data, const size_t len) {
+	/*
+	*  Queue a reply with the payload 'data' of 'len' bytes for
+	*  'client' and try to send it. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	char header[32];
+	char *tmp = NULL;
+	size_t header_len = 0;
+	size_t cap = 0;
+
+	header_len = snprintf(header, sizeof(header), "%s %zu\n",
+				ok ? "OK" : "ERR", len);
+	if (client->out_len + header_len + len > client->out_cap) {
+		cap = client->out_len + header_len + len;
+		errno = 0;
+		tmp = realloc(client->out, cap);
+		if (!tmp) {
+			printerrno("realloc()");
+			return 1;
+		}
+		client->out = tmp;
+		client->out_cap = cap;
+	}
+	memcpy(client->out + client->out_len, header, header_len);
+	memcpy(client->out + client->out_len + header_len, data, len);
+	client->out_len += header_len + len;
+	cli_daemon_flush(client);
+	return 0;
+}
+
+static int cli_daemon_reply_str(CLI_DAEMON_CLIENT *client, const int ok,
+				const char *str) {
+	return cli_daemon_reply(client, ok, str, strlen(str));
+}
+
+static ssize_t cli_daemon_send(CLI_DAEMON_CLIENT *client) {
+	/*
+	*  Send the queued output of 'client' up to the reply that
+	*  carries 'out_fd' or, if that reply is next, the rest of the
+	*  output with 'out_fd' attached. Returns the number of bytes
+	*  sent or -1 on failure.
+	*/
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg = NULL;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t ret = 0;
+
+	if (client->out_fd < 0) {
+		return send(client->fd, client->out, client->out_len, MSG_NOSIGNAL);
+	} else if (client->out_fd_off) {
+		return send(client->fd, client->out, client->out_fd_off, MSG_NOSIGNAL);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = client->out;
+	iov.iov_len = client->out_len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &client->out_fd, sizeof(int));
+
+	ret = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+	if (ret > 0) {
+		close(client->out_fd);
+		client->out_fd = -1;
+	}
+	return ret;
+}
+
+static void cli_daemon_flush(CLI_DAEMON_CLIENT *client) {
+	/*
+	*  Send as much of the queued output of 'client' as possible
+	*  without blocking. The rest is sent once the socket becomes
+	*  writable.
+	*/
+	ssize_t ret = 0;
+
+	while (client->out_len) {
+		errno = 0;
+		ret = cli_daemon_send(client);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				client->closing = 1;
+				client->out_len = 0;
+				if (client->out_fd >= 0) {
+					close(client->out_fd);
+					client->out_fd = -1;
+				}
+			}
+			break;
+		}
+		memmove(client->out, client->out + ret, client->out_len - ret);
+		client->out_len -= ret;
+		if (client->out_fd >= 0) {
+			client->out_fd_off -= ret;
+		}
+	}
+
+	cli_daemon_poll(client);
+}
+
+static void cli_daemon_poll(CLI_DAEMON_CLIENT *client) {
+	/*
+	*  Update the events the socket of 'client' is polled for.
+	*  Nothing is read while the client has a command running,
+	*  waits for a job or has a full input buffer, since the
+	*  socket would stay readable and the event loop would spin.
+	*/
+	uint32_t events = 0;
+
+	if (!client->closing && !client->cmd && !client->wait_job &&
+		client->in_len < sizeof(client->in)) {
+		events |= EPOLLIN;
+	}
+	if (client->out_len) {
+		events |= EPOLLOUT;
+	}
+	if (events != client->events &&
+		cli_daemon_epoll_set(client->fd, EPOLL_CTL_MOD, events) == 0) {
+		client->events = events;
+	}
+}
+
+static void cli_daemon_recv_fds(CLI_DAEMON_CLIENT *client, struct msghdr *msg) {
+	/*
+	*  Store the file descriptors passed in 'msg' in 'client'.
+	*  Descriptors that don't fit are closed.
+	*/
+	struct cmsghdr *cmsg = NULL;
+	size_t n = 0;
+	int fd = -1;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		n = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+		for (size_t i = 0; i < n; i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+			if (client->fd_count < CLI_DAEMON_MAX_FDS) {
+				client->fds[client->fd_count++] = fd;
+			} else {
+				close(fd);
+			}
+		}
+	}
+}
+
+static int cli_daemon_pop_fd(CLI_DAEMON_CLIENT *client) {
+	/*
+	*  Take the oldest unused file descriptor received from
+	*  'client'. Returns -1 if there are none.
+	*/
+	int ret = -1;
+
+	if (client->fd_count == 0) {
+		return -1;
+	}
+	ret = client->fds[0];
+	client->fd_count--;
+	memmove(client->fds, client->fds + 1, client->fd_count*sizeof(int));
+	return ret;
+}
+
+static int cli_daemon_create_shared(CLI_DAEMON_CMD *cmd) {
+	/*
+	*  Create a job for the image in the file descriptor passed
+	*  with 'job create-shared <w> <h> <format>' and print its ID.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	const PTRARRAY_TYPE(char) *keywords = cmd->keywords;
+	unsigned long int w = 0;
+	unsigned long int h = 0;
+	char *end_w = NULL;
+	char *end_h = NULL;
+	JOB *job = NULL;
+	int format = IMG_FORMAT_INVALID;
+	int fd = -1;
+
+	fd = cmd->in_fd;
+	cmd->in_fd = -1;
+	if (fd < 0) {
+		printerr("No file descriptor passed with the command.\n");
+		return 1;
+	}
+
+	errno = 0;
+	w = strtoul(keywords->ptrs[2], &end_w, 10);
+	h = strtoul(keywords->ptrs[3], &end_h, 10);
+	format = img_format_from_str(keywords->ptrs[4]);
+	if (errno != 0 || *end_w != '\0' || *end_h != '\0' ||
+		w > UINT32_MAX || h > UINT32_MAX) {
+		printerr("Invalid image size.\n");
+		close(fd);
+		return 1;
+	}
+
+	job = job_create_shared(fd, w, h, format);
+	if (!job) {
+		printerr("Failed to create job.\n");
+		return 1;
+	}
+	if (jobmanager_reg_job(job) != 0) {
+		printerr("Failed to register the JOB with the jobmanager.\n");
+		job_destroy(job);
+		return 1;
+	}
+	fprintf(print_stdout, "%s\n", job->job_id);
+	return 0;
+}
+
+static int cli_daemon_result_shared(const PTRARRAY_TYPE(char) *keywords,
+				int *fd) {
+	/*
+	*  Get a memfd with the result image of the job in the
+	*  'job result-shared <ID>' command in '*fd' and print the
+	*  size and the format of the image. Returns 0 on success
+	*  and 1 on failure.
+	*/
+	uint32_t w = 0;
+	uint32_t h = 0;
+	JOB *job = NULL;
+
+	job = jobmanager_get_job_by_id(keywords->ptrs[2]);
+	if (!job) {
+		return 1;
+	}
+	if (job_get_result_shared(job, fd, &w, &h) != 0) {
+		printerr("Failed to share the result image.\n");
+		return 1;
+	}
+	fprintf(print_stdout, "%u %u bgra8\n", w, h);
+	return 0;
+}
+
+static int cli_daemon_check_wait(CLI_DAEMON_CLIENT *client) {
+	/*
+	*  Reply to the 'job wait' of 'client' if the job is done.
+	*  Returns 1 if the client is still waiting and 0 otherwise.
+	*/
+	PIPELINE_HANDLE *handle = NULL;
+	char buf[128];
+	int state = 0;
+
+	if (!client->wait_job) {
+		return 0;
+	}
+
+	/*
+	*  The handles belong to the command thread while it runs a
+	*  command. The wait is checked again once it's done.
+	*/
+	if (pthread_mutex_trylock(&daemon_shell_mutex) != 0) {
+		return 1;
+	}
+	handle = cli_shell_get_handle(client->wait_job);
+	if (!handle) {
+		pthread_mutex_unlock(&daemon_shell_mutex);
+		snprintf(buf, sizeof(buf), "No asynchronous feed for job '%s'.\n",
+				client->wait_job);
+		cli_daemon_reply_str(client, 0, buf);
+	} else {
+		if (pipeline_poll(handle) < PIPELINE_HANDLE_SUCCESS) {
+			pthread_mutex_unlock(&daemon_shell_mutex);
+			return 1;
+		}
+		// Let the scheduler drop the job before replying.
+		state = pipeline_wait(handle);
+		pthread_mutex_unlock(&daemon_shell_mutex);
+		snprintf(buf, sizeof(buf), "Job %s %s.\n", client->wait_job,
+				state == PIPELINE_HANDLE_SUCCESS ? "finished" :
+				state == PIPELINE_HANDLE_CANCELLED ? "cancelled" :
+				"failed");
+		cli_daemon_reply_str(client, state == PIPELINE_HANDLE_SUCCESS, buf);
+	}
+	free(client->wait_job);
+	client->wait_job = NULL;
+	return 0;
+}
+
+static void cli_daemon_command(CLI_DAEMON_CMD *cmd) {
+	/*
+	*  Run 'cmd' on the command thread. The output of the command
+	*  is captured into 'cmd->out'.
+	*/
+	JOB *job = NULL;
+	int async = 0;
+	int proto = -1;
+
+	errno = 0;
+	print_stream = open_memstream(&cmd->out, &cmd->out_len);
+	if (!print_stream) {
+		printerrno("open_memstream()");
+		cmd->ret = 1;
+		return;
+	}
+
+	pthread_mutex_lock(&daemon_shell_mutex);
+	proto = cli_shell_prototype_match(cmd->keywords);
+	switch (proto) {
+		case 4: ; // job feed %s
+			job = cli_shell_feed_job(cmd->keywords, &async);
+			if (!job || cli_shell_feed_async(job, &cli_daemon_done_callback) != 0) {
+				printerr("Failed to submit job.\n");
+				cmd->ret = 1;
+				break;
+			}
+			fprintf(print_stdout, "Job %s queued.\n", job->job_id);
+			break;
+		case 15: ; // job wait %s
+			errno = 0;
+			cmd->wait_job = strdup(cmd->keywords->ptrs[2]);
+			if (!cmd->wait_job) {
+				printerrno("strdup()");
+				cmd->ret = 1;
+			}
+			break;
+		case 26: ; // exit
+			cmd->closing = 1;
+			break;
+		case 27: ; // job create-shared %s %s %s
+			cmd->ret = cli_daemon_create_shared(cmd);
+			break;
+		case 28: ; // job result-shared %s
+			cmd->ret = cli_daemon_result_shared(cmd->keywords, &cmd->out_fd);
+			break;
+		default:
+			if (proto < 0) {
+				printerr_va("Invalid command: %s\n", cmd->line);
+				cmd->ret = 1;
+			} else {
+				cmd->ret = cli_shell_execute(proto, cmd->keywords);
+			}
+			break;
+	}
+	pthread_mutex_unlock(&daemon_shell_mutex);
+
+	fclose(print_stream);
+	print_stream = NULL;
+}
+
+static void *cli_daemon_command_thread(void *arg) {
+	/*
+	*  Run the queued commands in order and wake up the event
+	*  loop after each one so that it sends the reply.
+	*/
+	CLI_DAEMON_CMD *cmd = NULL;
+	uint64_t one = 1;
+	ssize_t ret = 0;
+
+	(void) arg;
+	for (;;) {
+		pthread_mutex_lock(&daemon_cmd_mutex);
+		while (!daemon_cmd_head && !daemon_cmd_stop) {
+			pthread_cond_wait(&daemon_cmd_cond, &daemon_cmd_mutex);
+		}
+		if (daemon_cmd_stop) {
+			pthread_mutex_unlock(&daemon_cmd_mutex);
+			break;
+		}
+		cmd = daemon_cmd_head;
+		daemon_cmd_head = cmd->next;
+		if (!daemon_cmd_head) {
+			daemon_cmd_tail = NULL;
+		}
+		pthread_mutex_unlock(&daemon_cmd_mutex);
+
+		cli_daemon_command(cmd);
+
+		pthread_mutex_lock(&daemon_cmd_mutex);
+		cmd->next = daemon_cmd_done;
+		daemon_cmd_done = cmd;
+		pthread_mutex_unlock(&daemon_cmd_mutex);
+		ret = write(daemon_wake, &one, sizeof(one));
+		(void) ret;
+	}
+	return NULL;
+}
+
+static int cli_daemon_queue(CLI_DAEMON_CLIENT *client, const char *line) {
+	/*
+	*  Queue the command in 'line' of 'client' for the command
+	*  thread. Empty lines are skipped. Returns 0 on success and
+	*  1 on failure.
+	*/
+	PTRARRAY_TYPE(char) *keywords = NULL;
+	CLI_DAEMON_CMD *cmd = NULL;
+
+	keywords = cli_shell_tokenize(line);
+	if (!keywords) {
+		cli_daemon_reply_str(client, 0, "Failed to parse command.\n");
+		return 1;
+	}
+	if (keywords->ptrc == 0) {
+		cli_shell_free_keywords(keywords);
+		return 0;
+	}
+
+	errno = 0;
+	cmd = calloc(1, sizeof(*cmd));
+	if (cmd) {
+		cmd->line = strdup(line);
+	}
+	if (!cmd || !cmd->line) {
+		free(cmd);
+		cli_shell_free_keywords(keywords);
+		cli_daemon_reply_str(client, 0, "Out of memory.\n");
+		return 1;
+	}
+	cmd->client = client;
+	cmd->keywords = keywords;
+	cmd->in_fd = -1;
+	cmd->out_fd = -1;
+
+	// The file descriptor of a shared image comes with the command.
+	if (keywords->ptrc >= 2 && strcmp(keywords->ptrs[0], "job") == 0 &&
+		strcmp(keywords->ptrs[1], "create-shared") == 0) {
+		cmd->in_fd = cli_daemon_pop_fd(client);
+	}
+
+	client->cmd = cmd;
+	pthread_mutex_lock(&daemon_cmd_mutex);
+	if (daemon_cmd_tail) {
+		daemon_cmd_tail->next = cmd;
+	} else {
+		daemon_cmd_head = cmd;
+	}
+	daemon_cmd_tail = cmd;
+	pthread_cond_signal(&daemon_cmd_cond);
+	pthread_mutex_unlock(&daemon_cmd_mutex);
+	return 0;
+}
+
+static void cli_daemon_free_cmd(CLI_DAEMON_CMD *cmd) {
+	if (cmd->in_fd >= 0) {
+		close(cmd->in_fd);
+	}
+	if (cmd->out_fd >= 0) {
+		close(cmd->out_fd);
+	}
+	cli_shell_free_keywords(cmd->keywords);
+	free(cmd->line);
+	free(cmd->out);
+	free(cmd->wait_job);
+	free(cmd);
+}
+
+static CLI_DAEMON_CLIENT *cli_daemon_finish(CLI_DAEMON_CMD *cmd) {
+	/*
+	*  Queue the reply of the command 'cmd' that the command thread
+	*  is done with. Returns the client of the command or a NULL
+	*  pointer if the client had disconnected and was freed.
+	*/
+	CLI_DAEMON_CLIENT *client = cmd->client;
+
+	client->cmd = NULL;
+	if (client->closed) {
+		cli_daemon_free_cmd(cmd);
+		cli_daemon_free_client(client);
+		return NULL;
+	}
+
+	if (cmd->closing) {
+		client->closing = 1;
+	}
+	if (cmd->out_fd >= 0) {
+		client->out_fd = cmd->out_fd;
+		client->out_fd_off = client->out_len;
+		cmd->out_fd = -1;
+	}
+	if (!cmd->wait_job || cmd->ret != 0) {
+		cli_daemon_reply(client, cmd->ret == 0, cmd->out ? cmd->out : "",
+				cmd->out ? cmd->out_len : 0);
+	} else {
+		client->wait_job = cmd->wait_job;
+		cmd->wait_job = NULL;
+	}
+	cli_daemon_free_cmd(cmd);
+	if (client->wait_job) {
+		cli_daemon_check_wait(client);
+	}
+	return client;
+}
+
+static void cli_daemon_process(CLI_DAEMON_CLIENT *client) {
+	/*
+	*  Queue the next complete command in the input buffer of
+	*  'client' unless the client still has a command running,
+	*  waits for a job or for a file descriptor to be sent.
+	*/
+	char *nl = NULL;
+	size_t len = 0;
+
+	while (!client->closing && !client->cmd && client->out_fd < 0 &&
+		!cli_daemon_check_wait(client)) {
+		nl = memchr(client->in, '\n', client->in_len);
+		if (!nl) {
+			break;
+		}
+		*nl = '\0';
+		len = nl - client->in + 1;
+		cli_daemon_queue(client, client->in);
+		memmove(client->in, client->in + len, client->in_len - len);
+		client->in_len -= len;
+	}
+	cli_daemon_poll(client);
+}
+
+static void cli_daemon_read(CLI_DAEMON_CLIENT *client) {
+	/*
+	*  Read the data and the file descriptors available on the
+	*  socket of 'client'.
+	*/
+	char cbuf[CMSG_SPACE(CLI_DAEMON_MAX_FDS*sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t ret = 0;
+
+	for (;;) {
+		if (client->in_len == sizeof(client->in)) {
+			if (!memchr(client->in, '\n', client->in_len)) {
+				client->closing = 1;
+				cli_daemon_reply_str(client, 0, "Command too long.\n");
+			}
+			return;
+		}
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = client->in + client->in_len;
+		iov.iov_len = sizeof(client->in) - client->in_len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		errno = 0;
+		ret = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+		if (ret >= 0) {
+			cli_daemon_recv_fds(client, &msg);
+		}
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		} else if (ret <= 0) {
+			client->closing = 1;
+			client->out_len = 0;
+			return;
+		}
+		client->in_len += ret;
+		cli_daemon_process(client);
+	}
+}
+
+static void cli_daemon_accept(void) {
+	/*
+	*  Accept the pending connections on the listening socket.
+	*/
+	CLI_DAEMON_CLIENT *client = NULL;
+	struct ucred cred;
+	socklen_t cred_len = 0;
+	int fd = -1;
+
+	for (;;) {
+		errno = 0;
+		fd = accept4(daemon_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				printerrno("accept4()");
+			}
+			if (errno != EINTR) {
+				return;
+			}
+			continue;
+		}
+
+		// Only serve processes of the same user.
+		cred_len = sizeof(cred);
+		errno = 0;
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+			printerrno("getsockopt()");
+			close(fd);
+			continue;
+		}
+		if (cred.uid != geteuid()) {
+			printerr_va("Refused a connection from UID %u.\n",
+					(unsigned int) cred.uid);
+			close(fd);
+			continue;
+		}
+
+		errno = 0;
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			printerrno("calloc()");
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->out_fd = -1;
+		client->events = EPOLLIN;
+		if (hashmap_put_int(daemon_clients, fd, client) != 0) {
+			free(client);
+			close(fd);
+			continue;
+		}
+		if (cli_daemon_epoll_set(fd, EPOLL_CTL_ADD, EPOLLIN) != 0) {
+			hashmap_pop_int(daemon_clients, fd);
+			free(client);
+			close(fd);
+			continue;
+		}
+		printverb_va("Client %i connected.\n", fd);
+	}
+}
+
+static void cli_daemon_free_client(CLI_DAEMON_CLIENT *client) {
+	close(client->fd);
+	for (size_t i = 0; i < client->fd_count; i++) {
+		close(client->fds[i]);
+	}
+	if (client->out_fd >= 0) {
+		close(client->out_fd);
+	}
+	free(client->wait_job);
+	free(client->out);
+	free(client);
+}
+
+static void cli_daemon_close(CLI_DAEMON_CLIENT *client) {
+	/*
+	*  Disconnect 'client'. A client with a command on the command
+	*  thread is freed once the command is done.
+	*/
+	printverb_va("Client %i disconnected.\n", client->fd);
+	hashmap_pop_int(daemon_clients, client->fd);
+	epoll_ctl(daemon_epoll, EPOLL_CTL_DEL, client->fd, NULL);
+	if (client->cmd) {
+		client->closed = 1;
+		return;
+	}
+	cli_daemon_free_client(client);
+}
+
+static void cli_daemon_wake_clients(void) {
+	/*
+	*  Reply to the commands the command thread is done with and
+	*  to the clients whose jobs are done, and queue the commands
+	*  they sent after that.
+	*/
+	CLI_DAEMON_CLIENT *client = NULL;
+	CLI_DAEMON_CMD *cmd = NULL;
+	CLI_DAEMON_CMD *next = NULL;
+	uint64_t cnt = 0;
+	size_t iter = 0;
+	ssize_t ret = 0;
+
+	ret = read(daemon_wake, &cnt, sizeof(cnt));
+	(void) ret;
+
+	pthread_mutex_lock(&daemon_cmd_mutex);
+	cmd = daemon_cmd_done;
+	daemon_cmd_done = NULL;
+	pthread_mutex_unlock(&daemon_cmd_mutex);
+	for (; cmd; cmd = next) {
+		next = cmd->next;
+		client = cli_daemon_finish(cmd);
+		if (!client) {
+			continue;
+		}
+		if (client->out_fd < 0) {
+			cli_daemon_process(client);
+		}
+		if (client->closing && !client->out_len) {
+			cli_daemon_close(client);
+		}
+	}
+
+	while (hashmap_next(daemon_clients, &iter, (void**) &client)) {
+		if (client->wait_job && !cli_daemon_check_wait(client)) {
+			cli_daemon_process(client);
+		}
+	}
+}
+
+static int cli_daemon_listen(const char *path) {
+	/*
+	*  Create the listening socket at 'path'. A stale socket file
+	*  left behind by a previous daemon is replaced. The socket is
+	*  created with mode 0600. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask = 0;
+	int ret = 0;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printerr("Socket path too long.\n");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			printerr_va("'%s' exists and isn't a socket.\n", path);
+			return 1;
+		}
+		unlink(path);
+	}
+
+	errno = 0;
+	daemon_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (daemon_listen < 0) {
+		printerrno("socket()");
+		return 1;
+	}
+	mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+	errno = 0;
+	ret = bind(daemon_listen, (struct sockaddr*) &addr, sizeof(addr));
+	if (ret != 0) {
+		printerrno("bind()");
+	}
+	umask(mask);
+	if (ret != 0) {
+		return 1;
+	}
+	errno = 0;
+	if (listen(daemon_listen, CLI_DAEMON_BACKLOG) != 0) {
+		printerrno("listen()");
+		return 1;
+	}
+	return 0;
+}
+
+static void cli_daemon_cleanup(const char *path) {
+	CLI_DAEMON_CLIENT *client = NULL;
+	CLI_DAEMON_CMD *cmds[2];
+	CLI_DAEMON_CMD *next = NULL;
+	size_t iter = 0;
+
+	// Let the command thread finish the running command.
+	if (daemon_cmd_running) {
+		pthread_mutex_lock(&daemon_cmd_mutex);
+		daemon_cmd_stop = 1;
+		pthread_cond_broadcast(&daemon_cmd_cond);
+		pthread_mutex_unlock(&daemon_cmd_mutex);
+		pthread_join(daemon_cmd_thread, NULL);
+		daemon_cmd_running = 0;
+	}
+	cmds[0] = daemon_cmd_head;
+	cmds[1] = daemon_cmd_done;
+	daemon_cmd_head = NULL;
+	daemon_cmd_tail = NULL;
+	daemon_cmd_done = NULL;
+	for (size_t i = 0; i < 2; i++) {
+		for (; cmds[i]; cmds[i] = next) {
+			next = cmds[i]->next;
+			cmds[i]->client->cmd = NULL;
+			if (cmds[i]->client->closed) {
+				cli_daemon_free_client(cmds[i]->client);
+			}
+			cli_daemon_free_cmd(cmds[i]);
+		}
+	}
+
+	if (daemon_clients) {
+		while (hashmap_next(daemon_clients, &iter, (void**) &client)) {
+			cli_daemon_free_client(client);
+		}
+		hashmap_destroy(daemon_clients, 0);
+		daemon_clients = NULL;
+	}
+	if (daemon_listen >= 0) {
+		close(daemon_listen);
+		unlink(path);
+		daemon_listen = -1;
+	}
+	if (daemon_epoll >= 0) {
+		close(daemon_epoll);
+		daemon_epoll = -1;
+	}
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	if (daemon_wake >= 0) {
+		close(daemon_wake);
+		daemon_wake = -1;
+	}
+}
+
+int cli_daemon_run(const char *path) {
+	/*
+	*  Serve clients on the Unix domain socket 'path' until the
+	*  daemon gets SIGINT or SIGTERM. Returns 0 on a clean exit
+	*  and 1 on failure.
+	*/
+	struct epoll_event events[CLI_DAEMON_MAX_EVENTS];
+	struct sigaction sa;
+	CLI_DAEMON_CLIENT *client = NULL;
+	int n = 0;
+
+	errno = 0;
+	daemon_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	daemon_epoll = epoll_create1(EPOLL_CLOEXEC);
+	daemon_clients = hashmap_create(HASHMAP_KEY_INT, NULL);
+	if (daemon_wake < 0 || daemon_epoll < 0 || !daemon_clients) {
+		printerrno("Daemon setup");
+		cli_daemon_cleanup(path);
+		return 1;
+	}
+
+	if (cli_daemon_listen(path) != 0 ||
+		cli_daemon_epoll_set(daemon_listen, EPOLL_CTL_ADD, EPOLLIN) != 0 ||
+		cli_daemon_epoll_set(daemon_wake, EPOLL_CTL_ADD, EPOLLIN) != 0) {
+		cli_daemon_cleanup(path);
+		return 1;
+	}
+
+	daemon_cmd_stop = 0;
+	n = pthread_create(&daemon_cmd_thread, NULL, &cli_daemon_command_thread, NULL);
+	if (n != 0) {
+		errno = n;
+		printerrno("pthread_create()");
+		cli_daemon_cleanup(path);
+		return 1;
+	}
+	daemon_cmd_running = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &cli_daemon_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fprintf(print_stdout, "OIP daemon listening on '%s'.\n", path);
+	fflush(stdout);
+
+	while (!daemon_stop) {
+		errno = 0;
+		n = epoll_wait(daemon_epoll, events, CLI_DAEMON_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printerrno("epoll_wait()");
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == daemon_listen) {
+				cli_daemon_accept();
+				continue;
+			} else if (events[i].data.fd == daemon_wake) {
+				cli_daemon_wake_clients();
+				continue;
+			}
+
+			client = hashmap_get_int(daemon_clients, events[i].data.fd);
+			if (!client) {
+				continue;
+			}
+			if (events[i].events & (EPOLLHUP | EPOLLERR) &&
+				!(client->events & EPOLLIN)) {
+				// Hung up while nothing is read from the socket.
+				client->closing = 1;
+				client->out_len = 0;
+			} else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				cli_daemon_read(client);
+			}
+			if (events[i].events & EPOLLOUT) {
+				cli_daemon_flush(client);
+				if (client->out_fd < 0) {
+					cli_daemon_process(client);
+				}
+			}
+			if (client->closing && !client->out_len) {
+				cli_daemon_close(client);
+			}
+		}
+	}
+
+	fprintf(print_stdout, "OIP daemon stopping.\n");
+	cli_daemon_cleanup(path);
+	return 0;
+}
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "oipcore/abi/output.h"
 #include "oipcore/oip.h"
@@ -35,15 +36,48 @@
 #include "oipcore/pipeline.h"
 #include "oipcore/ptrarray.h"
 #include "oipcore/jobmanager.h"
+#include "oipcore/scheduler.h"
+#include "oipcore/hashmap.h"
+#include "oipcore/memgov.h"
+#include "oipcore/taskpool.h"
 #include "oipbuildinfo/oipbuildinfo.h"
 
+#include "cli_shell_priv.h"
+
 #define SHELL_BUFFER_LEN 100
-#define NUM_CLI_CMD_PROTOS 12
+#define NUM_CLI_CMD_PROTOS 30
 #define NUM_CLI_CMD_MAX_KEYWORDS 10
 
+// Exit statuses of a script run.
+#define CLI_SCRIPT_EXIT_OK    0
+#define CLI_SCRIPT_EXIT_FAIL  1
+#define CLI_SCRIPT_EXIT_ERROR 2
+
+// A parsed command of a script and its location.
+typedef struct STRUCT_CLI_SCRIPT_CMD {
+	PTRARRAY_TYPE(char) *keywords;
+	int proto;
+	const char *file;
+	size_t line;
+} CLI_SCRIPT_CMD;
+
+/*
+*  The pending work of a job in a script run. 'feed' is the
+*  handle of a feed that hasn't been waited for yet and 'saver'
+*  is a thread that runs 'save_cmd' once the feed is done.
+*/
+typedef struct STRUCT_CLI_SCRIPT_JOB {
+	PIPELINE_HANDLE *feed;
+	pthread_t saver;
+	int saving;
+	const CLI_SCRIPT_CMD *save_cmd;
+	int ret;
+} CLI_SCRIPT_JOB;
+
 static int exit_queued = 0;
 static JOB **cli_shell_jobs = NULL;
 static unsigned int cli_shell_jobs_count = 0;
+static HASHMAP *cli_shell_handles = NULL;
 
 static char *cli_cmd_prototypes[NUM_CLI_CMD_PROTOS][NUM_CLI_CMD_MAX_KEYWORDS] = {
 	{"plugin", "load", "%s", "%s"},
@@ -56,8 +90,26 @@ static char *cli_cmd_prototypes[NUM_CLI_CMD_PROTOS][NUM_CLI_CMD_MAX_KEYWORDS] =
 	{"job", "list"},
 	{"cache", "dump", "all"},
 	{"cache", "file", "delete", "%s", "%s"},
+	{"job", "set-priority", "%s", "%s"},
+	{"job", "set-deadline", "%s", "%s"},
+	{"job", "set-submitter", "%s", "%s"},
+	{"scheduler", "set-weight", "%s", "%s"},
+	{"scheduler", "status"},
+	{"job", "wait", "%s"},
+	{"job", "cancel", "%s"},
+	{"plugin", "set-input", "%s", "%s"},
+	{"job", "outputs", "%s", "%s"},
+	{"job", "save-node", "%s", "%s", "%s"},
+	{"pipeline", "create", "%s"},
+	{"pipeline", "select", "%s"},
+	{"pipeline", "list"},
+	{"job", "set-pipeline", "%s", "%s"},
+	{"job", "roi", "%s", "%s"},
 	{"help"},
-	{"exit"}
+	{"exit"},
+	{"job", "create-shared", "%s", "%s", "%s"},
+	{"job", "result-shared", "%s"},
+	{"mem", "status"}
 };
 
 static char *cli_cmd_help[NUM_CLI_CMD_PROTOS] = {
@@ -65,41 +117,303 @@ static char *cli_cmd_help[NUM_CLI_CMD_PROTOS] = {
 	"plugin list  ---------------------------------  List all loaded plugins.",
 	"plugin set-arg <plugin index> <arg> <val>  ---  Set the argument <arg> to <val> for plugin <plugin index>.",
 	"job create <filepath>  -----------------------  Create a job for <filepath>.",
-	"job feed <ID>  -------------------------------  Feed the job with the ID <ID> to the pipeline.",
+	"job feed [--async] [--preview <s>] <ID>  -----  Feed the job <ID> to the pipeline. --async returns immediately. --preview feeds at scale <s>.",
 	"job delete <ID>  -----------------------------  Delete the job with the ID <ID>.",
 	"job save <ID>  -------------------------------  Save the result image of the job with the ID <ID>.",
 	"job list  ------------------------------------  List all jobs.",
 	"cache dump all  ------------------------------  Dump information about existing caches to STDOUT.",
 	"cache file delete <cache> <fname> ------------  Delete the file <fname> from <cache>.",
+	"job set-priority <ID> <priority>  ------------  Set the priority (interactive, normal or batch) of the job <ID>.",
+	"job set-deadline <ID> <ms>  ------------------  Set the deadline of the job <ID> in milliseconds. 0 means none.",
+	"job set-submitter <ID> <name>  ---------------  Set the submitter of the job <ID>.",
+	"scheduler set-weight <submitter> <weight>  ---  Set the fair share weight of <submitter>.",
+	"scheduler status  ----------------------------  Print the scheduler and task pool status.",
+	"job wait <ID>  -------------------------------  Wait for the asynchronous feed of the job <ID> to finish.",
+	"job cancel <ID>  -----------------------------  Cancel the asynchronous feed of the job <ID>.",
+	"plugin set-input <plugin index> <input>  -----  Feed the output of plugin <input> (or 'src') to plugin <plugin index>.",
+	"job outputs <ID> <index,...>  ----------------  Set the plugins whose outputs the job <ID> produces. 'last' resets.",
+	"job save-node <ID> <plugin index> <path>  ----  Save the output of plugin <plugin index> for the job <ID>.",
+	"pipeline create <name>  ----------------------  Create an empty pipeline called <name>.",
+	"pipeline select <name>  ----------------------  Make the plugin commands operate on the pipeline <name>.",
+	"pipeline list  -------------------------------  List all pipelines and loaded plugin libraries.",
+	"job set-pipeline <ID> <name>  ----------------  Feed the job <ID> to the pipeline <name>.",
+	"job roi <ID> <x,y,w,h>  ----------------------  Only compute the region x,y,w,h of the outputs of the job <ID>. 'none' resets.",
 	"help  ----------------------------------------  Print this help.",
-	"exit  ----------------------------------------  Exit the program."
+	"exit  ----------------------------------------  Exit the program.",
+	"job create-shared <w> <h> <format>  ----------  Create a job for the image in the passed memfd. Daemon only.",
+	"job result-shared <ID>  ----------------------  Get the result image of the job <ID> as a memfd. Daemon only.",
+	"mem status  ----------------------------------  Print the current and peak image memory usage and the budget."
 };
 
+static int cli_shell_setup(void);
 static void cli_shell_cleanup(void);
 static void cli_shell_run(void);
 static int cli_shell_parse(char *str);
-static int cli_shell_prototype_match(const PTRARRAY_TYPE(char) *keywords);
-static void cli_shell_execute(const size_t proto,
-		const PTRARRAY_TYPE(char) *keywords);
+static int cli_script_load(const char *path, CLI_SCRIPT_CMD **cmds,
+				size_t *count);
+static void cli_script_free(CLI_SCRIPT_CMD *cmds, const size_t count);
+static CLI_SCRIPT_JOB *cli_script_get_job(HASHMAP *jobs, const char *id);
+static void *cli_script_saver(void *arg);
+static int cli_script_wait_job(CLI_SCRIPT_JOB *sjob);
+static int cli_script_wait_all(HASHMAP *jobs);
+static int cli_shell_run_script(const char *path);
 static void cli_shell_print_help(void);
 static void cli_shell_status_callback(const struct PIPELINE_STATUS *status);
+static void cli_shell_done_callback(JOB *job, const int state, void *arg);
+static int cli_shell_feed(const PTRARRAY_TYPE(char) *keywords);
+static int cli_shell_render_full(JOB *job);
+static int cli_shell_parse_index(const char *str, size_t *index);
+static int cli_shell_set_outputs(JOB *job, const char *str);
+static int cli_shell_set_roi(JOB *job, const char *str);
 
 static void cli_shell_status_callback(const struct PIPELINE_STATUS *status) {
-	printf("[%s : %s] [ ", status->c_plugin->p_params->name, status->c_job->filepath);
+	fprintf(print_stdout, "[%s : %s] [ ", status->c_plugin->p_params->name, status->c_job->filepath);
 	for (unsigned int i = 0; i < status->progress; i++) {
-		printf("#");
+		fprintf(print_stdout, "#");
 	}
 	if (status->progress == 100) {
-		printf(" ] 100 %%\n");
+		fprintf(print_stdout, " ] 100 %%\n");
+	} else {
+		fprintf(print_stdout, ">> %i %%\r", status->progress);
+	}
+	fflush(stdout);
+}
+
+static void cli_shell_done_callback(JOB *job, const int state, void *arg) {
+	(void) arg;
+	if (state == PIPELINE_HANDLE_SUCCESS) {
+		fprintf(print_stdout, "Job %s finished.\n", job->job_id);
+	} else if (state == PIPELINE_HANDLE_CANCELLED) {
+		fprintf(print_stdout, "Job %s cancelled.\n", job->job_id);
 	} else {
-		printf(">> %i %%\r", status->progress);
+		fprintf(print_stdout, "Job %s failed.\n", job->job_id);
 	}
 	fflush(stdout);
 }
 
+int cli_shell_feed_async(JOB *job,
+		void (*const callback)(JOB *job, const int state, void *arg)) {
+	/*
+	*  Submit 'job' to the pipeline without waiting for it. The
+	*  handle is stored so that the job can be waited for or
+	*  cancelled later and 'callback' is called once the job is
+	*  done. Returns 0 on success and 1 on failure.
+	*/
+	PIPELINE_HANDLE *handle = NULL;
+
+	handle = pipeline_submit(job);
+	if (!handle) {
+		return 1;
+	}
+
+	// Drop the handle of a previous feed of the same job.
+	if (hashmap_get_str(cli_shell_handles, job->job_id)) {
+		pipeline_release(hashmap_pop_str(cli_shell_handles, job->job_id));
+	}
+	if (hashmap_put_str(cli_shell_handles, job->job_id, handle) != 0) {
+		pipeline_cancel(handle);
+		pipeline_release(handle);
+		return 1;
+	}
+	pipeline_on_done(handle, callback, NULL);
+	return 0;
+}
+
+PIPELINE_HANDLE *cli_shell_get_handle(const char *id) {
+	/*
+	*  Return the handle of the asynchronous feed of the job
+	*  'id' or a NULL pointer if there's none.
+	*/
+	return hashmap_get_str(cli_shell_handles, id);
+}
+
+JOB *cli_shell_feed_job(const PTRARRAY_TYPE(char) *keywords, int *async) {
+	/*
+	*  Parse the options of the 'job feed [--async] [--preview
+	*  <scale>] <ID>' command in 'keywords' and set the preview
+	*  scale of the job. '*async' is set if --async was given.
+	*  Returns the job on success or a NULL pointer on failure.
+	*/
+	JOB *job = NULL;
+	char *end = NULL;
+	float scale = 1.0f;
+	size_t k = 2;
+
+	*async = 0;
+	for (; k + 1 < keywords->ptrc; k++) {
+		if (strcmp(keywords->ptrs[k], "--async") == 0) {
+			*async = 1;
+		} else if (strcmp(keywords->ptrs[k], "--preview") == 0) {
+			if (k + 2 >= keywords->ptrc) {
+				printerr("Missing preview scale or job ID.\n");
+				return NULL;
+			}
+			errno = 0;
+			scale = strtof(keywords->ptrs[++k], &end);
+			if (errno != 0 || *end != '\0') {
+				printerr("Invalid preview scale.\n");
+				return NULL;
+			}
+		} else {
+			printerr_va("Invalid option '%s'.\n", keywords->ptrs[k]);
+			return NULL;
+		}
+	}
+	if (k >= keywords->ptrc || strncmp(keywords->ptrs[k], "--", 2) == 0) {
+		printerr("Missing job ID.\n");
+		return NULL;
+	}
+
+	job = jobmanager_get_job_by_id(keywords->ptrs[k]);
+	if (!job || job_set_preview(job, scale) != 0) {
+		return NULL;
+	}
+	return job;
+}
+
+static int cli_shell_feed(const PTRARRAY_TYPE(char) *keywords) {
+	/*
+	*  Run the 'job feed [--async] [--preview <scale>] <ID>' command.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	JOB *job = NULL;
+	int async = 0;
+
+	job = cli_shell_feed_job(keywords, &async);
+	if (!job) {
+		return 1;
+	}
+	if (async) {
+		if (cli_shell_feed_async(job, &cli_shell_done_callback) != 0) {
+			printerr("Failed to submit job.\n");
+			return 1;
+		}
+		return 0;
+	}
+	if (scheduler_feed(job) != 0) {
+		printerr("Image processing failed.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int cli_shell_render_full(JOB *job) {
+	/*
+	*  Render the full resolution result of 'job' if the current
+	*  result is a preview. Returns 0 on success and 1 on failure.
+	*/
+	if (job->result_scale == 1.0f) {
+		return 0;
+	}
+	fprintf(print_stdout, "Rendering job %s at full resolution.\n", job->job_id);
+	if (job_set_preview(job, 1.0f) != 0 || scheduler_feed(job) != 0) {
+		printerr("Image processing failed.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int cli_shell_parse_index(const char *str, size_t *index) {
+	/*
+	*  Parse the plugin index in 'str' into *index.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	if (*str == '\0') {
+		printerr("Invalid plugin index.\n");
+		return 1;
+	}
+	for (size_t i = 0; i < strlen(str); i++) {
+		if (!isdigit(str[i])) {
+			printerr("Invalid plugin index.\n");
+			return 1;
+		}
+	}
+	*index = strtoul(str, NULL, 10);
+	return 0;
+}
+
+static int cli_shell_set_outputs(JOB *job, const char *str) {
+	/*
+	*  Set the outputs of 'job' from a comma separated list of
+	*  plugin indices in 'str'. Returns 0 on success and 1 on
+	*  failure.
+	*/
+	size_t *outputs = NULL;
+	size_t count = 0;
+	char *tmp_str = NULL;
+	char *token = NULL;
+	char *save = NULL;
+	int ret = 0;
+
+	if (strcmp(str, "last") == 0) {
+		return job_set_outputs(job, NULL, 0);
+	}
+
+	errno = 0;
+	tmp_str = calloc(strlen(str) + 1, sizeof(*str));
+	outputs = calloc(strlen(str)/2 + 1, sizeof(*outputs));
+	if (!tmp_str || !outputs) {
+		printerrno("calloc()");
+		free(tmp_str);
+		free(outputs);
+		return 1;
+	}
+	strcpy(tmp_str, str);
+
+	token = strtok_r(tmp_str, ",", &save);
+	while (token != NULL) {
+		if (cli_shell_parse_index(token, &outputs[count++]) != 0) {
+			free(tmp_str);
+			free(outputs);
+			return 1;
+		}
+		token = strtok_r(NULL, ",", &save);
+	}
+	ret = job_set_outputs(job, outputs, count);
+	free(tmp_str);
+	free(outputs);
+	return ret;
+}
+
+static int cli_shell_set_roi(JOB *job, const char *str) {
+	/*
+	*  Set the region of interest of 'job' from a string of the
+	*  form x,y,w,h. 'none' resets it. Returns 0 on success and
+	*  1 on failure.
+	*/
+	IMG_RECT roi;
+	char tmp = '\0';
+
+	if (strcmp(str, "none") == 0) {
+		job_set_roi(job, NULL);
+		return 0;
+	}
+	if (sscanf(str, "%u,%u,%u,%u%c", &roi.x, &roi.y, &roi.w, &roi.h, &tmp) != 4 ||
+		roi.w == 0 || roi.h == 0) {
+		printerr("Invalid region of interest.\n");
+		return 1;
+	}
+	job_set_roi(job, &roi);
+	return 0;
+}
+
 static void cli_shell_cleanup(void) {
-	// Free the jobs array.
+	PIPELINE_HANDLE *handle = NULL;
+	size_t iter = 0;
+
+	// Stop asynchronous feeds before the jobs are destroyed.
 	printverb("CLI shell cleanup.\n");
+	if (cli_shell_handles) {
+		while (hashmap_next(cli_shell_handles, &iter, (void**) &handle)) {
+			pipeline_cancel(handle);
+			pipeline_wait(handle);
+			pipeline_release(handle);
+		}
+		hashmap_destroy(cli_shell_handles, 0);
+		cli_shell_handles = NULL;
+	}
+
+	// Free the jobs array.
 	if (cli_shell_jobs != NULL) {
 		for (unsigned int i = 0; i < cli_shell_jobs_count; i++) {
 			if (cli_shell_jobs[i] != NULL) {
@@ -110,11 +424,22 @@ static void cli_shell_cleanup(void) {
 	}
 }
 
+static int cli_shell_setup(void) {
+	/*
+	*  Setup the state shared by the interactive shell, script
+	*  runs and the daemon. Returns 0 on success and 1 on failure.
+	*/
+	cli_shell_handles = hashmap_create(HASHMAP_KEY_STR, NULL);
+	if (!cli_shell_handles) {
+		printerr("Failed to create HASHMAP.\n");
+		return 1;
+	}
+	return 0;
+}
+
 static void cli_shell_run(void) {
 	char shell_buff[SHELL_BUFFER_LEN] = { '\0' };
 
-	pipeline_reg_status_callback(&cli_shell_status_callback);
-
 	printverb_va("Thread started. Shell buffer: %i b.\n", SHELL_BUFFER_LEN);
 	for (;;) {
 		if (exit_queued) {
@@ -134,7 +459,7 @@ static void cli_shell_run(void) {
 	return;
 }
 
-static int cli_shell_prototype_match(const PTRARRAY_TYPE(char) *keywords) {
+int cli_shell_prototype_match(const PTRARRAY_TYPE(char) *keywords) {
 	/*
 	*  Return the CMD prototype index that matched the supplied CMD.
 	*  If no match was found this function returns a negative number.
@@ -178,28 +503,32 @@ static int cli_shell_prototype_match(const PTRARRAY_TYPE(char) *keywords) {
 }
 
 static void cli_shell_print_help(void) {
-	printf("Open Image Pipeline CLI Shell interface help.\n");
+	fprintf(print_stdout, "Open Image Pipeline CLI Shell interface help.\n");
 	for (unsigned int i = 0; i < NUM_CLI_CMD_PROTOS; i++) {
-		printf("  %s\n", cli_cmd_help[i]);
+		fprintf(print_stdout, "  %s\n", cli_cmd_help[i]);
 	}
 }
 
-static void cli_shell_execute(const size_t proto,
+int cli_shell_execute(const size_t proto,
 		const PTRARRAY_TYPE(char) *keywords) {
 	/*
 	*  Execute the command in keywords that matches the command
-	*  prototype proto.
+	*  prototype proto. Returns 0 on success and 1 on failure.
 	*/
 	JOB *tmp_job = NULL;
+	PIPELINE_HANDLE *tmp_handle = NULL;
+	size_t tmp_index = 0;
+	int ret = 0;
 
 	if (proto >= NUM_CLI_CMD_PROTOS) {
-		return;
+		return 1;
 	}
 
 	switch (proto) {
 		case 0: ; // plugin load %s %s
 			if (plugin_load(keywords->ptrs[2], keywords->ptrs[3]) != 0) {
 				printerr("Failed to load plugin.\n");
+				ret = 1;
 			}
 			break;
 		case 1: ; // plugin list
@@ -214,43 +543,52 @@ static void cli_shell_execute(const size_t proto,
 				}
 			}
 			index = strtol(keywords->ptrs[2], NULL, 10);
-			plugin_set_arg(index, keywords->ptrs[3], keywords->ptrs[4]);
+			ret = plugin_set_arg(index, keywords->ptrs[3], keywords->ptrs[4]);
 			break;
 		case 3: ; // job create %s %s
 			tmp_job = job_create(keywords->ptrs[2]);
 			if (!tmp_job) {
 				printerr("Failed to create job.\n");
+				ret = 1;
 				break;
 			}
 			if (jobmanager_reg_job(tmp_job) != 0) {
 				printerr("Failed to register the JOB with the jobmanager.\n");
+				ret = 1;
 			}
 			break;
 		case 4: ; // job feed %s
-			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
-			if (!tmp_job) {
-				break;
-			}
-			if (pipeline_feed(tmp_job) != 0) {
-				printerr("Image processing failed.\n");
-			}
+			ret = cli_shell_feed(keywords);
 			break;
 		case 5: ; // job delete %s
 			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
 			if (!tmp_job) {
+				ret = 1;
 				break;
 			}
 			if (jobmanager_unreg_job(tmp_job, 1) != 0) {
 				printerr("Job deletion failed.\n");
+				ret = 1;
+				break;
+			}
+			tmp_handle = hashmap_pop_str(cli_shell_handles, keywords->ptrs[2]);
+			if (tmp_handle) {
+				pipeline_release(tmp_handle);
 			}
 			break;
 		case 6: ; // job save %s
 			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
 			if (!tmp_job) {
+				ret = 1;
+				break;
+			}
+			if (cli_shell_render_full(tmp_job) != 0) {
+				ret = 1;
 				break;
 			}
 			if (job_save_result(tmp_job, keywords->ptrs[3]) != 0) {
 				printerr("Failed to save image.\n");
+				ret = 1;
 			}
 			break;
 		case 7: ; // job list
@@ -264,90 +602,560 @@ static void cli_shell_execute(const size_t proto,
 			tmp_cache = cache_get_by_name(keywords->ptrs[3]);
 			if (tmp_cache == NULL) {
 				printerr_va("Failed to find cache %s.\n", keywords->ptrs[3]);
+				ret = 1;
 				break;
 			}
 
 			if (cache_delete_file(tmp_cache, keywords->ptrs[4]) != 0) {
 				printerr("Failed to delete cache file.\n");
+				ret = 1;
+			}
+			break;
+		case 10: ; // job set-priority %s %s
+			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
+			if (!tmp_job) {
+				ret = 1;
+				break;
+			}
+			if (job_set_priority(tmp_job, job_priority_from_str(keywords->ptrs[3])) != 0) {
+				printerr("Failed to set job priority.\n");
+				ret = 1;
+			}
+			break;
+		case 11: ; // job set-deadline %s %s
+			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
+			if (!tmp_job) {
+				ret = 1;
+				break;
+			}
+			ret = job_set_deadline(tmp_job, strtoul(keywords->ptrs[3], NULL, 10));
+			break;
+		case 12: ; // job set-submitter %s %s
+			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
+			if (!tmp_job) {
+				ret = 1;
+				break;
+			}
+			if (job_set_submitter(tmp_job, keywords->ptrs[3]) != 0) {
+				printerr("Failed to set job submitter.\n");
+				ret = 1;
+			}
+			break;
+		case 13: ; // scheduler set-weight %s %s
+			if (scheduler_set_weight(keywords->ptrs[2],
+					strtoul(keywords->ptrs[3], NULL, 10)) != 0) {
+				printerr("Failed to set submitter weight.\n");
+				ret = 1;
+			}
+			break;
+		case 14: ; // scheduler status
+			scheduler_print_status();
+			taskpool_print_status();
+			break;
+		case 15: ; // job wait %s
+			tmp_handle = hashmap_pop_str(cli_shell_handles, keywords->ptrs[2]);
+			if (!tmp_handle) {
+				printerr_va("No asynchronous feed for job '%s'.\n",
+						keywords->ptrs[2]);
+				ret = 1;
+				break;
+			}
+			if (pipeline_wait(tmp_handle) == PIPELINE_HANDLE_FAIL) {
+				printerr("Image processing failed.\n");
+				ret = 1;
+			}
+			pipeline_release(tmp_handle);
+			break;
+		case 16: ; // job cancel %s
+			tmp_handle = hashmap_get_str(cli_shell_handles, keywords->ptrs[2]);
+			if (!tmp_handle) {
+				printerr_va("No asynchronous feed for job '%s'.\n",
+						keywords->ptrs[2]);
+				ret = 1;
+				break;
+			}
+			if (pipeline_cancel(tmp_handle) != 0) {
+				printerr("Job has already finished.\n");
+				ret = 1;
+			}
+			break;
+		case 17: ; // plugin set-input %s %s
+			size_t input = 0;
+			if (cli_shell_parse_index(keywords->ptrs[2], &tmp_index) != 0) {
+				ret = 1;
+				break;
+			}
+			if (strcmp(keywords->ptrs[3], "src") == 0) {
+				ret = plugin_set_input(tmp_index, PLUGIN_INPUT_SRC);
+			} else if (cli_shell_parse_index(keywords->ptrs[3], &input) == 0) {
+				ret = plugin_set_input(tmp_index, input);
+			} else {
+				ret = 1;
 			}
 			break;
-		case 10: ; // help
+		case 18: ; // job outputs %s %s
+			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
+			if (!tmp_job) {
+				ret = 1;
+				break;
+			}
+			if (cli_shell_set_outputs(tmp_job, keywords->ptrs[3]) != 0) {
+				printerr("Failed to set job outputs.\n");
+				ret = 1;
+			}
+			break;
+		case 19: ; // job save-node %s %s %s
+			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
+			if (!tmp_job || cli_shell_parse_index(keywords->ptrs[3], &tmp_index) != 0) {
+				ret = 1;
+				break;
+			}
+			if (cli_shell_render_full(tmp_job) != 0) {
+				ret = 1;
+				break;
+			}
+			if (job_save_output(tmp_job, tmp_index, keywords->ptrs[4]) != 0) {
+				printerr("Failed to save image.\n");
+				ret = 1;
+			}
+			break;
+		case 20: ; // pipeline create %s
+			if (plugin_pipeline_create(keywords->ptrs[2]) != 0) {
+				printerr("Failed to create pipeline.\n");
+				ret = 1;
+			}
+			break;
+		case 21: ; // pipeline select %s
+			ret = plugin_pipeline_select(keywords->ptrs[2]);
+			break;
+		case 22: ; // pipeline list
+			plugin_pipeline_list();
+			break;
+		case 23: ; // job set-pipeline %s %s
+			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
+			if (!tmp_job) {
+				ret = 1;
+				break;
+			}
+			ret = job_set_pipeline(tmp_job, keywords->ptrs[3]);
+			break;
+		case 24: ; // job roi %s %s
+			tmp_job = jobmanager_get_job_by_id(keywords->ptrs[2]);
+			if (!tmp_job) {
+				ret = 1;
+				break;
+			}
+			ret = cli_shell_set_roi(tmp_job, keywords->ptrs[3]);
+			break;
+		case 25: ; // help
 			cli_shell_print_help();
 			break;
-		case 11: ; // exit
+		case 26: ; // exit
 			exit_queued = 1;
 			break;
+		case 27: ; // job create-shared %s %s %s
+		case 28: ; // job result-shared %s
+			printerr("Shared images can only be passed in daemon mode.\n");
+			ret = 1;
+			break;
+		case 29: ; // mem status
+			memgov_print_status();
+			break;
 		default:
 			break;
 	}
+	return ret;
 }
 
-static int cli_shell_parse(char *str) {
+PTRARRAY_TYPE(char) *cli_shell_tokenize(const char *str) {
 	/*
-	*  Parse and execute a CLI shell command from str.
-	*  Returns 0 on success and 1 on failure.
+	*  Split the command in 'str' into keywords. The command ends
+	*  at the first newline. Returns the keywords on success or a
+	*  NULL pointer on failure.
 	*/
-
 	PTRARRAY_TYPE(char) *keywords = NULL;
 	char *token = NULL;
+	char *save = NULL;
 	char *tmp_str = NULL;
-	int proto = -1;
 
 	tmp_str = calloc(strlen(str) + 1, sizeof(*str));
 	if (!tmp_str) {
-		return 1;
+		return NULL;
 	}
 	strcpy(tmp_str, str);
-	tmp_str[strcspn(tmp_str, "\n")] = '\0';
+	tmp_str[strcspn(tmp_str, "\r\n")] = '\0';
 
 	keywords = (PTRARRAY_TYPE(char)*) ptrarray_create(&free);
 	if (!keywords) {
 		free(tmp_str);
-		return 1;
+		return NULL;
 	}
 
-	token = strtok(tmp_str, " ");
+	token = strtok_r(tmp_str, " ", &save);
 	while (token != NULL) {
 		if (!ptrarray_put_data((PTRARRAY_TYPE(void)*) keywords, token,
 				(strlen(token) + 1)*sizeof(*token))) {
-
-			ptrarray_free_ptrs((PTRARRAY_TYPE(void)*) keywords);
-			ptrarray_free((PTRARRAY_TYPE(void)*) keywords);
+			cli_shell_free_keywords(keywords);
 			free(tmp_str);
-			return 1;
+			return NULL;
 		}
-		token = strtok(NULL, " ");
+		token = strtok_r(NULL, " ", &save);
+	}
+	free(tmp_str);
+	return keywords;
+}
+
+void cli_shell_free_keywords(PTRARRAY_TYPE(char) *keywords) {
+	ptrarray_free_ptrs((PTRARRAY_TYPE(void)*) keywords);
+	ptrarray_free((PTRARRAY_TYPE(void)*) keywords);
+}
+
+static int cli_shell_parse(char *str) {
+	/*
+	*  Parse and execute a CLI shell command from str.
+	*  Returns 0 on success and 1 on failure.
+	*/
+
+	PTRARRAY_TYPE(char) *keywords = NULL;
+	int proto = -1;
+
+	keywords = cli_shell_tokenize(str);
+	if (!keywords) {
+		return 1;
 	}
 
 	proto = cli_shell_prototype_match(keywords);
 	if (proto >= 0) {
 		cli_shell_execute(proto, keywords);
 	} else {
-		printerr_va("Invalid command: %s\n", tmp_str);
+		printerr_va("Invalid command: %.*s\n", (int) strcspn(str, "\r\n"), str);
+	}
+	cli_shell_free_keywords(keywords);
+	return 0;
+}
+
+static int cli_script_load(const char *path, CLI_SCRIPT_CMD **cmds,
+				size_t *count) {
+	/*
+	*  Parse every command in the script file 'path' into '*cmds'
+	*  and store the number of commands in '*count'. Empty lines
+	*  and lines starting with '#' are skipped. Returns 0 on
+	*  success and 1 if the file can't be read or it contains
+	*  invalid commands.
+	*/
+	CLI_SCRIPT_CMD *tmp_cmds = NULL;
+	CLI_SCRIPT_CMD *tmp = NULL;
+	PTRARRAY_TYPE(char) *keywords = NULL;
+	FILE *file = NULL;
+	char *line = NULL;
+	size_t line_len = 0;
+	size_t line_num = 0;
+	size_t n = 0;
+	int proto = -1;
+	int ret = 0;
+
+	errno = 0;
+	file = fopen(path, "r");
+	if (!file) {
+		printerrno("fopen()");
+		return 1;
 	}
 
-	ptrarray_free_ptrs((PTRARRAY_TYPE(void)*) keywords);
-	ptrarray_free((PTRARRAY_TYPE(void)*) keywords);
-	free(tmp_str);
+	errno = 0;
+	while (getline(&line, &line_len, file) != -1) {
+		line_num++;
+		if (line[strspn(line, " \t\r\n")] == '\0' ||
+			line[strspn(line, " \t")] == '#') {
+			continue;
+		}
+
+		keywords = cli_shell_tokenize(line);
+		if (!keywords) {
+			ret = 1;
+			break;
+		}
+		proto = cli_shell_prototype_match(keywords);
+		if (proto < 0) {
+			printerr_va("%s:%zu: Invalid command: %.*s\n", path, line_num,
+					(int) strcspn(line, "\r\n"), line);
+			cli_shell_free_keywords(keywords);
+			ret = 1;
+			continue;
+		}
 
+		errno = 0;
+		tmp = realloc(tmp_cmds, (n + 1)*sizeof(*tmp_cmds));
+		if (!tmp) {
+			printerrno("realloc()");
+			cli_shell_free_keywords(keywords);
+			ret = 1;
+			break;
+		}
+		tmp_cmds = tmp;
+		tmp_cmds[n].keywords = keywords;
+		tmp_cmds[n].proto = proto;
+		tmp_cmds[n].file = path;
+		tmp_cmds[n].line = line_num;
+		n++;
+	}
+	if (ferror(file)) {
+		printerrno("getline()");
+		ret = 1;
+	}
+	free(line);
+	fclose(file);
+
+	if (ret != 0) {
+		cli_script_free(tmp_cmds, n);
+		return 1;
+	}
+	*cmds = tmp_cmds;
+	*count = n;
 	return 0;
 }
 
+static void cli_script_free(CLI_SCRIPT_CMD *cmds, const size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		cli_shell_free_keywords(cmds[i].keywords);
+	}
+	free(cmds);
+}
+
+static CLI_SCRIPT_JOB *cli_script_get_job(HASHMAP *jobs, const char *id) {
+	/*
+	*  Get the pending work of the job 'id' or create it if it
+	*  doesn't exist. Returns a NULL pointer on failure.
+	*/
+	CLI_SCRIPT_JOB *ret = NULL;
+
+	ret = hashmap_get_str(jobs, id);
+	if (ret) {
+		return ret;
+	}
+
+	errno = 0;
+	ret = calloc(1, sizeof(*ret));
+	if (!ret) {
+		printerrno("calloc()");
+		return NULL;
+	}
+	if (hashmap_put_str(jobs, id, ret) != 0) {
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+static void *cli_script_saver(void *arg) {
+	/*
+	*  Wait for the feed of a job to finish and save its result.
+	*  The feed handle is released by the thread that joins this
+	*  one, so the feed can still be cancelled meanwhile.
+	*/
+	CLI_SCRIPT_JOB *sjob = (CLI_SCRIPT_JOB*) arg;
+
+	if (sjob->feed && pipeline_wait(sjob->feed) != PIPELINE_HANDLE_SUCCESS) {
+		printerr("Not saving a job that failed.\n");
+		sjob->ret = 1;
+		return NULL;
+	}
+	sjob->ret = cli_shell_execute(sjob->save_cmd->proto,
+					sjob->save_cmd->keywords);
+	return NULL;
+}
+
+static int cli_script_wait_job(CLI_SCRIPT_JOB *sjob) {
+	/*
+	*  Wait for the pending feed and save of a job. Returns 0 if
+	*  they succeeded and 1 otherwise.
+	*/
+	int ret = 0;
+
+	if (sjob->saving) {
+		pthread_join(sjob->saver, NULL);
+		sjob->saving = 0;
+		if (sjob->ret != 0) {
+			printerr_va("%s:%zu: Command failed.\n", sjob->save_cmd->file,
+					sjob->save_cmd->line);
+			ret = 1;
+		}
+	}
+	if (sjob->feed) {
+		if (pipeline_wait(sjob->feed) == PIPELINE_HANDLE_FAIL) {
+			ret = 1;
+		}
+		pipeline_release(sjob->feed);
+		sjob->feed = NULL;
+	}
+	return ret;
+}
+
+static int cli_script_wait_all(HASHMAP *jobs) {
+	/*
+	*  Wait for the pending work of every job. Returns 0 if all
+	*  of it succeeded and 1 otherwise.
+	*/
+	CLI_SCRIPT_JOB *sjob = NULL;
+	size_t iter = 0;
+	int ret = 0;
+
+	while (hashmap_next(jobs, &iter, (void**) &sjob)) {
+		ret |= cli_script_wait_job(sjob);
+	}
+	return ret;
+}
+
+static int cli_shell_run_script(const char *path) {
+	/*
+	*  Run the script file 'path' without user interaction. The
+	*  whole script is parsed before anything is run. Feeds and
+	*  saves are run in the background and a command only waits
+	*  for the earlier feeds and saves of the same job, so jobs
+	*  are processed concurrently. Every other command waits for
+	*  all pending work first. Returns CLI_SCRIPT_EXIT_OK if every
+	*  command succeeded, CLI_SCRIPT_EXIT_FAIL if some command
+	*  failed and CLI_SCRIPT_EXIT_ERROR if the script couldn't be
+	*  parsed.
+	*/
+	CLI_SCRIPT_CMD *cmds = NULL;
+	CLI_SCRIPT_JOB *sjob = NULL;
+	HASHMAP *jobs = NULL;
+	PIPELINE_HANDLE *handle = NULL;
+	const PTRARRAY_TYPE(char) *keywords = NULL;
+	JOB *job = NULL;
+	size_t count = 0;
+	int async = 0;
+	int fail = 0;
+	int ret = 0;
+
+	if (cli_script_load(path, &cmds, &count) != 0) {
+		printerr_va("Failed to load script '%s'.\n", path);
+		return CLI_SCRIPT_EXIT_ERROR;
+	}
+
+	jobs = hashmap_create(HASHMAP_KEY_STR, &free);
+	if (!jobs) {
+		cli_script_free(cmds, count);
+		return CLI_SCRIPT_EXIT_ERROR;
+	}
+
+	for (size_t i = 0; i < count && !exit_queued; i++) {
+		keywords = cmds[i].keywords;
+		ret = 0;
+		switch (cmds[i].proto) {
+			case 4: ; // job feed %s
+				sjob = cli_script_get_job(jobs, keywords->ptrs[keywords->ptrc - 1]);
+				if (!sjob) {
+					ret = 1;
+					break;
+				}
+				fail |= cli_script_wait_job(sjob);
+				job = cli_shell_feed_job(keywords, &async);
+				if (!job) {
+					ret = 1;
+					break;
+				}
+				handle = pipeline_submit(job);
+				if (!handle) {
+					printerr("Failed to submit job.\n");
+					ret = 1;
+					break;
+				}
+				pipeline_on_done(handle, &cli_shell_done_callback, NULL);
+				sjob->feed = handle;
+				break;
+			case 6: ; // job save %s
+			case 19: ; // job save-node %s %s %s
+				sjob = cli_script_get_job(jobs, keywords->ptrs[2]);
+				if (!sjob) {
+					ret = 1;
+					break;
+				}
+				if (sjob->saving) {
+					fail |= cli_script_wait_job(sjob);
+				}
+				sjob->save_cmd = &cmds[i];
+				sjob->ret = 0;
+				errno = pthread_create(&sjob->saver, NULL,
+							&cli_script_saver, sjob);
+				if (errno != 0) {
+					printerrno("pthread_create()");
+					ret = 1;
+					break;
+				}
+				sjob->saving = 1;
+				break;
+			case 15: ; // job wait %s
+				sjob = hashmap_get_str(jobs, keywords->ptrs[2]);
+				if (sjob) {
+					ret = cli_script_wait_job(sjob);
+				}
+				break;
+			case 16: ; // job cancel %s
+				sjob = hashmap_get_str(jobs, keywords->ptrs[2]);
+				if (!sjob || !sjob->feed || pipeline_cancel(sjob->feed) != 0) {
+					printerr("No running feed to cancel.\n");
+					ret = 1;
+				}
+				break;
+			default:
+				fail |= cli_script_wait_all(jobs);
+				ret = cli_shell_execute(cmds[i].proto, keywords);
+				break;
+		}
+		if (ret != 0) {
+			printerr_va("%s:%zu: Command failed.\n", path, cmds[i].line);
+			fail = 1;
+		}
+	}
+
+	if (cli_script_wait_all(jobs) != 0) {
+		printerr_va("%s: Some jobs failed.\n", path);
+		fail = 1;
+	}
+	hashmap_destroy(jobs, 1);
+	cli_script_free(cmds, count);
+	return fail ? CLI_SCRIPT_EXIT_FAIL : CLI_SCRIPT_EXIT_OK;
+}
 
 int main(int argc, char *argv[]) {
-	oip_setup(argc, argv);
+	int ret = 0;
 
-	printf("\nOpen Image Pipeline Copyright (C) 2017 Eero Talus\n");
-	printf("This program is licensed under the GNU General Public License\n");
-	printf("version 3 and comes with ABSOLUTELY NO WARRANTY. This program is\n");
-	printf("also free software. See the file LICENSE.txt for more details\n");
-	printf("about the license and the file README.md for general information.\n\n");
+	if (oip_setup(argc, argv) != 0) {
+		return CLI_SCRIPT_EXIT_ERROR;
+	}
+	if (cli_shell_setup() != 0) {
+		oip_cleanup();
+		return CLI_SCRIPT_EXIT_ERROR;
+	}
+
+	if (oip_get_daemon_socket()) {
+		ret = cli_daemon_run(oip_get_daemon_socket());
+	} else if (oip_get_watch_dir()) {
+		// A script can be used to set up the pipeline to watch with.
+		if (oip_get_script_file()) {
+			ret = cli_shell_run_script(oip_get_script_file());
+		}
+		if (ret == CLI_SCRIPT_EXIT_OK) {
+			ret = cli_watch_run(oip_get_watch_dir(), oip_get_output_dir());
+		}
+	} else if (oip_get_script_file()) {
+		pipeline_reg_status_callback(&cli_shell_status_callback);
+		ret = cli_shell_run_script(oip_get_script_file());
+	} else {
+		pipeline_reg_status_callback(&cli_shell_status_callback);
+		fprintf(print_stdout, "\nOpen Image Pipeline Copyright (C) 2017 Eero Talus\n");
+		fprintf(print_stdout, "This program is licensed under the GNU General Public License\n");
+		fprintf(print_stdout, "version 3 and comes with ABSOLUTELY NO WARRANTY. This program is\n");
+		fprintf(print_stdout, "also free software. See the file LICENSE.txt for more details\n");
+		fprintf(print_stdout, "about the license and the file README.md for general information.\n\n");
 
-	build_print_version_info("Version:", &OIP_BUILD_INFO);
-	printf("\n");
+		build_print_version_info("Version:", &OIP_BUILD_INFO);
+		fprintf(print_stdout, "\n");
 
-	cli_shell_run();
+		cli_shell_run();
+	}
 	cli_shell_cleanup();
 	oip_cleanup();
-	return 0;
+	return ret;
 }
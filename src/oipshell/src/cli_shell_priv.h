@@ -0,0 +1,42 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#ifndef INCLUDED_CLI_SHELL_PRIV
+	#define INCLUDED_CLI_SHELL_PRIV
+
+	#include "oipcore/ptrarray.h"
+	#include "oipcore/pipeline.h"
+	#include "oipcore/job.h"
+
+	PTRARRAY_TYPE(char) *cli_shell_tokenize(const char *str);
+	void cli_shell_free_keywords(PTRARRAY_TYPE(char) *keywords);
+	int cli_shell_prototype_match(const PTRARRAY_TYPE(char) *keywords);
+	int cli_shell_execute(const size_t proto,
+			const PTRARRAY_TYPE(char) *keywords);
+	JOB *cli_shell_feed_job(const PTRARRAY_TYPE(char) *keywords, int *async);
+	int cli_shell_feed_async(JOB *job,
+			void (*const callback)(JOB *job, const int state, void *arg));
+	PIPELINE_HANDLE *cli_shell_get_handle(const char *id);
+
+	int cli_daemon_run(const char *path);
+	int cli_watch_run(const char *dir, const char *out_dir);
+#endif
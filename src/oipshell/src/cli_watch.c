@@ -0,0 +1,616 @@
+/*
+*
+*  Copyright 2017 Eero Talus
+*
+*  This file is part of Open Image Pipeline.
+*
+*  Open Image Pipeline is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  Open Image Pipeline is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with Open Image Pipeline.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/*
+*  The watch mode feeds every file that lands in a spool directory
+*  to the pipeline and saves the result into an output directory.
+*  Files are picked up from inotify IN_CLOSE_WRITE and IN_MOVED_TO
+*  events. The events of a file are coalesced and the file is only
+*  processed once it has been left alone for 'watch_debounce_ms'.
+*  At most 'watch_max_jobs' jobs are in the pipeline at once and
+*  the rest of the files wait for a free slot. Hidden files are
+*  ignored so that uploaders can write into a temporary dotfile
+*  and rename it when it's complete. The results are saved the
+*  same way, so a reader of the output directory never sees a
+*  partial file.
+*/
+
+#define _GNU_SOURCE
+
+#define PRINT_IDENTIFIER "cli-watch"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "oipcore/abi/output.h"
+#include "oipcore/oip.h"
+#include "oipcore/hashmap.h"
+#include "oipcore/jobmanager.h"
+#include "oipcore/pipeline.h"
+#include "oipcore/file.h"
+
+#include "cli_shell_priv.h"
+
+#define CLI_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+#define CLI_WATCH_BUF_LEN (16*(sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/*
+*  A file in the spool directory that is waiting to be processed.
+*  'seen' is the time of the first event of the file and 'last'
+*  the time of the latest one.
+*/
+typedef struct STRUCT_CLI_WATCH_FILE {
+	char *name;
+	struct timespec seen;
+	struct timespec last;
+} CLI_WATCH_FILE;
+
+// A file that is being processed in the pipeline.
+typedef struct STRUCT_CLI_WATCH_JOB {
+	CLI_WATCH_FILE *file;
+	JOB *job;
+	PIPELINE_HANDLE *handle;
+} CLI_WATCH_JOB;
+
+static const char *watch_dir = NULL;
+static const char *watch_out_dir = NULL;
+static unsigned int watch_max_jobs = 0;
+static unsigned int watch_debounce_ms = 0;
+static mode_t watch_umask = 0;
+
+static int watch_inotify = -1;
+static int watch_wake = -1;
+static HASHMAP *watch_files = NULL;
+static CLI_WATCH_JOB *watch_jobs = NULL;
+static unsigned int watch_job_count = 0;
+static volatile sig_atomic_t watch_stop = 0;
+
+static void cli_watch_signal(int sig);
+static void cli_watch_done_callback(JOB *job, const int state, void *arg);
+static long long int cli_watch_ms_since(const struct timespec *t,
+				const struct timespec *now);
+static void cli_watch_free_file(void *file);
+static int cli_watch_touch(const char *name, const struct timespec *now);
+static void cli_watch_forget(const char *name);
+static int cli_watch_is_done(const char *name);
+static int cli_watch_scan(const int initial);
+static int cli_watch_read_events(void);
+static int cli_watch_start(CLI_WATCH_FILE *file);
+static int cli_watch_start_ready(void);
+static int cli_watch_save(CLI_WATCH_JOB *wjob, const char *path);
+static void cli_watch_finish(CLI_WATCH_JOB *wjob);
+static void cli_watch_reap(void);
+static int cli_watch_timeout(void);
+static void cli_watch_cleanup(void);
+
+static void cli_watch_signal(int sig) {
+	uint64_t one = 1;
+	ssize_t ret = 0;
+
+	(void) sig;
+	watch_stop = 1;
+	ret = write(watch_wake, &one, sizeof(one));
+	(void) ret;
+}
+
+static void cli_watch_done_callback(JOB *job, const int state, void *arg) {
+	// Wake up the watch loop to save the result of 'job'.
+	uint64_t one = 1;
+	ssize_t ret = 0;
+
+	(void) job;
+	(void) state;
+	(void) arg;
+	ret = write(watch_wake, &one, sizeof(one));
+	(void) ret;
+}
+
+static long long int cli_watch_ms_since(const struct timespec *t,
+				const struct timespec *now) {
+	return (now->tv_sec - t->tv_sec)*1000LL +
+		(now->tv_nsec - t->tv_nsec)/1000000LL;
+}
+
+static void cli_watch_free_file(void *file) {
+	if (file) {
+		free(((CLI_WATCH_FILE*) file)->name);
+		free(file);
+	}
+}
+
+static int cli_watch_touch(const char *name, const struct timespec *now) {
+	/*
+	*  Record an event for the file 'name'. Repeated events of a
+	*  file that is already waiting are coalesced into one entry
+	*  that restarts the debounce period. Returns 0 on success and
+	*  1 on failure.
+	*/
+	CLI_WATCH_FILE *file = NULL;
+
+	if (name[0] == '.') {
+		return 0;
+	}
+
+	file = hashmap_get_str(watch_files, name);
+	if (file) {
+		file->last = *now;
+		return 0;
+	}
+
+	errno = 0;
+	file = calloc(1, sizeof(*file));
+	if (!file) {
+		printerrno("calloc()");
+		return 1;
+	}
+	file->name = strdup(name);
+	if (!file->name) {
+		printerrno("strdup()");
+		free(file);
+		return 1;
+	}
+	file->seen = *now;
+	file->last = *now;
+	if (hashmap_put_str(watch_files, name, file) != 0) {
+		cli_watch_free_file(file);
+		return 1;
+	}
+	printverb_va("Spooled '%s'.\n", name);
+	return 0;
+}
+
+static void cli_watch_forget(const char *name) {
+	// Drop the waiting file 'name' if it was removed from the spool.
+	cli_watch_free_file(hashmap_pop_str(watch_files, name));
+}
+
+static int cli_watch_is_done(const char *name) {
+	/*
+	*  Return 1 if the output of the spooled file 'name' exists
+	*  and is newer than the file itself and 0 otherwise.
+	*/
+	struct stat src_st;
+	struct stat out_st;
+	char *src = NULL;
+	char *out = NULL;
+	int ret = 0;
+
+	src = file_path_join(2, watch_dir, name);
+	out = file_path_join(2, watch_out_dir, name);
+	if (src && out && stat(src, &src_st) == 0 && stat(out, &out_st) == 0 &&
+		S_ISREG(src_st.st_mode) && out_st.st_mtime >= src_st.st_mtime) {
+		ret = 1;
+	}
+	free(src);
+	free(out);
+	return ret;
+}
+
+static int cli_watch_scan(const int initial) {
+	/*
+	*  Spool every regular file in the watched directory. This is
+	*  done once at startup and whenever the inotify queue has
+	*  overflowed. At startup files whose output is up to date are
+	*  skipped. Returns 0 on success and 1 on failure.
+	*/
+	struct timespec now;
+	struct dirent *ent = NULL;
+	DIR *dir = NULL;
+
+	errno = 0;
+	dir = opendir(watch_dir);
+	if (!dir) {
+		printerrno("opendir()");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while ((ent = readdir(dir))) {
+		if (ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN) {
+			continue;
+		}
+		if (initial && cli_watch_is_done(ent->d_name)) {
+			continue;
+		}
+		cli_watch_touch(ent->d_name, &now);
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int cli_watch_read_events(void) {
+	/*
+	*  Read the pending inotify events. Returns 0 on success
+	*  and 1 on failure.
+	*/
+	char buf[CLI_WATCH_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev = NULL;
+	struct timespec now;
+	ssize_t len = 0;
+
+	for (;;) {
+		errno = 0;
+		len = read(watch_inotify, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN) {
+				return 0;
+			}
+			printerrno("read()");
+			return 1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event*) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				printverb("Inotify queue overflow. Rescanning.\n");
+				cli_watch_scan(0);
+			} else if (ev->mask & IN_IGNORED) {
+				printerr_va("'%s' isn't watched anymore.\n", watch_dir);
+				return 1;
+			} else if (!ev->len || ev->mask & IN_ISDIR) {
+				continue;
+			} else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+				cli_watch_touch(ev->name, &now);
+			} else if (ev->mask & (IN_MOVED_FROM | IN_DELETE)) {
+				cli_watch_forget(ev->name);
+			}
+		}
+	}
+}
+
+static int cli_watch_start(CLI_WATCH_FILE *file) {
+	/*
+	*  Create a job for the spooled 'file' and submit it to the
+	*  pipeline. 'file' is owned by the job slot after this call.
+	*  Returns 0 on success and 1 on failure.
+	*/
+	CLI_WATCH_JOB *wjob = &watch_jobs[watch_job_count];
+	char *path = NULL;
+
+	wjob->file = file;
+	path = file_path_join(2, watch_dir, file->name);
+	if (!path) {
+		cli_watch_free_file(file);
+		return 1;
+	}
+	wjob->job = job_create(path);
+	free(path);
+	if (!wjob->job) {
+		printerr_va("Failed to create a job for '%s'.\n", file->name);
+		cli_watch_free_file(file);
+		return 1;
+	}
+	if (jobmanager_reg_job(wjob->job) != 0) {
+		job_destroy(wjob->job);
+		cli_watch_free_file(file);
+		return 1;
+	}
+
+	wjob->handle = pipeline_submit(wjob->job);
+	if (!wjob->handle) {
+		printerr_va("Failed to submit '%s'.\n", file->name);
+		jobmanager_unreg_job(wjob->job, 1);
+		cli_watch_free_file(file);
+		return 1;
+	}
+	watch_job_count++;
+	pipeline_on_done(wjob->handle, &cli_watch_done_callback, NULL);
+	return 0;
+}
+
+static int cli_watch_start_ready(void) {
+	/*
+	*  Start the files whose debounce period has passed, oldest
+	*  first, until the in-flight limit is reached.
+	*/
+	CLI_WATCH_FILE *file = NULL;
+	CLI_WATCH_FILE *oldest = NULL;
+	struct timespec now;
+	size_t iter = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (watch_job_count < watch_max_jobs) {
+		oldest = NULL;
+		iter = 0;
+		while (hashmap_next(watch_files, &iter, (void**) &file)) {
+			if (cli_watch_ms_since(&file->last, &now) < watch_debounce_ms) {
+				continue;
+			}
+			if (!oldest || cli_watch_ms_since(&oldest->seen, &file->seen) < 0) {
+				oldest = file;
+			}
+		}
+		if (!oldest) {
+			break;
+		}
+		hashmap_pop_str(watch_files, oldest->name);
+		cli_watch_start(oldest);
+	}
+	return 0;
+}
+
+static int cli_watch_save(CLI_WATCH_JOB *wjob, const char *path) {
+	/*
+	*  Save the result of 'wjob' into a temporary dotfile in the
+	*  output directory and rename it to 'path'. Returns 0 on
+	*  success and 1 on failure.
+	*/
+	char *tmp_name = NULL;
+	char *tmp_path = NULL;
+	int fd = -1;
+	int ret = 1;
+
+	errno = 0;
+	if (asprintf(&tmp_name, ".%s.XXXXXX", wjob->file->name) == -1) {
+		printerrno("asprintf()");
+		return 1;
+	}
+	tmp_path = file_path_join(2, watch_out_dir, tmp_name);
+	free(tmp_name);
+	if (!tmp_path) {
+		return 1;
+	}
+
+	errno = 0;
+	fd = mkostemp(tmp_path, O_CLOEXEC);
+	if (fd == -1) {
+		printerrno("mkostemp()");
+		free(tmp_path);
+		return 1;
+	}
+	// Give the result the permissions of a newly created file.
+	fchmod(fd, 0666 & ~watch_umask);
+	close(fd);
+
+	if (job_save_result(wjob->job, tmp_path) == 0) {
+		errno = 0;
+		if (rename(tmp_path, path) == 0) {
+			ret = 0;
+		} else {
+			printerrno("rename()");
+		}
+	}
+	if (ret != 0) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	return ret;
+}
+
+static void cli_watch_finish(CLI_WATCH_JOB *wjob) {
+	/*
+	*  Save the result of the finished job in 'wjob' and free it.
+	*/
+	struct timespec now;
+	char *path = NULL;
+	int state = 0;
+
+	/*
+	*  The done callback runs before the scheduler has dropped
+	*  the job, so wait for that before freeing the job.
+	*/
+	state = pipeline_wait(wjob->handle);
+	if (state == PIPELINE_HANDLE_SUCCESS) {
+		path = file_path_join(2, watch_out_dir, wjob->file->name);
+		if (!path || cli_watch_save(wjob, path) != 0) {
+			printerr_va("Failed to save the result of '%s'.\n",
+					wjob->file->name);
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			fprintf(print_stdout, "%s -> %s (%lld ms)\n", wjob->file->name, path,
+				cli_watch_ms_since(&wjob->file->seen, &now));
+			fflush(stdout);
+		}
+		free(path);
+	} else if (state == PIPELINE_HANDLE_FAIL) {
+		printerr_va("Processing '%s' failed.\n", wjob->file->name);
+	}
+
+	pipeline_release(wjob->handle);
+	jobmanager_unreg_job(wjob->job, 1);
+	cli_watch_free_file(wjob->file);
+}
+
+static void cli_watch_reap(void) {
+	// Finish the jobs that are done and free their slots.
+	uint64_t cnt = 0;
+	ssize_t ret = 0;
+	unsigned int i = 0;
+
+	ret = read(watch_wake, &cnt, sizeof(cnt));
+	(void) ret;
+
+	while (i < watch_job_count) {
+		if (pipeline_poll(watch_jobs[i].handle) < PIPELINE_HANDLE_SUCCESS) {
+			i++;
+			continue;
+		}
+		cli_watch_finish(&watch_jobs[i]);
+		watch_jobs[i] = watch_jobs[--watch_job_count];
+	}
+}
+
+static int cli_watch_timeout(void) {
+	/*
+	*  Return the poll() timeout until the next spooled file is
+	*  ready or -1 if there is nothing to wait for.
+	*/
+	CLI_WATCH_FILE *file = NULL;
+	struct timespec now;
+	long long int left = 0;
+	long long int ret = -1;
+	size_t iter = 0;
+
+	if (watch_job_count >= watch_max_jobs) {
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (hashmap_next(watch_files, &iter, (void**) &file)) {
+		left = watch_debounce_ms - cli_watch_ms_since(&file->last, &now);
+		if (left < 0) {
+			left = 0;
+		}
+		if (ret < 0 || left < ret) {
+			ret = left;
+		}
+	}
+	return ret;
+}
+
+static void cli_watch_cleanup(void) {
+	/*
+	*  Cancel the jobs that are still in the pipeline and
+	*  free the resources of the watch mode.
+	*/
+	for (unsigned int i = 0; i < watch_job_count; i++) {
+		pipeline_cancel(watch_jobs[i].handle);
+		pipeline_wait(watch_jobs[i].handle);
+		pipeline_release(watch_jobs[i].handle);
+		jobmanager_unreg_job(watch_jobs[i].job, 1);
+		cli_watch_free_file(watch_jobs[i].file);
+	}
+	watch_job_count = 0;
+	free(watch_jobs);
+	watch_jobs = NULL;
+
+	if (watch_files) {
+		hashmap_destroy(watch_files, 1);
+		watch_files = NULL;
+	}
+	if (watch_inotify >= 0) {
+		close(watch_inotify);
+		watch_inotify = -1;
+	}
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	if (watch_wake >= 0) {
+		close(watch_wake);
+		watch_wake = -1;
+	}
+}
+
+int cli_watch_run(const char *dir, const char *out_dir) {
+	/*
+	*  Process the files that land in 'dir' and save the results
+	*  into 'out_dir' until SIGINT or SIGTERM is received. Returns
+	*  0 on a clean exit and 1 on failure.
+	*/
+	struct pollfd fds[2];
+	struct sigaction sa;
+	int ret = 0;
+
+	if (!out_dir) {
+		printerr("An output directory (-o) is required in watch mode.\n");
+		return 1;
+	}
+	watch_dir = dir;
+	watch_out_dir = out_dir;
+	watch_max_jobs = oip_get_watch_max_jobs();
+	watch_debounce_ms = oip_get_watch_debounce_ms();
+
+	/*
+	*  umask() can only be read by setting it, so read it once
+	*  here instead of racing with the files that other threads
+	*  create while the results are saved.
+	*/
+	watch_umask = umask(0);
+	umask(watch_umask);
+
+	errno = 0;
+	watch_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	watch_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	watch_files = hashmap_create(HASHMAP_KEY_STR, &cli_watch_free_file);
+	watch_jobs = calloc(watch_max_jobs, sizeof(*watch_jobs));
+	if (watch_wake < 0 || watch_inotify < 0 || !watch_files || !watch_jobs) {
+		printerrno("Watch setup");
+		cli_watch_cleanup();
+		return 1;
+	}
+
+	errno = 0;
+	if (inotify_add_watch(watch_inotify, dir, CLI_WATCH_EVENTS | IN_ONLYDIR) < 0) {
+		printerrno("inotify_add_watch()");
+		cli_watch_cleanup();
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &cli_watch_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// Pick up the files that were spooled while OIP wasn't running.
+	if (cli_watch_scan(1) != 0) {
+		cli_watch_cleanup();
+		return 1;
+	}
+
+	fprintf(print_stdout, "Watching '%s' (max %u jobs, debounce %u ms).\n",
+		dir, watch_max_jobs, watch_debounce_ms);
+	fflush(stdout);
+
+	fds[0].fd = watch_inotify;
+	fds[0].events = POLLIN;
+	fds[1].fd = watch_wake;
+	fds[1].events = POLLIN;
+	while (!watch_stop) {
+		cli_watch_start_ready();
+
+		errno = 0;
+		if (poll(fds, 2, cli_watch_timeout()) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printerrno("poll()");
+			ret = 1;
+			break;
+		}
+		if (fds[0].revents & POLLIN && cli_watch_read_events() != 0) {
+			ret = 1;
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			cli_watch_reap();
+		}
+	}
+
+	fprintf(print_stdout, "Watch mode stopping.\n");
+	cli_watch_cleanup();
+	return ret;
+}